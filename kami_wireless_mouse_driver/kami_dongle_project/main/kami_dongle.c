@@ -0,0 +1,250 @@
+#include "kami_dongle.h"
+
+// Source includes are a dangerous form of modularity but best option with compiler.
+#include "source/radio_protocol.c"
+
+/************* TinyUSB descriptors ****************/
+
+/**
+ * @brief HID report descriptor
+ *
+ * Same mouse input report as the mouse itself, so the host sees the same device either way.
+ */
+static const uint8_t hid_report_descriptor[] = {
+    TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(HID_ITF_PROTOCOL_MOUSE)),
+};
+
+/**
+ * @brief String descriptor
+ */
+static const char *hid_string_descriptor[5] = {
+    // array of pointer to string descriptors
+    (char[]){0x09, 0x04}, // 0: is supported language is English (0x0409)
+    "Kami",               // 1: Manufacturer
+    "Komplex Mouse Receiver", // 2: Product
+    "123456",             // 3: Serials, should use chip ID
+    "HID interface",      // 4: HID
+};
+
+/**
+ * @brief Configuration descriptor
+ *
+ * This is a simple configuration descriptor that defines 1 configuration and 1 HID interface
+ */
+static const uint8_t hid_configuration_descriptor[] = {
+    // Configuration number, interface count, string index, total length, attribute, power in mA
+    TUD_CONFIG_DESCRIPTOR(1, 1, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, MAX_POWER_MA),
+
+    // Interface number, string index, boot protocol, report descriptor len, EP In address, size & polling interval
+    TUD_HID_DESCRIPTOR(0, 4, false, sizeof(hid_report_descriptor), HID_EP_IN_ADDR, HID_EP_IN_SIZE, HID_EP_IN_INTERVAL),
+};
+
+/********* TinyUSB HID callbacks ***************/
+
+// Invoked when received GET HID REPORT DESCRIPTOR request
+// Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
+uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance)
+{
+    // We use only one interface and one HID report descriptor, so we can ignore parameter 'instance'
+    return hid_report_descriptor;
+}
+
+// Invoked when received GET_REPORT control request
+// Application must fill buffer report's content and return its length.
+// Return zero will cause the stack to STALL request
+uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen)
+{
+    (void)instance;
+    (void)report_id;
+    (void)report_type;
+    (void)buffer;
+    (void)reqlen;
+
+    return 0;
+}
+
+// Invoked when received SET_REPORT control request or
+// received data on OUT endpoint ( Report ID = 0, Type = 0 )
+void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize)
+{
+}
+
+/************* Radio ****************/
+
+static QueueHandle_t dongle_queue = NULL;
+static radio_rx_t dongle_rx;
+static uint32_t dongle_queue_overflows = 0;
+static uint32_t dongle_reports_dropped = 0;
+
+// Called from the Wi-Fi task for every ESP-NOW packet received, only queues the packet.
+static void dongle_recv_cb(const esp_now_recv_info_t *info, const uint8_t *data, int data_len)
+{
+    (void)info;
+    if (data_len <= 0 || data_len > RADIO_PACKET_MAX)
+    {
+        return;
+    }
+
+    dongle_packet_t packet;
+    packet.length = (uint8_t)data_len;
+    memcpy(packet.data, data, data_len);
+    if (xQueueSend(dongle_queue, &packet, 0) != pdTRUE)
+    {
+        dongle_queue_overflows++;
+    }
+}
+
+// Bring up Wi-Fi in station mode on the mouse channel and start receiving.
+static esp_err_t dongle_radio_init(void)
+{
+    wifi_init_config_t wifi_config = WIFI_INIT_CONFIG_DEFAULT();
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        nvs_flash_erase();
+        ret = nvs_flash_init();
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_event_loop_create_default();
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_init(&wifi_config);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_set_storage(WIFI_STORAGE_RAM);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_set_mode(WIFI_MODE_STA);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_start();
+    }
+    if (ret == ESP_OK)
+    {
+        // The receiver must listen all the time, modem sleep would miss packets.
+        ret = esp_wifi_set_ps(WIFI_PS_NONE);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_set_channel(DONGLE_CHANNEL, WIFI_SECOND_CHAN_NONE);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_now_init();
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_now_register_recv_cb(dongle_recv_cb);
+    }
+    return ret;
+}
+
+// Send one report, waiting for the IN endpoint for at most DONGLE_REPORT_TIMEOUT_MS.
+static bool dongle_send_report(uint8_t buttons, int8_t x, int8_t y, int8_t wheel, int8_t pan)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (!tud_hid_ready())
+    {
+        if (!tud_mounted() || xTaskGetTickCount() - start > pdMS_TO_TICKS(DONGLE_REPORT_TIMEOUT_MS))
+        {
+            dongle_reports_dropped++;
+            return false;
+        }
+        vTaskDelay(1);
+    }
+    return tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, buttons, x, y, wheel, pan);
+}
+
+// Re-emit a decoded report, the 16 bit deltas are split into as many 8 bit reports as needed.
+static void dongle_emit(const radio_report_t *report)
+{
+    int32_t x = report->sample.x;
+    int32_t y = report->sample.y;
+    int8_t wheel = report->sample.wheel;
+    int8_t pan = report->sample.pan;
+    do
+    {
+        int8_t step_x = (int8_t)max(-127, min(127, x));
+        int8_t step_y = (int8_t)max(-127, min(127, y));
+        dongle_send_report(report->buttons, step_x, step_y, wheel, pan);
+        x -= step_x;
+        y -= step_y;
+        wheel = 0;
+        pan = 0;
+    } while (x != 0 || y != 0);
+}
+
+// Task that decodes the received packets and forwards them to the host.
+// A held button is released once the mouse has been silent for RADIO_RX_TIMEOUT_US, so it cannot stay stuck
+// when the mouse is switched off or leaves the range.
+static void dongle_task(void *arg)
+{
+    radio_report_t reports[RADIO_MAX_SAMPLES];
+    dongle_packet_t packet;
+    int64_t stats_us = esp_timer_get_time();
+    int64_t packet_us = stats_us;
+    while (1)
+    {
+        if (xQueueReceive(dongle_queue, &packet, pdMS_TO_TICKS(RADIO_KEEPALIVE_US / 1000)) == pdTRUE)
+        {
+            uint32_t received = dongle_rx.received;
+            int count = radio_rx_packet(&dongle_rx, packet.data, packet.length, reports);
+            if (dongle_rx.received != received)
+            {
+                packet_us = esp_timer_get_time();
+            }
+            for (int i = 0; i < count; i++)
+            {
+                dongle_emit(&reports[i]);
+            }
+        }
+
+        int64_t now = esp_timer_get_time();
+        if (dongle_rx.synced && now - packet_us >= RADIO_RX_TIMEOUT_US)
+        {
+            if (radio_rx_timeout(&dongle_rx))
+            {
+                dongle_send_report(0, 0, 0, 0, 0);
+                ESP_LOGW(TAG, "Radio: no packet for %d ms, buttons released", RADIO_RX_TIMEOUT_US / 1000);
+            }
+        }
+        if (now - stats_us >= DONGLE_STATS_INTERVAL_MS * 1000LL)
+        {
+            stats_us = now;
+            ESP_LOGI(TAG, "Radio: %lu received, %lu lost, %lu rejected, %lu resyncs, %lu timeouts, %lu queue overflows, %lu reports dropped",
+                     dongle_rx.received, dongle_rx.lost, dongle_rx.rejected, dongle_rx.resyncs, dongle_rx.timeouts,
+                     dongle_queue_overflows, dongle_reports_dropped);
+        }
+    }
+}
+
+/********* Application ***************/
+
+void app_main(void)
+{
+    radio_rx_init(&dongle_rx, RADIO_LINK_ID_DEFAULT);
+    dongle_queue = xQueueCreate(DONGLE_QUEUE_LENGTH, sizeof(dongle_packet_t));
+
+    ESP_LOGI(TAG, "USB initialization");
+    const tinyusb_config_t tusb_cfg =
+        {
+            .device_descriptor = NULL,
+            .string_descriptor = hid_string_descriptor,
+            .string_descriptor_count = sizeof(hid_string_descriptor) / sizeof(hid_string_descriptor[0]),
+            .external_phy = false,
+            .configuration_descriptor = hid_configuration_descriptor,
+        };
+    ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
+    ESP_LOGI(TAG, "USB initialization DONE");
+
+    ESP_ERROR_CHECK(dongle_radio_init());
+    ESP_LOGI(TAG, "Radio listening on channel %d", DONGLE_CHANNEL);
+
+    // Create the task that forwards the received reports to the host.
+    xTaskCreate(dongle_task, "dongle_task", 4096, NULL, 2, NULL);
+}
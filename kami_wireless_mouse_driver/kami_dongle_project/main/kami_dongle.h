@@ -0,0 +1,52 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "class/hid/hid_device.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+#include "nvs_flash.h"
+#include "tinyusb.h"
+
+#include "header/radio_protocol.h"
+
+static const char *TAG = "KamiDongle";
+
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+
+/**************** HID Defs ****************/
+
+#define MAX_POWER_MA (100)
+#define HID_EP_IN_ADDR (0x81)
+#define HID_EP_IN_SIZE (16)
+// 1ms polling, the dongle forwards every sample the mouse packs into a packet.
+#define HID_EP_IN_INTERVAL (1)
+
+#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN)
+
+/**************** Radio Defs ****************/
+
+// Must match RADIO_CHANNEL in the mouse firmware.
+#define DONGLE_CHANNEL 1
+// Packets waiting for the USB task, the Wi-Fi task must never block on USB.
+#define DONGLE_QUEUE_LENGTH 16
+// How long a report may wait for the IN endpoint before it is dropped.
+#define DONGLE_REPORT_TIMEOUT_MS 8
+#define DONGLE_STATS_INTERVAL_MS 10000
+
+typedef struct
+{
+	uint8_t length;
+	uint8_t data[RADIO_PACKET_MAX];
+} dongle_packet_t;
+
+// Pre declarations
+// Non static functions visible outside file
+uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance);
+uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen);
+void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize);
+void app_main(void);
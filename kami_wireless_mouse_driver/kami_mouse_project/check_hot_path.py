@@ -0,0 +1,233 @@
+# Fail the build if the input hot path is not in internal RAM.
+#
+# Walks the call graph from every input ISR through the disassembly of the IRAM text section and rejects
+# calls into flash and literals that point at flash data, both stall or crash while a flash write has the
+# cache off. Calls through a function pointer cannot be followed, the profiler trampoline is the only one
+# and its targets are the ISRs listed here. The task side of the hot path only has to be in IRAM itself,
+# it logs and calls into TinyUSB, which are allowed to live in flash.
+#
+#   python check_hot_path.py [--objdump xtensa-esp32s3-elf-objdump] kami_mouse_project.elf
+import argparse
+import re
+import subprocess
+import sys
+
+# Handlers registered with profiler_isr_handler_add, and the trampoline itself.
+ISR_ROOTS = [
+    'profiler_isr',
+    'lmb_isr',
+    'rmb_isr',
+    'mmb_isr',
+    'smb4_isr',
+    'smb5_isr',
+    'swheel_a_isr',
+    'swheel_b_isr',
+    'sensor_motion_isr',
+    # Callbacks of the sensor's SPI device, called from the SPI master interrupt.
+    'sensor_spi_pre',
+    'sensor_spi_post',
+]
+# Only present in latency benchmark builds.
+OPTIONAL_ISR_ROOTS = ['latency_bench_isr']
+
+# Marked HOT_PATH and run in tasks. Static ones may be inlined into their callers, which is fine.
+HOT_FUNCTIONS = [
+    'sensor_burst_queue',
+    'sensor_burst_collect',
+    'sensor_decode_motion_burst',
+    'sensor_read_register',
+    'add_motion_data_to_buffer',
+    'process_motion_data',
+    'input_decode_motion_burst',
+    'input_motion_burst_plausible',
+    'input_motion_ring_push',
+    'input_motion_ring_pop',
+    'transport_report_button',
+    'transport_report_motion',
+    'transport_report_macro',
+    'macro_trigger',
+    'transport_poll',
+    'transport_mux_button',
+    'transport_mux_buttons',
+    'input_remap_button',
+    'transport_mux_motion',
+    'transport_mux_poll',
+    'transport_mux_pending',
+    'transport_trace',
+    'trace_record_report',
+    'telemetry_record_latency',
+    'power_activity',
+    'settings_snapshot',
+]
+
+# ESP32-S3 address map, soc/soc.h.
+IRAM_TEXT = '.iram0.text'
+FLASH_TEXT = (0x42000000, 0x44000000)
+# The flash data window is shared with PSRAM, .ext_ram.bss sits next to .flash.rodata, so data is told apart
+# by the section it is in and not by its address. Every section named .flash* other than the text is in flash.
+FLASH_DATA_PREFIX = '.flash'
+
+FUNCTION_RE = re.compile(r'^([0-9a-f]+) <(.+)>:$')
+INSN_RE = re.compile(r'^\s*([0-9a-f]+):\s+(\S+)\s*(.*)$')
+SYMBOL_RE = re.compile(r'^([0-9a-f]+)\s+\S*\s+F\s+(\S+)\s+[0-9a-f]+\s+(.+)$')
+SECTION_RE = re.compile(r'^\s*\d+\s+(\S+)\s+([0-9a-f]+)\s+([0-9a-f]+)\s')
+
+
+def run(objdump, *args):
+    return subprocess.run([objdump, *args], check=True, capture_output=True, text=True).stdout
+
+
+def in_range(address, bounds):
+    return bounds[0] <= address < bounds[1]
+
+
+def base_name(name):
+    # GCC clones keep the name with a suffix, lmb_isr.constprop.0.
+    return name.split('.')[0]
+
+
+def load_symbols(objdump, elf):
+    symbols = {}
+    for line in run(objdump, '-t', elf).splitlines():
+        match = SYMBOL_RE.match(line)
+        if match:
+            symbols.setdefault(base_name(match.group(3)), []).append((int(match.group(1), 16), match.group(2)))
+    return symbols
+
+
+def load_sections(objdump, elf):
+    # Name and address range of every section loaded to the target, the flags are on the line after the header.
+    sections = []
+    lines = run(objdump, '-h', elf).splitlines()
+    for line, flags in zip(lines, lines[1:] + ['']):
+        match = SECTION_RE.match(line)
+        if match and 'ALLOC' in flags:
+            address = int(match.group(3), 16)
+            sections.append((match.group(1), address, address + int(match.group(2), 16)))
+    return sections
+
+
+def section_at(sections, address):
+    for name, start, end in sections:
+        if start <= address < end:
+            return name
+    return None
+
+
+def is_flash_data(section):
+    return section is not None and section.startswith(FLASH_DATA_PREFIX) and section != '.flash.text'
+
+
+def load_words(objdump, elf):
+    # Literal pools of IRAM code are in the IRAM text section, read them from its hex dump.
+    words = {}
+    for line in run(objdump, '-s', '-j', IRAM_TEXT, elf).splitlines():
+        # ' 40378000 36410081 fbffe008 ...  6A...', the hex columns end where the ASCII column starts.
+        if not re.match(r'^ [0-9a-f]{8} ', line):
+            continue
+        address = int(line[1:9], 16)
+        data = bytes.fromhex(line[10:45].replace(' ', ''))
+        for offset in range(0, len(data) - 3, 4):
+            words[address + offset] = int.from_bytes(data[offset:offset + 4], 'little')
+    return words
+
+
+def load_functions(objdump, elf):
+    # Name and instructions of every function in the IRAM text section, keyed by start address.
+    functions = {}
+    current = None
+    for line in run(objdump, '-d', '--no-show-raw-insn', '-j', IRAM_TEXT, elf).splitlines():
+        match = FUNCTION_RE.match(line)
+        if match:
+            current = (match.group(2), [])
+            functions[int(match.group(1), 16)] = current
+            continue
+        match = INSN_RE.match(line)
+        if match and current is not None:
+            current[1].append((int(match.group(1), 16), match.group(2), match.group(3)))
+    return functions
+
+
+def name_at(symbols, address):
+    for name, entries in symbols.items():
+        if any(entry[0] == address for entry in entries):
+            return name
+    return hex(address)
+
+
+# Check one function, returns the IRAM functions it calls.
+def check_function(start, functions, words, symbols, sections, errors, path):
+    instructions = functions[start][1]
+    end = instructions[-1][0] if instructions else start
+    literals = {}
+    callees = []
+    for address, mnemonic, operands in instructions:
+        args = [arg.strip() for arg in operands.split(',')]
+        if mnemonic == 'l32r' and len(args) == 2:
+            literal = int(args[1].split()[0], 16)
+            value = words.get(literal)
+            literals[args[0]] = value
+            section = section_at(sections, value) if value is not None else None
+            if is_flash_data(section):
+                errors.append(f'{" -> ".join(path)}: reads flash data at {value:#x} in {section}')
+        elif re.fullmatch(r'call(0|4|8|12)', mnemonic):
+            callees.append(int(args[0].split()[0], 16))
+        elif re.fullmatch(r'callx(0|4|8|12)|jx', mnemonic):
+            if literals.get(args[0]) is not None:
+                callees.append(literals[args[0]])
+        elif mnemonic == 'j':
+            target = int(args[0].split()[0], 16)
+            if target < start or target > end:
+                callees.append(target)
+    for target in callees:
+        if in_range(target, FLASH_TEXT):
+            errors.append(f'{" -> ".join(path)}: calls {name_at(symbols, target)} in flash')
+    return [target for target in callees if target in functions]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check that the input hot path is in internal RAM.')
+    parser.add_argument('--objdump', default='xtensa-esp32s3-elf-objdump')
+    parser.add_argument('elf')
+    args = parser.parse_args()
+
+    symbols = load_symbols(args.objdump, args.elf)
+    sections = load_sections(args.objdump, args.elf)
+    words = load_words(args.objdump, args.elf)
+    functions = load_functions(args.objdump, args.elf)
+    starts = {base_name(name): address for address, (name, _) in functions.items()}
+
+    errors = []
+    for root in ISR_ROOTS + OPTIONAL_ISR_ROOTS:
+        if root not in starts:
+            if root in symbols:
+                errors.append(f'{root}: not in IRAM')
+            elif root not in OPTIONAL_ISR_ROOTS:
+                errors.append(f'{root}: not found, update ISR_ROOTS')
+            continue
+        visited = set()
+        stack = [(starts[root], [root])]
+        while stack:
+            start, path = stack.pop()
+            if start in visited:
+                continue
+            visited.add(start)
+            for callee in check_function(start, functions, words, symbols, sections, errors, path):
+                stack.append((callee, path + [functions[callee][0]]))
+
+    for name in HOT_FUNCTIONS:
+        for _, section in symbols.get(name, []):
+            if section != IRAM_TEXT:
+                errors.append(f'{name}: in {section}, not in IRAM')
+
+    for error in sorted(set(errors)):
+        print(f'hot path: {error}', file=sys.stderr)
+    if errors:
+        print('hot path: mark the functions HOT_PATH or move the call out of the ISR', file=sys.stderr)
+        return 1
+    print(f'hot path: {len(ISR_ROOTS)} ISRs and {len(HOT_FUNCTIONS)} hot functions in IRAM')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,140 @@
+# Build every input pipeline variant and compare their size and frame cost.
+#
+# Each variant is the default configuration plus the Kconfig options below (main/Kconfig.projbuild). It is built
+# in its own directory under build_variants/ with its own sdkconfig, so the main build is left alone. The table
+# has the image size, the IRAM and DRAM use and the size of the hot path functions (check_hot_path.py lists them).
+# With --port each variant is also flashed and the first "Frame cycles" line of its log is read, the mean and worst
+# CPU cycles of a sensor frame over 4096 frames. The MOTION interrupt variants only take frames while the mouse
+# moves, so keep moving it until the line shows up.
+#
+#   python compare_variants.py [--port PORT] [--only name,...] [--json out.json]
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+from check_hot_path import HOT_FUNCTIONS, ISR_ROOTS
+
+VARIANTS = {
+    'default': [],
+    'report-16bit': ['CONFIG_KAMI_REPORT_16BIT=y'],
+    'motion-irq': ['CONFIG_KAMI_ACQUISITION_MOTION_IRQ=y'],
+    'motion-sync': ['CONFIG_KAMI_ACQUISITION_MOTION_SYNC=y'],
+    'debounce-deferred': ['CONFIG_KAMI_DEBOUNCE_DEFERRED=y'],
+    'trace-events': ['CONFIG_KAMI_TRACE_EVENTS=y'],
+    'trace-off': ['CONFIG_KAMI_TRACE_OFF=y'],
+    'hot-path-log': ['CONFIG_KAMI_LOG_HOT_PATH=y'],
+    'heap-guard': ['CONFIG_KAMI_HEAP_GUARD=y'],
+    'lean': ['CONFIG_KAMI_TRACE_OFF=y'],
+}
+
+PROJECT_DIR = os.path.dirname(os.path.abspath(__file__))
+BUILD_ROOT = os.path.join(PROJECT_DIR, 'build_variants')
+ELF_NAME = 'kami_mouse_project.elf'
+MAP_NAME = 'kami_mouse_project.map'
+NM = 'xtensa-esp32s3-elf-nm'
+
+FRAME_CYCLES_RE = re.compile(r'Frame cycles: mean (\d+), max (\d+)')
+FRAME_TIMEOUT_S = 120
+
+
+def idf(build_dir, *args):
+    return subprocess.run(['idf.py', '-C', PROJECT_DIR, '-B', build_dir, *args], check=True, capture_output=True,
+                          text=True).stdout
+
+
+def build(name, options):
+    build_dir = os.path.join(BUILD_ROOT, name)
+    os.makedirs(build_dir, exist_ok=True)
+    fragment = os.path.join(build_dir, 'sdkconfig.variant')
+    with open(fragment, 'w') as f:
+        f.write('\n'.join(options) + '\n')
+    defaults = ';'.join([os.path.join(PROJECT_DIR, 'sdkconfig.defaults'), fragment])
+    idf(build_dir, f'-DSDKCONFIG={os.path.join(build_dir, "sdkconfig")}', f'-DSDKCONFIG_DEFAULTS={defaults}', 'build')
+    return build_dir
+
+
+def image_size(build_dir):
+    idf_size = os.path.join(os.environ['IDF_PATH'], 'tools', 'idf_size.py')
+    output = subprocess.run([sys.executable, idf_size, '--format', 'json', os.path.join(build_dir, MAP_NAME)],
+                            check=True, capture_output=True, text=True).stdout
+    size = json.loads(output)
+    return {
+        'total': size.get('total_size', 0),
+        'iram': size.get('iram_text', 0) + size.get('iram_vectors', 0),
+        'dram': size.get('dram_data', 0) + size.get('dram_bss', 0),
+        'flash': size.get('flash_code', 0) + size.get('flash_rodata', 0),
+    }
+
+
+def hot_path_size(build_dir):
+    # Functions inlined into their callers have no symbol, their code is counted with the caller.
+    names = set(ISR_ROOTS + HOT_FUNCTIONS)
+    total = 0
+    output = subprocess.run([NM, '--print-size', os.path.join(build_dir, ELF_NAME)], check=True, capture_output=True,
+                            text=True).stdout
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) == 4 and fields[3].split('.')[0] in names:
+            total += int(fields[1], 16)
+    return total
+
+
+def frame_cycles(build_dir, port):
+    import serial
+
+    idf(build_dir, '-p', port, 'flash')
+    print('  waiting for the frame cycles, move the mouse', file=sys.stderr)
+    with serial.Serial(port, 115200, timeout=FRAME_TIMEOUT_S) as console:
+        while True:
+            line = console.readline().decode(errors='replace')
+            if not line:
+                return None
+            match = FRAME_CYCLES_RE.search(line)
+            if match:
+                return int(match.group(1)), int(match.group(2))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare the size and frame cost of the input pipeline variants.')
+    parser.add_argument('--port', help='flash each variant and read its frame cycles')
+    parser.add_argument('--only', help='comma separated variant names')
+    parser.add_argument('--json', help='write the results to this file')
+    args = parser.parse_args()
+
+    names = args.only.split(',') if args.only else list(VARIANTS)
+    unknown = [name for name in names if name not in VARIANTS]
+    if unknown:
+        parser.error(f'unknown variants {", ".join(unknown)}, pick from {", ".join(VARIANTS)}')
+
+    results = {}
+    for name in names:
+        print(f'{name}: building', file=sys.stderr)
+        build_dir = build(name, VARIANTS[name])
+        result = image_size(build_dir)
+        result['hot_path'] = hot_path_size(build_dir)
+        if args.port:
+            cycles = frame_cycles(build_dir, args.port)
+            result['frame_cycles_mean'], result['frame_cycles_max'] = cycles if cycles else (None, None)
+        results[name] = result
+
+    base = results.get('default')
+    print(f'{"variant":<20} {"image":>9} {"iram":>8} {"dram":>8} {"flash":>9} {"hot path":>9} {"cycles":>9} {"max":>9}')
+    for name, result in results.items():
+        delta = f' ({result["total"] - base["total"]:+d})' if base and name != 'default' else ''
+        mean = result.get('frame_cycles_mean')
+        worst = result.get('frame_cycles_max')
+        print(f'{name:<20} {result["total"]:>9} {result["iram"]:>8} {result["dram"]:>8} {result["flash"]:>9} '
+              f'{result["hot_path"]:>9} {mean if mean is not None else "-":>9} {worst if worst is not None else "-":>9}'
+              f'{delta}')
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,496 @@
+// Estimate the energy a recorded input trace took, with the energy model the firmware runs for its ENERGY block.
+//
+// The trace is replayed on a millisecond clock. The power ladder follows the recorded input, the sensor residency
+// follows the rest state in every recorded burst and stops while the input tasks are parked, and the recorded
+// reports go through the radio sender to count the packets the mouse sent. The task wakeups are the sensor frames,
+// the reports and the polls of the input tasks while they are not parked. The counts are then estimated with the
+// default cost table.
+//
+// Fails if the estimate differs from a floating point evaluation of the same model, if its parts do not add up to
+// the total, if the residency does not cover the trace, if the battery life does not follow from the average
+// current, or if the same counts taken through the telemetry counters estimate differently. Without a trace an idle,
+// an office and a gaming session are generated and replayed, and each has to draw more than the one before it.
+//
+// Pass -u for traces recorded over USB, the radio then sent nothing.
+//
+//   energy_replay [-v] [-u] [trace.bin | monitor.log]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "header/energy_model.h"
+#include "header/input_pipeline.h"
+#include "header/radio_protocol.h"
+#include "header/sensor_registers.h"
+#include "trace_file.h"
+
+// Mirror SETTINGS_POWER_IDLE_MS_DEFAULT and SETTINGS_POWER_SLEEP_MS_DEFAULT in settings.h.
+#define REPLAY_IDLE_US 100000
+#define REPLAY_SLEEP_US 2000000
+// Mirror the 1 ms loops of the latch, debounce and wheel tasks, TRANSPORT_POLL_MS in transport.h
+// and RADIO_SEND_INTERVAL_MS in radio_link.h.
+#define REPLAY_POLL_TASKS 3
+#define REPLAY_TRANSPORT_POLL_MS 10
+#define REPLAY_RADIO_INTERVAL_MS 1
+#define REPLAY_TICK_US 1000
+
+// Synthetic sessions. Mirror REPORT_RATE_US in motion_sensor.h, the gaming rest timing in settings.h and PIN_LMB.
+#define SIM_SESSION_US 60000000
+#define SIM_FRAME_US 250
+#define SIM_REST1_US 1000000
+#define SIM_REST2_US 5000000
+#define SIM_REST3_US 30000000
+#define SIM_CLICK_US 50000
+#define SIM_PIN_LMB 4
+
+typedef struct
+{
+    power_policy_t policy;
+    radio_tx_t radio;
+    bool radio_enabled;
+    bool parked;
+    // Rest state of the last burst, and since when the sensor residency was last charged.
+    uint8_t rest_state;
+    uint32_t sensor_since_us;
+    uint64_t sensor_us[ENERGY_SENSOR_COUNT];
+    energy_counts_t counts;
+} replay_t;
+
+typedef struct
+{
+    const char *name;
+    // A move of move_us every move_every_us, and a click every click_every_us, 0 for none.
+    uint32_t move_every_us;
+    uint32_t move_us;
+    uint32_t click_every_us;
+} sim_session_t;
+
+// The trace does not record the tracking mode, the default HPM is assumed.
+static const uint8_t replay_rest_states[SENSOR_REST_COUNT] = {
+    [SENSOR_REST_RUN] = ENERGY_SENSOR_HPM,
+    [SENSOR_REST_1] = ENERGY_SENSOR_REST1,
+    [SENSOR_REST_2] = ENERGY_SENSOR_REST2,
+    [SENSOR_REST_3] = ENERGY_SENSOR_REST3,
+};
+
+static const sim_session_t sim_sessions[] = {
+    {"idle", 0, 0, 0},
+    {"office", 5000000, 300000, 10000000},
+    {"gaming", 1000000, 800000, 500000},
+};
+
+// Charge the sensor residency up to now to the state it was in.
+static void replay_sensor_charge(replay_t *replay, uint32_t now_us)
+{
+    int state = replay->parked ? ENERGY_SENSOR_PARKED : replay_rest_states[replay->rest_state];
+    replay->sensor_us[state] += now_us - replay->sensor_since_us;
+    replay->sensor_since_us = now_us;
+}
+
+static void replay_record(replay_t *replay, const trace_record_t *record)
+{
+    uint32_t now = record->timestamp_us;
+    if (record->type == TRACE_RECORD_BURST)
+    {
+        motion_burst_t burst;
+        bool moved = input_decode_motion_burst(record->payload, &burst);
+        replay_sensor_charge(replay, now);
+        replay->rest_state = burst.op_mode;
+        replay->counts.spi_transactions++;
+        replay->counts.task_wakeups++;
+        if (moved)
+        {
+            power_policy_activity(&replay->policy, now);
+        }
+    }
+    else if (record->type == TRACE_RECORD_GPIO)
+    {
+        power_policy_activity(&replay->policy, now);
+    }
+    else if (record->type == TRACE_RECORD_REPORT)
+    {
+        // The transport task is notified for every report.
+        replay->counts.task_wakeups++;
+        trace_report_t report;
+        trace_unpack_report(record->payload, &report);
+        radio_tx_queue_buttons(&replay->radio, report.buttons);
+        if (report.x != 0 || report.y != 0 || report.wheel != 0 || report.pan != 0)
+        {
+            const radio_sample_t sample = {now, report.x, report.y, report.wheel, report.pan};
+            radio_tx_add_sample(&replay->radio, &sample);
+        }
+    }
+}
+
+// One millisecond tick, the power ladder and the tasks that wake on their own.
+static void replay_tick(replay_t *replay, uint32_t now_us, uint32_t tick)
+{
+    bool parked = power_policy_update(&replay->policy, now_us) == POWER_LEVEL_SLEEP;
+    if (parked != replay->parked)
+    {
+        replay_sensor_charge(replay, now_us);
+        replay->parked = parked;
+    }
+    if (parked)
+    {
+        return;
+    }
+    replay->counts.task_wakeups += REPLAY_POLL_TASKS;
+    if (tick % REPLAY_TRANSPORT_POLL_MS == 0)
+    {
+        replay->counts.task_wakeups++;
+    }
+    if (replay->radio_enabled && tick % REPLAY_RADIO_INTERVAL_MS == 0)
+    {
+        uint8_t packet[RADIO_PACKET_MAX];
+        replay->counts.task_wakeups++;
+        replay->counts.radio_packets += radio_tx_build(&replay->radio, now_us, packet) != 0;
+    }
+}
+
+// Replay the trace from its first record to end_us and fill the counts.
+static void replay_trace(const trace_file_t *trace, uint32_t end_us, bool radio, energy_counts_t *counts)
+{
+    static replay_t replay;
+    uint32_t start_us = trace->record_count ? trace->records[0].timestamp_us : end_us;
+    replay = (replay_t){.radio_enabled = radio, .rest_state = SENSOR_REST_RUN, .sensor_since_us = start_us};
+    power_policy_init(&replay.policy, REPLAY_IDLE_US, REPLAY_SLEEP_US, start_us);
+    radio_tx_init(&replay.radio, RADIO_LINK_ID_DEFAULT);
+
+    size_t next = 0;
+    uint32_t tick = 0;
+    for (uint32_t now = start_us; now - start_us < end_us - start_us; now += REPLAY_TICK_US, tick++)
+    {
+        while (next < trace->record_count && trace->records[next].timestamp_us - start_us <= now - start_us)
+        {
+            replay_record(&replay, &trace->records[next++]);
+        }
+        replay_tick(&replay, now, tick);
+    }
+    replay_sensor_charge(&replay, end_us);
+    power_policy_update(&replay.policy, end_us);
+
+    replay.counts.elapsed_ms = (end_us - start_us) / 1000;
+    for (int i = 0; i < POWER_LEVEL_COUNT; i++)
+    {
+        uint64_t level_us = replay.policy.level_time_us[i];
+        if (i == (int)replay.policy.level)
+        {
+            level_us += end_us - replay.policy.level_since_us;
+        }
+        replay.counts.cpu_ms[i] = level_us / 1000;
+    }
+    for (int i = 0; i < ENERGY_SENSOR_COUNT; i++)
+    {
+        replay.counts.sensor_ms[i] = replay.sensor_us[i] / 1000;
+    }
+    *counts = replay.counts;
+}
+
+/************* Checks ****************/
+
+static uint32_t check_sum(const uint32_t *values, int count)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < count; i++)
+    {
+        sum += values[i];
+    }
+    return sum;
+}
+
+static bool check_near(const char *what, double expected, uint32_t value, double tolerance)
+{
+    if (fabs(expected - value) > tolerance)
+    {
+        printf("FAIL: %s %u, expected %.2f\n", what, value, expected);
+        return false;
+    }
+    return true;
+}
+
+// Estimate the counts and check the estimate, returns true if it passed.
+static bool check_estimate(const char *name, const energy_counts_t *counts, const energy_costs_t *costs,
+                           energy_estimate_t *estimate, bool verbose)
+{
+    energy_estimate(estimate, counts, costs);
+    printf("%s: %u ms, cpu %u/%u/%u ms, sensor %u/%u/%u/%u/%u ms, %u SPI transactions, %u wakeups, %u radio packets\n",
+           name, counts->elapsed_ms, counts->cpu_ms[POWER_LEVEL_FULL], counts->cpu_ms[POWER_LEVEL_IDLE],
+           counts->cpu_ms[POWER_LEVEL_SLEEP], counts->sensor_ms[ENERGY_SENSOR_HPM],
+           counts->sensor_ms[ENERGY_SENSOR_REST1], counts->sensor_ms[ENERGY_SENSOR_REST2],
+           counts->sensor_ms[ENERGY_SENSOR_REST3], counts->sensor_ms[ENERGY_SENSOR_PARKED], counts->spi_transactions,
+           counts->task_wakeups, counts->radio_packets);
+    printf("  %u uAh (cpu %u, sensor %u, spi %u, wakeups %u, radio %u), average %.2f mA, battery life %.1f h\n",
+           estimate->total_uah, estimate->cpu_uah, estimate->sensor_uah, estimate->spi_uah, estimate->wakeup_uah,
+           estimate->radio_uah, estimate->average_ua / 1000.0, estimate->battery_life_min / 60.0);
+    if (counts->elapsed_ms == 0)
+    {
+        printf("FAIL: nothing to estimate\n");
+        return false;
+    }
+
+    // The replay has to account for the whole trace, less what each state rounded off.
+    bool passed = true;
+    uint32_t cpu_ms = check_sum(counts->cpu_ms, POWER_LEVEL_COUNT);
+    uint32_t sensor_ms = check_sum(counts->sensor_ms, ENERGY_SENSOR_COUNT);
+    if (cpu_ms > counts->elapsed_ms || counts->elapsed_ms - cpu_ms > POWER_LEVEL_COUNT)
+    {
+        printf("FAIL: cpu residency %u ms of %u ms\n", cpu_ms, counts->elapsed_ms);
+        passed = false;
+    }
+    if (sensor_ms > counts->elapsed_ms || counts->elapsed_ms - sensor_ms > ENERGY_SENSOR_COUNT)
+    {
+        printf("FAIL: sensor residency %u ms of %u ms\n", sensor_ms, counts->elapsed_ms);
+        passed = false;
+    }
+
+    // The same model in floating point, a microamp for a millisecond is a nanocoulomb.
+    double cpu_nc = (double)(counts->elapsed_ms - cpu_ms) * costs->cpu_ua[POWER_LEVEL_FULL];
+    double sensor_nc = (double)(counts->elapsed_ms - sensor_ms) * costs->sensor_ua[ENERGY_SENSOR_PARKED];
+    for (int i = 0; i < POWER_LEVEL_COUNT; i++)
+    {
+        cpu_nc += (double)counts->cpu_ms[i] * costs->cpu_ua[i];
+    }
+    for (int i = 0; i < ENERGY_SENSOR_COUNT; i++)
+    {
+        sensor_nc += (double)counts->sensor_ms[i] * costs->sensor_ua[i];
+    }
+    double spi_nc = (double)counts->spi_transactions * costs->spi_transaction_nc;
+    double wakeup_nc = (double)counts->task_wakeups * costs->task_wakeup_nc;
+    double radio_nc = (double)counts->radio_packets * costs->radio_packet_nc;
+    double total_nc = cpu_nc + sensor_nc + spi_nc + wakeup_nc + radio_nc;
+    passed &= check_near("cpu uAh", cpu_nc / 3.6e6, estimate->cpu_uah, 0.5);
+    passed &= check_near("sensor uAh", sensor_nc / 3.6e6, estimate->sensor_uah, 0.5);
+    passed &= check_near("spi uAh", spi_nc / 3.6e6, estimate->spi_uah, 0.5);
+    passed &= check_near("wakeup uAh", wakeup_nc / 3.6e6, estimate->wakeup_uah, 0.5);
+    passed &= check_near("radio uAh", radio_nc / 3.6e6, estimate->radio_uah, 0.5);
+    passed &= check_near("total uAh", total_nc / 3.6e6, estimate->total_uah, 0.5);
+    passed &= check_near("average uA", total_nc / counts->elapsed_ms, estimate->average_ua, 1.0);
+
+    // Each part is rounded on its own, the total once.
+    uint32_t parts = estimate->cpu_uah + estimate->sensor_uah + estimate->spi_uah + estimate->wakeup_uah +
+                     estimate->radio_uah;
+    if (parts > estimate->total_uah + 3 || parts + 3 < estimate->total_uah)
+    {
+        printf("FAIL: the parts add up to %u uAh\n", parts);
+        passed = false;
+    }
+
+    // Without the events the current lies between the most frugal and the most expensive states.
+    uint32_t floor_ua = UINT32_MAX;
+    uint32_t peak_ua = 0;
+    for (int c = 0; c < POWER_LEVEL_COUNT; c++)
+    {
+        for (int s = 0; s < ENERGY_SENSOR_COUNT; s++)
+        {
+            uint32_t ua = costs->cpu_ua[c] + costs->sensor_ua[s];
+            floor_ua = ua < floor_ua ? ua : floor_ua;
+            peak_ua = ua > peak_ua ? ua : peak_ua;
+        }
+    }
+    double residency_ua = estimate->average_ua - (spi_nc + wakeup_nc + radio_nc) / counts->elapsed_ms;
+    if (residency_ua < floor_ua - 1.0 || residency_ua > peak_ua + 1.0)
+    {
+        printf("FAIL: residency current %.1f uA outside %u..%u uA\n", residency_ua, floor_ua, peak_ua);
+        passed = false;
+    }
+
+    uint32_t life_min = estimate->average_ua ? (uint32_t)((uint64_t)costs->battery_mah * 60000 / estimate->average_ua) : 0;
+    if (estimate->battery_life_min != life_min)
+    {
+        printf("FAIL: battery life %u min, %u mAh at %u uA is %u min\n", estimate->battery_life_min,
+               costs->battery_mah, estimate->average_ua, life_min);
+        passed = false;
+    }
+    if (verbose || !passed)
+    {
+        printf("  counted %u of %u ms cpu, %u ms sensor\n", cpu_ms, counts->elapsed_ms, sensor_ms);
+    }
+    return passed;
+}
+
+// The firmware leaves the parked sensor time out of its counters, the estimate from them has to come out the same.
+static bool check_telemetry(const energy_counts_t *counts, const energy_costs_t *costs, const energy_estimate_t *expected)
+{
+    const telemetry_counters_t counters = {
+        .counted_ms = counts->elapsed_ms,
+        .power_time_full_ms = counts->cpu_ms[POWER_LEVEL_FULL],
+        .power_time_idle_ms = counts->cpu_ms[POWER_LEVEL_IDLE],
+        .power_time_sleep_ms = counts->cpu_ms[POWER_LEVEL_SLEEP],
+        .sensor_run_hpm_ms = counts->sensor_ms[ENERGY_SENSOR_HPM],
+        .sensor_run_lpm_ms = counts->sensor_ms[ENERGY_SENSOR_LPM],
+        .sensor_run_wrk_ms = counts->sensor_ms[ENERGY_SENSOR_WRK],
+        .sensor_run_crd_ms = counts->sensor_ms[ENERGY_SENSOR_CRD],
+        .sensor_rest1_ms = counts->sensor_ms[ENERGY_SENSOR_REST1],
+        .sensor_rest2_ms = counts->sensor_ms[ENERGY_SENSOR_REST2],
+        .sensor_rest3_ms = counts->sensor_ms[ENERGY_SENSOR_REST3],
+        .spi_transactions = counts->spi_transactions,
+        .task_wakeups = counts->task_wakeups,
+        .radio_packets_sent = counts->radio_packets,
+    };
+    energy_counts_t from_counters;
+    energy_estimate_t estimate;
+    energy_counts_from_telemetry(&from_counters, &counters);
+    energy_estimate(&estimate, &from_counters, costs);
+    if (estimate.total_uah != expected->total_uah || estimate.sensor_uah != expected->sensor_uah ||
+        estimate.average_ua != expected->average_ua)
+    {
+        printf("FAIL: from the telemetry counters %u uAh, sensor %u uAh, average %u uA\n", estimate.total_uah,
+               estimate.sensor_uah, estimate.average_ua);
+        return false;
+    }
+    return true;
+}
+
+/************* Synthetic Sessions ****************/
+
+static void sim_append(trace_file_t *trace, uint32_t now_us, uint8_t type, const uint8_t *payload, uint8_t length)
+{
+    trace_record_t *record = &trace->records[trace->record_count++];
+    *record = (trace_record_t){.timestamp_us = now_us, .type = type, .length = length};
+    for (int i = 0; i < length; i++)
+    {
+        record->payload[i] = payload[i];
+    }
+}
+
+static void sim_report(trace_file_t *trace, uint32_t now_us, uint8_t buttons, int16_t x, int16_t y)
+{
+    const trace_report_t report = {.buttons = buttons, .x = x, .y = y};
+    uint8_t payload[TRACE_REPORT_PAYLOAD_SIZE];
+    sim_append(trace, now_us, TRACE_RECORD_REPORT, payload, trace_pack_report(payload, &report));
+}
+
+static void sim_click(trace_file_t *trace, uint32_t now_us, bool pressed)
+{
+    const uint8_t payload[TRACE_GPIO_PAYLOAD_SIZE] = {SIM_PIN_LMB, pressed ? 0 : TRACE_GPIO_LEVEL};
+    sim_append(trace, now_us, TRACE_RECORD_GPIO, payload, sizeof(payload));
+    sim_report(trace, now_us, pressed, 0, 0);
+}
+
+// Record a session like the firmware would. Bursts are read every frame until the input tasks park,
+// motion wakes them again, and the sensor reports the rest state its own timing puts it in.
+static bool sim_generate(const sim_session_t *session, trace_file_t *trace)
+{
+    size_t capacity = 2 * (SIM_SESSION_US / SIM_FRAME_US) + 16;
+    *trace = (trace_file_t){.records = malloc(capacity * sizeof(trace_record_t))};
+    if (trace->records == NULL)
+    {
+        return false;
+    }
+    uint32_t last_input_us = 0;
+    uint32_t last_motion_us = 0;
+    for (uint32_t now = 0; now < SIM_SESSION_US; now += SIM_FRAME_US)
+    {
+        bool moving = session->move_every_us && now % session->move_every_us < session->move_us;
+        if (session->click_every_us && now % session->click_every_us == 0)
+        {
+            sim_click(trace, now, true);
+            last_input_us = now;
+        }
+        if (session->click_every_us && now % session->click_every_us == SIM_CLICK_US)
+        {
+            sim_click(trace, now, false);
+            last_input_us = now;
+        }
+        if (moving)
+        {
+            last_input_us = now;
+            last_motion_us = now;
+        }
+        if (now - last_input_us >= REPLAY_SLEEP_US)
+        {
+            continue;
+        }
+
+        uint32_t still_us = now - last_motion_us;
+        uint8_t op_mode = still_us < SIM_REST1_US   ? SENSOR_REST_RUN
+                          : still_us < SIM_REST2_US ? SENSOR_REST_1
+                          : still_us < SIM_REST3_US ? SENSOR_REST_2
+                                                    : SENSOR_REST_3;
+        uint8_t burst[SENSOR_MOTION_BURST_SIZE] = {0};
+        burst[SENSOR_BURST_MOTION] = (uint8_t)(op_mode << SENSOR_MOTION_OP_MODE_SHIFT) | (moving ? SENSOR_MOTION_BIT : 0);
+        burst[SENSOR_BURST_OBSERVATION] = 0x3F;
+        burst[SENSOR_BURST_DELTA_X_L] = moving ? 3 : 0;
+        burst[SENSOR_BURST_DELTA_Y_L] = moving ? 1 : 0;
+        burst[SENSOR_BURST_SQUAL] = 0x40;
+        sim_append(trace, now, TRACE_RECORD_BURST, burst, sizeof(burst));
+        if (moving)
+        {
+            sim_report(trace, now, 0, 3, 1);
+        }
+    }
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [-u] [trace.bin | monitor.log]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+    bool radio = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "vu")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            verbose = true;
+            break;
+        case 'u':
+            radio = false;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    const energy_costs_t *costs = &energy_costs_default;
+    energy_counts_t counts;
+    energy_estimate_t estimate;
+
+    if (optind < argc)
+    {
+        trace_file_t trace;
+        if (trace_file_load(argv[optind], &trace) != 0)
+        {
+            return 1;
+        }
+        uint32_t end_us = trace.record_count ? trace.records[trace.record_count - 1].timestamp_us : 0;
+        replay_trace(&trace, end_us, radio, &counts);
+        bool passed = check_estimate(argv[optind], &counts, costs, &estimate, verbose) &&
+                      check_telemetry(&counts, costs, &estimate);
+        trace_file_free(&trace);
+        return !passed;
+    }
+
+    int failures = 0;
+    uint32_t previous_ua = 0;
+    for (size_t i = 0; i < sizeof(sim_sessions) / sizeof(sim_sessions[0]); i++)
+    {
+        trace_file_t trace;
+        if (!sim_generate(&sim_sessions[i], &trace))
+        {
+            return 1;
+        }
+        replay_trace(&trace, SIM_SESSION_US, radio, &counts);
+        failures += !check_estimate(sim_sessions[i].name, &counts, costs, &estimate, verbose);
+        failures += !check_telemetry(&counts, costs, &estimate);
+        if (estimate.average_ua <= previous_ua)
+        {
+            printf("FAIL: %s draws no more than the session before it\n", sim_sessions[i].name);
+            failures++;
+        }
+        previous_ua = estimate.average_ua;
+        trace_file_free(&trace);
+    }
+    printf("%zu sessions, %d failed\n", sizeof(sim_sessions) / sizeof(sim_sessions[0]), failures);
+    return failures != 0;
+}
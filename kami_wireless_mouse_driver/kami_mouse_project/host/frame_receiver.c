@@ -0,0 +1,346 @@
+// Receive raw sensor frames from the mouse's frame capture interface and save them.
+//
+// The capture interface is the mouse's second HID interface, Linux gives it a hidraw node without a driver.
+// The receiver finds it by name and interface number, sends the start command, reassembles the 64 byte packets
+// into frames (header/frame_format.h) and sends the stop command on exit or Ctrl-C.
+// Frames go to a binary file, each a frame_header_t followed by the pixels, and/or to one PGM image per frame.
+// The throughput is printed every second and at the end, with the frames lost on the way and the grabs that
+// waited for USB. With stalls the USB link was the limit, without them the sensor was.
+//
+// -d also takes a file of recorded packets, the frames in it are reassembled and saved without a device.
+//
+//   frame_receiver [-d /dev/hidrawN | packets.bin] [-n frames] [-t seconds] [-o frames.bin] [-p pgm_dir]
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "header/frame_format.h"
+
+// Mirror hid_string_descriptor and FRAME_CAPTURE_HID_INSTANCE in the firmware.
+#define RECEIVER_PRODUCT "Komplex Mouse"
+#define RECEIVER_INTERFACE 1
+#define RECEIVER_POLL_MS 100
+
+typedef struct
+{
+    uint8_t frame[FRAME_CHUNKS * FRAME_CHUNK_SIZE];
+    // Next chunk expected and the sequence byte of the frame being assembled, -1 while waiting for chunk 0.
+    int next_chunk;
+    uint8_t sequence;
+    // Statistics.
+    uint32_t frames;
+    uint32_t lost;
+    uint32_t broken;
+    uint32_t stalls;
+    uint64_t grab_us;
+    bool have_last;
+    uint32_t last_sequence;
+} receiver_t;
+
+static volatile sig_atomic_t receiver_stop = 0;
+
+static void receiver_signal(int sig)
+{
+    (void)sig;
+    receiver_stop = 1;
+}
+
+static double receiver_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The hidraw node of the capture interface, the USB interface directory above it ends in ":<config>.<interface>".
+static int receiver_find(char *path, size_t size)
+{
+    DIR *dir = opendir("/sys/class/hidraw");
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    struct dirent *entry;
+    int found = -1;
+    while (found < 0 && (entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0)
+        {
+            continue;
+        }
+        char link[PATH_MAX];
+        char interface[PATH_MAX];
+        snprintf(link, sizeof(link), "/sys/class/hidraw/%s/device/..", entry->d_name);
+        if (realpath(link, interface) == NULL)
+        {
+            continue;
+        }
+        const char *number = strrchr(interface, '.');
+        if (number == NULL || atoi(number + 1) != RECEIVER_INTERFACE)
+        {
+            continue;
+        }
+        char uevent_path[PATH_MAX];
+        snprintf(uevent_path, sizeof(uevent_path), "/sys/class/hidraw/%s/device/uevent", entry->d_name);
+        FILE *uevent = fopen(uevent_path, "r");
+        if (uevent == NULL)
+        {
+            continue;
+        }
+        char line[256];
+        while (fgets(line, sizeof(line), uevent) != NULL)
+        {
+            if (strncmp(line, "HID_NAME=", 9) == 0 && strstr(line, RECEIVER_PRODUCT) != NULL)
+            {
+                snprintf(path, size, "/dev/%s", entry->d_name);
+                found = 0;
+            }
+        }
+        fclose(uevent);
+    }
+    closedir(dir);
+    return found;
+}
+
+// Output report without a report ID, hidraw wants a leading 0 for that.
+static int receiver_command(int fd, frame_command_t command)
+{
+    uint8_t report[2] = {0, (uint8_t)command};
+    return write(fd, report, sizeof(report)) == (ssize_t)sizeof(report) ? 0 : -1;
+}
+
+static void receiver_save_pgm(const char *dir, const frame_header_t *header, const uint8_t *pixels)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/frame_%06u.pgm", dir, header->sequence);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        return;
+    }
+    fprintf(file, "P5\n%u %u\n255\n", header->width, header->height);
+    fwrite(pixels, 1, (size_t)header->width * header->height, file);
+    fclose(file);
+}
+
+// Add one packet, returns true when it completed a frame.
+static bool receiver_packet(receiver_t *receiver, const uint8_t *packet)
+{
+    uint8_t sequence = packet[0];
+    uint8_t chunk = packet[1];
+    if (chunk == 0)
+    {
+        if (receiver->next_chunk > 0)
+        {
+            receiver->broken++;
+        }
+        receiver->next_chunk = 0;
+        receiver->sequence = sequence;
+    }
+    else if (receiver->next_chunk != chunk || receiver->sequence != sequence)
+    {
+        if (receiver->next_chunk > 0)
+        {
+            receiver->broken++;
+        }
+        receiver->next_chunk = -1;
+        return false;
+    }
+    if (receiver->next_chunk < 0 || chunk >= FRAME_CHUNKS)
+    {
+        return false;
+    }
+    memcpy(&receiver->frame[chunk * FRAME_CHUNK_SIZE], &packet[FRAME_PACKET_HEADER_SIZE], FRAME_CHUNK_SIZE);
+    receiver->next_chunk++;
+    if (receiver->next_chunk < (int)FRAME_CHUNKS)
+    {
+        return false;
+    }
+    receiver->next_chunk = -1;
+
+    frame_header_t header;
+    memcpy(&header, receiver->frame, sizeof(header));
+    if (header.magic != FRAME_MAGIC || header.width != SENSOR_RAW_FRAME_WIDTH || header.height != SENSOR_RAW_FRAME_HEIGHT)
+    {
+        receiver->broken++;
+        return false;
+    }
+    if (receiver->have_last && header.sequence > receiver->last_sequence + 1)
+    {
+        receiver->lost += header.sequence - receiver->last_sequence - 1;
+    }
+    receiver->have_last = true;
+    receiver->last_sequence = header.sequence;
+    receiver->frames++;
+    receiver->stalls = header.stalls;
+    receiver->grab_us += header.grab_us;
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-d /dev/hidrawN | packets.bin] [-n frames] [-t seconds] [-o frames.bin] [-p pgm_dir]\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    char device[PATH_MAX] = "";
+    uint32_t max_frames = 0;
+    double max_seconds = 0;
+    const char *out_path = NULL;
+    const char *pgm_dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:t:o:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            snprintf(device, sizeof(device), "%s", optarg);
+            break;
+        case 'n':
+            max_frames = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            max_seconds = atof(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'p':
+            pgm_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (device[0] == '\0' && receiver_find(device, sizeof(device)) != 0)
+    {
+        fprintf(stderr, "no frame capture interface found, is the mouse plugged in?\n");
+        return 2;
+    }
+
+    int fd = open(device, O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: %s\n", device, strerror(errno));
+        return 2;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    bool live = S_ISCHR(st.st_mode);
+    FILE *out = NULL;
+    if (out_path != NULL && (out = fopen(out_path, "wb")) == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+        close(fd);
+        return 2;
+    }
+    if (pgm_dir != NULL)
+    {
+        mkdir(pgm_dir, 0755);
+    }
+
+    signal(SIGINT, receiver_signal);
+    signal(SIGTERM, receiver_signal);
+    if (live && receiver_command(fd, FRAME_COMMAND_START) != 0)
+    {
+        fprintf(stderr, "%s: start command failed: %s\n", device, strerror(errno));
+        close(fd);
+        return 2;
+    }
+    printf("receiving %ux%u frames from %s\n", SENSOR_RAW_FRAME_WIDTH, SENSOR_RAW_FRAME_HEIGHT, device);
+
+    static receiver_t receiver;
+    receiver.next_chunk = -1;
+    double start = 0;
+    double last_print = 0;
+    uint32_t last_frames = 0;
+    uint32_t first_sequence = 0;
+    while (!receiver_stop && (max_frames == 0 || receiver.frames < max_frames))
+    {
+        double now = receiver_now();
+        if (live && max_seconds > 0 && start > 0 && now - start >= max_seconds)
+        {
+            break;
+        }
+        if (live && start > 0 && now - last_print >= 1.0)
+        {
+            printf("%6.1f fps, %7.1f KB/s, %u frames, %u lost, %u stalls\n", (receiver.frames - last_frames) / (now - last_print),
+                   (receiver.frames - last_frames) * FRAME_SIZE / 1024.0 / (now - last_print), receiver.frames, receiver.lost,
+                   receiver.stalls);
+            last_print = now;
+            last_frames = receiver.frames;
+        }
+        if (live)
+        {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            if (poll(&pfd, 1, RECEIVER_POLL_MS) <= 0)
+            {
+                continue;
+            }
+        }
+        uint8_t packet[FRAME_PACKET_SIZE];
+        ssize_t length = read(fd, packet, sizeof(packet));
+        if (length == 0 || (length < 0 && errno != EINTR))
+        {
+            break;
+        }
+        if (length != (ssize_t)sizeof(packet) || !receiver_packet(&receiver, packet))
+        {
+            continue;
+        }
+        frame_header_t header;
+        memcpy(&header, receiver.frame, sizeof(header));
+        if (receiver.frames == 1)
+        {
+            start = last_print = receiver_now();
+            first_sequence = header.sequence;
+        }
+        if (out != NULL)
+        {
+            fwrite(receiver.frame, 1, FRAME_SIZE, out);
+        }
+        if (pgm_dir != NULL)
+        {
+            receiver_save_pgm(pgm_dir, &header, receiver.frame + sizeof(header));
+        }
+    }
+    double elapsed = start > 0 ? receiver_now() - start : 0;
+    if (live)
+    {
+        receiver_command(fd, FRAME_COMMAND_STOP);
+    }
+    close(fd);
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+
+    printf("%u frames, %u lost, %u broken", receiver.frames, receiver.lost, receiver.broken);
+    if (receiver.frames)
+    {
+        printf(", sequence %u..%u, mean grab %llu us, %u stalls", first_sequence, receiver.last_sequence,
+               (unsigned long long)(receiver.grab_us / receiver.frames), receiver.stalls);
+    }
+    printf("\n");
+    // The first frame starts the clock, so the rate counts the frames after it.
+    if (live && receiver.frames > 1 && elapsed > 0)
+    {
+        printf("throughput %.1f fps, %.1f KB/s over %.1f s\n", (receiver.frames - 1) / elapsed,
+               (receiver.frames - 1) * FRAME_SIZE / 1024.0 / elapsed, elapsed);
+    }
+    return receiver.frames ? 0 : 1;
+}
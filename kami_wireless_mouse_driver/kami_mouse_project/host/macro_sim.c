@@ -0,0 +1,531 @@
+// Play button macros through the report path under full tracking load on a virtual clock.
+//
+// The macro player and the transport mux run the same code as on the device. The sensor task reports motion
+// every report interval and holds the transport mutex while it does, and a mock USB host polls the endpoint
+// once per report interval. A macro starts on a button press. Its timer fires at the schedule of each step,
+// and the esp_timer task and the macro task then take a random dispatch latency before the step runs.
+// A step that finds the mutex taken waits for the sensor to let go of it.
+//
+// Each step is timed from its schedule to its handoff to the transport, the lateness the firmware counts in
+// macro_late_max_us, and from its handoff to the host. Fails if a handoff comes more than one report interval
+// late, a step takes more than two polls to reach the host (the report already in the endpoint, then its own),
+// a button step is not in the first report after it, the host ends up with other motion than the sensor and
+// the macros made, or a macro leaves buttons held.
+// The button map tables are checked first: the default map, two buttons on one HID button and a macro button.
+//
+//   macro_sim [-s seed] [-n macros] [-r report_rate_us] [-v]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "header/input_pipeline.h"
+#include "header/transport_mux.h"
+
+// Mirrors the default report_rate_us in settings.c (REPORT_RATE_US).
+#define SIM_REPORT_RATE_US_DEFAULT 250
+// Timer alarm to the macro task: the esp_timer task wakes, notifies the macro task and that one is switched in.
+#define SIM_DISPATCH_MIN_US 15
+#define SIM_DISPATCH_MAX_US 60
+// Time transport_report_motion holds the transport mutex.
+#define SIM_MUTEX_HOLD_US 20
+// Report completion to the transport task polling the mux.
+#define SIM_NOTIFY_US 10
+// Sensor motion per report, kept small so a report never has to carry motion over.
+#define SIM_SENSOR_DELTA 20
+// Steps that change buttons are this many report intervals apart, closer ones could share a report.
+#define SIM_BUTTON_GAP_REPORTS 3
+#define SIM_STEPS_MAX (INPUT_MACRO_STEPS * 4096)
+
+typedef struct
+{
+    uint32_t due_us;
+    uint32_t handoff_us;
+    uint32_t delivered_us;
+    // The step changed the report, steps that did not are only timed to their handoff.
+    bool visible;
+    bool submitted;
+    bool delivered;
+    // Buttons the first report after the step has to hold, for steps that changed them.
+    bool button;
+    uint8_t buttons;
+} sim_step_t;
+
+typedef struct
+{
+    transport_mux_t mux;
+    uint32_t now;
+    uint32_t rate_us;
+    uint32_t rng;
+    // Mock USB endpoint, one report waits for the host's next poll.
+    bool in_flight;
+    transport_report_t endpoint;
+    uint32_t notify_at;
+    // Sensor task, it holds the transport mutex until this time.
+    bool tracking;
+    uint32_t sensor_phase;
+    uint32_t mutex_until;
+    // Macro player and its timer, UINT32_MAX while not armed.
+    input_macro_player_t player;
+    uint32_t timer_at;
+    uint32_t task_at;
+    // Totals the host should end up with.
+    int64_t expect_x;
+    int64_t expect_y;
+    int64_t expect_wheel;
+    int64_t expect_pan;
+    int64_t host_x;
+    int64_t host_y;
+    int64_t host_wheel;
+    int64_t host_pan;
+    uint8_t host_buttons;
+    uint32_t host_reports;
+    // Step log.
+    sim_step_t *steps;
+    uint32_t step_count;
+    uint32_t first_unsubmitted;
+    uint32_t first_undelivered;
+    bool failed;
+} sim_t;
+
+static uint32_t sim_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int sim_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/************* Mock USB ****************/
+
+static bool sim_usb_available(void *context)
+{
+    (void)context;
+    return true;
+}
+
+static bool sim_usb_ready(void *context)
+{
+    const sim_t *sim = context;
+    return !sim->in_flight;
+}
+
+// The report waits in the endpoint, every step handed off before now is in it.
+static bool sim_usb_submit(void *context, const transport_report_t *report)
+{
+    sim_t *sim = context;
+    sim->in_flight = true;
+    sim->endpoint = *report;
+    for (uint32_t i = sim->first_unsubmitted; i < sim->step_count; i++)
+    {
+        sim_step_t *step = &sim->steps[i];
+        // Only the last button step before the report is checked, an earlier one may have been overtaken.
+        bool last_button = true;
+        for (uint32_t j = i + 1; j < sim->step_count; j++)
+        {
+            last_button = last_button && !sim->steps[j].button;
+        }
+        if (step->button && last_button && report->buttons != step->buttons)
+        {
+            printf("FAIL at %u us: step due at %u us should hold buttons 0x%02X, the report has 0x%02X\n", sim->now,
+                   step->due_us, step->buttons, report->buttons);
+            sim->failed = true;
+        }
+        step->submitted = true;
+    }
+    sim->first_unsubmitted = sim->step_count;
+    return true;
+}
+
+static sim_t sim;
+
+static const transport_t sim_transports[1] = {
+    {
+        .name = "USB",
+        .available = sim_usb_available,
+        .ready = sim_usb_ready,
+        .submit = sim_usb_submit,
+        .context = &sim,
+    },
+};
+
+// Host poll of the endpoint.
+static void sim_host_poll(sim_t *sim)
+{
+    if (!sim->in_flight)
+    {
+        return;
+    }
+    sim->in_flight = false;
+    sim->host_buttons = sim->endpoint.buttons;
+    sim->host_x += sim->endpoint.x;
+    sim->host_y += sim->endpoint.y;
+    sim->host_wheel += sim->endpoint.wheel;
+    sim->host_pan += sim->endpoint.pan;
+    sim->host_reports++;
+    for (uint32_t i = sim->first_undelivered; i < sim->step_count && sim->steps[i].submitted; i++)
+    {
+        sim->steps[i].delivered = true;
+        sim->steps[i].delivered_us = sim->now;
+        sim->first_undelivered = i + 1;
+    }
+    // tud_hid_report_complete_cb, the transport task polls the mux a moment later.
+    sim->notify_at = sim->now + SIM_NOTIFY_US;
+}
+
+/************* Tasks ****************/
+
+// transport_report_motion from the sensor task.
+static void sim_sensor(sim_t *sim)
+{
+    int16_t x = (int16_t)(sim_random(&sim->rng) % (2 * SIM_SENSOR_DELTA + 1)) - SIM_SENSOR_DELTA;
+    int16_t y = (int16_t)(sim_random(&sim->rng) % (2 * SIM_SENSOR_DELTA + 1)) - SIM_SENSOR_DELTA;
+    sim->expect_x += x;
+    sim->expect_y += y;
+    sim->mutex_until = sim->now + SIM_MUTEX_HOLD_US;
+    transport_mux_motion(&sim->mux, x, y, 0, 0, sim->now);
+    transport_mux_poll(&sim->mux, sim->now);
+}
+
+// One pass of macro_task, after its timer expired.
+static void sim_macro_task(sim_t *sim, uint32_t *late, uint32_t *late_count)
+{
+    uint32_t due_us;
+    const input_macro_step_t *step;
+    while ((step = input_macro_step(&sim->player, sim->now, &due_us)) != NULL)
+    {
+        // transport_report_macro.
+        bool move = step->op == INPUT_MACRO_MOVE;
+        bool wheel = step->op == INPUT_MACRO_WHEEL;
+        int16_t x = move ? step->x : 0;
+        int16_t y = move ? step->y : 0;
+        int8_t wheel_steps = wheel ? step->wheel : 0;
+        int8_t pan = wheel ? step->pan : 0;
+        uint8_t before = sim->mux.buttons;
+        transport_mux_buttons(&sim->mux, sim->player.buttons);
+        transport_mux_motion(&sim->mux, x, y, wheel_steps, pan, sim->now);
+        sim->expect_x += x;
+        sim->expect_y += y;
+        sim->expect_wheel += wheel_steps;
+        sim->expect_pan += pan;
+
+        if (sim->step_count < SIM_STEPS_MAX)
+        {
+            sim_step_t *log = &sim->steps[sim->step_count++];
+            memset(log, 0, sizeof(*log));
+            log->due_us = due_us;
+            log->handoff_us = sim->now;
+            log->button = sim->mux.buttons != before;
+            log->buttons = sim->mux.buttons;
+            log->visible = log->button || x != 0 || y != 0 || wheel_steps != 0 || pan != 0;
+        }
+        transport_mux_poll(&sim->mux, sim->now);
+
+        // macro_count_step.
+        uint32_t late_us = sim->now - due_us;
+        late[(*late_count)++ % SIM_STEPS_MAX] = late_us;
+        if (late_us > sim->rate_us)
+        {
+            printf("FAIL at %u us: step due at %u us handed off %u us late, report interval %u us\n", sim->now, due_us,
+                   late_us, sim->rate_us);
+            sim->failed = true;
+        }
+    }
+    sim->timer_at = sim->player.macro != NULL ? (sim->player.due_us > sim->now ? sim->player.due_us : sim->now + 1)
+                                              : UINT32_MAX;
+}
+
+// Advance the clock to `until` one microsecond at a time.
+static void sim_advance(sim_t *sim, uint32_t until, uint32_t *late, uint32_t *late_count)
+{
+    while (sim->now < until)
+    {
+        sim->now++;
+        if (sim->now % sim->rate_us == 0)
+        {
+            sim_host_poll(sim);
+        }
+        if (sim->now == sim->notify_at)
+        {
+            transport_mux_poll(&sim->mux, sim->now);
+        }
+        if (sim->tracking && sim->now % sim->rate_us == sim->sensor_phase)
+        {
+            sim_sensor(sim);
+        }
+        if (sim->now == sim->timer_at)
+        {
+            sim->timer_at = UINT32_MAX;
+            sim->task_at = sim->now + SIM_DISPATCH_MIN_US +
+                           sim_random(&sim->rng) % (SIM_DISPATCH_MAX_US - SIM_DISPATCH_MIN_US + 1);
+        }
+        if (sim->now == sim->task_at)
+        {
+            if (sim->now < sim->mutex_until)
+            {
+                sim->task_at = sim->mutex_until;
+            }
+            else
+            {
+                sim->task_at = UINT32_MAX;
+                sim_macro_task(sim, late, late_count);
+            }
+        }
+    }
+}
+
+/************* Macros ****************/
+
+// A random macro of 2 to 15 steps, the END step included.
+static void sim_make_macro(input_macro_t *macro, uint32_t rate_us, uint32_t *rng)
+{
+    memset(macro, 0, sizeof(*macro));
+    int count = 1 + sim_random(rng) % (INPUT_MACRO_STEPS - 2);
+    for (int i = 0; i < count; i++)
+    {
+        input_macro_step_t *step = &macro->steps[i];
+        step->op = INPUT_MACRO_PRESS + sim_random(rng) % (INPUT_MACRO_OP_COUNT - 1);
+        switch (step->op)
+        {
+        case INPUT_MACRO_PRESS:
+        case INPUT_MACRO_RELEASE:
+            step->buttons = 1 + sim_random(rng) % INPUT_HID_BUTTONS;
+            step->delay_us = SIM_BUTTON_GAP_REPORTS * rate_us + sim_random(rng) % 20000;
+            break;
+        case INPUT_MACRO_MOVE:
+            step->x = (int16_t)(sim_random(rng) % 121) - 60;
+            step->y = (int16_t)(sim_random(rng) % 121) - 60;
+            step->delay_us = sim_random(rng) % 5000;
+            break;
+        case INPUT_MACRO_WHEEL:
+            step->wheel = (int8_t)(sim_random(rng) % 7) - 3;
+            step->pan = (int8_t)(sim_random(rng) % 3) - 1;
+            step->delay_us = sim_random(rng) % 5000;
+            break;
+        }
+    }
+    macro->steps[count].op = INPUT_MACRO_END;
+    macro->steps[count].delay_us = SIM_BUTTON_GAP_REPORTS * rate_us + sim_random(rng) % 20000;
+}
+
+/************* Button Map ****************/
+
+static bool sim_expect(const char *what, uint32_t got, uint32_t want)
+{
+    if (got != want)
+    {
+        printf("FAIL: %s gave 0x%02X, expected 0x%02X\n", what, got, want);
+        return false;
+    }
+    return true;
+}
+
+// The button map tables on their own.
+static bool sim_remap_check(void)
+{
+    static const uint8_t defaults[INPUT_BUTTON_COUNT] = INPUT_REMAP_DEFAULT;
+    input_remap_t remap = {0};
+    bool ok = input_remap_valid(defaults);
+    input_remap_build(&remap, defaults);
+    ok &= sim_expect("middle press", input_remap_button(&remap, INPUT_BUTTON_MIDDLE, true), INPUT_HID_BUTTON_MIDDLE);
+    ok &= sim_expect("back press", input_remap_button(&remap, INPUT_BUTTON_BACK, true),
+                     INPUT_HID_BUTTON_MIDDLE | INPUT_HID_BUTTON_BACK);
+    ok &= sim_expect("forward press", input_remap_button(&remap, INPUT_BUTTON_FORWARD, true),
+                     INPUT_HID_BUTTON_MIDDLE | INPUT_HID_BUTTON_BACK | INPUT_HID_BUTTON_FORWARD);
+    ok &= sim_expect("middle release", input_remap_button(&remap, INPUT_BUTTON_MIDDLE, false),
+                     INPUT_HID_BUTTON_BACK | INPUT_HID_BUTTON_FORWARD);
+    input_remap_button(&remap, INPUT_BUTTON_BACK, false);
+    input_remap_button(&remap, INPUT_BUTTON_FORWARD, false);
+
+    // Back is a second left button, forward plays macro 1 and the middle button is off.
+    const uint8_t custom[INPUT_BUTTON_COUNT] = {INPUT_HID_BUTTON_LEFT, INPUT_HID_BUTTON_RIGHT, 0, INPUT_HID_BUTTON_LEFT,
+                                                INPUT_REMAP_MACRO | 1};
+    ok &= sim_expect("custom map valid", input_remap_valid(custom), true);
+    input_remap_build(&remap, custom);
+    ok &= sim_expect("left press", input_remap_button(&remap, INPUT_BUTTON_LEFT, true), INPUT_HID_BUTTON_LEFT);
+    ok &= sim_expect("back as left", input_remap_button(&remap, INPUT_BUTTON_BACK, true), INPUT_HID_BUTTON_LEFT);
+    ok &= sim_expect("left release, back held", input_remap_button(&remap, INPUT_BUTTON_LEFT, false),
+                     INPUT_HID_BUTTON_LEFT);
+    ok &= sim_expect("back release", input_remap_button(&remap, INPUT_BUTTON_BACK, false), 0);
+    ok &= sim_expect("disabled middle", input_remap_button(&remap, INPUT_BUTTON_MIDDLE, true), 0);
+    ok &= sim_expect("macro button", input_remap_button(&remap, INPUT_BUTTON_FORWARD, true), 0);
+    ok &= sim_expect("macro index", remap.macros[INPUT_BUTTON_FORWARD], 1);
+    ok &= sim_expect("plain button macro", remap.macros[INPUT_BUTTON_LEFT], INPUT_REMAP_NONE);
+
+    const uint8_t bad_bits[INPUT_BUTTON_COUNT] = {0x20, 0, 0, 0, 0};
+    const uint8_t bad_macro[INPUT_BUTTON_COUNT] = {0, 0, 0, 0, INPUT_REMAP_MACRO | INPUT_MACRO_COUNT};
+    ok &= sim_expect("unknown HID button rejected", input_remap_valid(bad_bits), false);
+    ok &= sim_expect("unknown macro rejected", input_remap_valid(bad_macro), false);
+
+    input_macro_t macro;
+    memset(&macro, 0, sizeof(macro));
+    for (int i = 0; i < INPUT_MACRO_STEPS; i++)
+    {
+        macro.steps[i].op = INPUT_MACRO_MOVE;
+    }
+    ok &= sim_expect("macro without END rejected", input_macro_valid(&macro), false);
+    macro.steps[INPUT_MACRO_STEPS - 1].op = INPUT_MACRO_END;
+    ok &= sim_expect("macro ending in the last step", input_macro_valid(&macro), true);
+    return ok;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n macros] [-r report_rate_us] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x4B4D;
+    int macros = 200;
+    uint32_t rate_us = SIM_REPORT_RATE_US_DEFAULT;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:r:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            seed = seed ? seed : 1;
+            break;
+        case 'n':
+            macros = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'r':
+            rate_us = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    // Mirrors SETTINGS_REPORT_RATE_US_MIN and SETTINGS_REPORT_RATE_US_MAX.
+    if (rate_us < 125 || rate_us > 8000)
+    {
+        fprintf(stderr, "report rate needs 125 <= report_rate_us <= 8000\n");
+        return 2;
+    }
+
+    bool remap_ok = sim_remap_check();
+    printf("button map: %s\n", remap_ok ? "ok" : "FAIL");
+
+    static sim_step_t steps[SIM_STEPS_MAX];
+    static uint32_t late[SIM_STEPS_MAX];
+    static uint32_t delivered[SIM_STEPS_MAX];
+    uint32_t late_count = 0;
+    memset(&sim, 0, sizeof(sim));
+    sim.steps = steps;
+    sim.rate_us = rate_us;
+    sim.rng = seed;
+    sim.notify_at = UINT32_MAX;
+    sim.timer_at = UINT32_MAX;
+    sim.task_at = UINT32_MAX;
+    sim.tracking = true;
+    sim.sensor_phase = sim_random(&sim.rng) % rate_us;
+    transport_mux_init(&sim.mux, sim_transports, 1);
+
+    static input_macro_t macro;
+    for (int m = 0; m < macros && !sim.failed; m++)
+    {
+        sim_make_macro(&macro, rate_us, &sim.rng);
+        if (!input_macro_valid(&macro))
+        {
+            printf("FAIL: generated macro %d is not valid\n", m);
+            sim.failed = true;
+            break;
+        }
+        // The press, then macro_trigger wakes the macro task.
+        sim_advance(&sim, sim.now + 1000 + sim_random(&sim.rng) % 50000, late, &late_count);
+        sim_advance(&sim, sim.now + SIM_DISPATCH_MIN_US, late, &late_count);
+        while (sim.now < sim.mutex_until)
+        {
+            sim_advance(&sim, sim.mutex_until, late, &late_count);
+        }
+        input_macro_start(&sim.player, &macro, sim.now);
+        sim_macro_task(&sim, late, &late_count);
+        while (sim.player.macro != NULL)
+        {
+            sim_advance(&sim, sim.now + 1, late, &late_count);
+        }
+        if (sim.mux.buttons != 0)
+        {
+            printf("FAIL at %u us: macro %d left buttons 0x%02X held\n", sim.now, m, sim.mux.buttons);
+            sim.failed = true;
+        }
+        if (verbose)
+        {
+            printf("%10.3f ms: macro %d done, %u steps so far\n", sim.now / 1000.0, m, sim.step_count);
+        }
+    }
+    // Stop moving and let the last reports drain.
+    sim.tracking = false;
+    sim_advance(&sim, sim.now + 4 * rate_us, late, &late_count);
+
+    uint32_t delivered_count = 0;
+    for (uint32_t i = 0; i < sim.step_count; i++)
+    {
+        const sim_step_t *step = &sim.steps[i];
+        if (!step->visible)
+        {
+            continue;
+        }
+        if (!step->delivered)
+        {
+            printf("FAIL: step due at %u us never reached the host\n", step->due_us);
+            sim.failed = true;
+            continue;
+        }
+        uint32_t path_us = step->delivered_us - step->handoff_us;
+        delivered[delivered_count++] = step->delivered_us - step->due_us;
+        if (path_us > 2 * rate_us)
+        {
+            printf("FAIL: step due at %u us took %u us from handoff to the host\n", step->due_us, path_us);
+            sim.failed = true;
+        }
+    }
+    if (sim.host_x != sim.expect_x || sim.host_y != sim.expect_y || sim.host_wheel != sim.expect_wheel ||
+        sim.host_pan != sim.expect_pan)
+    {
+        printf("FAIL: host got motion %lld,%lld wheel %lld,%lld, sensor and macros made %lld,%lld wheel %lld,%lld\n",
+               (long long)sim.host_x, (long long)sim.host_y, (long long)sim.host_wheel, (long long)sim.host_pan,
+               (long long)sim.expect_x, (long long)sim.expect_y, (long long)sim.expect_wheel, (long long)sim.expect_pan);
+        sim.failed = true;
+    }
+    if (sim.host_buttons != 0)
+    {
+        printf("FAIL: host left with buttons 0x%02X\n", sim.host_buttons);
+        sim.failed = true;
+    }
+
+    printf("%d macros, %u steps, %.1f s simulated, report interval %u us, %u reports\n", macros, sim.step_count,
+           sim.now / 1e6, rate_us, sim.host_reports);
+    uint32_t count = late_count < SIM_STEPS_MAX ? late_count : SIM_STEPS_MAX;
+    if (count)
+    {
+        qsort(late, count, sizeof(late[0]), sim_compare);
+        printf("step handoff lateness: p50 %u us, p99 %u us, max %u us (budget %u us)\n", late[count / 2],
+               late[count * 99 / 100], late[count - 1], rate_us);
+    }
+    if (delivered_count)
+    {
+        qsort(delivered, delivered_count, sizeof(delivered[0]), sim_compare);
+        printf("step at host lateness: p50 %u us, p99 %u us, max %u us\n", delivered[delivered_count / 2],
+               delivered[delivered_count * 99 / 100], delivered[delivered_count - 1]);
+    }
+    return sim.failed || !remap_ok ? 1 : 0;
+}
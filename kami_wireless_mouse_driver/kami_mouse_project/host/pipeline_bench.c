@@ -0,0 +1,635 @@
+// Time the input pipeline kernels in isolation and compare them against a stored baseline.
+//
+// Each kernel runs over precomputed inputs, so the loop measures the kernel and not the input generator.
+// A run is calibrated to take at least BENCH_RUN_NS, the best of BENCH_REPEATS runs is kept as ns/op.
+// Heap allocations are counted by wrapping malloc, calloc and realloc at link time, the kernels
+// must not allocate at all on the device.
+//
+// Any allocation fails the run. Timings are compared as the ratio of each kernel's ns/op to that of a reference
+// loop timed in turn with it, which follows the clock, the core and the load of the machine like the
+// kernel does, so the committed baseline holds on other machines too. Each kernel is checked against the baseline
+// file, host/pipeline_bench.baseline unless -b names another one. A kernel fails if its ratio grew by more than the
+// tolerance (and by more than BENCH_SLACK_NS, the timer noise of the fastest kernels) or it has no baseline, and a
+// missing baseline file fails the run. On a machine too noisy for that, -n only reports the slower kernels, the
+// allocation and baseline checks still fail the run. -w records the ratios of this run as the baseline.
+//
+//   pipeline_bench [-b baseline] [-w] [-n] [-t tolerance_percent] [-f filter]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "header/input_pipeline.h"
+#include "header/radio_protocol.h"
+#include "header/trace_format.h"
+#include "header/transport_mux.h"
+
+#define BENCH_INPUTS 1024
+#define BENCH_RUN_NS 2000000ULL
+#define BENCH_REPEATS 31
+// Extra timings of a kernel over its limit before it fails.
+#define BENCH_RETRIES 2
+#define BENCH_TOLERANCE_DEFAULT 30
+#define BENCH_SLACK_NS 1.0
+#define BENCH_MAX 32
+// Mirror the default debounce_ms and debounce_min_ms in settings.c.
+#define BENCH_STABLE_US 10000
+#define BENCH_STABLE_MIN_US 2000
+// The committed baseline, the build passes its path in the source tree.
+#ifndef BENCH_BASELINE_DEFAULT
+#define BENCH_BASELINE_DEFAULT "pipeline_bench.baseline"
+#endif
+
+typedef struct
+{
+    const char *name;
+    uint32_t (*run)(uint32_t iterations);
+} bench_t;
+
+typedef struct
+{
+    char name[64];
+    double ns;
+    // ns/op over that of the reference loop.
+    double ratio;
+    double allocs;
+} bench_result_t;
+
+/************* Allocation Counter ****************/
+
+// Linked with -Wl,--wrap=malloc and friends, so every allocation of the kernels goes through here.
+static uint64_t bench_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    bench_allocs++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+/************* Inputs ****************/
+
+static uint8_t bench_bursts[BENCH_INPUTS][SENSOR_MOTION_BURST_SIZE];
+static uint8_t bench_levels[BENCH_INPUTS];
+static int16_t bench_deltas[BENCH_INPUTS];
+// Keeps the results alive, the compiler cannot drop a kernel call whose result ends up here.
+static volatile uint32_t bench_sink;
+
+static uint32_t bench_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Bursts like the sensor sends while moving, every eighth one without motion.
+static void bench_inputs_init(void)
+{
+    uint32_t rng = 0x4B4D;
+    for (int i = 0; i < BENCH_INPUTS; i++)
+    {
+        uint8_t *burst = bench_bursts[i];
+        int16_t dx = (int16_t)(bench_random(&rng) % 2001) - 1000;
+        int16_t dy = (int16_t)(bench_random(&rng) % 2001) - 1000;
+        burst[SENSOR_BURST_MOTION] = (i % 8) ? SENSOR_MOTION_BIT : 0x00;
+        burst[SENSOR_BURST_OBSERVATION] = 0x3F;
+        burst[SENSOR_BURST_DELTA_X_L] = (uint8_t)dx;
+        burst[SENSOR_BURST_DELTA_X_H] = (uint8_t)((uint16_t)dx >> 8);
+        burst[SENSOR_BURST_DELTA_Y_L] = (uint8_t)dy;
+        burst[SENSOR_BURST_DELTA_Y_H] = (uint8_t)((uint16_t)dy >> 8);
+        burst[SENSOR_BURST_SQUAL] = 0x40 + bench_random(&rng) % 0x40;
+        for (int j = SENSOR_BURST_SQUAL + 1; j < SENSOR_MOTION_BURST_SIZE; j++)
+        {
+            burst[j] = 0x10 + bench_random(&rng) % 0x80;
+        }
+        bench_levels[i] = bench_random(&rng) & 0x03;
+        bench_deltas[i] = (int16_t)(bench_random(&rng) % 201) - 100;
+    }
+}
+
+/************* Kernels ****************/
+
+// Reference loop the kernels are timed against. A call per input that folds the burst and the levels, so it has
+// the calls, loads and integer work the kernels have. Kept out of line like the kernels in kami_pipeline.
+static __attribute__((noinline)) uint32_t bench_reference_fold(const uint8_t *burst, uint8_t levels)
+{
+    uint32_t hash = levels;
+    for (int i = 0; i < SENSOR_MOTION_BURST_SIZE; i++)
+    {
+        hash = hash * 31 + burst[i];
+    }
+    return hash;
+}
+
+static uint32_t bench_reference(uint32_t iterations)
+{
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        sum += bench_reference_fold(bench_bursts[i % BENCH_INPUTS], bench_levels[i % BENCH_INPUTS]);
+    }
+    return sum;
+}
+
+static uint32_t bench_burst_decode(uint32_t iterations)
+{
+    uint32_t sum = 0;
+    motion_burst_t burst;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        sum += input_decode_motion_burst(bench_bursts[i % BENCH_INPUTS], &burst);
+        sum += (uint16_t)burst.delta_x;
+    }
+    return sum;
+}
+
+static uint32_t bench_burst_plausible(uint32_t iterations)
+{
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        sum += input_motion_burst_plausible(bench_bursts[i % BENCH_INPUTS]);
+    }
+    return sum;
+}
+
+// A push and a pop, the sensor task's steady state.
+static uint32_t bench_motion_ring(uint32_t iterations)
+{
+    static motion_ring_t ring;
+    uint32_t sum = 0;
+    motion_sample_t sample;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        input_motion_ring_push(&ring, bench_deltas[i % BENCH_INPUTS], bench_deltas[(i + 1) % BENCH_INPUTS], i);
+        input_motion_ring_pop(&ring, &sample);
+        sum += (uint16_t)sample.motion_x;
+    }
+    return sum;
+}
+
+// Pushes into a full ring, each one merges the two oldest samples.
+static uint32_t bench_motion_ring_full(uint32_t iterations)
+{
+    static motion_ring_t ring;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        sum += input_motion_ring_push(&ring, bench_deltas[i % BENCH_INPUTS], 1, i);
+    }
+    return sum + (uint16_t)ring.samples[ring.read_index].motion_x;
+}
+
+static uint32_t bench_quadrature(uint32_t iterations)
+{
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint8_t levels = bench_levels[i % BENCH_INPUTS];
+        sum += input_quadrature_step(i & 1, levels & 1, levels >> 1);
+    }
+    return sum;
+}
+
+static uint32_t bench_latch(uint32_t iterations)
+{
+    mouse_button_state_t state = MOUSE_BUTTON_UP;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint8_t levels = bench_levels[i % BENCH_INPUTS];
+        state = input_latch_state(levels & 1, levels >> 1, state);
+        sum += state;
+    }
+    return sum;
+}
+
+// An edge and a poll, a bouncing contact with 1 ms between edges.
+static uint32_t bench_eager_debounce(uint32_t iterations)
+{
+    eager_debounce_t debounce = {.state = MOUSE_BUTTON_UP};
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint32_t now_us = i * 1000;
+        sum += input_eager_debounce_edge(&debounce, bench_levels[i % BENCH_INPUTS] & 1, now_us);
+        sum += input_eager_debounce_poll(&debounce, now_us, BENCH_STABLE_US);
+    }
+    return sum;
+}
+
+static uint32_t bench_deferred_debounce(uint32_t iterations)
+{
+    deferred_debounce_t debounce = {.state = MOUSE_BUTTON_UP};
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint32_t now_us = i * 1000;
+        input_deferred_debounce_edge(&debounce, bench_levels[i % BENCH_INPUTS] & 1, now_us);
+        sum += input_deferred_debounce_poll(&debounce, now_us, BENCH_STABLE_US);
+    }
+    return sum;
+}
+
+// Hold time learning on the same edges, the ISR side and the task side of one debounced button.
+static uint32_t bench_debounce_tune(uint32_t iterations)
+{
+    debounce_tuner_t tuner;
+    input_debounce_tune_init(&tuner, BENCH_STABLE_MIN_US, BENCH_STABLE_US);
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint32_t now_us = i * 1000;
+        if (bench_levels[i % BENCH_INPUTS] & 1)
+        {
+            input_debounce_tune_edge(&tuner, now_us);
+        }
+        sum += input_debounce_tune_poll(&tuner, now_us, BENCH_STABLE_MIN_US, BENCH_STABLE_US);
+    }
+    return sum;
+}
+
+// Presses and releases of each button in turn through the default button map.
+static uint32_t bench_button_remap(uint32_t iterations)
+{
+    static const uint8_t map[INPUT_BUTTON_COUNT] = INPUT_REMAP_DEFAULT;
+    input_remap_t remap = {0};
+    input_remap_build(&remap, map);
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        input_button_t button = (input_button_t)(i % INPUT_BUTTON_COUNT);
+        sum += input_remap_button(&remap, button, bench_levels[i % BENCH_INPUTS] & 1);
+    }
+    return sum;
+}
+
+// USB backend that packs each report into the boot protocol layout, as tud_hid_mouse_report does.
+static uint8_t bench_usb_report[5];
+
+static bool bench_usb_available(void *context)
+{
+    (void)context;
+    return true;
+}
+
+static bool bench_usb_ready(void *context)
+{
+    (void)context;
+    return true;
+}
+
+static bool bench_usb_submit(void *context, const transport_report_t *report)
+{
+    (void)context;
+    bench_usb_report[0] = report->buttons;
+    bench_usb_report[1] = (uint8_t)report->x;
+    bench_usb_report[2] = (uint8_t)report->y;
+    bench_usb_report[3] = (uint8_t)report->wheel;
+    bench_usb_report[4] = (uint8_t)report->pan;
+    return true;
+}
+
+static const transport_t bench_transports[1] = {
+    {
+        .name = "USB",
+        .available = bench_usb_available,
+        .ready = bench_usb_ready,
+        .submit = bench_usb_submit,
+    },
+};
+
+// Motion in, one packed report out.
+static uint32_t bench_report_pack(uint32_t iterations)
+{
+    static transport_mux_t mux;
+    transport_mux_init(&mux, bench_transports, 1);
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        transport_mux_motion(&mux, bench_deltas[i % BENCH_INPUTS], bench_deltas[(i + 7) % BENCH_INPUTS], 0, 0, i);
+        transport_mux_poll(&mux, i);
+        sum += bench_usb_report[1];
+    }
+    return sum;
+}
+
+static uint32_t bench_trace_pack(uint32_t iterations)
+{
+    uint8_t payload[TRACE_REPORT_PAYLOAD_SIZE];
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        trace_report_t report = {
+            .buttons = bench_levels[i % BENCH_INPUTS],
+            .x = bench_deltas[i % BENCH_INPUTS],
+            .y = bench_deltas[(i + 7) % BENCH_INPUTS],
+        };
+        sum += trace_pack_report(payload, &report);
+        sum += payload[1];
+    }
+    return sum;
+}
+
+// A sample added and a radio packet built from it.
+static uint32_t bench_radio_pack(uint32_t iterations)
+{
+    static radio_tx_t tx;
+    radio_tx_init(&tx, RADIO_LINK_ID_DEFAULT);
+    uint8_t packet[RADIO_PACKET_MAX];
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        radio_sample_t sample = {
+            .timestamp_us = i,
+            .x = bench_deltas[i % BENCH_INPUTS],
+            .y = bench_deltas[(i + 7) % BENCH_INPUTS],
+        };
+        radio_tx_add_sample(&tx, &sample);
+        sum += radio_tx_build(&tx, i, packet);
+    }
+    return sum;
+}
+
+static const bench_t bench_kernels[] = {
+    {"burst_decode", bench_burst_decode},
+    {"burst_plausible", bench_burst_plausible},
+    {"motion_ring", bench_motion_ring},
+    {"motion_ring_full", bench_motion_ring_full},
+    {"quadrature_step", bench_quadrature},
+    {"latch_state", bench_latch},
+    {"eager_debounce", bench_eager_debounce},
+    {"deferred_debounce", bench_deferred_debounce},
+    {"debounce_tune", bench_debounce_tune},
+    {"button_remap", bench_button_remap},
+    {"report_pack", bench_report_pack},
+    {"trace_pack", bench_trace_pack},
+    {"radio_pack", bench_radio_pack},
+};
+#define BENCH_KERNELS (sizeof(bench_kernels) / sizeof(bench_kernels[0]))
+
+/************* Runner ****************/
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Iterations for one run of a kernel to last at least BENCH_RUN_NS.
+static uint32_t bench_iterations(const bench_t *bench)
+{
+    // Double the iterations until one run is long enough to time.
+    uint32_t iterations = 1024;
+    while (1)
+    {
+        uint64_t start = bench_now_ns();
+        bench_sink += bench->run(iterations);
+        if (bench_now_ns() - start >= BENCH_RUN_NS || iterations >= (1U << 30))
+        {
+            return iterations;
+        }
+        iterations *= 2;
+    }
+}
+
+static double bench_time(const bench_t *bench, uint32_t iterations)
+{
+    uint64_t start = bench_now_ns();
+    bench_sink += bench->run(iterations);
+    return (double)(bench_now_ns() - start) / iterations;
+}
+
+// Time a kernel and the reference loop in turn, so each pair of runs sees the same load on the machine.
+// The best of BENCH_REPEATS runs of each is kept, a run the machine interrupted is slower and drops out.
+static void bench_run(const bench_t *bench, const bench_t *reference, bench_result_t *result)
+{
+    uint32_t iterations = bench_iterations(bench);
+    uint32_t reference_iterations = bench_iterations(reference);
+    double best = 0;
+    double reference_best = 0;
+    uint64_t allocs_start = bench_allocs;
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        double ns = bench_time(bench, iterations);
+        best = (r == 0 || ns < best) ? ns : best;
+        uint64_t allocs = bench_allocs;
+        ns = bench_time(reference, reference_iterations);
+        reference_best = (r == 0 || ns < reference_best) ? ns : reference_best;
+        // Only the kernel's allocations count.
+        allocs_start += bench_allocs - allocs;
+    }
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+    result->ns = best;
+    result->ratio = best / reference_best;
+    result->allocs = (double)(bench_allocs - allocs_start) / ((double)iterations * BENCH_REPEATS);
+}
+
+// True if the ratio grew by more than the tolerance, and by more than BENCH_SLACK_NS at the reference's speed.
+static bool bench_slower(const bench_result_t *result, const bench_result_t *base, double tolerance)
+{
+    double reference_ns = result->ns / result->ratio;
+    return result->ratio > base->ratio * (1 + tolerance / 100) && (result->ratio - base->ratio) * reference_ns > BENCH_SLACK_NS;
+}
+
+static int bench_load_baseline(const char *path, bench_result_t *baseline, int max)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    int count = 0;
+    char line[256];
+    while (count < max && fgets(line, sizeof(line), file) != NULL)
+    {
+        if (line[0] == '#')
+        {
+            continue;
+        }
+        bench_result_t *entry = &baseline[count];
+        if (sscanf(line, "%63s %lf %lf", entry->name, &entry->ratio, &entry->allocs) == 3)
+        {
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static int bench_save_baseline(const char *path, const bench_result_t *results, int count)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    fprintf(file, "# pipeline_bench baseline, kernel ns/op relative to the reference loop, allocs/op\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(file, "%s %.3f %.2f\n", results[i].name, results[i].ratio, results[i].allocs);
+    }
+    fclose(file);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b baseline] [-w] [-n] [-t tolerance_percent] [-f filter]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *baseline_path = BENCH_BASELINE_DEFAULT;
+    bool write = false;
+    bool timing = true;
+    double tolerance = BENCH_TOLERANCE_DEFAULT;
+    const char *filter = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:wnt:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'w':
+            write = true;
+            break;
+        case 'n':
+            timing = false;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    static bench_result_t baseline[BENCH_MAX];
+    int baseline_count = 0;
+    if (!write)
+    {
+        baseline_count = bench_load_baseline(baseline_path, baseline, BENCH_MAX);
+        if (baseline_count < 0)
+        {
+            fprintf(stderr, "%s: cannot read the baseline\n", baseline_path);
+            return 2;
+        }
+    }
+
+    bench_inputs_init();
+    static bench_result_t results[BENCH_MAX];
+    int count = 0;
+    int failed = 0;
+    static const bench_t reference = {"reference", bench_reference};
+    printf("%-20s %10s %10s %10s %10s %s\n", "kernel", "ns/op", "ratio", "allocs/op", "baseline", "");
+    for (size_t k = 0; k < BENCH_KERNELS; k++)
+    {
+        if (filter != NULL && strstr(bench_kernels[k].name, filter) == NULL)
+        {
+            continue;
+        }
+        const bench_result_t *base = NULL;
+        for (int b = 0; b < baseline_count; b++)
+        {
+            if (strcmp(baseline[b].name, bench_kernels[k].name) == 0)
+            {
+                base = &baseline[b];
+            }
+        }
+        bench_result_t *result = &results[count++];
+        bench_run(&bench_kernels[k], &reference, result);
+        // A kernel over its limit is timed again. A busy machine slows one run, a regression slows all of them.
+        for (int retry = 0; retry < BENCH_RETRIES && base != NULL && bench_slower(result, base, tolerance); retry++)
+        {
+            bench_result_t again;
+            bench_run(&bench_kernels[k], &reference, &again);
+            if (again.ratio < result->ratio)
+            {
+                result->ns = again.ns;
+                result->ratio = again.ratio;
+            }
+        }
+
+        const char *verdict = "";
+        if (result->allocs > 0)
+        {
+            // The kernels must not allocate, whatever the baseline says.
+            verdict = "FAIL allocates";
+            failed++;
+        }
+        else if (base != NULL)
+        {
+            if (bench_slower(result, base, tolerance))
+            {
+                verdict = timing ? "FAIL slower" : "slower";
+                failed += timing;
+            }
+            else
+            {
+                verdict = "ok";
+            }
+        }
+        else if (!write)
+        {
+            // A new kernel has to be recorded in the baseline before it is checked.
+            verdict = "FAIL no baseline";
+            failed++;
+        }
+        if (base != NULL)
+        {
+            printf("%-20s %10.2f %10.3f %10.2f %10.3f %s\n", result->name, result->ns, result->ratio, result->allocs,
+                   base->ratio, verdict);
+        }
+        else
+        {
+            printf("%-20s %10.2f %10.3f %10.2f %10s %s\n", result->name, result->ns, result->ratio, result->allocs, "-",
+                   verdict);
+        }
+    }
+
+    if (write)
+    {
+        if (bench_save_baseline(baseline_path, results, count) != 0)
+        {
+            fprintf(stderr, "%s: cannot write the baseline\n", baseline_path);
+            return 2;
+        }
+        printf("baseline written to %s\n", baseline_path);
+    }
+    if (failed)
+    {
+        printf("FAIL: %d kernels allocate, regressed by more than %.0f%% against the reference loop or have no baseline "
+               "in %s\n", failed, tolerance, baseline_path);
+        return 1;
+    }
+    return 0;
+}
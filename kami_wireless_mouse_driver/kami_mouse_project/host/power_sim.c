@@ -0,0 +1,306 @@
+// Drive the power policy through mouse sessions on a virtual clock.
+//
+// A session is a run of motion bursts, clicks and idle gaps of random length, used either on the radio link
+// or plugged into USB. The policy runs the same code as on the device: input marks activity, reports stay
+// pending until the transport took them, and the power task updates the level when its timer expires
+// or input arrives below POWER_LEVEL_FULL. The timer runs in FreeRTOS ticks, so a downshift may come up to
+// two ticks late but never early. Light sleep is only entered on the radio link, USB stops without its clocks.
+//
+// Each input that finds the policy at POWER_LEVEL_SLEEP pays the modelled wake latency before its task runs.
+// Fails if a wake takes longer than one report interval, the level is below full while reports are pending,
+// a downshift comes early or late, or an idle gap longer than the ladder never reaches POWER_LEVEL_SLEEP.
+//
+//   power_sim [-s seed] [-n sessions] [-i idle_ms] [-l sleep_ms] [-v]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "header/power_policy.h"
+
+// Mirror POWER_WAKE_BUDGET_US, POWER_LIGHT_SLEEP_WAKE_US and POWER_WAKE_DISPATCH_US in power.h.
+#define SIM_WAKE_BUDGET_US 1000
+#define SIM_LIGHT_SLEEP_WAKE_US 300
+#define SIM_WAKE_DISPATCH_US 100
+// Mirror the ladder defaults in settings.h.
+#define SIM_IDLE_MS_DEFAULT 100
+#define SIM_SLEEP_MS_DEFAULT 2000
+// FreeRTOS tick, CONFIG_FREERTOS_HZ is 1000.
+#define SIM_TICK_US 1000
+// Sensor report interval while moving.
+#define SIM_MOTION_INTERVAL_US 125
+// Time a report waits for its transport, one USB frame or one radio send interval.
+#define SIM_DRAIN_US 1000
+// Wake latencies kept for the percentiles.
+#define SIM_WAKES_MAX 65536
+
+typedef struct
+{
+    uint32_t time_us[POWER_LEVEL_COUNT];
+    uint32_t wakes[SIM_WAKES_MAX];
+    uint32_t wake_count;
+    bool failed;
+} sim_stats_t;
+
+typedef struct
+{
+    power_policy_t policy;
+    uint32_t now;
+    // Light sleep is allowed, the session runs on the radio link.
+    bool radio;
+    // Reports queued and the time the transport takes them.
+    bool pending;
+    uint32_t drain_at;
+    // Power task timer, UINT32_MAX while it waits for a notification only.
+    uint32_t deadline;
+    power_level_t level;
+    uint32_t last_activity;
+} sim_t;
+
+static const char *sim_level_names[POWER_LEVEL_COUNT] = {"full", "idle", "sleep"};
+
+static uint32_t sim_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int sim_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// One pass of the power task, as after its timer expired or a notification.
+static void sim_power_task(sim_t *sim, sim_stats_t *stats, bool verbose)
+{
+    power_level_t level = power_policy_update(&sim->policy, sim->now);
+    if (level != sim->level)
+    {
+        if (level > sim->level)
+        {
+            uint32_t idle_us = sim->now - sim->last_activity;
+            uint32_t due_us = sim->policy.downshift_us[level];
+            if (idle_us < due_us || idle_us >= due_us + 2 * SIM_TICK_US)
+            {
+                printf("FAIL at %u us: downshift to %s after %u us idle, ladder says %u us\n", sim->now,
+                       sim_level_names[level], idle_us, due_us);
+                stats->failed = true;
+            }
+        }
+        if (verbose)
+        {
+            printf("%10.3f ms: %s -> %s\n", sim->now / 1000.0, sim_level_names[sim->level], sim_level_names[level]);
+        }
+        sim->level = level;
+    }
+    if (level != POWER_LEVEL_FULL && sim->pending)
+    {
+        printf("FAIL at %u us: level %s with reports pending\n", sim->now, sim_level_names[level]);
+        stats->failed = true;
+    }
+    // Round up to the next tick, like pdMS_TO_TICKS(next_us / 1000 + 1).
+    uint32_t next_us = power_policy_next_us(&sim->policy, sim->now);
+    sim->deadline = next_us == UINT32_MAX ? UINT32_MAX : sim->now + (next_us / SIM_TICK_US + 1) * SIM_TICK_US;
+}
+
+// Advance the clock to `until`, running the transport drain and the power task timer on the way.
+static void sim_advance(sim_t *sim, sim_stats_t *stats, uint32_t until, bool verbose)
+{
+    while (1)
+    {
+        uint32_t next = until;
+        if (sim->pending && sim->drain_at < next)
+        {
+            next = sim->drain_at;
+        }
+        if (sim->deadline < next)
+        {
+            next = sim->deadline;
+        }
+        stats->time_us[sim->level] += next - sim->now;
+        sim->now = next;
+        if (next == until)
+        {
+            return;
+        }
+        if (sim->pending && sim->now == sim->drain_at)
+        {
+            // The transport took the last report, transport_poll passes this on through power_reports_pending.
+            sim->pending = false;
+            power_policy_pending(&sim->policy, false, sim->now);
+            sim->last_activity = sim->now;
+            sim_power_task(sim, stats, verbose);
+        }
+        if (sim->now == sim->deadline)
+        {
+            sim_power_task(sim, stats, verbose);
+        }
+    }
+}
+
+// An input edge or sensor frame, reported through the transport.
+static void sim_input(sim_t *sim, sim_stats_t *stats, bool verbose)
+{
+    if (sim->level == POWER_LEVEL_SLEEP)
+    {
+        // The wake pin or MOTION interrupt, then the input task runs once the chip is back.
+        uint32_t wake_us = SIM_WAKE_DISPATCH_US + (sim->radio ? SIM_LIGHT_SLEEP_WAKE_US : 0);
+        if (stats->wake_count < SIM_WAKES_MAX)
+        {
+            stats->wakes[stats->wake_count++] = wake_us;
+        }
+        if (wake_us > SIM_WAKE_BUDGET_US)
+        {
+            printf("FAIL at %u us: wake took %u us\n", sim->now, wake_us);
+            stats->failed = true;
+        }
+        power_policy_activity(&sim->policy, sim->now);
+        sim->last_activity = sim->now;
+        sim_power_task(sim, stats, verbose);
+        sim_advance(sim, stats, sim->now + wake_us, verbose);
+    }
+
+    // power_activity from the transport, the task is only notified below full.
+    power_policy_activity(&sim->policy, sim->now);
+    sim->last_activity = sim->now;
+    if (!sim->pending)
+    {
+        sim->pending = true;
+        sim->drain_at = sim->now + SIM_DRAIN_US;
+    }
+    power_policy_pending(&sim->policy, true, sim->now);
+    if (sim->level != POWER_LEVEL_FULL)
+    {
+        sim_power_task(sim, stats, verbose);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n sessions] [-i idle_ms] [-l sleep_ms] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x4B4D;
+    int sessions = 40;
+    uint32_t idle_ms = SIM_IDLE_MS_DEFAULT;
+    uint32_t sleep_ms = SIM_SLEEP_MS_DEFAULT;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:i:l:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            seed = seed ? seed : 1;
+            break;
+        case 'n':
+            sessions = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'i':
+            idle_ms = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            sleep_ms = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (idle_ms == 0 || sleep_ms < idle_ms || sleep_ms > 60000)
+    {
+        fprintf(stderr, "ladder needs 1 <= idle_ms <= sleep_ms <= 60000\n");
+        return 2;
+    }
+
+    static sim_stats_t stats;
+    static sim_t sim;
+    memset(&stats, 0, sizeof(stats));
+    memset(&sim, 0, sizeof(sim));
+    power_policy_init(&sim.policy, idle_ms * 1000, sleep_ms * 1000, 0);
+    sim.deadline = UINT32_MAX;
+    sim_power_task(&sim, &stats, verbose);
+
+    uint32_t rng = seed;
+    uint32_t long_gaps = 0;
+    for (int s = 0; s < sessions; s++)
+    {
+        sim.radio = s % 2 == 0;
+        int actions = 5 + sim_random(&rng) % 20;
+        for (int a = 0; a < actions; a++)
+        {
+            uint32_t kind = sim_random(&rng) % 3;
+            if (kind == 0)
+            {
+                // Motion burst of 20 to 500 ms.
+                uint32_t end = sim.now + 20000 + sim_random(&rng) % 480000;
+                while (sim.now < end)
+                {
+                    sim_input(&sim, &stats, verbose);
+                    sim_advance(&sim, &stats, sim.now + SIM_MOTION_INTERVAL_US, verbose);
+                }
+            }
+            else if (kind == 1)
+            {
+                // Click, held for 40 to 150 ms.
+                sim_input(&sim, &stats, verbose);
+                sim_advance(&sim, &stats, sim.now + 40000 + sim_random(&rng) % 110000, verbose);
+                sim_input(&sim, &stats, verbose);
+            }
+            else
+            {
+                // Idle gap, mostly short pauses and now and then the hand leaving the mouse.
+                uint32_t gap = sim_random(&rng) % 4 == 0 ? 1000000 + sim_random(&rng) % 9000000 : 1000 + sim_random(&rng) % 400000;
+                uint32_t start = sim.now;
+                sim_advance(&sim, &stats, sim.now + gap, verbose);
+                if (gap > sleep_ms * 1000 + SIM_DRAIN_US + 2 * SIM_TICK_US)
+                {
+                    long_gaps++;
+                    if (sim.level != POWER_LEVEL_SLEEP)
+                    {
+                        printf("FAIL at %u us: idle since %u us and still at %s\n", sim.now, start,
+                               sim_level_names[sim.level]);
+                        stats.failed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    uint32_t total_us = sim.now;
+    printf("%d sessions, %.1f s simulated, ladder idle %u ms, sleep %u ms, %u long gaps\n", sessions, total_us / 1e6,
+           idle_ms, sleep_ms, long_gaps);
+    printf("time at level:");
+    for (int i = 0; i < POWER_LEVEL_COUNT; i++)
+    {
+        printf(" %s %.1f%%", sim_level_names[i], 100.0 * stats.time_us[i] / total_us);
+    }
+    printf("\ndownshifts %u, upshifts %u\n", sim.policy.downshifts, sim.policy.upshifts);
+    if (stats.wake_count)
+    {
+        qsort(stats.wakes, stats.wake_count, sizeof(stats.wakes[0]), sim_compare);
+        printf("wakes from sleep %u: p50 %u us, p99 %u us, max %u us (budget %u us)\n", stats.wake_count,
+               stats.wakes[stats.wake_count / 2], stats.wakes[stats.wake_count * 99 / 100],
+               stats.wakes[stats.wake_count - 1], SIM_WAKE_BUDGET_US);
+    }
+    if (long_gaps == 0)
+    {
+        printf("FAIL: no idle gap long enough to reach sleep\n");
+        stats.failed = true;
+    }
+    return stats.failed ? 1 : 0;
+}
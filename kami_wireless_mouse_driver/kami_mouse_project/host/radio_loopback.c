@@ -0,0 +1,413 @@
+// Run the radio protocol over a simulated lossy link.
+//
+// A synthetic mouse session, steady motion plus random clicks, is fed through the same sender and receiver code
+// the mouse and the dongle run, with the ESP-NOW hop replaced by a virtual clock loopback that drops packets.
+// For each drop rate the delivery latency, motion loss and button state errors are measured.
+// Fails if the receiver ends with a different button state, loses motion or clicks without drops,
+// a button stays wrong for longer than the keepalive can explain, a burst of queued clicks is not
+// delivered in order, the receiver timeout does not release a held button, or merged wheel steps wrap.
+//
+//   radio_loopback [-s seed] [-t seconds] [-d drop_percent]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "header/radio_protocol.h"
+
+// Sensor report interval of the simulated mouse.
+#define LOOPBACK_MOTION_INTERVAL_US 250
+// Mirrors RADIO_SEND_INTERVAL_MS in radio_link.h.
+#define LOOPBACK_SEND_INTERVAL_US 1000
+// Air time of a packet, header plus samples at the ESP-NOW PHY rate, and the fixed stack latency on either side.
+#define LOOPBACK_AIR_BASE_US 120
+#define LOOPBACK_AIR_PER_BYTE_US 1
+#define LOOPBACK_STACK_US 150
+// Clicks are held between 20 and 150 ms and come every 50 to 500 ms.
+#define LOOPBACK_HOLD_MIN_US 20000
+#define LOOPBACK_HOLD_MAX_US 150000
+#define LOOPBACK_GAP_MIN_US 50000
+#define LOOPBACK_GAP_MAX_US 500000
+// The mouse rests for this share of the session, so button packets are often sent without motion.
+#define LOOPBACK_IDLE_PERCENT 50
+
+#define LOOPBACK_MAX_LATENCIES 1000000
+
+typedef struct
+{
+    uint32_t seed;
+    uint32_t drop_permille;
+} loopback_config_t;
+
+typedef struct
+{
+    uint32_t packets_sent;
+    uint32_t packets_dropped;
+    uint32_t samples;
+    int64_t motion_sent;
+    int64_t motion_received;
+    uint32_t clicks;
+    uint32_t clicks_seen;
+    uint64_t button_error_us;
+    uint32_t button_error_max_us;
+    bool final_match;
+    uint32_t *latencies;
+    size_t latency_count;
+} loopback_result_t;
+
+static uint32_t loopback_random(uint32_t *state)
+{
+    // xorshift32, deterministic for a given seed.
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static uint32_t loopback_range(uint32_t *state, uint32_t low, uint32_t high)
+{
+    return low + loopback_random(state) % (high - low + 1);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Run one session of duration_us on the virtual clock.
+static void loopback_run(const loopback_config_t *config, uint32_t duration_us, loopback_result_t *result)
+{
+    uint32_t rng = config->seed;
+    radio_tx_t tx;
+    radio_rx_t rx;
+    radio_tx_init(&tx, RADIO_LINK_ID_DEFAULT);
+    radio_rx_init(&rx, RADIO_LINK_ID_DEFAULT);
+
+    uint32_t *latencies = result->latencies;
+    memset(result, 0, sizeof(*result));
+    result->latencies = latencies;
+
+    // Mouse side.
+    uint8_t buttons = 0;
+    uint32_t next_button_us = loopback_range(&rng, LOOPBACK_GAP_MIN_US, LOOPBACK_GAP_MAX_US);
+    uint32_t next_motion_us = 0;
+    uint32_t next_send_us = 0;
+    bool click_seen = false;
+
+    // Link, ESP-NOW holds one packet at a time.
+    uint8_t packet[RADIO_PACKET_MAX];
+    size_t packet_length = 0;
+    bool in_flight = false;
+    bool dropped = false;
+    uint32_t arrival_us = 0;
+
+    // Dongle side.
+    uint8_t host_buttons = 0;
+    uint32_t error_start_us = 0;
+    bool error = false;
+    radio_report_t reports[RADIO_MAX_SAMPLES];
+
+    // Run past the end of the input so the last button change and samples can drain.
+    uint32_t end_us = duration_us + LOOPBACK_HOLD_MAX_US;
+    for (uint32_t now = 0; now < end_us; now++)
+    {
+        bool inputs = now < duration_us;
+
+        // Buttons, a change behind one not sent yet waits in the sender's queue, like radio_link_report.
+        bool button_change = false;
+        if (inputs && now >= next_button_us)
+        {
+            buttons = buttons ? 0 : 0x01;
+            if (buttons)
+            {
+                result->clicks++;
+                click_seen = false;
+                next_button_us = now + loopback_range(&rng, LOOPBACK_HOLD_MIN_US, LOOPBACK_HOLD_MAX_US);
+            }
+            else
+            {
+                next_button_us = now + loopback_range(&rng, LOOPBACK_GAP_MIN_US, LOOPBACK_GAP_MAX_US);
+            }
+            radio_tx_queue_buttons(&tx, buttons);
+            button_change = true;
+        }
+
+        // Motion, in bursts with rest in between.
+        if (inputs && now >= next_motion_us)
+        {
+            next_motion_us = now + LOOPBACK_MOTION_INTERVAL_US;
+            if ((now / 100000) % 100 >= LOOPBACK_IDLE_PERCENT)
+            {
+                radio_sample_t sample = {
+                    .timestamp_us = now,
+                    .x = (int16_t)loopback_range(&rng, 1, 20),
+                    .y = (int16_t)-(int32_t)loopback_range(&rng, 0, 10),
+                };
+                radio_tx_add_sample(&tx, &sample);
+                result->samples++;
+                result->motion_sent += sample.x - sample.y;
+            }
+        }
+
+        // Delivery.
+        if (in_flight && now >= arrival_us)
+        {
+            in_flight = false;
+            if (!dropped)
+            {
+                int count = radio_rx_packet(&rx, packet, packet_length, reports);
+                for (int i = 0; i < count; i++)
+                {
+                    host_buttons = reports[i].buttons;
+                    result->motion_received += reports[i].sample.x - reports[i].sample.y;
+                    if (reports[i].sample.x != 0 || reports[i].sample.y != 0)
+                    {
+                        if (result->latency_count < LOOPBACK_MAX_LATENCIES)
+                        {
+                            result->latencies[result->latency_count++] = now - reports[i].sample.timestamp_us;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Sending, on the interval, on a click, or as soon as the previous packet left while there is a backlog.
+        if (!in_flight && (now >= next_send_us || button_change || tx.sample_count > 1))
+        {
+            next_send_us = now + LOOPBACK_SEND_INTERVAL_US;
+            packet_length = radio_tx_build(&tx, now, packet);
+            if (packet_length != 0)
+            {
+                in_flight = true;
+                dropped = loopback_range(&rng, 0, 999) < config->drop_permille;
+                arrival_us = now + LOOPBACK_STACK_US + LOOPBACK_AIR_BASE_US + packet_length * LOOPBACK_AIR_PER_BYTE_US;
+                result->packets_sent++;
+                result->packets_dropped += dropped;
+            }
+        }
+
+        // Button state as seen by the host against the real one.
+        if (buttons && host_buttons)
+        {
+            if (!click_seen)
+            {
+                click_seen = true;
+                result->clicks_seen++;
+            }
+        }
+        bool mismatch = host_buttons != buttons;
+        if (mismatch && !error)
+        {
+            error = true;
+            error_start_us = now;
+        }
+        else if (!mismatch && error)
+        {
+            error = false;
+            uint32_t error_us = now - error_start_us;
+            result->button_error_us += error_us;
+            if (error_us > result->button_error_max_us)
+            {
+                result->button_error_max_us = error_us;
+            }
+        }
+    }
+    result->final_match = host_buttons == buttons;
+}
+
+// Queue a burst of button changes faster than the packets and check each one reaches the receiver in order.
+// Returns the number of changes lost or reordered.
+static int loopback_button_burst(void)
+{
+    static const uint8_t states[] = {0x01, 0x00, 0x01, 0x03, 0x02, 0x00, 0x04, 0x00};
+    radio_tx_t tx;
+    radio_rx_t rx;
+    radio_tx_init(&tx, RADIO_LINK_ID_DEFAULT);
+    radio_rx_init(&rx, RADIO_LINK_ID_DEFAULT);
+    for (size_t i = 0; i < sizeof(states); i++)
+    {
+        radio_tx_queue_buttons(&tx, states[i]);
+    }
+
+    uint8_t packet[RADIO_PACKET_MAX];
+    radio_report_t reports[RADIO_MAX_SAMPLES];
+    size_t seen = 0;
+    int errors = 0;
+    for (uint32_t now = 0; now < RADIO_KEEPALIVE_US; now += LOOPBACK_SEND_INTERVAL_US)
+    {
+        size_t length = radio_tx_build(&tx, now, packet);
+        if (length != 0 && radio_rx_packet(&rx, packet, length, reports) != 0)
+        {
+            errors += seen == sizeof(states) || reports[0].buttons != states[seen];
+            seen++;
+        }
+    }
+    return errors + (int)(sizeof(states) - (seen < sizeof(states) ? seen : sizeof(states)));
+}
+
+// Hold a button, then let the sender go silent and check the receiver's timeout releases it,
+// and that the next packet reports the held state again without counting a loss.
+static bool loopback_timeout(void)
+{
+    radio_tx_t tx;
+    radio_rx_t rx;
+    radio_tx_init(&tx, RADIO_LINK_ID_DEFAULT);
+    radio_rx_init(&rx, RADIO_LINK_ID_DEFAULT);
+    uint8_t packet[RADIO_PACKET_MAX];
+    radio_report_t reports[RADIO_MAX_SAMPLES];
+
+    radio_tx_queue_buttons(&tx, 0x01);
+    size_t length = radio_tx_build(&tx, 0, packet);
+    radio_rx_packet(&rx, packet, length, reports);
+    bool released = rx.buttons == 0x01 && radio_rx_timeout(&rx) && rx.buttons == 0 && !radio_rx_timeout(&rx);
+
+    // Skip the repeats, the next packet is a keepalive long after the last one.
+    tx.button_repeats = 0;
+    length = radio_tx_build(&tx, RADIO_RX_TIMEOUT_US * 2, packet);
+    int count = radio_rx_packet(&rx, packet, length, reports);
+    return released && count == 1 && reports[0].buttons == 0x01 && rx.lost == 0 && rx.resyncs == 0 && rx.timeouts == 2;
+}
+
+// Overfill a packet with fast wheel and pan steps and check the merged samples saturate instead of wrapping.
+static bool loopback_wheel_merge(void)
+{
+    radio_tx_t tx;
+    radio_rx_t rx;
+    radio_tx_init(&tx, RADIO_LINK_ID_DEFAULT);
+    radio_rx_init(&rx, RADIO_LINK_ID_DEFAULT);
+    for (int i = 0; i <= RADIO_MAX_SAMPLES; i++)
+    {
+        radio_sample_t sample = {.timestamp_us = (uint32_t)i, .wheel = 100, .pan = -100};
+        radio_tx_add_sample(&tx, &sample);
+    }
+
+    uint8_t packet[RADIO_PACKET_MAX];
+    radio_report_t reports[RADIO_MAX_SAMPLES];
+    size_t length = radio_tx_build(&tx, RADIO_MAX_SAMPLES, packet);
+    int count = radio_rx_packet(&rx, packet, length, reports);
+    bool saturated = count == RADIO_MAX_SAMPLES && reports[0].sample.wheel == 127 && reports[0].sample.pan == -127;
+    for (int i = 1; i < count; i++)
+    {
+        saturated = saturated && reports[i].sample.wheel == 100 && reports[i].sample.pan == -100;
+    }
+    return saturated;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-t seconds] [-d drop_percent]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x4B4D;
+    uint32_t seconds = 60;
+    int single_drop = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            seed = seed ? seed : 1;
+            break;
+        case 't':
+            seconds = atoi(optarg) > 0 ? (uint32_t)atoi(optarg) : 1;
+            break;
+        case 'd':
+            single_drop = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    static const uint32_t default_drops[] = {0, 10, 50, 100, 200};
+    uint32_t drops[5];
+    size_t drop_count = 0;
+    if (single_drop >= 0)
+    {
+        drops[drop_count++] = (uint32_t)(single_drop > 100 ? 100 : single_drop) * 10;
+    }
+    else
+    {
+        memcpy(drops, default_drops, sizeof(default_drops));
+        drop_count = sizeof(default_drops) / sizeof(default_drops[0]);
+    }
+
+    loopback_result_t result;
+    result.latencies = malloc(LOOPBACK_MAX_LATENCIES * sizeof(uint32_t));
+    if (result.latencies == NULL)
+    {
+        return 1;
+    }
+
+    int burst_errors = loopback_button_burst();
+    printf("button burst: %d changes lost or out of order\n", burst_errors);
+    if (burst_errors != 0)
+    {
+        printf("  FAIL: queued button changes did not all arrive in order\n");
+    }
+
+    bool timeout = loopback_timeout();
+    printf("receiver timeout: %s\n", timeout ? "buttons released" : "FAIL: buttons not released or link not restored");
+
+    bool wheel_merge = loopback_wheel_merge();
+    printf("wheel merge: %s\n", wheel_merge ? "saturated" : "FAIL: merged wheel or pan steps wrapped");
+
+    // A lost release is corrected by the next keepalive, a lost press by the next packet with the button held.
+    uint32_t error_limit_us = RADIO_KEEPALIVE_US * 2;
+    bool failed = burst_errors != 0 || !timeout || !wheel_merge;
+    printf("%ds session, seed 0x%x, %d samples/packet max, %d button repeats\n", seconds, seed, RADIO_MAX_SAMPLES,
+           RADIO_BUTTON_REPEATS);
+    printf("drop%%  packets  samples/pkt  latency p50/p99/max us  motion lost%%  clicks seen  button error ms total/max\n");
+    for (size_t i = 0; i < drop_count; i++)
+    {
+        loopback_config_t config = {.seed = seed, .drop_permille = drops[i]};
+        loopback_run(&config, seconds * 1000000, &result);
+
+        uint32_t p50 = 0, p99 = 0, max = 0;
+        if (result.latency_count > 0)
+        {
+            qsort(result.latencies, result.latency_count, sizeof(uint32_t), compare_u32);
+            p50 = result.latencies[result.latency_count / 2];
+            p99 = result.latencies[(result.latency_count * 99) / 100];
+            max = result.latencies[result.latency_count - 1];
+        }
+        double motion_lost = result.motion_sent
+                                 ? 100.0 * (double)(result.motion_sent - result.motion_received) / (double)result.motion_sent
+                                 : 0.0;
+        double per_packet = result.packets_sent ? (double)result.samples / result.packets_sent : 0.0;
+        printf("%5.1f  %7u  %11.2f  %6u/%u/%u  %14.2f  %6u/%-6u  %8.1f/%.1f\n", drops[i] / 10.0,
+               result.packets_sent, per_packet, p50, p99, max, motion_lost, result.clicks_seen, result.clicks,
+               result.button_error_us / 1000.0, result.button_error_max_us / 1000.0);
+
+        if (!result.final_match)
+        {
+            printf("  FAIL: receiver ended with a different button state\n");
+            failed = true;
+        }
+        if (drops[i] == 0 && (result.motion_received != result.motion_sent || result.clicks_seen != result.clicks))
+        {
+            printf("  FAIL: motion or clicks lost without packet drops\n");
+            failed = true;
+        }
+        if (result.button_error_max_us > error_limit_us + LOOPBACK_SEND_INTERVAL_US * RADIO_BUTTON_REPEATS)
+        {
+            // Only a long run of drops can cause this, report it rather than fail at high drop rates.
+            printf("  %s: a button was wrong for %u us\n", drops[i] <= 50 ? "FAIL" : "note", result.button_error_max_us);
+            failed = failed || drops[i] <= 50;
+        }
+    }
+
+    free(result.latencies);
+    return failed ? 1 : 0;
+}
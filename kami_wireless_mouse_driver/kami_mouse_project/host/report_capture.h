@@ -0,0 +1,24 @@
+/**************** Report Capture ****************/
+
+#pragma once
+
+#include <stdint.h>
+
+// Mirrors HID_ITF_PROTOCOL_MOUSE, the report ID of the mouse input report.
+#define CAPTURE_MOUSE_REPORT_ID 2
+// Longest mouse input report with its report ID, the 16 bit X and Y layout.
+#define CAPTURE_REPORT_MAX 8
+
+// A mouse input report as read from hidraw, with the time it was read.
+// A capture file is a run of these in host byte order.
+typedef struct
+{
+	uint64_t time_ns;
+	uint8_t length;
+	uint8_t data[CAPTURE_REPORT_MAX];
+	uint8_t reserved[7];
+} capture_record_t;
+
+// Reports with motion this many report intervals apart or more are taken as the hand stopping and starting again,
+// closer ones as a stroke that lost reports on the way.
+#define CAPTURE_IDLE_INTERVALS 8
@@ -0,0 +1,543 @@
+// Measure the report rate the mouse delivers to the host, through its hidraw node.
+//
+// Every mouse input report is timestamped when read. Reports with motion less than CAPTURE_IDLE_INTERVALS report
+// intervals apart make a stroke, and the intervals between its reports are its steps. Their distribution gives
+// the delivered rate and the jitter. A step of more than 1.5 intervals lost reports on the way, the motion of the missing ones
+// arrives coalesced into the report that ends it. Longer gaps are the hand stopping and do not count.
+// The expected interval is the report rate setting read through the vendor feature report, or the USB poll interval
+// if that is longer. -r overrides it, without either the median step is used.
+//
+// Before and after the run the counters block is read through the vendor report too. The reports the device counted
+// as sent must match the reports the host read, and the device's skipped report intervals (frame_overruns) show if a
+// loss happened on the device or on the bus. Skipped when the device switched transports during the run.
+//
+// Finds the mouse by name on USB interface 0, or the uhid_mouse simulated device. -d takes a hidraw node or a capture
+// file saved with -o or written by uhid_mouse -o, a capture has no device counters to check against.
+// Fails if no motion was seen or the counters disagree.
+//
+//   report_rate [-d /dev/hidrawN | capture.bin] [-n reports] [-t seconds] [-r report_rate_us] [-o capture.bin] [-v]
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/hidraw.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "header/telemetry_format.h"
+#include "header/vendor_protocol.h"
+#include "report_capture.h"
+
+// Mirror hid_string_descriptor and the mouse HID instance in the firmware.
+#define RATE_PRODUCT "Komplex Mouse"
+#define RATE_INTERFACE 0
+#define RATE_POLL_MS 100
+// Reports kept, about 2 minutes at 8 kHz.
+#define RATE_REPORTS_MAX (1 << 20)
+// Reports the device may send between the counter read and the first report read, or after the last one.
+#define RATE_COUNT_SLACK 2
+
+typedef struct
+{
+    capture_record_t *reports;
+    uint32_t count;
+    // Steps of the strokes in nanoseconds, and the number of strokes they came in.
+    uint64_t *steps;
+    uint32_t step_count;
+    uint32_t strokes;
+} rate_run_t;
+
+static volatile sig_atomic_t rate_stop = 0;
+
+static void rate_signal(int sig)
+{
+    (void)sig;
+    rate_stop = 1;
+}
+
+static uint64_t rate_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int rate_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The hidraw node of the mouse interface. A USB interface directory ends in ":<config>.<interface>",
+// a uhid device has none.
+static int rate_find(char *path, size_t size, char *sysfs, size_t sysfs_size)
+{
+    DIR *dir = opendir("/sys/class/hidraw");
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    struct dirent *entry;
+    int found = -1;
+    while (found < 0 && (entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0)
+        {
+            continue;
+        }
+        char link[PATH_MAX];
+        char interface[PATH_MAX];
+        snprintf(link, sizeof(link), "/sys/class/hidraw/%s/device/..", entry->d_name);
+        if (realpath(link, interface) == NULL)
+        {
+            continue;
+        }
+        const char *base = strrchr(interface, '/');
+        const char *number = strrchr(base != NULL ? base : interface, '.');
+        if (number != NULL && atoi(number + 1) != RATE_INTERFACE)
+        {
+            continue;
+        }
+        char uevent_path[PATH_MAX];
+        snprintf(uevent_path, sizeof(uevent_path), "/sys/class/hidraw/%s/device/uevent", entry->d_name);
+        FILE *uevent = fopen(uevent_path, "r");
+        if (uevent == NULL)
+        {
+            continue;
+        }
+        char line[256];
+        while (fgets(line, sizeof(line), uevent) != NULL)
+        {
+            if (strncmp(line, "HID_NAME=", 9) == 0 && strstr(line, RATE_PRODUCT) != NULL)
+            {
+                snprintf(path, size, "/dev/%s", entry->d_name);
+                snprintf(sysfs, sysfs_size, "%s", interface);
+                found = 0;
+            }
+        }
+        fclose(uevent);
+    }
+    closedir(dir);
+    return found;
+}
+
+// bInterval of the interrupt IN endpoint in microseconds, 0 if the node is not on USB.
+// Full speed counts in frames of 1 ms, high speed in 2^(n-1) microframes.
+static uint32_t rate_poll_us(const char *interface)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/ep_81/interval", interface);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    // sysfs prints the interval as "<n>ms" or "<n>us".
+    unsigned value = 0;
+    char unit[4] = "";
+    int fields = fscanf(file, "%u%3s", &value, unit);
+    fclose(file);
+    if (fields != 2)
+    {
+        return 0;
+    }
+    return strcmp(unit, "ms") == 0 ? value * 1000 : value;
+}
+
+/************* Vendor Report ****************/
+
+// One vendor request and its response, the response payload is copied to `out`.
+static int rate_vendor(int fd, uint8_t command, const uint8_t *payload, uint8_t length, uint8_t *out, uint8_t *out_length)
+{
+    static uint8_t sequence = 0;
+    uint8_t report[1 + VENDOR_REPORT_SIZE];
+    memset(report, 0, sizeof(report));
+    report[0] = VENDOR_REPORT_ID;
+    report[1] = command;
+    report[2] = ++sequence;
+    report[3] = length;
+    memcpy(&report[1 + VENDOR_REQUEST_HEADER_SIZE], payload, length);
+    if (ioctl(fd, HIDIOCSFEATURE(sizeof(report)), report) < 0)
+    {
+        return -1;
+    }
+    memset(report, 0, sizeof(report));
+    report[0] = VENDOR_REPORT_ID;
+    if (ioctl(fd, HIDIOCGFEATURE(sizeof(report)), report) < 0)
+    {
+        return -1;
+    }
+    const uint8_t *response = &report[1];
+    if (response[0] != command || response[1] != sequence || response[2] != VENDOR_STATUS_OK ||
+        response[3] > VENDOR_RESPONSE_PAYLOAD_MAX)
+    {
+        return -1;
+    }
+    memcpy(out, &response[VENDOR_RESPONSE_HEADER_SIZE], response[3]);
+    *out_length = response[3];
+    return 0;
+}
+
+// The report rate setting, 0 if it could not be read.
+static uint32_t rate_vendor_rate_us(int fd)
+{
+    uint8_t tag = VENDOR_TAG_REPORT_RATE_US;
+    uint8_t out[VENDOR_RESPONSE_PAYLOAD_MAX];
+    uint8_t length = 0;
+    if (rate_vendor(fd, VENDOR_CMD_GET, &tag, 1, out, &length) != 0 || length != 4 || out[0] != tag || out[1] != 2)
+    {
+        return 0;
+    }
+    return out[2] | out[3] << 8;
+}
+
+// The counters block, read in chunks from offset 0 so the device takes one snapshot.
+static int rate_vendor_counters(int fd, telemetry_counters_t *counters)
+{
+    uint8_t *data = (uint8_t *)counters;
+    uint32_t offset = 0;
+    memset(counters, 0, sizeof(*counters));
+    while (1)
+    {
+        uint8_t request[5] = {VENDOR_BLOCK_COUNTERS, (uint8_t)offset, (uint8_t)(offset >> 8), (uint8_t)(offset >> 16),
+                              (uint8_t)(offset >> 24)};
+        uint8_t out[VENDOR_RESPONSE_PAYLOAD_MAX];
+        uint8_t length = 0;
+        if (rate_vendor(fd, VENDOR_CMD_READ, request, sizeof(request), out, &length) != 0 || length < 4)
+        {
+            return -1;
+        }
+        uint32_t total = out[0] | out[1] << 8 | out[2] << 16 | (uint32_t)out[3] << 24;
+        uint32_t chunk = length - 4;
+        // An older firmware has a shorter block, a newer one a longer one, the common part is compared.
+        uint32_t keep = offset < sizeof(*counters) ? sizeof(*counters) - offset : 0;
+        memcpy(&data[offset], &out[4], chunk < keep ? chunk : keep);
+        offset += chunk;
+        if (chunk == 0 || offset >= total || offset >= sizeof(*counters))
+        {
+            return 0;
+        }
+    }
+}
+
+/************* Analysis ****************/
+
+static bool rate_has_motion(const capture_record_t *report)
+{
+    if (report->length < 4 || report->data[0] != CAPTURE_MOUSE_REPORT_ID)
+    {
+        return false;
+    }
+    // 8 bit X and Y in a 6 byte report, 16 bit in an 8 byte one.
+    if (report->length >= 8)
+    {
+        return report->data[2] || report->data[3] || report->data[4] || report->data[5];
+    }
+    return report->data[2] || report->data[3];
+}
+
+// The steps of the strokes, with `expected_ns` 0 only the gaps longer than a second end a stroke.
+// A stroke runs from motion report to motion report while they are less than the idle gap apart, its steps are
+// the intervals between all the reports in it. A click in the middle of a stroke splits a step in two.
+static void rate_steps(rate_run_t *run, uint64_t expected_ns)
+{
+    uint64_t idle_ns = expected_ns ? CAPTURE_IDLE_INTERVALS * expected_ns : 1000000000ull;
+    run->step_count = 0;
+    run->strokes = 0;
+    int64_t last = -1;
+    for (uint32_t i = 0; i < run->count; i++)
+    {
+        if (!rate_has_motion(&run->reports[i]))
+        {
+            continue;
+        }
+        if (last >= 0 && run->reports[i].time_ns - run->reports[last].time_ns < idle_ns)
+        {
+            for (uint32_t j = (uint32_t)last + 1; j <= i; j++)
+            {
+                run->steps[run->step_count++] = run->reports[j].time_ns - run->reports[j - 1].time_ns;
+            }
+        }
+        else
+        {
+            run->strokes++;
+        }
+        last = i;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-d /dev/hidrawN | capture.bin] [-n reports] [-t seconds] [-r report_rate_us] [-o capture.bin] "
+            "[-v]\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    char device[PATH_MAX] = "";
+    char interface[PATH_MAX] = "";
+    uint32_t max_reports = 0;
+    double max_seconds = 0;
+    uint32_t expected_us = 0;
+    const char *out_path = NULL;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:t:r:o:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            snprintf(device, sizeof(device), "%s", optarg);
+            break;
+        case 'n':
+            max_reports = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            max_seconds = atof(optarg);
+            break;
+        case 'r':
+            expected_us = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (device[0] == '\0' && rate_find(device, sizeof(device), interface, sizeof(interface)) != 0)
+    {
+        fprintf(stderr, "no mouse found, is it plugged in or uhid_mouse running?\n");
+        return 2;
+    }
+
+    int fd = open(device, O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: %s\n", device, strerror(errno));
+        return 2;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    bool live = S_ISCHR(st.st_mode);
+    FILE *capture = live ? NULL : fdopen(fd, "rb");
+
+    static rate_run_t run;
+    run.reports = malloc(RATE_REPORTS_MAX * sizeof(run.reports[0]));
+    run.steps = malloc(RATE_REPORTS_MAX * sizeof(run.steps[0]));
+    if (run.reports == NULL || run.steps == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        close(fd);
+        return 2;
+    }
+
+    // Device side: the setting, the poll interval and the counters before the run.
+    uint32_t setting_us = 0;
+    uint32_t poll_us = 0;
+    bool have_counters = false;
+    static telemetry_counters_t before;
+    static telemetry_counters_t after;
+    if (live)
+    {
+        setting_us = rate_vendor_rate_us(fd);
+        poll_us = interface[0] ? rate_poll_us(interface) : 0;
+        have_counters = rate_vendor_counters(fd, &before) == 0;
+        printf("reading %s, report rate setting %u us, USB poll interval %u us%s\n", device, setting_us, poll_us,
+               have_counters ? "" : ", no device counters");
+    }
+    if (expected_us == 0)
+    {
+        expected_us = setting_us > poll_us ? setting_us : poll_us;
+    }
+
+    signal(SIGINT, rate_signal);
+    signal(SIGTERM, rate_signal);
+    uint64_t start_ns = rate_now_ns();
+    while (!rate_stop && run.count < RATE_REPORTS_MAX && (max_reports == 0 || run.count < max_reports))
+    {
+        capture_record_t *record = &run.reports[run.count];
+        if (!live)
+        {
+            if (fread(record, sizeof(*record), 1, capture) != 1)
+            {
+                break;
+            }
+            run.count++;
+            continue;
+        }
+        if (max_seconds > 0 && (rate_now_ns() - start_ns) / 1e9 >= max_seconds)
+        {
+            break;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, RATE_POLL_MS) <= 0)
+        {
+            continue;
+        }
+        uint8_t data[64];
+        ssize_t length = read(fd, data, sizeof(data));
+        uint64_t now_ns = rate_now_ns();
+        if (length == 0 || (length < 0 && errno != EINTR))
+        {
+            break;
+        }
+        if (length < 1 || data[0] != CAPTURE_MOUSE_REPORT_ID || length > CAPTURE_REPORT_MAX)
+        {
+            continue;
+        }
+        memset(record, 0, sizeof(*record));
+        record->time_ns = now_ns;
+        record->length = (uint8_t)length;
+        memcpy(record->data, data, length);
+        run.count++;
+    }
+    if (live)
+    {
+        have_counters = have_counters && rate_vendor_counters(fd, &after) == 0;
+        close(fd);
+    }
+    else
+    {
+        fclose(capture);
+    }
+
+    if (out_path != NULL)
+    {
+        FILE *out = fopen(out_path, "wb");
+        if (out == NULL)
+        {
+            fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+        }
+        else
+        {
+            fwrite(run.reports, sizeof(run.reports[0]), run.count, out);
+            fclose(out);
+        }
+    }
+
+    // Without a setting, the median step of the strokes.
+    if (expected_us == 0)
+    {
+        rate_steps(&run, 0);
+        if (run.step_count)
+        {
+            qsort(run.steps, run.step_count, sizeof(run.steps[0]), rate_compare);
+            expected_us = (uint32_t)((run.steps[run.step_count / 2] + 500) / 1000);
+        }
+    }
+    uint64_t expected_ns = (uint64_t)expected_us * 1000;
+    rate_steps(&run, expected_ns);
+
+    bool failed = false;
+    uint32_t motion_reports = 0;
+    for (uint32_t i = 0; i < run.count; i++)
+    {
+        motion_reports += rate_has_motion(&run.reports[i]);
+    }
+    double span = run.count > 1 ? (run.reports[run.count - 1].time_ns - run.reports[0].time_ns) / 1e9 : 0;
+    printf("%u reports, %u with motion, over %.2f s, expected interval %u us (%.0f Hz)\n", run.count, motion_reports,
+           span, expected_us, expected_us ? 1e6 / expected_us : 0.0);
+    if (run.step_count == 0 || expected_ns == 0)
+    {
+        printf("FAIL: no motion, move the mouse while measuring\n");
+        free(run.reports);
+        free(run.steps);
+        return 1;
+    }
+
+    // Missed frames and the unbroken runs, in time order before the steps are sorted.
+    // A stroke starts a new run, its steps follow each other in the array.
+    uint64_t missed = 0;
+    uint32_t coalesced = 0;
+    uint32_t run_length = 1;
+    uint32_t longest_run = 1;
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < run.step_count; i++)
+    {
+        uint64_t step = run.steps[i];
+        sum += step;
+        if (step * 2 > expected_ns * 3)
+        {
+            missed += (step + expected_ns / 2) / expected_ns - 1;
+            coalesced++;
+            run_length = 1;
+        }
+        else if (++run_length > longest_run)
+        {
+            longest_run = run_length;
+        }
+    }
+
+    double mean = (double)sum / run.step_count;
+    double variance = 0;
+    for (uint32_t i = 0; i < run.step_count; i++)
+    {
+        double d = run.steps[i] - mean;
+        variance += d * d;
+    }
+    double jitter = sqrt(variance / run.step_count);
+    qsort(run.steps, run.step_count, sizeof(run.steps[0]), rate_compare);
+    printf("%u strokes, %u steps: mean %.1f us (%.0f Hz), jitter %.1f us\n", run.strokes, run.step_count, mean / 1000,
+           1e9 / mean, jitter / 1000);
+    printf("steps p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", run.steps[run.step_count / 2] / 1000.0,
+           run.steps[run.step_count * 90 / 100] / 1000.0, run.steps[run.step_count * 99 / 100] / 1000.0,
+           run.steps[run.step_count - 1] / 1000.0);
+    printf("missed frames %llu (%.2f%%), %u coalesced reports, longest unbroken run %u reports\n",
+           (unsigned long long)missed, 100.0 * missed / (missed + run.step_count), coalesced, longest_run);
+    if (verbose)
+    {
+        // Histogram of the steps in units of the expected interval.
+        uint32_t buckets[5] = {0};
+        for (uint32_t i = 0; i < run.step_count; i++)
+        {
+            uint64_t n = (run.steps[i] + expected_ns / 2) / expected_ns;
+            buckets[n < 4 ? n : 4]++;
+        }
+        printf("steps at 0x %u, 1x %u, 2x %u, 3x %u, 4x+ %u\n", buckets[0], buckets[1], buckets[2], buckets[3],
+               buckets[4]);
+    }
+
+    // Device side.
+    if (have_counters)
+    {
+        uint32_t sent = after.reports_sent - before.reports_sent;
+        uint32_t overruns = after.frame_overruns - before.frame_overruns;
+        uint32_t failed_reports = after.reports_failed - before.reports_failed;
+        printf("device: %u reports sent, %u failed, %u report intervals skipped\n", sent, failed_reports, overruns);
+        if (after.transport_switches != before.transport_switches)
+        {
+            printf("device switched transports during the run, counters not compared\n");
+        }
+        else if (sent > run.count + RATE_COUNT_SLACK || sent + RATE_COUNT_SLACK < run.count)
+        {
+            printf("FAIL: device sent %u reports, host read %u\n", sent, run.count);
+            failed = true;
+        }
+        else if (missed && !overruns)
+        {
+            printf("missed frames with no skipped intervals on the device, lost on the bus or in the host\n");
+        }
+    }
+
+    free(run.reports);
+    free(run.steps);
+    return failed ? 1 : 0;
+}
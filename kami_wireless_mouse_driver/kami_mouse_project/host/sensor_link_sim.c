@@ -0,0 +1,489 @@
+// Calibrate the sensor SPI link against simulated boards with a known data eye.
+//
+// The calibration runs the same sweep, pick and read back as on the device. The simulated board returns the
+// product ID and its inverse with bit errors that depend on the clock and input delay. MISO data arrives a fixed
+// lag after the clock edge, and a read is error free while the input delay is within half a clock period,
+// less the board's timing uncertainty, of that lag. Just past the eye a thin band of settings flips a bit
+// now and then, rarely enough that the sweep can miss it. Further out the bits are mostly wrong.
+// Settings above the SPI driver's frequency limit for their input delay are refused like the driver does.
+//
+// Each board is checked against the eye it was built with. Fails if the picked setting has any bit errors,
+// less than SENSOR_LINK_MARGIN_NS of error free delays on both sides, a slower clock than the fastest that has
+// the margin, or if a pick is missing where one exists. A band setting can get through the read back too,
+// with the default seed none does.
+//
+// The sensor pins are simulated too, connected the way the ESP-IDF calls of motion_sensor.c leave the GPIO matrix.
+// Each board boots, calibrates, which adds the SPI device again for every setting, reads bursts, is power cycled
+// by a recovery, reads bursts again and falls back to the datasheet setting. Fails if a transfer is not framed
+// by NCS or has MOSI or SCLK off the SPI outputs, if a pin is driven while the supply is off, or if the pins are
+// connected differently than at boot after any of these steps.
+//
+//   sensor_link_sim [-s seed] [-l lag_ns] [-u uncertainty_ns] [-v]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "header/sensor_registers.h"
+
+// Mirror spi_get_freq_limit of the ESP-IDF SPI master, the sensor pins go through the GPIO matrix.
+#define SIM_APB_CLOCK_HZ 80000000
+#define SIM_GPIO_DELAY_NS 25
+// Mirror SENSOR_READ_SETUP_US and SENSOR_SPI_CLOCK_SPEED_HZ in motion_sensor.h, SENSOR_MOTION_BURST_SIZE in input_pipeline.h.
+#define SIM_READ_SETUP_US 2
+#define SIM_DATASHEET_CLOCK_HZ 10000000
+#define SIM_BURST_BITS (8 + 12 * 8)
+// Width of the band past the eye and its bit error rate, and the rate further out, in parts per million.
+#define SIM_BAND_NS 4
+#define SIM_BAND_PPM 100
+#define SIM_OUTSIDE_PPM 50000
+// Mirror spics_io_num of sensor_spi_device_config in motion_sensor.c, NCS is not the device's hardware CS.
+#define SIM_DEVICE_SPICS -1
+// Bursts read after each step.
+#define SIM_BURSTS 100
+
+// Sensor pins driven by the firmware, MISO is an input throughout.
+typedef enum
+{
+    SIM_PIN_NCS,
+    SIM_PIN_MOSI,
+    SIM_PIN_SCLK,
+    SIM_PIN_NRESET,
+    SIM_PIN_COUNT,
+} sim_pin_t;
+
+static const char *const sim_pin_names[SIM_PIN_COUNT] = {"NCS", "MOSI", "SCLK", "NRESET"};
+
+// What the GPIO matrix connects a pin to.
+typedef enum
+{
+    SIM_ROUTE_INPUT,
+    SIM_ROUTE_GPIO,
+    SIM_ROUTE_SPI,
+} sim_route_t;
+
+typedef struct
+{
+    sim_route_t route[SIM_PIN_COUNT];
+    bool powered;
+    // Transfers that did not reach the sensor, and pins driven while the supply was off.
+    uint32_t lost;
+    uint32_t back_powered;
+} sim_pins_t;
+
+typedef struct
+{
+    int lag_ns;
+    int uncertainty_ns;
+    uint32_t rng;
+    // Setting the link is configured to.
+    uint32_t clock_hz;
+    int delay_ns;
+    bool configured;
+    sim_pins_t pins;
+} sim_board_t;
+
+// The ESP-IDF calls the firmware makes on the sensor pins.
+// gpio_config and gpio_set_direction to an output connect the plain GPIO output, to an input they disconnect it.
+static void sim_gpio_output(sim_pins_t *pins, sim_pin_t pin)
+{
+    pins->route[pin] = SIM_ROUTE_GPIO;
+}
+
+static void sim_gpio_input(sim_pins_t *pins, sim_pin_t pin)
+{
+    pins->route[pin] = SIM_ROUTE_INPUT;
+}
+
+// spi_bus_initialize and esp_rom_gpio_connect_out_signal with an SPI3 output.
+static void sim_spi_connect(sim_pins_t *pins, sim_pin_t pin)
+{
+    pins->route[pin] = SIM_ROUTE_SPI;
+}
+
+// spi_bus_add_device, which routes its hardware CS if it has one.
+static void sim_spi_add_device(sim_pins_t *pins)
+{
+    if (SIM_DEVICE_SPICS >= 0)
+    {
+        sim_spi_connect(pins, SIM_PIN_NCS);
+    }
+}
+
+static void sim_supply(sim_pins_t *pins, bool on)
+{
+    pins->powered = on;
+    for (int pin = 0; pin < SIM_PIN_COUNT && !on; pin++)
+    {
+        pins->back_powered += pins->route[pin] != SIM_ROUTE_INPUT;
+    }
+}
+
+// A transfer reaches the sensor if the SPI callbacks can frame it with NCS as a GPIO and MOSI and SCLK come
+// from the SPI peripheral. Returns true if it did.
+static bool sim_transfer(sim_pins_t *pins)
+{
+    bool reached = pins->powered && pins->route[SIM_PIN_NCS] == SIM_ROUTE_GPIO &&
+                   pins->route[SIM_PIN_MOSI] == SIM_ROUTE_SPI && pins->route[SIM_PIN_SCLK] == SIM_ROUTE_SPI;
+    pins->lost += !reached;
+    return reached;
+}
+
+// Mirror sensor_init: the plain GPIOs, then the bus and the device.
+static void sim_boot(sim_pins_t *pins)
+{
+    sim_gpio_output(pins, SIM_PIN_NCS);
+    sim_gpio_output(pins, SIM_PIN_NRESET);
+    sim_spi_connect(pins, SIM_PIN_MOSI);
+    sim_spi_connect(pins, SIM_PIN_SCLK);
+    sim_spi_add_device(pins);
+    sim_supply(pins, true);
+}
+
+// Mirror sensor_power_up and sensor_release_pins, with the reads of the sequence.
+static void sim_power_up(sim_pins_t *pins, bool power_cycle)
+{
+    if (power_cycle)
+    {
+        for (int pin = 0; pin < SIM_PIN_COUNT; pin++)
+        {
+            sim_gpio_input(pins, pin);
+        }
+        sim_supply(pins, false);
+    }
+    sim_supply(pins, true);
+    if (power_cycle)
+    {
+        sim_gpio_output(pins, SIM_PIN_NCS);
+        sim_gpio_output(pins, SIM_PIN_NRESET);
+        sim_gpio_output(pins, SIM_PIN_MOSI);
+        sim_spi_connect(pins, SIM_PIN_MOSI);
+        sim_gpio_output(pins, SIM_PIN_SCLK);
+        sim_spi_connect(pins, SIM_PIN_SCLK);
+    }
+    for (int i = 0; i < 6; i++)
+    {
+        sim_transfer(pins);
+    }
+}
+
+static uint32_t sim_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static bool sim_refused(uint32_t clock_hz, int delay_ns)
+{
+    int apb_periods = (1 + delay_ns + SIM_GPIO_DELAY_NS) * (SIM_APB_CLOCK_HZ / 1000) / 1000 / 1000;
+    return clock_hz > (uint32_t)(SIM_APB_CLOCK_HZ / (apb_periods + 1));
+}
+
+// Bit error rate of a setting on a board.
+static uint32_t sim_error_ppm(const sim_board_t *board, uint32_t clock_hz, int delay_ns)
+{
+    int half_ns = (int)(500000000u / clock_hz) - board->uncertainty_ns;
+    int outside_ns = abs(delay_ns - board->lag_ns) - half_ns;
+    if (outside_ns <= 0)
+    {
+        return 0;
+    }
+    return outside_ns <= SIM_BAND_NS ? SIM_BAND_PPM : SIM_OUTSIDE_PPM;
+}
+
+static int sim_configure(void *context, uint32_t clock_hz, uint8_t input_delay_ns)
+{
+    sim_board_t *board = context;
+    // Like sensor_link_apply, the device is added again for every setting.
+    sim_spi_add_device(&board->pins);
+    board->configured = !sim_refused(clock_hz, input_delay_ns);
+    board->clock_hz = clock_hz;
+    board->delay_ns = input_delay_ns;
+    return !board->configured;
+}
+
+static int sim_write(void *context, uint8_t address, uint8_t value)
+{
+    (void)context;
+    (void)address;
+    (void)value;
+    return 0;
+}
+
+static int sim_read(void *context, uint8_t address, uint8_t *value)
+{
+    sim_board_t *board = context;
+    if (!board->configured || !sim_transfer(&board->pins))
+    {
+        return 1;
+    }
+    uint8_t data = address == SENSOR_REG_PRODUCT_ID ? SENSOR_PRODUCT_ID : SENSOR_INVERSE_PRODUCT_ID;
+    uint32_t ppm = sim_error_ppm(board, board->clock_hz, board->delay_ns);
+    if (ppm)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            if (sim_random(&board->rng) % 1000000 < ppm)
+            {
+                data ^= 1u << bit;
+            }
+        }
+    }
+    *value = data;
+    return 0;
+}
+
+// Error free input delays on both sides of a setting, -1 if it has errors itself.
+static int sim_margin_ns(const sim_board_t *board, int clock, int delay)
+{
+    uint32_t clock_hz = sensor_link_clocks_hz[clock];
+    int margin = SENSOR_LINK_DELAYS;
+    for (int side = -1; side <= 1; side += 2)
+    {
+        int steps = 0;
+        for (int d = delay; d >= 0 && d < SENSOR_LINK_DELAYS; d += side)
+        {
+            int delay_ns = d * SENSOR_LINK_DELAY_STEP_NS;
+            if (sim_refused(clock_hz, delay_ns) || sim_error_ppm(board, clock_hz, delay_ns) != 0)
+            {
+                break;
+            }
+            steps++;
+        }
+        margin = steps < margin ? steps : margin;
+    }
+    return margin > 0 ? (margin - 1) * SENSOR_LINK_DELAY_STEP_NS : -1;
+}
+
+// Fastest clock of the board with the full margin around some input delay, -1 if none has it.
+static int sim_expected_clock(const sim_board_t *board)
+{
+    for (int c = SENSOR_LINK_CLOCKS - 1; c >= 0; c--)
+    {
+        for (int d = 0; d < SENSOR_LINK_DELAYS; d++)
+        {
+            if (sim_margin_ns(board, c, d) >= SENSOR_LINK_MARGIN_NS)
+            {
+                return c;
+            }
+        }
+    }
+    return -1;
+}
+
+static double sim_burst_us(uint32_t clock_hz)
+{
+    return (SIM_BURST_BITS + sensor_link_dummy_bits(clock_hz, SIM_READ_SETUP_US)) * 1e6 / clock_hz;
+}
+
+static void sim_print_sweep(const sensor_link_report_t *report)
+{
+    printf("  %9s", "delay ns");
+    for (int d = 0; d < SENSOR_LINK_DELAYS; d++)
+    {
+        printf(" %5d", d * report->delay_step_ns);
+    }
+    printf("\n");
+    for (int c = 0; c < SENSOR_LINK_CLOCKS; c++)
+    {
+        printf("  %6.2f MHz", report->clock_hz[c] / 1e6);
+        for (int d = 0; d < SENSOR_LINK_DELAYS; d++)
+        {
+            if (report->bit_errors[c][d] == SENSOR_LINK_REFUSED)
+            {
+                printf(" %5s", "-");
+            }
+            else
+            {
+                printf(" %5u", report->bit_errors[c][d]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+// Check that the pins are connected as at boot and nothing was lost or back powered, returns true if so.
+static bool sim_check_pins(const sim_pins_t *pins, const sim_pins_t *boot, const char *step)
+{
+    bool passed = true;
+    for (int pin = 0; pin < SIM_PIN_COUNT; pin++)
+    {
+        if (pins->route[pin] != boot->route[pin])
+        {
+            printf("FAIL: %s connected differently after %s than at boot\n", sim_pin_names[pin], step);
+            passed = false;
+        }
+    }
+    if (pins->lost != 0)
+    {
+        printf("FAIL: %u transfers did not reach the sensor by the end of %s\n", pins->lost, step);
+        passed = false;
+    }
+    if (pins->back_powered != 0)
+    {
+        printf("FAIL: %u pins driven with the supply off by the end of %s\n", pins->back_powered, step);
+        passed = false;
+    }
+    return passed;
+}
+
+// Read bursts, power cycle the sensor like a recovery, read again and fall back to the datasheet setting like
+// sensor_link_fallback. Returns true if every step kept the pins as at boot.
+static bool sim_exercise_pins(sim_board_t *board, const sim_pins_t *boot)
+{
+    bool passed = sim_check_pins(&board->pins, boot, "the calibration");
+    for (int i = 0; i < SIM_BURSTS; i++)
+    {
+        sim_transfer(&board->pins);
+    }
+    passed &= sim_check_pins(&board->pins, boot, "the bursts");
+    sim_power_up(&board->pins, true);
+    for (int i = 0; i < SIM_BURSTS; i++)
+    {
+        sim_transfer(&board->pins);
+    }
+    passed &= sim_check_pins(&board->pins, boot, "the recovery");
+    sim_configure(board, SIM_DATASHEET_CLOCK_HZ, 0);
+    sim_power_up(&board->pins, true);
+    for (int i = 0; i < SIM_BURSTS; i++)
+    {
+        sim_transfer(&board->pins);
+    }
+    passed &= sim_check_pins(&board->pins, boot, "the fallback");
+    return passed;
+}
+
+// Calibrate one board and check the pick, returns true if it passed.
+static bool sim_board(int lag_ns, int uncertainty_ns, uint32_t seed, bool verbose)
+{
+    sim_board_t board = {.lag_ns = lag_ns, .uncertainty_ns = uncertainty_ns, .rng = seed};
+    const sensor_bus_t bus = {.write = sim_write, .read = sim_read, .context = &board};
+    static sensor_link_report_t report;
+    sim_boot(&board.pins);
+    sim_power_up(&board.pins, false);
+    const sim_pins_t boot = board.pins;
+    bool found = sensor_link_calibrate(&report, &bus, sim_configure);
+    int expected = sim_expected_clock(&board);
+
+    printf("lag %2d ns, uncertainty %2d ns: ", lag_ns, uncertainty_ns);
+    bool passed = true;
+    if (!found)
+    {
+        printf("no setting, %u rejected\n", report.rejected);
+        if (expected >= 0)
+        {
+            printf("FAIL: %.2f MHz has the margin\n", sensor_link_clocks_hz[expected] / 1e6);
+            passed = false;
+        }
+    }
+    else
+    {
+        int clock = 0;
+        while (sensor_link_clocks_hz[clock] != report.link.clock_hz)
+        {
+            clock++;
+        }
+        int delay = report.link.input_delay_ns / SENSOR_LINK_DELAY_STEP_NS;
+        int margin_ns = sim_margin_ns(&board, clock, delay);
+        printf("%.2f MHz, input delay %u ns, margin %d ns, %u bit errors in %u bits, %u rejected, burst %.1f us (datasheet %.1f us)\n",
+               report.link.clock_hz / 1e6, report.link.input_delay_ns, margin_ns, report.confirm_bit_errors,
+               report.confirm_bits, report.rejected, sim_burst_us(report.link.clock_hz), sim_burst_us(SIM_DATASHEET_CLOCK_HZ));
+        if (sim_error_ppm(&board, report.link.clock_hz, report.link.input_delay_ns) != 0 || report.confirm_bit_errors != 0)
+        {
+            printf("FAIL: the picked setting has bit errors\n");
+            passed = false;
+        }
+        else if (margin_ns < SENSOR_LINK_MARGIN_NS)
+        {
+            printf("FAIL: margin below %d ns\n", SENSOR_LINK_MARGIN_NS);
+            passed = false;
+        }
+        if (clock < expected)
+        {
+            printf("FAIL: %.2f MHz has the margin too\n", sensor_link_clocks_hz[expected] / 1e6);
+            passed = false;
+        }
+    }
+    if (verbose || !passed)
+    {
+        sim_print_sweep(&report);
+    }
+    // Like sensor_calibrate_link, the picked setting is applied and the sensor powered up again.
+    sim_configure(&board, found ? report.link.clock_hz : SIM_DATASHEET_CLOCK_HZ, found ? report.link.input_delay_ns : 0);
+    sim_power_up(&board.pins, false);
+    passed &= sim_exercise_pins(&board, &boot);
+    return passed;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-l lag_ns] [-u uncertainty_ns] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x4B4D;
+    int lag_ns = -1;
+    int uncertainty_ns = -1;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:u:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            seed = seed ? seed : 1;
+            break;
+        case 'l':
+            lag_ns = atoi(optarg);
+            break;
+        case 'u':
+            uncertainty_ns = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((lag_ns != -1 && (lag_ns < 0 || lag_ns > 100)) || (uncertainty_ns != -1 && (uncertainty_ns < 0 || uncertainty_ns > 60)))
+    {
+        fprintf(stderr, "board needs 0 <= lag_ns <= 100 and 0 <= uncertainty_ns <= 60\n");
+        return 2;
+    }
+
+    // Without a board given, a spread of lags on a clean, a typical and a noisy board, and one with no eye at all.
+    static const int lags[] = {10, 20, 30, 40, 50, 60, 70};
+    static const int uncertainties[] = {6, 12, 18, 60};
+    int failures = 0;
+    int boards = 0;
+    for (size_t u = 0; u < sizeof(uncertainties) / sizeof(uncertainties[0]); u++)
+    {
+        for (size_t l = 0; l < sizeof(lags) / sizeof(lags[0]); l++)
+        {
+            int board_lag = lag_ns != -1 ? lag_ns : lags[l];
+            int board_uncertainty = uncertainty_ns != -1 ? uncertainty_ns : uncertainties[u];
+            failures += !sim_board(board_lag, board_uncertainty, seed + boards, verbose);
+            boards++;
+            if (lag_ns != -1)
+            {
+                break;
+            }
+        }
+        if (uncertainty_ns != -1)
+        {
+            break;
+        }
+    }
+    printf("%d boards, %d failed\n", boards, failures);
+    return failures != 0;
+}
@@ -0,0 +1,201 @@
+// Count the SPI transactions of PAW3395 mode, resolution and rest timing changes.
+//
+// The programming sequences are run through the firmware's register shadow on top of a simulated register file,
+// and the transactions it issues are compared against writing every table entry as is.
+// The simulated sensor also checks that the shadowed writes leave it in the same state as the plain ones.
+// Rest timings are written after a mode change like the firmware does, and the times the registers end up with
+// are checked against the requested ones.
+//
+//   sensor_regs
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "header/sensor_registers.h"
+
+static const char *mode_names[] = {"HPM", "LPM", "WRK", "CRD"};
+
+// Simulated register file of the sensor.
+typedef struct
+{
+    uint8_t bank;
+    uint8_t registers[SENSOR_REG_BANKS][SENSOR_REG_COUNT];
+    unsigned writes;
+    unsigned reads;
+} sim_sensor_t;
+
+static int sim_write(void *context, uint8_t address, uint8_t value)
+{
+    sim_sensor_t *sensor = context;
+    sensor->writes++;
+    if (address == SENSOR_REG_BANK_SELECT)
+    {
+        sensor->bank = value;
+    }
+    else
+    {
+        sensor->registers[sensor->bank][address] = value;
+    }
+    return 0;
+}
+
+static int sim_read(void *context, uint8_t address, uint8_t *value)
+{
+    sim_sensor_t *sensor = context;
+    sensor->reads++;
+    *value = sensor->registers[sensor->bank][address];
+    return 0;
+}
+
+// Reset and power up a simulated sensor.
+static void power_up(sensor_shadow_t *shadow, sim_sensor_t *sensor)
+{
+    memset(sensor, 0, sizeof(*sensor));
+    sensor_shadow_reset(shadow);
+    sensor_shadow_write_sequence(shadow, &sensor_sequence_first, SENSOR_WRITE_RAW);
+    sensor_shadow_write_sequence(shadow, &sensor_sequence_second, SENSOR_WRITE_RAW);
+}
+
+// Write a sequence the way the firmware did before the shadow, every entry as is.
+// The mode bits of the performance register are merged by hand so both sensors end up in the same state.
+static unsigned plain_write(sim_sensor_t *sensor, const sensor_sequence_t *sequence)
+{
+    unsigned writes = sensor->writes;
+    for (size_t i = 0; i < sequence->length; i++)
+    {
+        uint8_t address = sequence->writes[i][0];
+        uint8_t value = sequence->writes[i][1];
+        if (sensor->bank == 0x00 && address == SENSOR_REG_PERFORMANCE)
+        {
+            value = (sensor->registers[0][address] & ~SENSOR_PERFORMANCE_MODE_MASK) | (value & SENSOR_PERFORMANCE_MODE_MASK);
+        }
+        sim_write(sensor, address, value);
+    }
+    return sensor->writes - writes;
+}
+
+static int compare(const sim_sensor_t *plain, const sim_sensor_t *shadowed)
+{
+    if (memcmp(plain->registers, shadowed->registers, sizeof(plain->registers)) != 0 || plain->bank != shadowed->bank)
+    {
+        printf("  MISMATCH: shadowed writes left a different register state\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static sim_sensor_t plain;
+    static sim_sensor_t shadowed;
+    static sensor_shadow_t shadow;
+    sensor_bus_t plain_bus = {sim_write, sim_read, &plain};
+    sensor_bus_t shadow_bus = {sim_write, sim_read, &shadowed};
+    sensor_shadow_t plain_shadow;
+    sensor_shadow_init(&shadow, &shadow_bus);
+    sensor_shadow_init(&plain_shadow, &plain_bus);
+    int failures = 0;
+
+    printf("%-12s %8s %8s %8s\n", "change", "plain", "shadow", "skipped");
+    for (int from = 0; from < 4; from++)
+    {
+        for (int to = 0; to < 4; to++)
+        {
+            power_up(&plain_shadow, &plain);
+            power_up(&shadow, &shadowed);
+            plain_write(&plain, &sensor_sequence_modes[from]);
+            sensor_shadow_write_sequence(&shadow, &sensor_sequence_modes[from], SENSOR_WRITE_CHANGED);
+
+            uint32_t transactions = shadow.transactions;
+            uint32_t skipped = shadow.skipped;
+            unsigned plain_count = plain_write(&plain, &sensor_sequence_modes[to]);
+            sensor_shadow_write_sequence(&shadow, &sensor_sequence_modes[to], SENSOR_WRITE_CHANGED);
+            printf("%s -> %s   %8u %8u %8u\n", mode_names[from], mode_names[to], plain_count,
+                   (unsigned)(shadow.transactions - transactions), (unsigned)(shadow.skipped - skipped));
+            failures += compare(&plain, &shadowed);
+        }
+    }
+
+    static const uint16_t cpi_changes[][2] = {{800, 1600}, {1600, 3200}, {1600, 1650}, {3200, 26000}, {26000, 50}};
+    for (size_t i = 0; i < sizeof(cpi_changes) / sizeof(cpi_changes[0]); i++)
+    {
+        uint8_t writes[SENSOR_RESOLUTION_SEQUENCE_LENGTH][2];
+        sensor_sequence_t sequence = {writes, SENSOR_RESOLUTION_SEQUENCE_LENGTH};
+        power_up(&plain_shadow, &plain);
+        power_up(&shadow, &shadowed);
+        sensor_resolution_sequence(cpi_changes[i][0], writes);
+        plain_write(&plain, &sequence);
+        sensor_shadow_write_sequence(&shadow, &sequence, SENSOR_WRITE_CHANGED);
+
+        uint32_t transactions = shadow.transactions;
+        uint32_t skipped = shadow.skipped;
+        sensor_resolution_sequence(cpi_changes[i][1], writes);
+        unsigned plain_count = plain_write(&plain, &sequence);
+        sensor_shadow_write_sequence(&shadow, &sequence, SENSOR_WRITE_CHANGED);
+        printf("%5u->%-5u  %8u %8u %8u\n", cpi_changes[i][0], cpi_changes[i][1], plain_count,
+               (unsigned)(shadow.transactions - transactions), (unsigned)(shadow.skipped - skipped));
+        failures += compare(&plain, &shadowed);
+    }
+
+    // Gaming and office timings with their sensor modes, mirroring the profile defaults in settings.h.
+    static const sensor_rest_t rests[] = {
+        {1000, 5000, 30000, 1, 4, 10},
+        {250, 4800, 60000, 10, 50, 100},
+    };
+    static const char *rest_names[] = {"gaming", "office"};
+    static const int rest_modes[] = {0, 2};
+    for (int from = 0; from < 2; from++)
+    {
+        int to = !from;
+        uint8_t writes[SENSOR_REST_SEQUENCE_LENGTH][2];
+        sensor_sequence_t sequence = {writes, SENSOR_REST_SEQUENCE_LENGTH};
+        if (!sensor_rest_valid(&rests[from]))
+        {
+            printf("  INVALID: %s rest timing\n", rest_names[from]);
+            failures++;
+        }
+        power_up(&plain_shadow, &plain);
+        power_up(&shadow, &shadowed);
+        sensor_rest_sequence(&rests[from], writes);
+        plain_write(&plain, &sensor_sequence_modes[rest_modes[from]]);
+        plain_write(&plain, &sequence);
+        sensor_shadow_write_sequence(&shadow, &sensor_sequence_modes[rest_modes[from]], SENSOR_WRITE_CHANGED);
+        sensor_shadow_write_sequence(&shadow, &sequence, SENSOR_WRITE_CHANGED);
+
+        // A profile switch changes the mode and then the rest timing.
+        uint32_t transactions = shadow.transactions;
+        uint32_t skipped = shadow.skipped;
+        sensor_rest_sequence(&rests[to], writes);
+        unsigned plain_count = plain_write(&plain, &sensor_sequence_modes[rest_modes[to]]);
+        plain_count += plain_write(&plain, &sequence);
+        sensor_shadow_write_sequence(&shadow, &sensor_sequence_modes[rest_modes[to]], SENSOR_WRITE_CHANGED);
+        sensor_shadow_write_sequence(&shadow, &sequence, SENSOR_WRITE_CHANGED);
+        printf("%s->%s %8u %8u %8u\n", rest_names[from], rest_names[to], plain_count,
+               (unsigned)(shadow.transactions - transactions), (unsigned)(shadow.skipped - skipped));
+        failures += compare(&plain, &shadowed);
+
+        // The downshift registers hold steps, the programmed time is within half a step of the requested one.
+        const uint8_t *bank0 = shadowed.registers[0];
+        const sensor_rest_t *rest = &rests[to];
+        unsigned run_ms = bank0[SENSOR_REG_RUN_DOWNSHIFT] * SENSOR_RUN_DOWNSHIFT_UNIT_MS;
+        unsigned rest1_step_ms = SENSOR_REST_DOWNSHIFT_FRAMES * bank0[SENSOR_REG_REST1_PERIOD];
+        unsigned rest2_step_ms = SENSOR_REST_DOWNSHIFT_FRAMES * bank0[SENSOR_REG_REST2_PERIOD];
+        unsigned rest1_ms = bank0[SENSOR_REG_REST1_DOWNSHIFT] * rest1_step_ms;
+        unsigned rest2_ms = bank0[SENSOR_REG_REST2_DOWNSHIFT] * rest2_step_ms;
+        printf("  run %u ms, rest1 %u ms at %u ms frames, rest2 %u ms at %u ms frames, rest3 at %u ms frames\n", run_ms,
+               rest1_ms, bank0[SENSOR_REG_REST1_PERIOD], rest2_ms, bank0[SENSOR_REG_REST2_PERIOD],
+               bank0[SENSOR_REG_REST3_PERIOD]);
+        if (abs((int)run_ms - rest->run_downshift_ms) * 2 > SENSOR_RUN_DOWNSHIFT_UNIT_MS ||
+            abs((int)rest1_ms - rest->rest1_downshift_ms) * 2 > (int)rest1_step_ms ||
+            abs((int)rest2_ms - rest->rest2_downshift_ms) * 2 > (int)rest2_step_ms ||
+            bank0[SENSOR_REG_REST1_PERIOD] != rest->rest1_period_ms ||
+            bank0[SENSOR_REG_REST2_PERIOD] != rest->rest2_period_ms ||
+            bank0[SENSOR_REG_REST3_PERIOD] != rest->rest3_period_ms)
+        {
+            printf("  MISMATCH: %s rest timing not programmed\n", rest_names[to]);
+            failures++;
+        }
+    }
+    return failures != 0;
+}
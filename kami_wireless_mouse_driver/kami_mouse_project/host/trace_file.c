@@ -0,0 +1,207 @@
+#include "trace_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int trace_file_read_all(const char *path, uint8_t **data, size_t *length);
+static size_t trace_file_unhex_log(const uint8_t *text, size_t length, uint8_t *out);
+static int trace_file_parse(const uint8_t *data, size_t length, trace_file_t *trace);
+
+// Read a whole file into memory.
+static int trace_file_read_all(const char *path, uint8_t **data, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    size_t capacity = 1 << 16;
+    size_t used = 0;
+    uint8_t *buffer = malloc(capacity);
+    while (buffer != NULL)
+    {
+        size_t read = fread(buffer + used, 1, capacity - used, file);
+        used += read;
+        if (used < capacity)
+        {
+            break;
+        }
+        capacity *= 2;
+        uint8_t *grown = realloc(buffer, capacity);
+        if (grown == NULL)
+        {
+            free(buffer);
+        }
+        buffer = grown;
+    }
+    fclose(file);
+
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    *data = buffer;
+    *length = used;
+    return 0;
+}
+
+// Extract the hex lines between "TRACE BEGIN" and "TRACE END" of a serial monitor log.
+// Returns the number of binary bytes written to out, which must be at least length / 2 bytes.
+static size_t trace_file_unhex_log(const uint8_t *text, size_t length, uint8_t *out)
+{
+    const char *begin = NULL;
+    // The log is not NUL terminated, so search manually.
+    for (size_t i = 0; i + 11 <= length; i++)
+    {
+        if (memcmp(&text[i], "TRACE BEGIN", 11) == 0)
+        {
+            begin = (const char *)&text[i];
+        }
+    }
+    if (begin == NULL)
+    {
+        return 0;
+    }
+
+    // Skip the rest of the BEGIN line.
+    const char *end = (const char *)text + length;
+    const char *cursor = memchr(begin, '\n', end - begin);
+    size_t written = 0;
+    while (cursor != NULL && cursor < end)
+    {
+        cursor++;
+        const char *line_end = memchr(cursor, '\n', end - cursor);
+        if (line_end == NULL)
+        {
+            line_end = end;
+        }
+        if ((size_t)(line_end - cursor) >= 9 && memcmp(cursor, "TRACE END", 9) == 0)
+        {
+            break;
+        }
+        for (const char *c = cursor; c + 1 < line_end; c += 2)
+        {
+            unsigned int value;
+            if (sscanf(c, "%2x", &value) != 1)
+            {
+                break;
+            }
+            out[written++] = (uint8_t)value;
+        }
+        cursor = line_end;
+    }
+    return written;
+}
+
+// Parse the binary dump format.
+static int trace_file_parse(const uint8_t *data, size_t length, trace_file_t *trace)
+{
+    if (length < sizeof(trace_file_header_t))
+    {
+        fprintf(stderr, "trace too short\n");
+        return -1;
+    }
+    memcpy(&trace->header, data, sizeof(trace_file_header_t));
+    if (trace->header.magic != TRACE_MAGIC || trace->header.version != TRACE_VERSION)
+    {
+        fprintf(stderr, "not a version %d trace\n", TRACE_VERSION);
+        return -1;
+    }
+
+    trace->records = calloc(trace->header.record_count ? trace->header.record_count : 1, sizeof(trace_record_t));
+    if (trace->records == NULL)
+    {
+        return -1;
+    }
+
+    size_t offset = trace->header.header_size;
+    trace->record_count = 0;
+    while (trace->record_count < trace->header.record_count && offset + TRACE_RECORD_HEADER_SIZE <= length)
+    {
+        const uint8_t *in = &data[offset];
+        trace_record_t *record = &trace->records[trace->record_count];
+        record->type = in[0];
+        record->length = in[1];
+        record->timestamp_us = in[2] | in[3] << 8 | in[4] << 16 | (uint32_t)in[5] << 24;
+        if (record->length > TRACE_PAYLOAD_MAX || offset + TRACE_RECORD_HEADER_SIZE + record->length > length)
+        {
+            fprintf(stderr, "truncated record %zu\n", trace->record_count);
+            break;
+        }
+        memcpy(record->payload, &in[TRACE_RECORD_HEADER_SIZE], record->length);
+        offset += TRACE_RECORD_HEADER_SIZE + record->length;
+        trace->record_count++;
+    }
+    return 0;
+}
+
+// Load a trace from either a binary dump or a serial monitor log containing a console dump.
+int trace_file_load(const char *path, trace_file_t *trace)
+{
+    uint8_t *data;
+    size_t length;
+    memset(trace, 0, sizeof(*trace));
+    if (trace_file_read_all(path, &data, &length) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t magic = TRACE_MAGIC;
+    int result;
+    if (length >= sizeof(magic) && memcmp(data, &magic, sizeof(magic)) == 0)
+    {
+        result = trace_file_parse(data, length, trace);
+    }
+    else
+    {
+        uint8_t *binary = malloc(length / 2 + 1);
+        size_t binary_length = binary ? trace_file_unhex_log(data, length, binary) : 0;
+        result = trace_file_parse(binary, binary_length, trace);
+        free(binary);
+    }
+    free(data);
+    return result;
+}
+
+// Save a trace in the binary dump format.
+int trace_file_save(const char *path, const trace_file_t *trace)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    trace_file_header_t header = trace->header;
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.header_size = sizeof(header);
+    header.record_count = trace->record_count;
+    fwrite(&header, sizeof(header), 1, file);
+    for (size_t i = 0; i < trace->record_count; i++)
+    {
+        const trace_record_t *record = &trace->records[i];
+        uint8_t out[TRACE_RECORD_HEADER_SIZE] = {
+            record->type,
+            record->length,
+            (uint8_t)record->timestamp_us,
+            (uint8_t)(record->timestamp_us >> 8),
+            (uint8_t)(record->timestamp_us >> 16),
+            (uint8_t)(record->timestamp_us >> 24),
+        };
+        fwrite(out, sizeof(out), 1, file);
+        fwrite(record->payload, record->length, 1, file);
+    }
+    return fclose(file);
+}
+
+void trace_file_free(trace_file_t *trace)
+{
+    free(trace->records);
+    trace->records = NULL;
+    trace->record_count = 0;
+}
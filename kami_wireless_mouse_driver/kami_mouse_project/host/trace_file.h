@@ -0,0 +1,22 @@
+/**************** Trace File ****************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "header/trace_format.h"
+
+// A loaded trace, records are expanded back into the fixed size in RAM layout.
+typedef struct
+{
+	trace_file_header_t header;
+	trace_record_t *records;
+	size_t record_count;
+} trace_file_t;
+
+// Pre declarations
+// Non static functions visible outside file
+int trace_file_load(const char *path, trace_file_t *trace);
+int trace_file_save(const char *path, const trace_file_t *trace);
+void trace_file_free(trace_file_t *trace);
@@ -0,0 +1,532 @@
+// Replay a recorded input trace through the pipeline kernels.
+//
+// The recorded GPIO edges and motion bursts are fed back through the same decoding logic the firmware runs,
+// the inputs it produces are compared against the reports the device submitted to its transport,
+// and the host throughput of the replay and the device side input to report latency are measured.
+//
+// Buttons, motion and the wheel reach the transport from different tasks, so their reports interleave in no
+// fixed order. Each stream is compared on its own and in order. The transport merges the motion or wheel steps
+// that arrive while it is busy and splits what does not fit in one report, so those two streams are compared by
+// their running totals: every report has to end on an input from before it, unless it was split.
+//
+// Pass -d for traces of firmware built with CONFIG_KAMI_DEBOUNCE_DEFERRED.
+//
+//   trace_replay [-v] [-d] [-n repeats] [-o trace.bin] <trace.bin | monitor.log>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "header/input_pipeline.h"
+#include "trace_file.h"
+
+// Mirror the default debounce_ms and debounce_min_ms in settings.c (STABLE_POLL_TIME_MS, STABLE_POLL_TIME_MIN_MS),
+// the bounds of the learned release hold time.
+#define REPLAY_STABLE_TIME_US 10000
+#define REPLAY_STABLE_TIME_MIN_US 2000
+// Mirrors the default scroll_speed_min in settings.c, scroll acceleration is off by default.
+#define REPLAY_WHEEL_SPEED 1
+// Largest delta of a report, TRANSPORT_MOTION_MAX of the 8 and 16 bit reports in transport_mux.h.
+#define REPLAY_REPORT_MAX_8BIT 127
+#define REPLAY_REPORT_MAX_16BIT 32767
+
+// Pins recorded by the firmware ISRs.
+#define PIN_LMB 4
+#define PIN_RMB 6
+#define PIN_MMB 10
+#define PIN_SWHEEL_A 11
+#define PIN_SWHEEL_B 12
+#define PIN_SMB4 18
+#define PIN_SMB5 19
+
+// Streams of a report, compared separately.
+typedef enum
+{
+    REPLAY_BUTTONS,
+    REPLAY_MOTION,
+    REPLAY_WHEEL,
+    REPLAY_STREAMS,
+} replay_stream_t;
+
+static const char *const replay_stream_names[REPLAY_STREAMS] = {"buttons", "motion", "wheel"};
+
+// One input of a stream, the button state or the deltas on the stream's two axes.
+typedef struct
+{
+    uint8_t buttons;
+    int32_t a;
+    int32_t b;
+    // Timestamp of the input, or of the report for recorded ones.
+    uint32_t us;
+} replay_input_t;
+
+typedef struct
+{
+    replay_input_t *inputs;
+    size_t count;
+} replay_list_t;
+
+typedef struct
+{
+    size_t recorded;
+    size_t replayed;
+    size_t matched;
+    // Reports ending inside an input, the rest of it came in the next report.
+    size_t split;
+    size_t mismatched;
+    size_t missing;
+} replay_result_t;
+
+typedef struct
+{
+    mouse_button_state_t lmb;
+    mouse_button_state_t rmb;
+    eager_debounce_t mmb;
+    eager_debounce_t smb4;
+    eager_debounce_t smb5;
+    deferred_debounce_t mmb_deferred;
+    deferred_debounce_t smb4_deferred;
+    deferred_debounce_t smb5_deferred;
+    // Hold time learning of MMB, SMB4 and SMB5, fed the same edges as on the device.
+    debounce_tuner_t tune[3];
+    // Button map of the recording, the defaults, and the HID buttons held. Every report carries the full button state.
+    input_remap_t remap;
+    uint8_t buttons;
+    replay_list_t streams[REPLAY_STREAMS];
+    // Debounce strategy of the firmware that recorded the trace.
+    bool deferred;
+} replay_model_t;
+
+static void replay_emit(replay_list_t *list, uint32_t us, uint8_t buttons, int32_t a, int32_t b)
+{
+    replay_input_t *input = &list->inputs[list->count++];
+    input->buttons = buttons;
+    input->a = a;
+    input->b = b;
+    input->us = us;
+}
+
+// A button map change the host sees, a press of an unmapped button or one already held by another is no report.
+static void replay_button(replay_model_t *model, uint32_t input_us, input_button_t button, bool pressed)
+{
+    uint8_t buttons = input_remap_button(&model->remap, button, pressed);
+    if (buttons != model->buttons)
+    {
+        model->buttons = buttons;
+        replay_emit(&model->streams[REPLAY_BUTTONS], input_us, buttons, 0, 0);
+    }
+}
+
+static void replay_wheel(replay_model_t *model, uint32_t input_us, int8_t step)
+{
+    if (step != 0)
+    {
+        replay_emit(&model->streams[REPLAY_WHEEL], input_us, model->buttons, step * REPLAY_WHEEL_SPEED, 0);
+    }
+}
+
+// Index of a debounced button in replay_model_t.tune.
+static int replay_tune_index(input_button_t button)
+{
+    return button - INPUT_BUTTON_MIDDLE;
+}
+
+// A debounced button, through the kernel the firmware was built with.
+static void replay_debounce_edge(replay_model_t *model, eager_debounce_t *eager, deferred_debounce_t *deferred,
+                                 input_button_t button, int level, uint32_t now_us)
+{
+    input_debounce_tune_edge(&model->tune[replay_tune_index(button)], now_us);
+    if (model->deferred)
+    {
+        input_deferred_debounce_edge(deferred, level, now_us);
+    }
+    else if (input_eager_debounce_edge(eager, level, now_us))
+    {
+        replay_button(model, now_us, button, true);
+    }
+}
+
+// Poll one debounced button with its learned hold time, like button_debounce_task_report.
+static void replay_debounce_poll_button(replay_model_t *model, eager_debounce_t *eager, deferred_debounce_t *deferred,
+                                        input_button_t button, uint32_t now_us)
+{
+    debounce_tuner_t *tune = &model->tune[replay_tune_index(button)];
+    uint32_t stable_us = input_debounce_tune_poll(tune, now_us, REPLAY_STABLE_TIME_MIN_US, REPLAY_STABLE_TIME_US);
+    if (model->deferred)
+    {
+        if (input_deferred_debounce_poll(deferred, now_us, stable_us))
+        {
+            if (deferred->state == MOUSE_BUTTON_UP)
+            {
+                input_debounce_tune_release(tune);
+            }
+            replay_button(model, deferred->edge_us, button, deferred->state == MOUSE_BUTTON_DOWN);
+        }
+    }
+    else if (input_eager_debounce_poll(eager, now_us, stable_us))
+    {
+        input_debounce_tune_release(tune);
+        replay_button(model, eager->release_start_us, button, false);
+    }
+}
+
+static void replay_debounce_poll(replay_model_t *model, uint32_t now_us)
+{
+    replay_debounce_poll_button(model, &model->mmb, &model->mmb_deferred, INPUT_BUTTON_MIDDLE, now_us);
+    replay_debounce_poll_button(model, &model->smb4, &model->smb4_deferred, INPUT_BUTTON_BACK, now_us);
+    replay_debounce_poll_button(model, &model->smb5, &model->smb5_deferred, INPUT_BUTTON_FORWARD, now_us);
+}
+
+static void replay_gpio(replay_model_t *model, const trace_record_t *record)
+{
+    uint8_t pin = record->payload[0];
+    int level = (record->payload[1] & TRACE_GPIO_LEVEL) != 0;
+    int partner = (record->payload[1] & TRACE_GPIO_PARTNER_LEVEL) != 0;
+    uint32_t now = record->timestamp_us;
+    mouse_button_state_t next;
+
+    switch (pin)
+    {
+    case PIN_LMB:
+        next = input_latch_state(level, partner, model->lmb);
+        if (next != model->lmb)
+        {
+            model->lmb = next;
+            replay_button(model, now, INPUT_BUTTON_LEFT, next == MOUSE_BUTTON_DOWN);
+        }
+        break;
+    case PIN_RMB:
+        next = input_latch_state(level, partner, model->rmb);
+        if (next != model->rmb)
+        {
+            model->rmb = next;
+            replay_button(model, now, INPUT_BUTTON_RIGHT, next == MOUSE_BUTTON_DOWN);
+        }
+        break;
+    case PIN_MMB:
+        replay_debounce_edge(model, &model->mmb, &model->mmb_deferred, INPUT_BUTTON_MIDDLE, level, now);
+        break;
+    case PIN_SMB4:
+        replay_debounce_edge(model, &model->smb4, &model->smb4_deferred, INPUT_BUTTON_BACK, level, now);
+        break;
+    case PIN_SMB5:
+        replay_debounce_edge(model, &model->smb5, &model->smb5_deferred, INPUT_BUTTON_FORWARD, level, now);
+        break;
+    case PIN_SWHEEL_A:
+        replay_wheel(model, now, input_quadrature_step(true, level, partner));
+        break;
+    case PIN_SWHEEL_B:
+        replay_wheel(model, now, input_quadrature_step(false, partner, level));
+        break;
+    default:
+        break;
+    }
+}
+
+// Run the whole trace through the model once.
+static void replay_run(replay_model_t *model, const trace_file_t *trace)
+{
+    static const uint8_t map[INPUT_BUTTON_COUNT] = INPUT_REMAP_DEFAULT;
+    memset(model, 0, offsetof(replay_model_t, streams));
+    for (int i = 0; i < REPLAY_STREAMS; i++)
+    {
+        model->streams[i].count = 0;
+    }
+    input_remap_build(&model->remap, map);
+    for (int i = 0; i < 3; i++)
+    {
+        input_debounce_tune_init(&model->tune[i], REPLAY_STABLE_TIME_MIN_US, REPLAY_STABLE_TIME_US);
+    }
+
+    for (size_t i = 0; i < trace->record_count; i++)
+    {
+        const trace_record_t *record = &trace->records[i];
+        replay_debounce_poll(model, record->timestamp_us);
+
+        if (record->type == TRACE_RECORD_GPIO)
+        {
+            replay_gpio(model, record);
+        }
+        else if (record->type == TRACE_RECORD_BURST)
+        {
+            motion_burst_t burst;
+            if (input_decode_motion_burst(record->payload, &burst) && (burst.delta_x != 0 || burst.delta_y != 0))
+            {
+                replay_emit(&model->streams[REPLAY_MOTION], record->timestamp_us, model->buttons, burst.delta_x,
+                            burst.delta_y);
+            }
+        }
+    }
+}
+
+// Split the recorded reports into the streams, a button report is one that changed the button state.
+static void replay_split_reports(const trace_file_t *trace, replay_list_t *streams)
+{
+    uint8_t buttons = 0;
+    for (size_t i = 0; i < trace->record_count; i++)
+    {
+        const trace_record_t *record = &trace->records[i];
+        if (record->type != TRACE_RECORD_REPORT)
+        {
+            continue;
+        }
+        trace_report_t report;
+        trace_unpack_report(record->payload, &report);
+        if (report.buttons != buttons)
+        {
+            buttons = report.buttons;
+            replay_emit(&streams[REPLAY_BUTTONS], record->timestamp_us, buttons, 0, 0);
+        }
+        if (report.x != 0 || report.y != 0)
+        {
+            replay_emit(&streams[REPLAY_MOTION], record->timestamp_us, buttons, report.x, report.y);
+        }
+        if (report.wheel != 0 || report.pan != 0)
+        {
+            replay_emit(&streams[REPLAY_WHEEL], record->timestamp_us, buttons, report.wheel, report.pan);
+        }
+    }
+}
+
+// Compare the button states in order, one report per change.
+static void replay_match_buttons(const replay_list_t *expected, const replay_list_t *recorded, replay_result_t *result,
+                                 uint32_t *latencies, size_t *latency_count, bool verbose)
+{
+    size_t count = expected->count < recorded->count ? expected->count : recorded->count;
+    for (size_t i = 0; i < count; i++)
+    {
+        const replay_input_t *input = &expected->inputs[i];
+        const replay_input_t *report = &recorded->inputs[i];
+        if (input->buttons == report->buttons && (int32_t)(report->us - input->us) >= 0)
+        {
+            result->matched++;
+            latencies[(*latency_count)++] = report->us - input->us;
+        }
+        else
+        {
+            result->mismatched++;
+            if (verbose)
+            {
+                printf("buttons mismatch at %u us: device %02x, replay %02x\n", report->us, report->buttons,
+                       input->buttons);
+            }
+        }
+    }
+    result->mismatched += recorded->count - count;
+    result->missing = expected->count - count;
+}
+
+// True if a report delta is at the limit of its field, the transport then left the rest for the next report.
+static bool replay_at_limit(int32_t delta)
+{
+    int32_t magnitude = delta < 0 ? -delta : delta;
+    return magnitude == REPLAY_REPORT_MAX_8BIT || magnitude == REPLAY_REPORT_MAX_16BIT;
+}
+
+// Compare merged deltas by their running totals. A report carries the inputs that arrived since the previous one,
+// so its total has to equal the total of the replayed inputs up to one that came before the report. A report with a
+// delta at its field limit may also end inside the inputs, the transport split them. The latency is taken from the
+// oldest input in the report.
+static void replay_match_deltas(const char *name, const replay_list_t *expected, const replay_list_t *recorded,
+                                replay_result_t *result, uint32_t *latencies, size_t *latency_count, bool verbose)
+{
+    int64_t report_a = 0, report_b = 0;
+    int64_t covered_a = 0, covered_b = 0;
+    size_t covered = 0;
+    for (size_t i = 0; i < recorded->count; i++)
+    {
+        const replay_input_t *report = &recorded->inputs[i];
+        report_a += report->a;
+        report_b += report->b;
+
+        // The latest input before the report that brings the totals level.
+        int64_t total_a = covered_a, total_b = covered_b;
+        size_t end = covered;
+        for (size_t next = covered; next < expected->count && (int32_t)(expected->inputs[next].us - report->us) <= 0; next++)
+        {
+            total_a += expected->inputs[next].a;
+            total_b += expected->inputs[next].b;
+            if (total_a == report_a && total_b == report_b)
+            {
+                end = next + 1;
+            }
+        }
+
+        if (end != covered)
+        {
+            result->matched++;
+        }
+        else if (replay_at_limit(report->a) || replay_at_limit(report->b))
+        {
+            result->split++;
+        }
+        else
+        {
+            result->mismatched++;
+            if (verbose)
+            {
+                printf("%s mismatch at %u us: device %d %d, total %lld %lld\n", name, report->us, report->a, report->b,
+                       (long long)report_a, (long long)report_b);
+            }
+            continue;
+        }
+        if (covered < expected->count && (int32_t)(report->us - expected->inputs[covered].us) >= 0)
+        {
+            latencies[(*latency_count)++] = report->us - expected->inputs[covered].us;
+        }
+        for (; covered < end; covered++)
+        {
+            covered_a += expected->inputs[covered].a;
+            covered_b += expected->inputs[covered].b;
+        }
+    }
+    result->missing = expected->count - covered;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [-d] [-n repeats] [-o trace.bin] <trace.bin | monitor.log>\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+    bool deferred = false;
+    int repeats = 100;
+    const char *save_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "vdn:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            verbose = true;
+            break;
+        case 'd':
+            deferred = true;
+            break;
+        case 'n':
+            repeats = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'o':
+            save_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    trace_file_t trace;
+    if (trace_file_load(argv[optind], &trace) != 0)
+    {
+        return 1;
+    }
+    if (save_path != NULL && trace_file_save(save_path, &trace) != 0)
+    {
+        return 1;
+    }
+
+    size_t counts[TRACE_RECORD_REPORT + 1] = {0};
+    for (size_t i = 0; i < trace.record_count; i++)
+    {
+        if (trace.records[i].type <= TRACE_RECORD_REPORT)
+        {
+            counts[trace.records[i].type]++;
+        }
+    }
+    printf("records: %zu (bursts %zu, gpio %zu, reports %zu), dropped on device: %u\n",
+           trace.record_count, counts[TRACE_RECORD_BURST], counts[TRACE_RECORD_GPIO], counts[TRACE_RECORD_REPORT],
+           trace.header.dropped_count);
+
+    // Every input record produces at most one input, plus one for each pending release.
+    replay_model_t model;
+    model.deferred = deferred;
+    replay_list_t recorded[REPLAY_STREAMS];
+    bool allocated = true;
+    for (int i = 0; i < REPLAY_STREAMS; i++)
+    {
+        model.streams[i].inputs = calloc(trace.record_count + 4, sizeof(replay_input_t));
+        recorded[i].inputs = calloc(trace.record_count + 1, sizeof(replay_input_t));
+        recorded[i].count = 0;
+        allocated = allocated && model.streams[i].inputs != NULL && recorded[i].inputs != NULL;
+    }
+    if (!allocated)
+    {
+        return 1;
+    }
+
+    // Throughput.
+    double start = now_seconds();
+    for (int i = 0; i < repeats; i++)
+    {
+        replay_run(&model, &trace);
+    }
+    double elapsed = now_seconds() - start;
+    double records = (double)trace.record_count * repeats;
+    printf("replay: %.1f Mrecords/s, %.1f ns/record\n", records / elapsed / 1e6, elapsed * 1e9 / (records ? records : 1));
+
+    // Equivalence, each stream against the recorded reports of that stream.
+    replay_split_reports(&trace, recorded);
+    // A report may be in all three streams.
+    uint32_t *latencies = calloc(trace.record_count * REPLAY_STREAMS + 1, sizeof(uint32_t));
+    size_t latency_count = 0;
+    bool failed = latencies == NULL;
+    for (int i = 0; i < REPLAY_STREAMS && latencies != NULL; i++)
+    {
+        replay_result_t result = {.recorded = recorded[i].count, .replayed = model.streams[i].count};
+        if (i == REPLAY_BUTTONS)
+        {
+            replay_match_buttons(&model.streams[i], &recorded[i], &result, latencies, &latency_count, verbose);
+        }
+        else
+        {
+            replay_match_deltas(replay_stream_names[i], &model.streams[i], &recorded[i], &result, latencies, &latency_count,
+                                verbose);
+        }
+        printf("%s: %zu reports recorded, %zu inputs replayed, %zu matched, %zu split, %zu mismatched, "
+               "%zu inputs not reported by device\n",
+               replay_stream_names[i], result.recorded, result.replayed, result.matched, result.split,
+               result.mismatched, result.missing);
+        failed = failed || result.mismatched != 0 || result.missing != 0;
+    }
+
+    // Device side latency from the input record to the report that carried it.
+    if (latency_count > 0)
+    {
+        qsort(latencies, latency_count, sizeof(uint32_t), compare_u32);
+        printf("input to report latency: min %u us, p50 %u us, p99 %u us, max %u us\n", latencies[0],
+               latencies[latency_count / 2], latencies[(latency_count * 99) / 100], latencies[latency_count - 1]);
+    }
+
+    free(latencies);
+    for (int i = 0; i < REPLAY_STREAMS; i++)
+    {
+        free(model.streams[i].inputs);
+        free(recorded[i].inputs);
+    }
+    trace_file_free(&trace);
+    return failed ? 1 : 0;
+}
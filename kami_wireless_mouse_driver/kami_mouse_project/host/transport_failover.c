@@ -0,0 +1,409 @@
+// Drive the transport mux through USB plug and unplug with mock transports.
+//
+// The mouse moves steadily and clicks while the cable is plugged in and pulled out. The mux runs the same code
+// as on the device: it is polled on input, on report completion, on link changes and on the transport task tick.
+// The mock USB host polls its endpoint once per interval and enumerates some time after the cable is plugged in.
+// A report reaches the host when its endpoint is polled. After an unplug the endpoint is never polled again, the
+// report in it never completes, and the unplug is only noticed once the bus has been idle long enough for a suspend.
+// The mock dongle takes every report. Each host keeps the button state and motion it was sent.
+//
+// For every switch the time from the link change to the first report on the new transport is measured.
+// Fails if a switch takes longer than the unplug detection, the transport task tick and one USB interval together,
+// a held button is not carried to the new host, a host is left with a button pressed,
+// motion from before a gap arrives as a burst, or any motion sent after the first transport came up is lost.
+//
+//   transport_failover [-s seed] [-n cycles] [-v]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "header/transport_mux.h"
+
+// Mirrors TRANSPORT_POLL_MS in transport.h.
+#define FAILOVER_POLL_US 10000
+// Sensor report interval and counts per sample.
+#define FAILOVER_MOTION_INTERVAL_US 125
+#define FAILOVER_MOTION_STEP 1
+// Mock USB, endpoint polling interval and the time from plugging in to the host configuring the device.
+#define FAILOVER_USB_INTERVAL_US 1000
+#define FAILOVER_USB_ENUMERATION_US 120000
+// Bus idle time before the device sees a suspend, the USB 2.0 spec allows 3 ms.
+#define FAILOVER_USB_DETECT_US 3000
+// Mock dongle, the radio link comes up this long after boot.
+#define FAILOVER_RADIO_START_US 300000
+// Simulation step.
+#define FAILOVER_STEP_US 5
+
+typedef struct
+{
+    const char *name;
+    bool connected;
+    uint8_t buttons;
+    int64_t x;
+    uint32_t reports;
+    // Largest single report delta, a burst of stale motion shows up here.
+    int max_x;
+} mock_host_t;
+
+typedef struct
+{
+    uint32_t now;
+    // USB
+    bool plugged;
+    uint32_t plugged_at;
+    // Mounted as far as the device can tell.
+    bool mounted;
+    uint32_t unplugged_at;
+    uint32_t usb_busy_until;
+    bool usb_completion;
+    // Report in the IN endpoint until the host polls it, and the reports left in it by an unplug.
+    transport_report_t usb_report;
+    uint32_t usb_stuck;
+    mock_host_t usb_host;
+    // Radio
+    mock_host_t dongle;
+} mock_world_t;
+
+static mock_world_t world;
+
+static bool mock_usb_available(void *context)
+{
+    (void)context;
+    return world.mounted;
+}
+
+static bool mock_usb_ready(void *context)
+{
+    (void)context;
+    return !world.usb_completion;
+}
+
+static void mock_host_receive(mock_host_t *host, const transport_report_t *report)
+{
+    host->buttons = report->buttons;
+    host->x += report->x;
+    host->reports++;
+    if (abs(report->x) > host->max_x)
+    {
+        host->max_x = abs(report->x);
+    }
+}
+
+static bool mock_usb_submit(void *context, const transport_report_t *report)
+{
+    (void)context;
+    if (!mock_usb_available(NULL) || !mock_usb_ready(NULL))
+    {
+        return false;
+    }
+    // The report goes out on the next poll of the endpoint.
+    world.usb_busy_until = (world.now / FAILOVER_USB_INTERVAL_US + 1) * FAILOVER_USB_INTERVAL_US;
+    world.usb_completion = true;
+    world.usb_report = *report;
+    if (!world.plugged)
+    {
+        world.usb_stuck++;
+    }
+    return true;
+}
+
+// Buttons a host has, or will have once the report waiting in its USB endpoint is polled.
+static uint8_t mock_host_buttons(const mock_host_t *host)
+{
+    if (host == &world.usb_host && world.usb_completion && world.plugged && world.mounted)
+    {
+        return world.usb_report.buttons;
+    }
+    return host->buttons;
+}
+
+static bool mock_radio_available(void *context)
+{
+    (void)context;
+    return world.now >= FAILOVER_RADIO_START_US;
+}
+
+static bool mock_radio_ready(void *context)
+{
+    (void)context;
+    return true;
+}
+
+static bool mock_radio_submit(void *context, const transport_report_t *report)
+{
+    (void)context;
+    mock_host_receive(&world.dongle, report);
+    return true;
+}
+
+static const transport_t mock_transports[] = {
+    {.name = "usb", .available = mock_usb_available, .ready = mock_usb_ready, .submit = mock_usb_submit},
+    {.name = "radio", .available = mock_radio_available, .ready = mock_radio_ready, .submit = mock_radio_submit},
+};
+
+typedef struct
+{
+    uint32_t at_us;
+    enum
+    {
+        EVENT_PRESS,
+        EVENT_RELEASE,
+        EVENT_PLUG,
+        EVENT_UNPLUG,
+    } type;
+} failover_event_t;
+
+static uint32_t failover_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n cycles] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 0x4B4D;
+    int cycles = 50;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            seed = seed ? seed : 1;
+            break;
+        case 'n':
+            cycles = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // Each cycle plugs and unplugs the cable once, with a click held across each change and one in between.
+    size_t event_count = (size_t)cycles * 6;
+    failover_event_t *events = calloc(event_count, sizeof(failover_event_t));
+    if (events == NULL)
+    {
+        return 1;
+    }
+    uint32_t rng = seed;
+    uint32_t t = FAILOVER_RADIO_START_US + 100000;
+    size_t n = 0;
+    for (int i = 0; i < cycles; i++)
+    {
+        uint32_t types[6] = {EVENT_PRESS, EVENT_PLUG, EVENT_RELEASE, EVENT_PRESS, EVENT_UNPLUG, EVENT_RELEASE};
+        for (int j = 0; j < 6; j++)
+        {
+            // Plug events leave time for enumeration before the held button is released.
+            t += (j == 2 ? FAILOVER_USB_ENUMERATION_US : 0) + 20000 + failover_random(&rng) % 200000;
+            events[n].at_us = t;
+            events[n].type = types[j];
+            n++;
+        }
+    }
+    uint32_t end_us = t + 200000;
+
+    transport_mux_t mux;
+    transport_mux_init(&mux, mock_transports, 2);
+    memset(&world, 0, sizeof(world));
+    world.usb_host.name = "usb";
+    world.dongle.name = "dongle";
+
+    uint8_t buttons = 0;
+    int64_t motion_sent = 0;
+    uint32_t next_motion_us = 0;
+    uint32_t next_tick_us = 0;
+    size_t next_event = 0;
+    uint32_t link_change_us = 0;
+    bool awaiting_switch = false;
+    int expected = TRANSPORT_NONE;
+    uint32_t switches = 0;
+    uint32_t switch_max_us = 0;
+    uint64_t switch_total_us = 0;
+    bool failed = false;
+    uint32_t switch_limit_us = FAILOVER_USB_DETECT_US + FAILOVER_POLL_US + FAILOVER_USB_INTERVAL_US;
+
+    for (world.now = 0; world.now < end_us; world.now += FAILOVER_STEP_US)
+    {
+        bool poll = false;
+
+        // Link changes, the firmware is notified through tud_mount_cb and tud_umount_cb.
+        if (world.plugged && !world.mounted && world.now - world.plugged_at == FAILOVER_USB_ENUMERATION_US)
+        {
+            // The bus reset of the enumeration empties the endpoint.
+            world.mounted = true;
+            world.usb_completion = false;
+            poll = true;
+        }
+        if (!world.plugged && world.mounted && world.now - world.unplugged_at == FAILOVER_USB_DETECT_US)
+        {
+            world.mounted = false;
+            poll = true;
+        }
+        if (world.now == FAILOVER_RADIO_START_US)
+        {
+            // The radio coming up is only seen on the next tick.
+            link_change_us = world.now;
+            awaiting_switch = true;
+            expected = 1;
+        }
+
+        while (next_event < n && events[next_event].at_us <= world.now)
+        {
+            const failover_event_t *event = &events[next_event++];
+            switch (event->type)
+            {
+            case EVENT_PRESS:
+                buttons = 0x01;
+                transport_mux_button(&mux, 0x01, true);
+                poll = true;
+                break;
+            case EVENT_RELEASE:
+                buttons = 0x00;
+                transport_mux_button(&mux, 0x01, false);
+                poll = true;
+                break;
+            case EVENT_PLUG:
+                world.plugged = true;
+                world.plugged_at = world.now;
+                world.usb_host.connected = true;
+                link_change_us = world.now + FAILOVER_USB_ENUMERATION_US;
+                awaiting_switch = true;
+                expected = 0;
+                break;
+            case EVENT_UNPLUG:
+                // The host drops the state of a device that goes away.
+                world.plugged = false;
+                world.unplugged_at = world.now;
+                world.usb_stuck += world.usb_completion;
+                world.usb_host.connected = false;
+                world.usb_host.buttons = 0;
+                link_change_us = world.now;
+                awaiting_switch = true;
+                expected = 1;
+                break;
+            }
+        }
+
+        if (world.now >= next_motion_us)
+        {
+            next_motion_us += FAILOVER_MOTION_INTERVAL_US;
+            transport_mux_motion(&mux, FAILOVER_MOTION_STEP, 0, 0, 0, world.now);
+            motion_sent += FAILOVER_MOTION_STEP;
+            poll = true;
+        }
+
+        // Completion of the USB report, from tud_hid_report_complete_cb. Only a host that polls completes it.
+        if (world.usb_completion && world.now >= world.usb_busy_until && world.plugged && world.mounted)
+        {
+            world.usb_completion = false;
+            mock_host_receive(&world.usb_host, &world.usb_report);
+            poll = true;
+        }
+        if (world.now >= next_tick_us)
+        {
+            next_tick_us += FAILOVER_POLL_US;
+            poll = true;
+        }
+        if (!poll)
+        {
+            continue;
+        }
+
+        uint32_t submitted_before = mux.submitted;
+        transport_mux_poll(&mux, world.now);
+
+        if (awaiting_switch && mux.active == expected && mux.submitted != submitted_before && !mux.switching)
+        {
+            mock_host_t *host = mux.active == 0 ? &world.usb_host : &world.dongle;
+            uint32_t switch_us = world.now - link_change_us;
+            awaiting_switch = false;
+            switches++;
+            switch_total_us += switch_us;
+            if (switch_us > switch_max_us)
+            {
+                switch_max_us = switch_us;
+            }
+            if (verbose)
+            {
+                printf("%9.3f ms: switched to %s in %u us, buttons %02x\n", world.now / 1000.0,
+                       mock_transports[mux.active].name, switch_us, mock_host_buttons(host));
+            }
+            if (mock_host_buttons(host) != buttons)
+            {
+                printf("FAIL at %u us: %s host has buttons %02x, mouse holds %02x\n", world.now, host->name,
+                       mock_host_buttons(host), buttons);
+                failed = true;
+            }
+            if (switch_us > switch_limit_us)
+            {
+                printf("FAIL at %u us: switch to %s took %u us\n", world.now, host->name, switch_us);
+                failed = true;
+            }
+        }
+
+        // A host that is still connected but no longer active must not keep a button pressed.
+        if (mux.active == 1 && world.usb_host.connected && mock_host_buttons(&world.usb_host) != 0 && !mux.switching)
+        {
+            printf("FAIL at %u us: usb host left with buttons %02x\n", world.now, mock_host_buttons(&world.usb_host));
+            failed = true;
+        }
+        if (mux.active == 0 && mux.release == TRANSPORT_NONE && world.dongle.buttons != 0)
+        {
+            printf("FAIL at %u us: dongle host left with buttons %02x\n", world.now, world.dongle.buttons);
+            failed = true;
+        }
+    }
+
+    int64_t delivered = world.usb_host.x + world.dongle.x;
+    // Motion from before the radio came up, the sample at that tick included, is older than TRANSPORT_STALE_MOTION_US
+    // and must not be delivered. Everything after it must arrive, including the reports stuck in an unplugged cable.
+    int64_t expected_drop = (FAILOVER_RADIO_START_US / FAILOVER_MOTION_INTERVAL_US + 1) * FAILOVER_MOTION_STEP;
+    printf("%d plug cycles, %u switches, switchover avg %.0f us, max %u us (limit %u us)\n", cycles, switches,
+           switches ? (double)switch_total_us / switches : 0.0, switch_max_us, switch_limit_us);
+    printf("reports: usb %u, dongle %u, stuck on unplug %u, motion recovered %u times; motion sent %lld, delivered %lld, "
+           "stale dropped %u times\n",
+           world.usb_host.reports, world.dongle.reports, world.usb_stuck, mux.motion_recovered, (long long)motion_sent,
+           (long long)delivered, mux.stale_motion_dropped);
+    printf("largest report delta: usb %d, dongle %d\n", world.usb_host.max_x, world.dongle.max_x);
+
+    if (world.usb_host.buttons != 0 || world.dongle.buttons != 0)
+    {
+        printf("FAIL: a host ended with a button pressed\n");
+        failed = true;
+    }
+    if (delivered != motion_sent - expected_drop || mux.stale_motion_dropped != 1)
+    {
+        printf("FAIL: %lld counts of motion lost or replayed across switches\n",
+               (long long)(motion_sent - expected_drop - delivered));
+        failed = true;
+    }
+    // Without a gap the merged motion per report is bounded by one USB interval of samples.
+    if (world.usb_host.max_x > FAILOVER_USB_INTERVAL_US / FAILOVER_MOTION_INTERVAL_US * FAILOVER_MOTION_STEP * 2 + 1 ||
+        world.dongle.max_x > FAILOVER_POLL_US / FAILOVER_MOTION_INTERVAL_US * FAILOVER_MOTION_STEP + 1)
+    {
+        printf("FAIL: burst of stale motion after a switch\n");
+        failed = true;
+    }
+
+    free(events);
+    return failed ? 1 : 0;
+}
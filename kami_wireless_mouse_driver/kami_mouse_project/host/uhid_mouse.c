@@ -0,0 +1,557 @@
+// A simulated Kami mouse on a virtual uhid device, for testing the hidraw host tools without hardware.
+//
+// The device has the mouse's report descriptor: the mouse input report with 8 bit X and Y and the vendor feature
+// report. Its reports come out of the transport mux, the same sources the firmware builds. Every report interval
+// the sensor adds motion and the mux is polled. The hand moves in strokes of 50 to 500 ms, with clicks and wheel
+// steps in the pauses between them. With -m a share of the report intervals is skipped, as if the device was busy.
+// The mux then merges their motion into the next report, like it does on the device.
+// The vendor report answers GET of the report rate tag, READ of the counters block and RESET. The counters count
+// the reports sent and the skipped intervals (frame_overruns), like the firmware does.
+//
+// Needs the uhid driver (modprobe uhid) and write access to /dev/uhid, the node shows up as "Kami Komplex Mouse".
+// With -o the device runs on a virtual clock and writes the reports it would send to a capture file instead,
+// report_rate reads those with -d.
+// At the end it prints the skipped intervals that fell into a stroke, report_rate should count as many missed frames.
+//
+//   uhid_mouse [-r report_rate_us] [-t seconds] [-m skip_percent] [-s seed] [-o capture.bin]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "header/telemetry_format.h"
+#include "header/transport_mux.h"
+#include "header/vendor_protocol.h"
+#include "report_capture.h"
+
+// Mirrors REPORT_RATE_US in motion_sensor.h, the default report_rate_us setting.
+#define DEVICE_REPORT_RATE_US_DEFAULT 250
+// Mirror the USB IDs and strings of the firmware's descriptors.
+#define DEVICE_NAME "Kami Komplex Mouse"
+#define DEVICE_VENDOR 0x303A
+#define DEVICE_PRODUCT 0x4004
+
+// TUD_HID_REPORT_DESC_MOUSE with the mouse report ID, then the vendor feature report, as in kami_mouse.c.
+static const uint8_t device_report_descriptor[] = {
+    0x05, 0x01,                   // Usage Page (Generic Desktop)
+    0x09, 0x02,                   // Usage (Mouse)
+    0xA1, 0x01,                   // Collection (Application)
+    0x85, CAPTURE_MOUSE_REPORT_ID, //   Report ID
+    0x09, 0x01,                   //   Usage (Pointer)
+    0xA1, 0x00,                   //   Collection (Physical)
+    0x05, 0x09,                   //     Usage Page (Button)
+    0x19, 0x01,                   //     Usage Minimum (1)
+    0x29, 0x05,                   //     Usage Maximum (5)
+    0x15, 0x00,                   //     Logical Minimum (0)
+    0x25, 0x01,                   //     Logical Maximum (1)
+    0x95, 0x05,                   //     Report Count (5)
+    0x75, 0x01,                   //     Report Size (1)
+    0x81, 0x02,                   //     Input (Data, Variable, Absolute)
+    0x95, 0x01,                   //     Report Count (1)
+    0x75, 0x03,                   //     Report Size (3)
+    0x81, 0x01,                   //     Input (Constant)
+    0x05, 0x01,                   //     Usage Page (Generic Desktop)
+    0x09, 0x30,                   //     Usage (X)
+    0x09, 0x31,                   //     Usage (Y)
+    0x15, 0x81,                   //     Logical Minimum (-127)
+    0x25, 0x7F,                   //     Logical Maximum (127)
+    0x95, 0x02,                   //     Report Count (2)
+    0x75, 0x08,                   //     Report Size (8)
+    0x81, 0x06,                   //     Input (Data, Variable, Relative)
+    0x09, 0x38,                   //     Usage (Wheel)
+    0x15, 0x81,                   //     Logical Minimum (-127)
+    0x25, 0x7F,                   //     Logical Maximum (127)
+    0x95, 0x01,                   //     Report Count (1)
+    0x75, 0x08,                   //     Report Size (8)
+    0x81, 0x06,                   //     Input (Data, Variable, Relative)
+    0x05, 0x0C,                   //     Usage Page (Consumer)
+    0x0A, 0x38, 0x02,             //     Usage (AC Pan)
+    0x15, 0x81,                   //     Logical Minimum (-127)
+    0x25, 0x7F,                   //     Logical Maximum (127)
+    0x95, 0x01,                   //     Report Count (1)
+    0x75, 0x08,                   //     Report Size (8)
+    0x81, 0x06,                   //     Input (Data, Variable, Relative)
+    0xC0,                         //   End Collection
+    0xC0,                         // End Collection
+    0x06, 0x00, 0xFF,             // Usage Page (Vendor)
+    0x09, 0x01,                   // Usage (1)
+    0xA1, 0x01,                   // Collection (Application)
+    0x85, VENDOR_REPORT_ID,       //   Report ID
+    0x09, 0x02,                   //   Usage (2)
+    0x15, 0x00,                   //   Logical Minimum (0)
+    0x26, 0xFF, 0x00,             //   Logical Maximum (255)
+    0x75, 0x08,                   //   Report Size (8)
+    0x95, VENDOR_REPORT_SIZE,     //   Report Count
+    0xB1, 0x00,                   //   Feature (Data, Array, Absolute)
+    0xC0,                         // End Collection
+};
+
+typedef struct
+{
+    transport_mux_t mux;
+    telemetry_counters_t counters;
+    telemetry_counters_t snapshot;
+    uint8_t response[VENDOR_REPORT_SIZE];
+    uint32_t rng;
+    uint32_t rate_us;
+    uint32_t skip_percent;
+    uint32_t now_us;
+    // The hand: ticks left in the current stroke or pause, and the stroke's velocity.
+    uint32_t stroke_ticks;
+    uint32_t pause_ticks;
+    uint32_t release_tick;
+    int16_t vx;
+    int16_t vy;
+    uint8_t buttons;
+    // Skipped intervals are counted the way report_rate counts missed frames: those between two reports with motion
+    // less than CAPTURE_IDLE_INTERVALS apart.
+    bool have_motion;
+    uint32_t last_motion_us;
+    uint32_t span_skipped;
+    uint32_t skipped;
+    uint32_t ticks;
+    // Where the reports go, the uhid device or a capture file.
+    int uhid;
+    FILE *capture;
+} device_t;
+
+static device_t device;
+static volatile sig_atomic_t device_stop = 0;
+
+static void device_signal(int sig)
+{
+    (void)sig;
+    device_stop = 1;
+}
+
+static uint32_t device_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int device_write(int fd, const struct uhid_event *event)
+{
+    return write(fd, event, sizeof(*event)) == (ssize_t)sizeof(*event) ? 0 : -1;
+}
+
+/************* Backend ****************/
+
+static bool device_available(void *context)
+{
+    (void)context;
+    return true;
+}
+
+static bool device_ready(void *context)
+{
+    (void)context;
+    return true;
+}
+
+// One input report, to the uhid device or the capture file.
+static bool device_submit(void *context, const transport_report_t *report)
+{
+    device_t *dev = context;
+    uint8_t data[6] = {CAPTURE_MOUSE_REPORT_ID, report->buttons, (uint8_t)report->x, (uint8_t)report->y,
+                       (uint8_t)report->wheel, (uint8_t)report->pan};
+    if (dev->capture != NULL)
+    {
+        capture_record_t record = {.time_ns = (uint64_t)dev->now_us * 1000, .length = sizeof(data)};
+        memcpy(record.data, data, sizeof(data));
+        fwrite(&record, sizeof(record), 1, dev->capture);
+    }
+    else
+    {
+        struct uhid_event event = {.type = UHID_INPUT2};
+        event.u.input2.size = sizeof(data);
+        memcpy(event.u.input2.data, data, sizeof(data));
+        if (device_write(dev->uhid, &event) != 0)
+        {
+            dev->counters.reports_failed++;
+            return false;
+        }
+    }
+    dev->counters.reports_sent++;
+    if (report->x != 0 || report->y != 0)
+    {
+        if (dev->have_motion && dev->now_us - dev->last_motion_us < CAPTURE_IDLE_INTERVALS * dev->rate_us)
+        {
+            dev->skipped += dev->span_skipped;
+        }
+        dev->have_motion = true;
+        dev->last_motion_us = dev->now_us;
+        dev->span_skipped = 0;
+    }
+    return true;
+}
+
+static const transport_t device_transports[1] = {
+    {
+        .name = "uhid",
+        .available = device_available,
+        .ready = device_ready,
+        .submit = device_submit,
+        .context = &device,
+    },
+};
+
+/************* Hand ****************/
+
+// The next stroke or pause, strokes of 50 to 500 ms and pauses of 20 to 300 ms.
+// A pause is never shorter than CAPTURE_IDLE_INTERVALS, so report_rate sees the hand stop.
+static void device_next_move(device_t *dev)
+{
+    uint32_t stroke_ms = 50 + device_random(&dev->rng) % 451;
+    uint32_t pause_ms = 20 + device_random(&dev->rng) % 281;
+    dev->stroke_ticks = stroke_ms * 1000 / dev->rate_us;
+    dev->pause_ticks = pause_ms * 1000 / dev->rate_us;
+    if (dev->pause_ticks < 2 * CAPTURE_IDLE_INTERVALS)
+    {
+        dev->pause_ticks = 2 * CAPTURE_IDLE_INTERVALS;
+    }
+    dev->vx = (int16_t)(device_random(&dev->rng) % 41) - 20;
+    dev->vy = (int16_t)(device_random(&dev->rng) % 41) - 20;
+    dev->release_tick = 0;
+}
+
+// One report interval: the sensor frame, then the mux poll unless the interval is skipped.
+static void device_tick(device_t *dev, bool skip)
+{
+    dev->ticks++;
+    dev->counters.bursts_read++;
+    dev->counters.uptime_ms = dev->now_us / 1000;
+    if (dev->stroke_ticks > 0)
+    {
+        int16_t x = dev->vx + (int16_t)(device_random(&dev->rng) % 5) - 2;
+        int16_t y = dev->vy + (int16_t)(device_random(&dev->rng) % 5) - 2;
+        x = x == 0 && y == 0 ? 1 : x;
+        transport_mux_motion(&dev->mux, x, y, 0, 0, dev->now_us);
+        dev->counters.motion_bursts++;
+        if (--dev->stroke_ticks == 0)
+        {
+            // A click in one pause out of four, a wheel step in another.
+            uint32_t what = device_random(&dev->rng) % 4;
+            if (what == 0)
+            {
+                dev->buttons = 0x01;
+                dev->release_tick = dev->pause_ticks / 2;
+                transport_mux_buttons(&dev->mux, dev->buttons);
+                dev->counters.button_events++;
+            }
+            else if (what == 1)
+            {
+                transport_mux_motion(&dev->mux, 0, 0, (device_random(&dev->rng) & 1) ? 1 : -1, 0, dev->now_us);
+                dev->counters.wheel_events++;
+            }
+        }
+    }
+    else if (dev->pause_ticks > 0)
+    {
+        if (dev->buttons && dev->pause_ticks == dev->release_tick)
+        {
+            dev->buttons = 0;
+            transport_mux_buttons(&dev->mux, dev->buttons);
+            dev->counters.button_events++;
+        }
+        if (--dev->pause_ticks == 0)
+        {
+            device_next_move(dev);
+        }
+    }
+
+    if (skip)
+    {
+        dev->counters.frame_overruns++;
+        dev->span_skipped++;
+        return;
+    }
+    transport_mux_poll(&dev->mux, dev->now_us);
+}
+
+static bool device_skip(device_t *dev)
+{
+    return device_random(&dev->rng) % 100 < dev->skip_percent;
+}
+
+/************* Vendor Report ****************/
+
+static void device_write_u32(uint8_t *out, uint32_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)(value >> 16);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+// The part of vendor_report_set the host tools use.
+static void device_vendor_request(device_t *dev, const uint8_t *request, size_t size)
+{
+    uint8_t *response = dev->response;
+    memset(response, 0, VENDOR_REPORT_SIZE);
+    if (size < VENDOR_REQUEST_HEADER_SIZE || request[2] > VENDOR_REQUEST_PAYLOAD_MAX ||
+        VENDOR_REQUEST_HEADER_SIZE + (size_t)request[2] > size)
+    {
+        response[2] = VENDOR_STATUS_BAD_LENGTH;
+        return;
+    }
+    uint8_t command = request[0];
+    uint8_t length = request[2];
+    const uint8_t *payload = &request[VENDOR_REQUEST_HEADER_SIZE];
+    uint8_t *out = &response[VENDOR_RESPONSE_HEADER_SIZE];
+    response[0] = command;
+    response[1] = request[1];
+    response[2] = VENDOR_STATUS_OK;
+
+    if (command == VENDOR_CMD_GET)
+    {
+        uint8_t used = 0;
+        for (int i = 0; i < length; i++)
+        {
+            if (payload[i] != VENDOR_TAG_REPORT_RATE_US || used + 4 > VENDOR_RESPONSE_PAYLOAD_MAX)
+            {
+                response[2] = VENDOR_STATUS_UNKNOWN_TAG;
+                return;
+            }
+            out[used] = VENDOR_TAG_REPORT_RATE_US;
+            out[used + 1] = 2;
+            out[used + 2] = (uint8_t)dev->rate_us;
+            out[used + 3] = (uint8_t)(dev->rate_us >> 8);
+            used += 4;
+        }
+        response[3] = used;
+    }
+    else if (command == VENDOR_CMD_READ)
+    {
+        uint32_t offset = length == 5 ? payload[1] | payload[2] << 8 | payload[3] << 16 | (uint32_t)payload[4] << 24 : 0;
+        if (length != 5 || payload[0] != VENDOR_BLOCK_COUNTERS || offset > sizeof(dev->snapshot))
+        {
+            response[2] = length != 5 ? VENDOR_STATUS_BAD_LENGTH : VENDOR_STATUS_BAD_VALUE;
+            return;
+        }
+        if (offset == 0)
+        {
+            dev->snapshot = dev->counters;
+        }
+        uint32_t chunk = sizeof(dev->snapshot) - offset;
+        chunk = chunk < VENDOR_READ_CHUNK_MAX ? chunk : VENDOR_READ_CHUNK_MAX;
+        device_write_u32(out, sizeof(dev->snapshot));
+        memcpy(&out[4], (const uint8_t *)&dev->snapshot + offset, chunk);
+        response[3] = (uint8_t)(4 + chunk);
+    }
+    else if (command == VENDOR_CMD_RESET)
+    {
+        memset(&dev->counters, 0, sizeof(dev->counters));
+    }
+    else
+    {
+        response[2] = VENDOR_STATUS_UNKNOWN_COMMAND;
+    }
+}
+
+// Feature report requests from the kernel, hidraw passes the report ID as the first byte.
+static void device_uhid_event(device_t *dev)
+{
+    struct uhid_event event;
+    if (read(dev->uhid, &event, sizeof(event)) <= 0)
+    {
+        return;
+    }
+    struct uhid_event reply;
+    memset(&reply, 0, sizeof(reply));
+    if (event.type == UHID_SET_REPORT)
+    {
+        reply.type = UHID_SET_REPORT_REPLY;
+        reply.u.set_report_reply.id = event.u.set_report.id;
+        if (event.u.set_report.rnum == VENDOR_REPORT_ID && event.u.set_report.rtype == UHID_FEATURE_REPORT &&
+            event.u.set_report.size > 1)
+        {
+            device_vendor_request(dev, &event.u.set_report.data[1], event.u.set_report.size - 1);
+        }
+        else
+        {
+            reply.u.set_report_reply.err = EIO;
+        }
+        device_write(dev->uhid, &reply);
+    }
+    else if (event.type == UHID_GET_REPORT)
+    {
+        reply.type = UHID_GET_REPORT_REPLY;
+        reply.u.get_report_reply.id = event.u.get_report.id;
+        if (event.u.get_report.rnum == VENDOR_REPORT_ID && event.u.get_report.rtype == UHID_FEATURE_REPORT)
+        {
+            reply.u.get_report_reply.size = 1 + VENDOR_REPORT_SIZE;
+            reply.u.get_report_reply.data[0] = VENDOR_REPORT_ID;
+            memcpy(&reply.u.get_report_reply.data[1], dev->response, VENDOR_REPORT_SIZE);
+        }
+        else
+        {
+            reply.u.get_report_reply.err = EIO;
+        }
+        device_write(dev->uhid, &reply);
+    }
+}
+
+/************* Runs ****************/
+
+// Real time on the uhid device. Ticks the timer fired late are skipped, the device was busy for them.
+static int device_run_uhid(device_t *dev, double seconds)
+{
+    dev->uhid = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if (dev->uhid < 0)
+    {
+        fprintf(stderr, "/dev/uhid: %s\n", strerror(errno));
+        return 2;
+    }
+    struct uhid_event create;
+    memset(&create, 0, sizeof(create));
+    create.type = UHID_CREATE2;
+    snprintf((char *)create.u.create2.name, sizeof(create.u.create2.name), "%s", DEVICE_NAME);
+    snprintf((char *)create.u.create2.phys, sizeof(create.u.create2.phys), "uhid_mouse");
+    create.u.create2.rd_size = sizeof(device_report_descriptor);
+    create.u.create2.bus = BUS_USB;
+    create.u.create2.vendor = DEVICE_VENDOR;
+    create.u.create2.product = DEVICE_PRODUCT;
+    memcpy(create.u.create2.rd_data, device_report_descriptor, sizeof(device_report_descriptor));
+    if (device_write(dev->uhid, &create) != 0)
+    {
+        fprintf(stderr, "uhid create: %s\n", strerror(errno));
+        close(dev->uhid);
+        return 2;
+    }
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec period = {
+        .it_interval = {.tv_sec = dev->rate_us / 1000000, .tv_nsec = (dev->rate_us % 1000000) * 1000},
+        .it_value = {.tv_sec = dev->rate_us / 1000000, .tv_nsec = (dev->rate_us % 1000000) * 1000},
+    };
+    timerfd_settime(timer, 0, &period, NULL);
+    printf("%s up, report interval %u us, skipping %u%% of the intervals\n", DEVICE_NAME, dev->rate_us,
+           dev->skip_percent);
+
+    uint64_t end_ticks = seconds > 0 ? (uint64_t)(seconds * 1e6 / dev->rate_us) : UINT64_MAX;
+    while (!device_stop && dev->ticks < end_ticks)
+    {
+        struct pollfd fds[2] = {{.fd = dev->uhid, .events = POLLIN}, {.fd = timer, .events = POLLIN}};
+        if (poll(fds, 2, -1) < 0)
+        {
+            continue;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            device_uhid_event(dev);
+        }
+        uint64_t expirations = 0;
+        if ((fds[1].revents & POLLIN) && read(timer, &expirations, sizeof(expirations)) == sizeof(expirations))
+        {
+            for (uint64_t i = 0; i < expirations; i++)
+            {
+                dev->now_us += dev->rate_us;
+                device_tick(dev, i + 1 < expirations || device_skip(dev));
+            }
+        }
+    }
+
+    struct uhid_event destroy = {.type = UHID_DESTROY};
+    device_write(dev->uhid, &destroy);
+    close(timer);
+    close(dev->uhid);
+    return 0;
+}
+
+// Virtual clock into a capture file.
+static int device_run_capture(device_t *dev, const char *path, double seconds)
+{
+    dev->capture = fopen(path, "wb");
+    if (dev->capture == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    uint64_t end_ticks = (uint64_t)((seconds > 0 ? seconds : 10) * 1e6 / dev->rate_us);
+    while (dev->ticks < end_ticks)
+    {
+        dev->now_us += dev->rate_us;
+        device_tick(dev, device_skip(dev));
+    }
+    fclose(dev->capture);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-r report_rate_us] [-t seconds] [-m skip_percent] [-s seed] [-o capture.bin]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t rate_us = DEVICE_REPORT_RATE_US_DEFAULT;
+    uint32_t skip_percent = 0;
+    uint32_t seed = 0x4B4D;
+    double seconds = 0;
+    const char *capture_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:m:s:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rate_us = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'm':
+            skip_percent = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            seed = seed ? seed : 1;
+            break;
+        case 'o':
+            capture_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    // Mirrors SETTINGS_REPORT_RATE_US_MIN and SETTINGS_REPORT_RATE_US_MAX.
+    if (rate_us < 125 || rate_us > 8000 || skip_percent > 50)
+    {
+        fprintf(stderr, "needs 125 <= report_rate_us <= 8000 and skip_percent <= 50\n");
+        return 2;
+    }
+
+    device.rate_us = rate_us;
+    device.skip_percent = skip_percent;
+    device.rng = seed;
+    device.uhid = -1;
+    transport_mux_init(&device.mux, device_transports, 1);
+    device_next_move(&device);
+    signal(SIGINT, device_signal);
+    signal(SIGTERM, device_signal);
+
+    int result = capture_path != NULL ? device_run_capture(&device, capture_path, seconds)
+                                      : device_run_uhid(&device, seconds);
+    if (result != 0)
+    {
+        return result;
+    }
+    printf("%u intervals, %u reports sent, %u skipped, %u of them in a stroke\n", device.ticks,
+           device.counters.reports_sent, device.counters.frame_overruns, device.skipped);
+    return 0;
+}
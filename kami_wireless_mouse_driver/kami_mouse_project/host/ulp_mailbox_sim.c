@@ -0,0 +1,697 @@
+// Run the ULP button and wheel scanner and the main CPU handback on a virtual clock.
+//
+// Each round starts parked with the pins handed to the ULP. Clicks of the latched main buttons, bouncing clicks of
+// the debounced buttons, wheel turns and short glitches arrive at random times. The ULP side runs the same mailbox
+// code as the ULP program, once per scan period. Once it asks for a wake the main CPU runs after the wake latency,
+// and if the ULP software interrupt reached the power task it takes the pins back, replays the buffered changes through the same decoder and kernels as ulp_scan_stop, turns the edge
+// interrupts back on and syncs the live levels. Edges from then on go to the modelled ISRs and debounce task.
+// The wheel ISR steps on every edge here, the once per millisecond report of the wheel task is left out.
+//
+// Fails if a glitch wakes the main CPU, a wake does not reach the power task, a wake comes later than the input allows, a buffered change is timed more
+// than two scan periods early or late, or the reported presses, releases and wheel steps differ from the input.
+//
+//   ulp_mailbox_sim [-s seed] [-n rounds] [-w wake_us] [-v]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "header/input_pipeline.h"
+#include "header/ulp_mailbox.h"
+
+// Mirror ULP_SCAN_PERIOD_US in ulp_scan.h.
+#define SIM_PERIOD_US 1000
+// Mirror POWER_LIGHT_SLEEP_WAKE_US plus POWER_WAKE_DISPATCH_US in power.h.
+#define SIM_WAKE_US_DEFAULT 400
+// From the edge interrupts back on to the live level read in ulp_scan_stop.
+#define SIM_HANDBACK_US 50
+// Mirror STABLE_POLL_TIME_MS in eager_debounce_switch.h, the upper bound of the learned hold time.
+#define SIM_STABLE_US 10000
+// Debounce task period.
+#define SIM_POLL_US 1000
+// Idle time after the last input of a round before the power task parks again.
+#define SIM_IDLE_US 300000
+// Longest contact bounce of a click.
+#define SIM_BOUNCE_MAX_US 800
+#define SIM_EDGES_MAX (1 << 20)
+// Scan times kept for timing the buffered changes, far more than a mailbox holds.
+#define SIM_SCANS_MAX 4096
+#define SIM_WAKES_MAX 65536
+#define SIM_NEVER UINT32_MAX
+
+// The firmware pins, see ulp_scan.c.
+static const ulp_pins_t sim_pins = {
+    .latch_no = {4, 6},
+    .latch_nc = {5, 7},
+    .debounced = {10, 18, 19},
+    .wheel_a = 11,
+    .wheel_b = 12,
+};
+
+// Buttons in latch then debounced order, as the decoder indexes them.
+#define SIM_BUTTONS (ULP_LATCH_BUTTONS + ULP_DEBOUNCED_BUTTONS)
+static const char *sim_button_names[SIM_BUTTONS] = {"LMB", "RMB", "MMB", "SMB4", "SMB5"};
+
+typedef struct
+{
+    uint32_t time_us;
+    uint8_t pin;
+    uint8_t level;
+} sim_edge_t;
+
+typedef struct
+{
+    // Pins and the edges still to come, in time order.
+    uint32_t levels;
+    sim_edge_t *edges;
+    uint32_t edge_count;
+    uint32_t edge_next;
+    uint32_t seed;
+
+    // ULP side.
+    ulp_mailbox_t mailbox;
+    uint32_t mask;
+    bool ulp_running;
+    uint32_t next_scan;
+    // Raised by the ULP program, the main CPU clears both when it takes the pins back.
+    bool cpu_wake;
+    bool sw_intr;
+    uint32_t scan_us[SIM_SCANS_MAX];
+
+    // Main CPU side, the handback runs at handback_at and reads the live levels at live_at.
+    bool awake;
+    uint32_t handback_at;
+    uint32_t live_at;
+    uint32_t next_poll;
+    ulp_decoder_t decoder;
+
+    // Input modules, as the firmware keeps them.
+    mouse_button_state_t latch[ULP_LATCH_BUTTONS];
+    eager_debounce_t debounce[ULP_DEBOUNCED_BUTTONS];
+    int debounce_level[ULP_DEBOUNCED_BUTTONS];
+    bool debounce_pressed[ULP_DEBOUNCED_BUTTONS];
+    int wheel_a;
+    int wheel_b;
+
+    // What the host saw and what the input was.
+    bool reported_down[SIM_BUTTONS];
+    uint32_t downs[SIM_BUTTONS];
+    uint32_t clicks[SIM_BUTTONS];
+    int wheel_reported;
+    int wheel_expected;
+
+    // Round state.
+    uint32_t first_input_us;
+    uint32_t wake_by_us;
+    uint32_t wake_us[SIM_WAKES_MAX];
+    uint32_t wake_count;
+    uint32_t handovers;
+    uint32_t lost_wakes;
+    uint32_t replayed;
+    uint32_t glitches;
+    uint32_t overflows;
+    uint32_t stamp_error_max;
+    bool verbose;
+    bool failed;
+} sim_t;
+
+static uint32_t sim_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static uint32_t sim_range(sim_t *sim, uint32_t low, uint32_t high)
+{
+    return low + sim_random(&sim->seed) % (high - low + 1);
+}
+
+static int sim_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int sim_level(uint32_t levels, uint8_t pin)
+{
+    return (levels >> pin) & 1;
+}
+
+/************* Input ****************/
+
+static void sim_add_edge(sim_t *sim, uint32_t time_us, uint8_t pin, int level)
+{
+    if (sim->edge_count == SIM_EDGES_MAX)
+    {
+        fprintf(stderr, "edge buffer full\n");
+        exit(2);
+    }
+    sim->edges[sim->edge_count++] = (sim_edge_t){.time_us = time_us, .pin = pin, .level = level};
+}
+
+// A contact that settles on level after a few bounces. Returns the time it settled.
+static uint32_t sim_bounce(sim_t *sim, uint32_t time_us, uint8_t pin, int level)
+{
+    int bounces = sim_range(sim, 0, 2);
+    for (int i = 0; i < bounces; i++)
+    {
+        sim_add_edge(sim, time_us, pin, level);
+        time_us += sim_range(sim, 30, SIM_BOUNCE_MAX_US / 4);
+        sim_add_edge(sim, time_us, pin, !level);
+        time_us += sim_range(sim, 30, SIM_BOUNCE_MAX_US / 4);
+    }
+    sim_add_edge(sim, time_us, pin, level);
+    return time_us;
+}
+
+// Hold time of a click, some short enough to end while the main CPU wakes.
+static uint32_t sim_hold(sim_t *sim)
+{
+    return sim_range(sim, 0, 4) ? sim_range(sim, 20000, 150000) : sim_range(sim, 2000, 4000);
+}
+
+// A latched main button. NO rises before NC falls on a press and NC rises before NO falls on a release,
+// the latch only moves on the falling edge that completes the pair. NC may bounce as it closes.
+// Returns the end of the click, sets the latest time the ULP has to wake by.
+static uint32_t sim_latch_click(sim_t *sim, int index, uint32_t time_us, uint32_t *wake_by)
+{
+    uint8_t no = sim_pins.latch_no[index];
+    uint8_t nc = sim_pins.latch_nc[index];
+    sim_add_edge(sim, time_us, no, 1);
+    uint32_t settled = sim_bounce(sim, time_us + sim_range(sim, 100, 400), nc, 0);
+    *wake_by = settled + ULP_MAILBOX_CONFIRM_SCANS * SIM_PERIOD_US;
+    time_us = settled + sim_hold(sim);
+    sim_add_edge(sim, time_us, nc, 1);
+    time_us += sim_range(sim, 100, 400);
+    sim_add_edge(sim, time_us, no, 0);
+    sim->clicks[index]++;
+    return time_us;
+}
+
+// A debounced button, it bounces on both press and release.
+static uint32_t sim_debounced_click(sim_t *sim, int index, uint32_t time_us, uint32_t *wake_by)
+{
+    uint8_t pin = sim_pins.debounced[index];
+    uint32_t settled = sim_bounce(sim, time_us, pin, 1);
+    *wake_by = settled + ULP_MAILBOX_CONFIRM_SCANS * SIM_PERIOD_US;
+    time_us = sim_bounce(sim, settled + sim_hold(sim), pin, 0);
+    sim->clicks[ULP_LATCH_BUTTONS + index]++;
+    // The release is reported once the pin held for the stable time.
+    return time_us + SIM_STABLE_US;
+}
+
+// A wheel turn in one direction, each phase edge is a step. Edges are more than half a scan period apart,
+// so a scan sees at most both phases change. The first two are a full period apart, so the first step the
+// ULP buffered gives the direction for the scans that see both phases change.
+static uint32_t sim_wheel_turn(sim_t *sim, uint32_t time_us, uint32_t *wake_by, uint32_t *levels)
+{
+    int dir = sim_range(sim, 0, 1) ? QUADRATURE_STEP_UP : QUADRATURE_STEP_DOWN;
+    int edges = sim_range(sim, 2, 12);
+    for (int i = 0; i < edges; i++)
+    {
+        int a = sim_level(*levels, sim_pins.wheel_a);
+        int b = sim_level(*levels, sim_pins.wheel_b);
+        uint8_t pin = input_quadrature_step(true, !a, b) == dir ? sim_pins.wheel_a : sim_pins.wheel_b;
+        *levels ^= 1u << pin;
+        sim_add_edge(sim, time_us, pin, sim_level(*levels, pin));
+        sim->wheel_expected += dir;
+        if (i == 1)
+        {
+            *wake_by = time_us + SIM_PERIOD_US;
+        }
+        time_us += i == 0 ? sim_range(sim, SIM_PERIOD_US, 4000) : sim_range(sim, SIM_PERIOD_US * 6 / 10, 4000);
+    }
+    return time_us;
+}
+
+// A pulse on any pin shorter than a scan period, at most one scan sees it.
+static uint32_t sim_glitch(sim_t *sim, uint32_t time_us, uint32_t levels)
+{
+    uint32_t mask = sim->mask;
+    uint8_t pin;
+    do
+    {
+        pin = sim_range(sim, 0, 31);
+    } while (!(mask & 1u << pin));
+    int level = sim_level(levels, pin);
+    sim_add_edge(sim, time_us, pin, !level);
+    time_us += sim_range(sim, 20, SIM_PERIOD_US - 100);
+    sim_add_edge(sim, time_us, pin, level);
+    return time_us;
+}
+
+// Input of one round, glitches while parked and then the gestures. Returns the end of the round.
+static uint32_t sim_generate(sim_t *sim, uint32_t time_us)
+{
+    uint32_t levels = sim->levels;
+    int glitches = sim_range(sim, 0, 2);
+    for (int i = 0; i < glitches; i++)
+    {
+        // Gone for three scans before anything else, so the mailbox has dropped it.
+        time_us = sim_glitch(sim, time_us + sim_range(sim, 1000, 50000), levels) + 3 * SIM_PERIOD_US;
+    }
+
+    sim->first_input_us = SIM_NEVER;
+    sim->wake_by_us = SIM_NEVER;
+    int gestures = sim_range(sim, 0, 4) ? sim_range(sim, 1, 4) : 0;
+    for (int i = 0; i < gestures; i++)
+    {
+        time_us += sim_range(sim, i ? 20000 : 1000, 60000);
+        uint32_t wake_by = SIM_NEVER;
+        uint32_t start = time_us;
+        int kind = sim_range(sim, 0, SIM_BUTTONS);
+        if (kind < ULP_LATCH_BUTTONS)
+        {
+            time_us = sim_latch_click(sim, kind, time_us, &wake_by);
+        }
+        else if (kind < SIM_BUTTONS)
+        {
+            time_us = sim_debounced_click(sim, kind - ULP_LATCH_BUTTONS, time_us, &wake_by);
+        }
+        else
+        {
+            time_us = sim_wheel_turn(sim, time_us, &wake_by, &levels);
+        }
+        if (i == 0)
+        {
+            sim->first_input_us = start;
+            sim->wake_by_us = wake_by;
+        }
+    }
+    return time_us + SIM_IDLE_US;
+}
+
+/************* Main CPU ****************/
+
+static void sim_report(sim_t *sim, int button, bool down, uint32_t time_us)
+{
+    if (sim->reported_down[button] == down)
+    {
+        printf("FAIL at %u us: %s reported %s twice\n", time_us, sim_button_names[button], down ? "down" : "up");
+        sim->failed = true;
+    }
+    sim->reported_down[button] = down;
+    sim->downs[button] += down;
+    if (sim->verbose)
+    {
+        printf("%10.3f ms: %s %s\n", time_us / 1000.0, sim_button_names[button], down ? "down" : "up");
+    }
+}
+
+static void sim_latch_set(sim_t *sim, int index, mouse_button_state_t state, uint32_t time_us)
+{
+    if (state == sim->latch[index])
+    {
+        return;
+    }
+    sim->latch[index] = state;
+    sim_report(sim, index, state == MOUSE_BUTTON_DOWN, time_us);
+}
+
+// button_debounce_task_report for one button.
+static void sim_debounce_report(sim_t *sim, int index, uint32_t now_us)
+{
+    eager_debounce_t *debounce = &sim->debounce[index];
+    if (sim->debounce_pressed[index])
+    {
+        sim->debounce_pressed[index] = false;
+        sim_report(sim, ULP_LATCH_BUTTONS + index, true, now_us);
+    }
+    else if (input_eager_debounce_poll(debounce, now_us, SIM_STABLE_US))
+    {
+        sim_report(sim, ULP_LATCH_BUTTONS + index, false, now_us);
+    }
+}
+
+// button_feed for one button.
+static void sim_debounce_feed(sim_t *sim, int index, int level, uint32_t now_us)
+{
+    sim->debounce_level[index] = level;
+    if (input_eager_debounce_edge(&sim->debounce[index], level, now_us))
+    {
+        sim->debounce_pressed[index] = true;
+    }
+}
+
+// swheel_edge, stepping on every edge.
+static void sim_wheel_edge(sim_t *sim, bool a_pin, int level)
+{
+    int *state = a_pin ? &sim->wheel_a : &sim->wheel_b;
+    if (level == *state)
+    {
+        return;
+    }
+    *state = level;
+    sim->wheel_reported += input_quadrature_step(a_pin, sim->wheel_a, sim->wheel_b);
+}
+
+// The GPIO ISRs, only while the main CPU owns the pins.
+static void sim_isr(sim_t *sim, uint8_t pin, int level, uint32_t now_us)
+{
+    for (int i = 0; i < ULP_LATCH_BUTTONS; i++)
+    {
+        // The latch pins interrupt on the falling edge only.
+        if ((pin == sim_pins.latch_no[i] || pin == sim_pins.latch_nc[i]) && !level)
+        {
+            sim_latch_set(sim, i,
+                          input_latch_state(sim_level(sim->levels, sim_pins.latch_no[i]), sim_level(sim->levels, sim_pins.latch_nc[i]),
+                                            sim->latch[i]),
+                          now_us);
+        }
+    }
+    for (int i = 0; i < ULP_DEBOUNCED_BUTTONS; i++)
+    {
+        if (pin == sim_pins.debounced[i])
+        {
+            sim_debounce_feed(sim, i, level, now_us);
+        }
+    }
+    if (pin == sim_pins.wheel_a || pin == sim_pins.wheel_b)
+    {
+        sim_wheel_edge(sim, pin == sim_pins.wheel_a, level);
+    }
+}
+
+// ulp_scan_apply with the replay functions of the input modules.
+static void sim_apply(sim_t *sim, uint32_t pins, uint32_t time_us)
+{
+    ulp_input_t inputs[ULP_INPUTS_PER_EVENT];
+    int count = ulp_decoder_change(&sim->decoder, pins, time_us, inputs);
+    for (int i = 0; i < count; i++)
+    {
+        ulp_input_t *input = &inputs[i];
+        switch (input->kind)
+        {
+        case ULP_INPUT_LATCH:
+            sim_latch_set(sim, input->index, input->value, input->time_us);
+            break;
+        case ULP_INPUT_EDGE:
+            if (input->value != sim->debounce_level[input->index])
+            {
+                sim_debounce_report(sim, input->index, input->time_us);
+                sim_debounce_feed(sim, input->index, input->value, input->time_us);
+            }
+            break;
+        case ULP_INPUT_WHEEL:
+        {
+            int a = sim_level(pins, sim_pins.wheel_a);
+            int b = sim_level(pins, sim_pins.wheel_b);
+            if (a != sim->wheel_a || b != sim->wheel_b)
+            {
+                sim->wheel_reported += input->value;
+            }
+            sim->wheel_a = a;
+            sim->wheel_b = b;
+            break;
+        }
+        }
+    }
+}
+
+// Time of the last edge that made the change a scan saw.
+static uint32_t sim_change_us(sim_t *sim, uint32_t changed, uint32_t scan_us)
+{
+    for (uint32_t i = sim->edge_next; i-- > 0;)
+    {
+        if (sim->edges[i].time_us <= scan_us && (changed & 1u << sim->edges[i].pin))
+        {
+            return sim->edges[i].time_us;
+        }
+    }
+    return scan_us;
+}
+
+// ulp_scan_stop up to the live level read: replay the mailbox with the times of the scans.
+static void sim_handback(sim_t *sim, uint32_t now_us)
+{
+    ulp_mailbox_t *mailbox = &sim->mailbox;
+    sim->ulp_running = false;
+    sim->awake = true;
+    sim->cpu_wake = false;
+    sim->sw_intr = false;
+    ulp_decoder_init(&sim->decoder, &sim_pins, mailbox->rest, sim->latch);
+    uint32_t pins = mailbox->rest;
+    for (uint32_t i = 0; i < mailbox->count; i++)
+    {
+        const ulp_event_t *event = &mailbox->events[i];
+        uint32_t time_us = ulp_mailbox_event_us(mailbox, event, now_us, SIM_PERIOD_US);
+        if (!mailbox->overflows)
+        {
+            uint32_t error = time_us - sim_change_us(sim, event->pins ^ pins, sim->scan_us[event->scan % SIM_SCANS_MAX]);
+            if (error > sim->stamp_error_max)
+            {
+                sim->stamp_error_max = error;
+            }
+            if (error >= 2 * SIM_PERIOD_US)
+            {
+                printf("FAIL at %u us: change timed %d us off\n", now_us, (int)error);
+                sim->failed = true;
+            }
+        }
+        pins = event->pins;
+        sim_apply(sim, event->pins, time_us);
+    }
+    sim->replayed += mailbox->count;
+    sim->glitches += mailbox->glitches;
+    sim->overflows += mailbox->overflows;
+    sim->live_at = now_us + SIM_HANDBACK_US;
+    sim->next_poll = sim->live_at;
+}
+
+// Park for light sleep and hand the pins to the ULP at their levels now.
+static void sim_handover(sim_t *sim, uint32_t now_us)
+{
+    sim->awake = false;
+    sim->ulp_running = true;
+    sim->next_scan = now_us + SIM_PERIOD_US;
+    sim->handovers++;
+    uint32_t wheel_mask = 1u << sim_pins.wheel_a | 1u << sim_pins.wheel_b;
+    ulp_mailbox_arm(&sim->mailbox, sim->mask, wheel_mask, sim->levels);
+}
+
+static void sim_scan(sim_t *sim, uint32_t now_us)
+{
+    ulp_mailbox_t *mailbox = &sim->mailbox;
+    sim->scan_us[(mailbox->scans + 1) % SIM_SCANS_MAX] = now_us;
+    sim->next_scan = now_us + SIM_PERIOD_US;
+    // Mirror main in ulp/ulp_scan.c.
+    if (!ulp_mailbox_scan(mailbox, sim->levels))
+    {
+        return;
+    }
+    sim->sw_intr = true;
+    sim->cpu_wake = true;
+
+    if (sim->first_input_us == SIM_NEVER || now_us < sim->first_input_us)
+    {
+        printf("FAIL at %u us: woken by a glitch\n", now_us);
+        sim->failed = true;
+    }
+    else
+    {
+        if (now_us > sim->wake_by_us)
+        {
+            printf("FAIL at %u us: wake %u us late\n", now_us, now_us - sim->wake_by_us);
+            sim->failed = true;
+        }
+        if (sim->wake_count < SIM_WAKES_MAX)
+        {
+            sim->wake_us[sim->wake_count++] = now_us - sim->first_input_us;
+        }
+    }
+    if (sim->verbose)
+    {
+        printf("%10.3f ms: wake after %u scans\n", now_us / 1000.0, mailbox->scans);
+    }
+}
+
+/************* Clock ****************/
+
+static void sim_round(sim_t *sim, uint32_t now_us, uint32_t end_us, uint32_t wake_latency_us)
+{
+    sim->handback_at = SIM_NEVER;
+    sim->live_at = SIM_NEVER;
+    while (1)
+    {
+        uint32_t edge_at = sim->edge_next < sim->edge_count ? sim->edges[sim->edge_next].time_us : SIM_NEVER;
+        uint32_t scan_at = sim->ulp_running ? sim->next_scan : SIM_NEVER;
+        uint32_t poll_at = sim->awake && sim->live_at == SIM_NEVER ? sim->next_poll : SIM_NEVER;
+        uint32_t next = edge_at;
+        next = scan_at < next ? scan_at : next;
+        next = sim->handback_at < next ? sim->handback_at : next;
+        next = sim->live_at < next ? sim->live_at : next;
+        next = poll_at < next ? poll_at : next;
+        if (next >= end_us)
+        {
+            break;
+        }
+        now_us = next;
+
+        if (edge_at == now_us)
+        {
+            sim_edge_t *edge = &sim->edges[sim->edge_next++];
+            sim->levels = (sim->levels & ~(1u << edge->pin)) | (uint32_t)edge->level << edge->pin;
+            if (sim->awake)
+            {
+                sim_isr(sim, edge->pin, edge->level, now_us);
+            }
+        }
+        else if (scan_at == now_us)
+        {
+            sim_scan(sim, now_us);
+            if (sim->cpu_wake && sim->handback_at == SIM_NEVER && !sim->awake)
+            {
+                sim->handback_at = now_us + wake_latency_us;
+            }
+        }
+        else if (sim->handback_at == now_us)
+        {
+            sim->handback_at = SIM_NEVER;
+            sim->cpu_wake = false;
+            if (!sim->sw_intr)
+            {
+                // ulp_scan_isr never runs, the power task stays blocked and the CPU goes back to sleep.
+                // The mailbox stays woken, so the ULP never wakes the CPU again.
+                printf("FAIL at %u us: ULP wake did not reach the power task\n", now_us);
+                sim->failed = true;
+                sim->lost_wakes++;
+                continue;
+            }
+            // ulp_scan_isr, power_wake_from_isr and the power task releasing the input tasks.
+            sim_handback(sim, now_us);
+        }
+        else if (sim->live_at == now_us)
+        {
+            sim->live_at = SIM_NEVER;
+            sim_apply(sim, sim->levels, now_us);
+        }
+        else
+        {
+            for (int i = 0; i < ULP_DEBOUNCED_BUTTONS; i++)
+            {
+                sim_debounce_report(sim, i, now_us);
+            }
+            sim->next_poll = now_us + SIM_POLL_US;
+        }
+    }
+
+    if (sim->first_input_us != SIM_NEVER && !sim->awake)
+    {
+        printf("FAIL at %u us: input and no wake\n", end_us);
+        sim->failed = true;
+    }
+    // Idle long enough, the power task parks again. Without a wake the ULP just keeps scanning.
+    if (sim->awake)
+    {
+        sim_handover(sim, end_us);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n rounds] [-w wake_us] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 1;
+    int rounds = 1000;
+    uint32_t wake_latency_us = SIM_WAKE_US_DEFAULT;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:w:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'w':
+            wake_latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    // Rounds last about a second, the virtual clock has to stay clear of the wrap.
+    if (rounds < 1 || rounds > 2000 || wake_latency_us > 20000)
+    {
+        fprintf(stderr, "needs 1 <= rounds <= 2000 and wake_us <= 20000\n");
+        return 2;
+    }
+
+    static sim_t sim;
+    sim.seed = seed ? seed : 1;
+    sim.verbose = verbose;
+    sim.edges = malloc(SIM_EDGES_MAX * sizeof(sim_edge_t));
+    if (sim.edges == NULL)
+    {
+        return 2;
+    }
+    sim.mask = ulp_mailbox_mask(&sim_pins);
+    // At rest NO is low and NC high, the debounced buttons and the wheel phases low.
+    for (int i = 0; i < ULP_LATCH_BUTTONS; i++)
+    {
+        sim.levels |= 1u << sim_pins.latch_nc[i];
+        sim.latch[i] = MOUSE_BUTTON_UP;
+    }
+
+    uint32_t now_us = 0;
+    sim_handover(&sim, now_us);
+    for (int round = 0; round < rounds; round++)
+    {
+        uint32_t end_us = sim_generate(&sim, now_us);
+        sim_round(&sim, now_us, end_us, wake_latency_us);
+        now_us = end_us;
+    }
+
+    uint32_t presses = 0;
+    for (int i = 0; i < SIM_BUTTONS; i++)
+    {
+        presses += sim.clicks[i];
+        if (sim.downs[i] != sim.clicks[i] || sim.reported_down[i])
+        {
+            printf("FAIL: %s clicked %u times, reported %u presses and ends %s\n", sim_button_names[i], sim.clicks[i],
+                   sim.downs[i], sim.reported_down[i] ? "down" : "up");
+            sim.failed = true;
+        }
+    }
+    if (sim.wheel_reported != sim.wheel_expected)
+    {
+        printf("FAIL: wheel turned %d steps, reported %d\n", sim.wheel_expected, sim.wheel_reported);
+        sim.failed = true;
+    }
+
+    if (sim.ulp_running)
+    {
+        sim.glitches += sim.mailbox.glitches;
+        sim.overflows += sim.mailbox.overflows;
+    }
+    printf("%d rounds, %.1f s simulated, %u clicks, %d wheel steps net\n", rounds, now_us / 1e6, presses, sim.wheel_expected);
+    printf("handovers %u, wakes %u, lost %u, changes replayed %u, glitches dropped %u, overflows %u\n", sim.handovers,
+           sim.wake_count, sim.lost_wakes, sim.replayed, sim.glitches, sim.overflows);
+    if (sim.wake_count)
+    {
+        qsort(sim.wake_us, sim.wake_count, sizeof(sim.wake_us[0]), sim_compare);
+        printf("input to wake: p50 %u us, p99 %u us, max %u us (scan period %u us, wake %u us)\n",
+               sim.wake_us[sim.wake_count / 2], sim.wake_us[sim.wake_count * 99 / 100], sim.wake_us[sim.wake_count - 1],
+               SIM_PERIOD_US, wake_latency_us);
+    }
+    printf("buffered change timing error max %u us\n", sim.stamp_error_max);
+    free(sim.edges);
+    return sim.failed ? 1 : 0;
+}
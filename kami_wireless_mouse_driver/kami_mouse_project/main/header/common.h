@@ -6,6 +6,36 @@
 #include "driver/gpio.h"
 #include "esp_timer.h"
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_intr_alloc.h"
+
+// The input hot path runs from IRAM and its interrupts stay enabled during flash writes, see hot_path.h.
+// HOT_PATH_IN_FLASH=1 leaves it in flash, only for the latency benchmark.
+#if HOT_PATH_IN_FLASH
+#define HOT_PATH
+#define HOT_PATH_DATA
+#define HOT_PATH_ISR_FLAGS 0
+#else
+#define HOT_PATH IRAM_ATTR
+#define HOT_PATH_DATA DRAM_ATTR
+#define HOT_PATH_ISR_FLAGS ESP_INTR_FLAG_IRAM
+#endif
+#include "header/hot_path.h"
+
+// The pipeline variants are picked in menuconfig, see main/Kconfig.projbuild.
+// Each module maps its choice to a constant at compile time, only the chosen variant is built.
+#if CONFIG_KAMI_REPORT_16BIT
+#define TRANSPORT_MOTION_16BIT 1
+#endif
+
+// Console logging on the input path, compiled out unless CONFIG_KAMI_LOG_HOT_PATH is set.
+#if CONFIG_KAMI_LOG_HOT_PATH
+#define HOT_PATH_LOGI(...) ESP_LOGI(__VA_ARGS__)
+#define HOT_PATH_LOG_BUFFER_HEX(...) ESP_LOG_BUFFER_HEX(__VA_ARGS__)
+#else
+#define HOT_PATH_LOGI(...)
+#define HOT_PATH_LOG_BUFFER_HEX(...)
+#endif
 
 static const char *TAG = "KamiKomplexMouse";
 
@@ -21,8 +51,9 @@ typedef unsigned long uint32_t;
 #define max(a,b) (((a) > (b)) ? (a) : (b))
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 
-// Function to convert US to ticks
-#define pdUS_TO_TICKS(xTimeInUs) ((TickType_t)((TickType_t)(pdMS_TO_TICKS(1) * 1000) * xTimeInUs))
+// Function to convert US to ticks, rounded down.
+// A tick is 1 ms, shorter waits are spun with esp_rom_delay_us.
+#define pdUS_TO_TICKS(xTimeInUs) ((TickType_t)(((uint64_t)(xTimeInUs) * configTICK_RATE_HZ) / 1000000))
 
-// Function to convert NS to ticks
-#define pdNS_TO_TICKS(xTimeInNs) ((TickType_t)((TickType_t)(pdMS_TO_TICKS(1) * 1000000) * xTimeInNs))
\ No newline at end of file
+// Function to convert NS to US, rounded up for esp_rom_delay_us.
+#define NS_TO_US_CEIL(xTimeInNs) (((xTimeInNs) + 999) / 1000)
\ No newline at end of file
@@ -4,13 +4,54 @@
 
 #include "header/switch.h"
 #include "header/common.h"
+#include "header/input_pipeline.h"
 
 // This needs to be sufficiently long to debounce the buttons and for the report to be sent.
 // But it also needs to be short enough to not cause the mouse to lag.
 // These butttons are not high preformance, so 10ms should be sufficient.
+// The release hold time of each button is learned from its bounce between these two bounds (settings.debounce_min_ms
+// and settings.debounce_ms). A new button starts at the upper bound, a worn one that chatters moves back towards it.
 #define STABLE_POLL_TIME_MS 10
+// A healthy switch settles well within a millisecond, the debounce task polls once per millisecond.
+#define STABLE_POLL_TIME_MIN_MS 2
+
+// MMB, SMB4 and SMB5.
+#define DEBOUNCED_BUTTON_COUNT 3
+
+// Debounce strategy, picked with CONFIG_KAMI_DEBOUNCE_*. Eager reports a press on its first edge,
+// deferred waits until the pin is stable for both presses and releases.
+#if CONFIG_KAMI_DEBOUNCE_DEFERRED
+#define BUTTON_DEBOUNCE_DEFERRED 1
+typedef deferred_debounce_t button_debounce_t;
+#else
+#define BUTTON_DEBOUNCE_DEFERRED 0
+typedef eager_debounce_t button_debounce_t;
+#endif
+
+// A single pin button and its debouncer, shared by its ISR and button_debounce_task.
+typedef struct
+{
+	gpio_num_t pin;
+	input_button_t button;	// Physical button, the button map picks what it does.
+	const char *name;
+	button_debounce_t debounce;
+	int level;			// Pin level at the last edge.
+	bool pressed;		// Eager press not reported yet.
+	uint32_t event_us;	// Time of the edge behind the last state change, for the latency histogram.
+	debounce_tuner_t tune;
+	uint32_t chatter_logged;
+} debounced_button_t;
+
+// Wear statistics of the debounced buttons in MMB, SMB4, SMB5 order.
+// The layout is part of the vendor protocol.
+typedef struct
+{
+	switch_wear_t switches[DEBOUNCED_BUTTON_COUNT];
+} switch_wear_stats_t;
 
 // Pre declarations
 // Non static functions visible outside file
 void button_debounce_init(void);
-void button_debounce_task(void *arg);
\ No newline at end of file
+void button_debounce_task(void *arg);
+void button_debounce_wear_snapshot(switch_wear_stats_t *stats);
+void button_debounce_replay(int index, int level, uint32_t event_us);
\ No newline at end of file
@@ -0,0 +1,85 @@
+/**************** Energy Model ****************/
+
+#pragma once
+
+// The energy model is plain C with no ESP-IDF dependencies. The firmware fills the counts from its telemetry
+// counters, the host energy replay fills them from a recorded trace, and both estimate with the same cost table.
+// The estimate is the residency in each state times its current, plus the events times their charge.
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "header/power_policy.h"
+#include "header/telemetry_format.h"
+
+// Bounds of a cost table sent by the host, well above anything the board draws.
+#define ENERGY_CURRENT_UA_MAX 1000000
+#define ENERGY_CHARGE_NC_MAX 1000000
+#define ENERGY_BATTERY_MAH_MAX 10000
+
+// States the sensor residency is kept for. The tracking modes are in the order of MouseMode,
+// the rest modes in the order of sensor_rest_state_t.
+typedef enum
+{
+	ENERGY_SENSOR_HPM,
+	ENERGY_SENSOR_LPM,
+	ENERGY_SENSOR_WRK,
+	ENERGY_SENSOR_CRD,
+	ENERGY_SENSOR_REST1,
+	ENERGY_SENSOR_REST2,
+	ENERGY_SENSOR_REST3,
+	ENERGY_SENSOR_PARKED,	// Time no frame was read, the sensor rests or is shut down on its own.
+	ENERGY_SENSOR_COUNT,
+} energy_sensor_t;
+
+// What the device did over some time. Residency in milliseconds.
+typedef struct
+{
+	uint32_t elapsed_ms;
+	uint32_t cpu_ms[POWER_LEVEL_COUNT];
+	uint32_t sensor_ms[ENERGY_SENSOR_COUNT];
+	uint32_t spi_transactions;
+	uint32_t task_wakeups;
+	uint32_t radio_packets;
+} energy_counts_t;
+
+// Current of each state in microamps and charge of each event in nanocoulombs, on top of the state it happens in.
+// The layout is part of the vendor protocol and of the settings blob.
+typedef struct
+{
+	uint32_t cpu_ua[POWER_LEVEL_COUNT];
+	uint32_t sensor_ua[ENERGY_SENSOR_COUNT];
+	uint32_t spi_transaction_nc;
+	uint32_t task_wakeup_nc;
+	uint32_t radio_packet_nc;
+	uint32_t battery_mah;
+} energy_costs_t;
+
+// Charge drawn by each part in microamp hours, the total is summed before rounding.
+typedef struct
+{
+	uint32_t cpu_uah;
+	uint32_t sensor_uah;
+	uint32_t spi_uah;
+	uint32_t wakeup_uah;
+	uint32_t radio_uah;
+	uint32_t total_uah;
+	// Average current over the elapsed time, and the battery life at that current. Both 0 without elapsed time.
+	uint32_t average_ua;
+	uint32_t battery_life_min;
+} energy_estimate_t;
+
+// Energy block of the vendor protocol.
+typedef struct
+{
+	energy_counts_t counts;
+	energy_costs_t costs;
+	energy_estimate_t estimate;
+} energy_report_t;
+
+extern const energy_costs_t energy_costs_default;
+
+// Pre declarations
+// Non static functions visible outside file
+bool energy_costs_valid(const energy_costs_t *costs);
+void energy_counts_from_telemetry(energy_counts_t *counts, const telemetry_counters_t *counters);
+void energy_estimate(energy_estimate_t *estimate, const energy_counts_t *counts, const energy_costs_t *costs);
@@ -0,0 +1,51 @@
+/**************** Frame Capture ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/frame_format.h"
+
+// The capture interface is a second HID interface next to the mouse, hidraw opens it without a driver.
+// Its interrupt endpoint moves one packet per 1 ms USB frame.
+#define FRAME_CAPTURE_HID_INSTANCE 1
+#define FRAME_CAPTURE_EP_IN_ADDR (0x82)
+#define FRAME_CAPTURE_EP_IN_SIZE FRAME_PACKET_SIZE
+#define FRAME_CAPTURE_EP_IN_INTERVAL (1)
+
+// Frame buffers, the SPI DMA fills one while the other goes out over USB.
+#define FRAME_CAPTURE_BUFFERS 2
+// Header and pixels, rounded up to whole words for the DMA.
+#define FRAME_CAPTURE_BUFFER_SIZE ((FRAME_SIZE + 3) & ~3)
+// The sensor task looks for a stop at this interval while both buffers are out.
+#define FRAME_CAPTURE_CLAIM_MS 100
+// Capture stops when the host takes no packet for this long, e.g. the receiver was killed.
+#define FRAME_CAPTURE_HOST_TIMEOUT_MS 1000
+// Interval of the throughput log line while capturing.
+#define FRAME_CAPTURE_LOG_MS 1000
+
+// Report descriptor of the capture interface, 64 byte input packets and a 1 byte command output report.
+#define TUD_HID_REPORT_DESC_FRAME_CAPTURE()                 \
+    HID_USAGE_PAGE_N(HID_USAGE_PAGE_VENDOR, 2),             \
+    HID_USAGE(0x03),                                        \
+    HID_COLLECTION(HID_COLLECTION_APPLICATION),             \
+    HID_USAGE(0x04),                                        \
+    HID_LOGICAL_MIN(0x00),                                  \
+    HID_LOGICAL_MAX_N(0xff, 2),                             \
+    HID_REPORT_SIZE(8),                                     \
+    HID_REPORT_COUNT(FRAME_PACKET_SIZE),                    \
+    HID_INPUT(HID_DATA | HID_ARRAY | HID_ABSOLUTE),         \
+    HID_USAGE(0x05),                                        \
+    HID_REPORT_COUNT(1),                                    \
+    HID_OUTPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE),     \
+    HID_COLLECTION_END
+
+// Pre declarations
+// Non static functions visible outside file
+void frame_capture_init(void);
+void frame_capture_command(const uint8_t *buffer, uint16_t bufsize);
+bool frame_capture_active(void);
+uint8_t *frame_capture_claim(void);
+void frame_capture_release(void);
+void frame_capture_submit(uint32_t timestamp_us, uint32_t grab_us);
+void frame_capture_notify(void);
+void frame_capture_task(void *arg);
@@ -0,0 +1,49 @@
+/**************** Frame Capture Format ****************/
+
+#pragma once
+
+// The frame format is shared with the host receiver, so it must not depend on ESP-IDF.
+#include <stdint.h>
+
+#include "header/sensor_registers.h"
+
+/*
+Raw sensor frames stream over the capture HID interface as 64 byte input reports without a report ID.
+All fields are little endian.
+
+Packet layout:
+BYTE[0] = Frame sequence, low byte
+BYTE[1] = Chunk index within the frame
+BYTE[2..63] = Chunk data
+
+A frame is a frame_header_t followed by the pixels row by row, cut into FRAME_CHUNK_SIZE chunks.
+The last chunk is padded with zeros. A frame with a missing chunk is lost, the next one starts at chunk 0.
+
+The host starts and stops capture with a 1 byte output report holding a frame_command_t.
+*/
+
+#define FRAME_MAGIC 0x4D52464B // "KFRM"
+
+#define FRAME_PACKET_SIZE 64
+#define FRAME_PACKET_HEADER_SIZE 2
+#define FRAME_CHUNK_SIZE (FRAME_PACKET_SIZE - FRAME_PACKET_HEADER_SIZE)
+
+typedef enum
+{
+	FRAME_COMMAND_STOP = 0,
+	FRAME_COMMAND_START = 1,
+} frame_command_t;
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint32_t sequence;		// Frames grabbed since capture started.
+	uint32_t timestamp_us;	// Start of the grab.
+	uint16_t grab_us;		// From arming the grab to the last pixel.
+	uint8_t width;
+	uint8_t height;
+	uint32_t stalls;		// Grabs so far that waited for USB to free a buffer.
+} frame_header_t;
+
+#define FRAME_SIZE (sizeof(frame_header_t) + SENSOR_RAW_FRAME_PIXELS)
+#define FRAME_CHUNKS ((FRAME_SIZE + FRAME_CHUNK_SIZE - 1) / FRAME_CHUNK_SIZE)
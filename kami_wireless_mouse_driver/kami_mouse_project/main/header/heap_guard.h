@@ -0,0 +1,27 @@
+/**************** Heap Guard ****************/
+
+#pragma once
+
+#include "header/common.h"
+
+// Debug builds only, picked with CONFIG_KAMI_HEAP_GUARD. Without it heap_guard_watch compiles to nothing.
+#if CONFIG_KAMI_HEAP_GUARD
+#define HEAP_GUARD_ENABLED 1
+#else
+#define HEAP_GUARD_ENABLED 0
+#endif
+
+// Input tasks the guard can watch.
+#define HEAP_GUARD_TASKS_MAX 8
+
+// Pre declarations
+// Non static functions visible outside file
+#if HEAP_GUARD_ENABLED
+void heap_guard_watch(void);
+void heap_guard_pause(void);
+void heap_guard_resume(void);
+#else
+#define heap_guard_watch() ((void)0)
+#define heap_guard_pause() ((void)0)
+#define heap_guard_resume() ((void)0)
+#endif
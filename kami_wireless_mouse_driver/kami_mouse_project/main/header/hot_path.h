@@ -0,0 +1,16 @@
+/**************** Hot Path ****************/
+
+#pragma once
+
+// Code on the input path, from a pin edge or a sensor burst to the report handed to a transport.
+// The firmware defines HOT_PATH as IRAM_ATTR in common.h, so neither a cache miss nor a flash write
+// (NVS, OTA) can stall it. The portable kernels use the same markers and compile to plain code on the host.
+// check_hot_path.py fails the firmware build if anything reachable from an input ISR is left in flash.
+#ifndef HOT_PATH
+#define HOT_PATH
+#endif
+
+// Constant data read on the hot path, DRAM_ATTR in the firmware.
+#ifndef HOT_PATH_DATA
+#define HOT_PATH_DATA
+#endif
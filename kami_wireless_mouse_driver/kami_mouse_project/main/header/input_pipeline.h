@@ -0,0 +1,226 @@
+/**************** Input Pipeline ****************/
+
+#pragma once
+
+// The pipeline kernels are plain C with no ESP-IDF dependencies.
+// They are shared by the firmware and the host tools (trace replay, benchmarks),
+// so anything hardware specific must stay in the switch, wheel and sensor sources.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "header/hot_path.h"
+#include "header/switch.h"
+
+// The PAW3395 motion burst is 12 bytes long.
+#define SENSOR_MOTION_BURST_SIZE 12
+
+// Byte offsets into the motion burst (5.7.1 Motion Read).
+#define SENSOR_BURST_MOTION 0
+#define SENSOR_BURST_OBSERVATION 1
+#define SENSOR_BURST_DELTA_X_L 2
+#define SENSOR_BURST_DELTA_X_H 3
+#define SENSOR_BURST_DELTA_Y_L 4
+#define SENSOR_BURST_DELTA_Y_H 5
+#define SENSOR_BURST_SQUAL 6
+#define SENSOR_BURST_SHUTTER_UPPER 10
+#define SENSOR_BURST_SHUTTER_LOWER 11
+
+// Motion register bit that flags new deltas.
+#define SENSOR_MOTION_BIT 0x80
+// Motion register bits [2:1] hold the operation mode, run or one of the rest modes (sensor_rest_state_t).
+#define SENSOR_MOTION_OP_MODE_MASK 0x06
+#define SENSOR_MOTION_OP_MODE_SHIFT 1
+
+// Decoded motion burst.
+typedef struct
+{
+	uint8_t motion;
+	uint8_t op_mode;
+	uint8_t squal;
+	int16_t delta_x;
+	int16_t delta_y;
+} motion_burst_t;
+
+// Motion samples waiting for the transport, 2 bursts worth.
+#define MOTION_RING_SIZE 24
+
+typedef struct
+{
+	int16_t motion_x;
+	int16_t motion_y;
+	uint32_t timestamp;
+} motion_sample_t;
+
+// Ring of motion samples, one slot is kept free to tell full from empty.
+// When full the oldest sample is folded into the next one, so no motion is lost, only its timing.
+typedef struct
+{
+	motion_sample_t samples[MOTION_RING_SIZE];
+	int write_index;
+	int read_index;
+} motion_ring_t;
+
+// Scroll wheel step reported by the quadrature decoder.
+#define QUADRATURE_STEP_UP 1
+#define QUADRATURE_STEP_DOWN -1
+
+// State of a single eager debounced button.
+// Presses are accepted on the first edge, releases only once the pin has stayed released for the stable time.
+typedef struct
+{
+	mouse_button_state_t state;
+	bool release_pending;
+	uint32_t release_start_us;
+} eager_debounce_t;
+
+// State of a single deferred debounced button.
+// Presses and releases are both accepted once the pin has stayed at its new level for the stable time.
+typedef struct
+{
+	mouse_button_state_t state;
+	bool pending;
+	int level;
+	uint32_t edge_us;
+} deferred_debounce_t;
+
+// Release hold time learned per switch, twice the bounce peak plus a margin, within the configured bounds.
+#define DEBOUNCE_TUNE_MARGIN_US 500
+// Transitions measured before the hold leaves the upper bound.
+#define DEBOUNCE_TUNE_WARMUP 8
+// The bounce peak loses 1/16 per transition, so one long bounce is forgotten after about a hundred clean ones.
+#define DEBOUNCE_TUNE_DECAY_SHIFT 4
+
+// Bounce profile of a debounced switch and the hold time learned from it.
+// The layout is part of the vendor protocol, only append new fields.
+typedef struct
+{
+	uint32_t transitions;		// Presses and releases measured.
+	uint32_t glitches;			// Edges after the first one of a transition.
+	uint32_t chatter;			// Edges right after an accepted release, the hold was too short.
+	uint32_t bounce_last_us;	// First to last edge of the last transition.
+	uint32_t bounce_max_us;
+	uint32_t bounce_peak_us;	// Decaying peak the hold is learned from.
+	uint32_t hold_us;			// Release hold time in use.
+} switch_wear_t;
+
+// Learning state of a debounced switch. A transition is open from its first edge until the pin stayed quiet
+// for the upper bound, every edge in between is bounce.
+typedef struct
+{
+	switch_wear_t wear;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint32_t start_us;
+	uint32_t last_edge_us;
+	uint32_t edges;
+	bool open;
+	bool released;				// The debouncer accepted a release in the open transition.
+} debounce_tuner_t;
+
+// Physical buttons, the index into a button map.
+typedef enum
+{
+	INPUT_BUTTON_LEFT,
+	INPUT_BUTTON_RIGHT,
+	INPUT_BUTTON_MIDDLE,
+	INPUT_BUTTON_BACK,		// SMB4
+	INPUT_BUTTON_FORWARD,	// SMB5
+	INPUT_BUTTON_COUNT,
+} input_button_t;
+
+// Button bits of the HID mouse report.
+#define INPUT_HID_BUTTON_LEFT 0x01
+#define INPUT_HID_BUTTON_RIGHT 0x02
+#define INPUT_HID_BUTTON_MIDDLE 0x04
+#define INPUT_HID_BUTTON_BACK 0x08
+#define INPUT_HID_BUTTON_FORWARD 0x10
+#define INPUT_HID_BUTTONS 0x1F
+
+// Action of a physical button in a button map: the HID buttons it holds, 0 to disable it,
+// or INPUT_REMAP_MACRO with a macro index to play that macro on every press.
+#define INPUT_REMAP_MACRO 0x80
+#define INPUT_REMAP_NONE 0xFF
+#define INPUT_REMAP_DEFAULT \
+	{INPUT_HID_BUTTON_LEFT, INPUT_HID_BUTTON_RIGHT, INPUT_HID_BUTTON_MIDDLE, INPUT_HID_BUTTON_BACK, INPUT_HID_BUTTON_FORWARD}
+
+// Button map compiled into lookup tables, the HID buttons of every set of held physical buttons.
+// Two buttons mapped to the same HID button hold it until both are released.
+typedef struct
+{
+	uint8_t buttons[1 << INPUT_BUTTON_COUNT];
+	uint8_t macros[INPUT_BUTTON_COUNT];	// Macro played on a press, INPUT_REMAP_NONE for none.
+	uint8_t held;						// Physical buttons held, bit per input_button_t.
+} input_remap_t;
+
+// Macro table, every macro needs an INPUT_MACRO_END step within its INPUT_MACRO_STEPS and ends there.
+#define INPUT_MACRO_COUNT 4
+#define INPUT_MACRO_STEPS 16
+// Longest wait before a step.
+#define INPUT_MACRO_DELAY_MAX_US 10000000
+
+typedef enum
+{
+	INPUT_MACRO_END,
+	INPUT_MACRO_PRESS,		// Hold buttons.
+	INPUT_MACRO_RELEASE,	// Let go of buttons.
+	INPUT_MACRO_MOVE,		// Relative motion, x and y.
+	INPUT_MACRO_WHEEL,		// Wheel and pan steps.
+	INPUT_MACRO_OP_COUNT,
+} input_macro_op_t;
+
+// One macro step. The layout is part of the vendor protocol.
+typedef struct
+{
+	uint32_t delay_us;	// Wait after the previous step, or after the press for the first one.
+	uint8_t op;
+	uint8_t buttons;
+	int8_t wheel;
+	int8_t pan;
+	int16_t x;
+	int16_t y;
+} input_macro_step_t;
+
+typedef struct
+{
+	input_macro_step_t steps[INPUT_MACRO_STEPS];
+} input_macro_t;
+
+typedef struct
+{
+	input_macro_t macros[INPUT_MACRO_COUNT];
+} input_macro_table_t;
+
+// Macro being played. Steps are due at the press time plus the delays before them, so a late step does not
+// push back the ones after it.
+typedef struct
+{
+	const input_macro_t *macro;	// NULL while idle.
+	uint8_t next;
+	uint8_t buttons;			// HID buttons the macro holds.
+	uint32_t due_us;			// Schedule of the next step.
+} input_macro_player_t;
+
+// Pre declarations
+// Non static functions visible outside file
+bool input_decode_motion_burst(const uint8_t *response, motion_burst_t *burst);
+bool input_motion_burst_plausible(const uint8_t *response);
+bool input_motion_ring_push(motion_ring_t *ring, int16_t motion_x, int16_t motion_y, uint32_t timestamp);
+bool input_motion_ring_pop(motion_ring_t *ring, motion_sample_t *sample);
+void input_motion_ring_clear(motion_ring_t *ring);
+mouse_button_state_t input_latch_state(int no_level, int nc_level, mouse_button_state_t current_state);
+int input_quadrature_step(bool a_changed, int a_level, int b_level);
+bool input_eager_debounce_edge(eager_debounce_t *debounce, int level, uint32_t now_us);
+bool input_eager_debounce_poll(eager_debounce_t *debounce, uint32_t now_us, uint32_t stable_us);
+void input_deferred_debounce_edge(deferred_debounce_t *debounce, int level, uint32_t now_us);
+bool input_deferred_debounce_poll(deferred_debounce_t *debounce, uint32_t now_us, uint32_t stable_us);
+void input_debounce_tune_init(debounce_tuner_t *tuner, uint32_t min_us, uint32_t max_us);
+void input_debounce_tune_edge(debounce_tuner_t *tuner, uint32_t now_us);
+void input_debounce_tune_release(debounce_tuner_t *tuner);
+uint32_t input_debounce_tune_poll(debounce_tuner_t *tuner, uint32_t now_us, uint32_t min_us, uint32_t max_us);
+bool input_remap_valid(const uint8_t *map);
+void input_remap_build(input_remap_t *remap, const uint8_t *map);
+uint8_t input_remap_button(input_remap_t *remap, input_button_t button, bool pressed);
+bool input_macro_valid(const input_macro_t *macro);
+void input_macro_start(input_macro_player_t *player, const input_macro_t *macro, uint32_t now_us);
+const input_macro_step_t *input_macro_step(input_macro_player_t *player, uint32_t now_us, uint32_t *due_us);
\ No newline at end of file
@@ -16,4 +16,6 @@ typedef enum
 // Pre declarations
 // Non static functions visible outside file
 void mb_latch_init(void);
-void mb_latch_task(void *arg);
\ No newline at end of file
+void mb_latch_task(void *arg);
+mouse_button_state_t mb_latch_state(int index);
+void mb_latch_replay(int index, mouse_button_state_t state, uint32_t event_us);
\ No newline at end of file
@@ -0,0 +1,45 @@
+/**************** Latency Benchmark ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "driver/ledc.h"
+#include "hal/gpio_ll.h"
+#include "nvs.h"
+
+// Built in with idf.py -DLATENCY_BENCH=1 build, the normal firmware leaves the task out.
+// Build it once more with -DHOT_PATH_IN_FLASH=1 for the comparison without IRAM placement.
+#ifndef LATENCY_BENCH
+#define LATENCY_BENCH 0
+#endif
+
+// Free pin driven by LEDC and read back as an input, so the edges keep coming while a flash write
+// stalls both cores. No wiring needed.
+#define LATENCY_BENCH_PIN GPIO_NUM_21
+// One rising edge every 20 ms. An ISR more than half a period late is counted to the next edge.
+#define LATENCY_BENCH_PERIOD_US 20000
+#define LATENCY_BENCH_FREQ_HZ (1000000 / LATENCY_BENCH_PERIOD_US)
+#define LATENCY_BENCH_DUTY_BITS LEDC_TIMER_14_BIT
+// Edges per phase, 10 s each.
+#define LATENCY_BENCH_EDGES 500
+// Time for the boot to settle before the first phase.
+#define LATENCY_BENCH_START_DELAY_MS 3000
+// Blob rewritten in NVS during the second phase. Every commit programs flash, now and then a sector is erased.
+#define LATENCY_BENCH_NVS_NAMESPACE "bench"
+#define LATENCY_BENCH_NVS_KEY "blob"
+#define LATENCY_BENCH_BLOB_SIZE 1024
+
+// One phase, latencies are from the edge to the ISR entry and relative to the fastest edge of the phase.
+typedef struct
+{
+	uint32_t edges;
+	uint32_t missed;
+	uint32_t flash_writes;
+	uint32_t p50_us;
+	uint32_t p99_us;
+	uint32_t max_us;
+} latency_bench_result_t;
+
+// Pre declarations
+// Non static functions visible outside file
+void latency_bench_task(void *arg);
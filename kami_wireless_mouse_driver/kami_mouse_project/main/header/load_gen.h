@@ -0,0 +1,76 @@
+/**************** Load Generator ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "driver/gptimer.h"
+
+// Built in with idf.py -DLOAD_GEN=1 build, the normal firmware reads the real sensor and pins.
+#ifndef LOAD_GEN
+#define LOAD_GEN 0
+#endif
+
+// Level of a button or wheel pin as the ISRs read it. The generator's pins stand in for the real ones.
+#if LOAD_GEN
+#define INPUT_PIN_LEVEL(pin) load_gen_pin_level(pin)
+#else
+#define INPUT_PIN_LEVEL(pin) gpio_get_level(pin)
+#endif
+
+// Motion patterns, the deltas of each frame.
+#define LOAD_GEN_PATTERN_CIRCLE 0	// Constant speed, the direction turns a full circle in about 100 frames.
+#define LOAD_GEN_PATTERN_ZIGZAG 1	// Back and forth along X, the direction flips every LOAD_GEN_ZIGZAG_FRAMES.
+#define LOAD_GEN_PATTERN_JITTER 2	// Random deltas up to the step in every direction.
+#define LOAD_GEN_PATTERN LOAD_GEN_PATTERN_CIRCLE
+// Counts per frame, a fast flick.
+#define LOAD_GEN_MOTION_STEP 40
+#define LOAD_GEN_ZIGZAG_FRAMES 64
+
+// Rates at 1x, each phase multiplies all of them. Frames come at the report interval, button transitions go
+// round the five buttons one click at a time, the wheel spins up one quadrature edge at a time.
+#define LOAD_GEN_CLICKS_HZ 20
+#define LOAD_GEN_WHEEL_EDGES_HZ 500
+#define LOAD_GEN_MULTIPLIERS {1, 2, 4, 8}
+// Extra edges around each press and release of the debounced buttons, the latched ones do not bounce.
+#define LOAD_GEN_BOUNCE_EDGES 2
+// Shortest frame interval, the shortest period of the motion sync frame timer.
+#define LOAD_GEN_FRAME_US_MIN 50
+
+// Time for the boot to settle before the first phase, the length of a phase and the wait after it for the
+// debouncers to release. A phase spans a few profiler windows, the last one is taken for the CPU shares.
+#define LOAD_GEN_START_DELAY_MS 5000
+#define LOAD_GEN_PHASE_MS 4000
+#define LOAD_GEN_SETTLE_MS 100
+// A phase saturates the pipeline when it loses input or leaves a core less idle time than this.
+#define LOAD_GEN_HEADROOM_MIN 1000
+// Frame intervals a phase may miss to the rounding of its length, per thousand.
+#define LOAD_GEN_MISSED_FRAMES_PERMILLE 10
+// Timer ticks of the edge generator.
+#define LOAD_GEN_TIMER_HZ 1000000
+
+// One phase. Input counts are what the generator made and what the pipeline reported of it.
+typedef struct
+{
+	uint32_t multiplier;
+	uint32_t frame_us;
+	uint32_t frames;			// Bursts decoded.
+	uint32_t frames_missed;		// Frame intervals of the phase without a burst.
+	uint32_t frame_overruns;
+	uint32_t ring_overflows;
+	uint32_t transitions;		// Presses and releases generated.
+	uint32_t button_events;
+	uint32_t wheel_edges;
+	uint32_t wheel_events;
+	uint32_t reports_sent;
+	uint32_t reports_failed;
+	uint32_t reports_coalesced;	// Input folded into a report still waiting for the transport.
+	uint16_t idle_load[portNUM_PROCESSORS];
+	uint16_t isr_load[portNUM_PROCESSORS];
+} load_gen_result_t;
+
+// Pre declarations
+// Non static functions visible outside file
+int load_gen_pin_level(gpio_num_t pin);
+uint32_t load_gen_frame_us(uint32_t report_rate_us);
+void load_gen_motion_burst(uint8_t *burst);
+void load_gen_task(void *arg);
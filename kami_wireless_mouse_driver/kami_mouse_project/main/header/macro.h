@@ -0,0 +1,12 @@
+/**************** Macro ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/input_pipeline.h"
+
+// Pre declarations
+// Non static functions visible outside file
+void macro_init(void);
+void macro_trigger(uint8_t index);
+void macro_task(void *arg);
@@ -3,22 +3,15 @@
 #pragma once
 
 #include "header/common.h"
+#include "header/sensor_registers.h"
+#include "hal/gpio_ll.h"
+#include "esp_cpu.h"
 
 // The sensor is configured to use SPI mode 3.
 #define SENSOR_SPI_MODE 3
-// The sensor is configured to use a clock speed of 10MHz.
+// The sensor is configured to use a clock speed of 10MHz, until a link calibration picks another.
 #define SENSOR_SPI_CLOCK_SPEED_HZ SPI_MASTER_FREQ_10M
 
-// Motion data struct, 2 motion bytes and a timestamp in 12 packet bursts so allow for 2 bursts to be stored.
-#define MOTION_DATA_BUFFER_SIZE 24
-
-typedef struct
-{
-	uint8_t motion_x;
-	uint8_t motion_y;
-	uint32_t timestamp;
-} MotionData;
-
 /*
 10 MHz = 100 ns(p) = 0.1 μs(p)
 Motion Delay After Reset (tMOT-RST) : 50 ms - From reset to valid motion, assuming motion is present
@@ -70,6 +63,7 @@ SCLK To NCS Inactive For Write Operation (tSCLK-NCS) : 1 μs - From last SCLK ri
 #define SENSOR_RESET_DELAY_US 1
 
 // Maximum data valid time of slave.
+// The datasheet input delay, used until a link calibration measured the one of the board.
 #define SENSOR_INPUT_DELAY_NS (T_MISO_RISE_NS + T_DLY_MISO_NS + T_HOLD_MISO_NS)
 
 // Time between end of one write and start of next operation.
@@ -81,15 +75,22 @@ SCLK To NCS Inactive For Write Operation (tSCLK-NCS) : 1 μs - From last SCLK ri
 // Time between setup of read and start of read.
 #define SENSOR_READ_SETUP_US T_SRAD_US
 
-// Number of dummy bits needed to be sent to the sensor to read the motion data.
-#define SENSOR_DUMMY_BITS (SENSOR_READ_SETUP_US * (SENSOR_SPI_CLOCK_SPEED_HZ / 1000000))
+// The dummy bits sent to the sensor before reading the motion data cover SENSOR_READ_SETUP_US.
+// They depend on the link clock, see sensor_link_dummy_bits.
 
 // After the burst transmission is complete, the
 // microcontroller must raise the NCS line for at least tBEXIT to terminate burst mode. The serial port is not available for
 // use until it is reset with NCS, even for a second burst transmission.
-#define SENSOR_BURST_EXIT_DELAY_NS T_BEXIT_NS
+// Both are below a microsecond, rounded up for esp_rom_delay_us.
+#define SENSOR_BURST_EXIT_DELAY_US NS_TO_US_CEIL(T_BEXIT_NS)
+
+#define SENSOR_NCS_SCLK_DELAY_US NS_TO_US_CEIL(T_NCS_SCLK_NS)
+// Held after the last bit of a write before NCS goes high. The read time is shorter than the SPI interrupt
+// takes to get to the post callback.
+#define SENSOR_SCLK_NCS_WRITE_DELAY_US NS_TO_US_CEIL(T_SCLK_NCS_WRITE_NS)
 
-#define SENSOR_NCS_SCLK_DELAY_NS T_NCS_SCLK_NS
+// Motion bursts are read into alternating DMA buffers, one on the bus while the task decodes the other.
+#define SENSOR_BURST_BUFFERS 2
 
 /*
 Wait for 1ms
@@ -108,6 +109,28 @@ c. Write register 0x7F with value 0x00
 #define SENSOR_0x6C_READ_INTERVAL_TOLERANCE_MS 1
 #define SENSOR_0x6C_READ_VALUE 0x80
 
+// Failed SPI transfers or implausible bursts in a row before the sensor is power cycled.
+#define SENSOR_FAULT_BURSTS 16
+// Interval of the product ID check while tracking.
+#define SENSOR_HEALTH_CHECK_INTERVAL_MS 500
+// Time the supply is held off during a power cycle so the sensor fully resets.
+#define SENSOR_POWER_OFF_DELAY_MS 10
+// Delay after the first failed recovery attempt, e.g. while the sensor is unplugged. It doubles after each
+// further failure up to the longest delay.
+#define SENSOR_RECOVERY_RETRY_MS 1000
+#define SENSOR_RECOVERY_RETRY_MAX_MS 30000
+// Failed recovery attempts before the sensor is reported failed, it is still retried at the longest delay.
+#define SENSOR_RECOVERY_ATTEMPTS 5
+// Interval sensor_task checks for parking and the next attempt while the sensor is down.
+#define SENSOR_RECOVERY_POLL_MS 100
+// Failed power ups with a calibrated SPI link before it is dropped for the datasheet setting.
+#define SENSOR_LINK_FALLBACK_ATTEMPTS 2
+// Longest wait for the sensor to hold a grabbed frame.
+#define SENSOR_RAW_GRAB_TIMEOUT_US 10000
+// Motion and delta registers, reading them releases the MOTION pin.
+#define SENSOR_MOTION_REGS_FIRST 0x02
+#define SENSOR_MOTION_REGS_LAST 0x06
+
 // Enum for different mouse modes
 typedef enum
 {
@@ -117,10 +140,32 @@ typedef enum
 	MOUSE_MODE_CRD = 3, // Corded gaming mode
 } MouseMode;
 
+// Mode the sensor holds after a failed mode write.
+#define SENSOR_MODE_UNKNOWN 0xFF
+
 // Max 4000Hz
+// Default for settings.report_rate_us.
 #define REPORT_RATE_US 250
 
+// What starts a motion burst read, picked with CONFIG_KAMI_ACQUISITION_*.
+#define SENSOR_ACQUISITION_POLLED 0			// Every report interval.
+#define SENSOR_ACQUISITION_MOTION_IRQ 1		// When MOTION goes low, at most once per report interval.
+#define SENSOR_ACQUISITION_MOTION_SYNC 2	// On a periodic timer at the report interval.
+#if CONFIG_KAMI_ACQUISITION_MOTION_IRQ
+#define SENSOR_ACQUISITION SENSOR_ACQUISITION_MOTION_IRQ
+#elif CONFIG_KAMI_ACQUISITION_MOTION_SYNC
+#define SENSOR_ACQUISITION SENSOR_ACQUISITION_MOTION_SYNC
+#else
+#define SENSOR_ACQUISITION SENSOR_ACQUISITION_POLLED
+#endif
+
+// Frames per "Frame cycles" log line, the mean and worst CPU cycles of a frame for comparing the variants.
+#define SENSOR_FRAME_CYCLES_LOG_FRAMES 4096
+
 // Pre declarations
 // Non static functions visible outside file
 void sensor_init(void);
-void sensor_task(void *arg);
\ No newline at end of file
+void sensor_task(void *arg);
+void sensor_link_request(void);
+bool sensor_link_busy(void);
+void sensor_link_snapshot(sensor_link_report_t *out);
\ No newline at end of file
@@ -0,0 +1,68 @@
+/**************** Power ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/power_policy.h"
+#include "header/radio_link.h"
+#include "freertos/event_groups.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "hal/gpio_ll.h"
+
+// CPU frequency while active, and the floor it may drop to once the ladder leaves POWER_LEVEL_FULL.
+// 80 MHz keeps the PLL and the 80 MHz APB clock running, so USB and SPI timings do not change.
+#define POWER_ACTIVE_CPU_MHZ 240
+#define POWER_IDLE_CPU_MHZ 80
+
+// A host that has not resumed this long after a remote wakeup is treated as gone.
+#define POWER_WAKE_TIMEOUT_MS 1000
+
+// Light sleep is only used on the radio link, so a wake has to fit in one radio send interval.
+#define POWER_WAKE_BUDGET_US (RADIO_SEND_INTERVAL_MS * 1000)
+// Exit time of light sleep with the CPU kept powered and the sleep code in IRAM, plus the task switch to the input task.
+#define POWER_LIGHT_SLEEP_WAKE_US 300
+#define POWER_WAKE_DISPATCH_US 100
+
+// Pins that wake the chip from light sleep, the buttons and the wheel.
+#define POWER_WAKE_PINS_MAX 12
+
+// Set in the power event group while the input tasks should run.
+#define POWER_EVENT_ACTIVE BIT0
+
+// Notification bits of the power task.
+#define POWER_NOTIFY_USB BIT0		// The host mounted, suspended or resumed the bus.
+#define POWER_NOTIFY_WAKE BIT1		// Input while suspended.
+#define POWER_NOTIFY_ACTIVITY BIT2	// Input or drained reports below POWER_LEVEL_FULL.
+
+typedef enum
+{
+	POWER_ACTIVE,		// Host awake or another transport in use, the downshift ladder runs.
+	POWER_SUSPENDED,	// Host suspended and no transport left, the input tasks are parked.
+	POWER_WAKING,		// Woken by input, remote wakeup issued and the host not resumed yet.
+} power_state_t;
+
+// A pin armed as a light sleep wake source, with the interrupt type it is put back to on wake.
+typedef struct
+{
+	gpio_num_t pin;
+	gpio_int_type_t intr_type;
+} power_wake_pin_t;
+
+// Pre declarations
+// Non static functions visible outside file
+void power_init(void);
+void power_add_wake_pin(gpio_num_t pin, gpio_int_type_t intr_type);
+void power_usb_event(void);
+void power_usb_suspend(bool remote_wakeup_en);
+void power_usb_resume(void);
+void power_wake_from_isr(void);
+void power_activity(void);
+void power_reports_pending(bool pending);
+void power_wait_active(void);
+bool power_parked(void);
+bool power_suspended(void);
+bool power_remote_wakeup_armed(void);
+void power_report_sent(void);
+void power_sync_telemetry(void);
+void power_task(void *arg);
@@ -0,0 +1,43 @@
+/**************** Power Policy ****************/
+
+#pragma once
+
+// The power policy is plain C with no ESP-IDF dependencies, the clock is passed in by the caller.
+// It is shared by the firmware and the host power simulation, which drives it with a virtual clock.
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "header/hot_path.h"
+
+// Power levels from the fastest to the most frugal, each one is entered after a longer time without input.
+typedef enum
+{
+	POWER_LEVEL_FULL,	// Input or reports pending, the CPU is held at full speed.
+	POWER_LEVEL_IDLE,	// No input for a moment, the CPU may drop to its lowest frequency.
+	POWER_LEVEL_SLEEP,	// No input for a while, the input tasks wait on their pins and the chip may light sleep.
+	POWER_LEVEL_COUNT,
+} power_level_t;
+
+typedef struct
+{
+	// Time without input before each level is entered, ascending, the first entry is 0.
+	uint32_t downshift_us[POWER_LEVEL_COUNT];
+	power_level_t level;
+	uint32_t activity_us;
+	// Reports waiting for a transport keep the level at full.
+	bool pending;
+	// Statistics.
+	uint32_t level_since_us;
+	uint64_t level_time_us[POWER_LEVEL_COUNT];
+	uint32_t downshifts;
+	uint32_t upshifts;
+} power_policy_t;
+
+// Pre declarations
+// Non static functions visible outside file
+void power_policy_init(power_policy_t *policy, uint32_t idle_us, uint32_t sleep_us, uint32_t now_us);
+void power_policy_set_ladder(power_policy_t *policy, uint32_t idle_us, uint32_t sleep_us);
+void power_policy_activity(power_policy_t *policy, uint32_t now_us);
+void power_policy_pending(power_policy_t *policy, bool pending, uint32_t now_us);
+power_level_t power_policy_update(power_policy_t *policy, uint32_t now_us);
+uint32_t power_policy_next_us(const power_policy_t *policy, uint32_t now_us);
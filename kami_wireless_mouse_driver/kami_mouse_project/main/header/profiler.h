@@ -0,0 +1,59 @@
+/**************** Profiler ****************/
+
+#pragma once
+
+#include "header/common.h"
+
+// CPU shares are measured over this window, the block read over the vendor report is the last complete one.
+#define PROFILER_WINDOW_MS 1000
+// Tasks reported, the firmware's own and those of ESP-IDF (idle, IPC, timers, TinyUSB, Wi-Fi).
+// uxTaskGetSystemState fails outright if there are more, so leave headroom.
+#define PROFILER_TASKS_MAX 24
+#define PROFILER_TASK_NAME_LENGTH configMAX_TASK_NAME_LEN
+// GPIO interrupt handlers timed by the profiler.
+#define PROFILER_ISRS_MAX 12
+// Loads are in 0.01 % of one core.
+#define PROFILER_LOAD_SCALE 10000
+// A task with less free stack than this is logged after each window.
+#define PROFILER_STACK_MARGIN 256
+// Core of tasks that may run on either core.
+#define PROFILER_CORE_ANY 0xFF
+
+// One task over the last window.
+typedef struct
+{
+	char name[PROFILER_TASK_NAME_LENGTH];
+	uint16_t load;			// Share of one core, including the interrupts that hit the task.
+	uint16_t stack_free;	// Lowest free stack since the task started, in bytes.
+	uint8_t core;			// Core the task is pinned to or PROFILER_CORE_ANY.
+	uint8_t priority;
+	uint16_t reserved;
+} profiler_task_t;
+
+// The layout is part of the vendor protocol, only append new fields.
+typedef struct
+{
+	uint32_t window_us;
+	uint16_t idle_load[portNUM_PROCESSORS];	// Idle task share per core, light sleep included.
+	uint16_t isr_load[portNUM_PROCESSORS];	// Time in the GPIO handlers per core.
+	uint32_t isr_count;
+	uint32_t isr_max_us;
+	uint8_t task_count;
+	uint8_t reserved[3];
+	profiler_task_t tasks[PROFILER_TASKS_MAX];
+} profiler_stats_t;
+
+// A GPIO handler wrapped by the profiler.
+typedef struct
+{
+	gpio_num_t pin;
+	gpio_isr_t handler;
+	void *arg;
+} profiler_isr_t;
+
+// Pre declarations
+// Non static functions visible outside file
+esp_err_t profiler_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void *arg);
+void profiler_isr_raise(gpio_num_t pin);
+void profiler_snapshot(profiler_stats_t *stats);
+void profiler_task(void *arg);
@@ -0,0 +1,22 @@
+/**************** Radio Link ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/radio_protocol.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+
+// Wi-Fi channel shared with the receiver dongle.
+#define RADIO_CHANNEL 1
+// ESP-NOW PHY rate, the fastest rate keeps the air time of a packet well under the report interval.
+#define RADIO_PHY_RATE WIFI_PHY_RATE_MCS7_SGI
+// Interval of the radio task when there is nothing in flight, samples arriving in between are packed together.
+#define RADIO_SEND_INTERVAL_MS 1
+
+// Pre declarations
+// Non static functions visible outside file
+bool radio_link_available(void);
+void radio_link_power_save(bool enable);
+bool radio_link_report(uint8_t buttons, int16_t x, int16_t y, int8_t wheel, int8_t pan);
+void radio_task(void *arg);
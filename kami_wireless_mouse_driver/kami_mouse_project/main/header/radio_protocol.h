@@ -0,0 +1,115 @@
+/**************** Radio Protocol ****************/
+
+#pragma once
+
+// The radio protocol is plain C with no ESP-IDF dependencies.
+// It is shared by the mouse, the receiver dongle and the host loopback test.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+Mouse to dongle packet, sent as a broadcast ESP-NOW frame, all multi byte values are little endian.
+Broadcast frames are not acknowledged or retried by the MAC, so lost packets are handled here:
+motion is simply lost, while the button state is carried in every packet, repeated after each change
+and kept alive while a button is held, so a lost release cannot leave a button stuck on the host.
+
+BYTE[0..1]  = Link ID, packets of other links are ignored
+BYTE[2]     = Protocol version
+BYTE[3..4]  = Sequence number
+BYTE[5..8]  = Sender timestamp in microseconds
+BYTE[9]     = Buttons
+BYTE[10]    = Button sequence, bumped on every button change
+BYTE[11]    = Sample count
+BYTE[12..]  = Samples, each [age (u16 us before the timestamp)][x (i16)][y (i16)][wheel (i8)][pan (i8)]
+*/
+
+#define RADIO_PROTOCOL_VERSION 1
+#define RADIO_LINK_ID_DEFAULT 0x4B4D
+
+#define RADIO_HEADER_SIZE 12
+#define RADIO_SAMPLE_SIZE 8
+// Samples packed into one packet, older samples are merged once it is full.
+#define RADIO_MAX_SAMPLES 8
+#define RADIO_PACKET_MAX (RADIO_HEADER_SIZE + RADIO_MAX_SAMPLES * RADIO_SAMPLE_SIZE)
+
+// Packets sent back to back with the new button state after a change, even if there is no motion to send.
+#define RADIO_BUTTON_REPEATS 3
+// Then the state is resent at this interval while a button is held, and a few more times after the release.
+#define RADIO_KEEPALIVE_US 20000
+#define RADIO_KEEPALIVE_PACKETS 5
+// The receiver releases the buttons when no valid packet came for this long, a held button sends several keepalives.
+#define RADIO_RX_TIMEOUT_US (RADIO_KEEPALIVE_US * 4)
+// Button changes waiting for the previous change to go out, a burst of clicks faster than the packets.
+#define RADIO_BUTTON_QUEUE 8
+// Older sequence numbers within this window are duplicates or reordered, anything further back is a sender restart.
+#define RADIO_REORDER_WINDOW 64
+
+// One motion report.
+typedef struct
+{
+	uint32_t timestamp_us;
+	int16_t x;
+	int16_t y;
+	int8_t wheel;
+	int8_t pan;
+} radio_sample_t;
+
+// Sender state.
+typedef struct
+{
+	uint16_t link_id;
+	uint16_t sequence;
+	uint8_t buttons;
+	uint8_t button_sequence;
+	// Packets still to be sent back to back with the current button state.
+	uint8_t button_repeats;
+	// Keepalive packets still to be sent after the last change, once no button is held.
+	uint8_t keepalive_left;
+	// Button states applied one per packet once the current change has been sent.
+	uint8_t button_queue[RADIO_BUTTON_QUEUE];
+	uint8_t button_queue_head;
+	uint8_t button_queue_count;
+	// Changes dropped because the queue was full, the newest state replaced the last queued one.
+	uint32_t button_overflows;
+	uint32_t last_send_us;
+	uint8_t sample_count;
+	radio_sample_t samples[RADIO_MAX_SAMPLES];
+	// Samples merged because the packet was full.
+	uint32_t merged;
+} radio_tx_t;
+
+// Receiver state.
+typedef struct
+{
+	uint16_t link_id;
+	bool synced;
+	uint16_t sequence;
+	uint8_t buttons;
+	uint8_t button_sequence;
+	uint32_t received;
+	uint32_t lost;
+	uint32_t rejected;
+	uint32_t resyncs;
+	uint32_t timeouts;
+} radio_rx_t;
+
+// A report the receiver emits, timestamps are in the sender's clock.
+typedef struct
+{
+	uint8_t buttons;
+	radio_sample_t sample;
+} radio_report_t;
+
+// Pre declarations
+// Non static functions visible outside file
+void radio_tx_init(radio_tx_t *tx, uint16_t link_id);
+bool radio_tx_button_pending(const radio_tx_t *tx);
+void radio_tx_set_buttons(radio_tx_t *tx, uint8_t buttons);
+bool radio_tx_queue_buttons(radio_tx_t *tx, uint8_t buttons);
+void radio_tx_add_sample(radio_tx_t *tx, const radio_sample_t *sample);
+bool radio_tx_due(const radio_tx_t *tx, uint32_t now_us);
+size_t radio_tx_build(radio_tx_t *tx, uint32_t now_us, uint8_t *packet);
+void radio_rx_init(radio_rx_t *rx, uint16_t link_id);
+int radio_rx_packet(radio_rx_t *rx, const uint8_t *packet, size_t length, radio_report_t *reports);
+bool radio_rx_timeout(radio_rx_t *rx);
@@ -29,4 +29,5 @@ typedef enum
 // Pre declarations
 // Non static functions visible outside file
 void swheel_init(void);
-void swheel_task(void *arg);
\ No newline at end of file
+void swheel_task(void *arg);
+void swheel_replay(int steps, int a_level, int b_level, uint32_t event_us);
\ No newline at end of file
@@ -0,0 +1,213 @@
+/**************** Sensor Registers ****************/
+
+#pragma once
+
+// The register layer is plain C with no ESP-IDF dependencies, the SPI access is passed in as a sensor_bus_t.
+// It is shared by the firmware and the host tools, which count the SPI transactions of mode and CPI changes.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Writing this register selects the bank the following register addresses refer to.
+#define SENSOR_REG_BANK_SELECT 0x7F
+// Banks 0x00 to 0x1F, each with 128 registers.
+#define SENSOR_REG_BANKS 32
+#define SENSOR_REG_COUNT 128
+#define SENSOR_BANK_UNKNOWN 0xFF
+
+// Bank 0 registers.
+#define SENSOR_REG_PRODUCT_ID 0x00
+#define SENSOR_REG_MOTION_BURST 0x16
+#define SENSOR_REG_POWER_UP_RESET 0x3A
+#define SENSOR_REG_SHUTDOWN 0x3B
+#define SENSOR_REG_PERFORMANCE 0x40
+#define SENSOR_REG_INVERSE_PRODUCT_ID 0x5F
+#define SENSOR_REG_SET_RESOLUTION 0x47
+#define SENSOR_REG_RAW_DATA_GRAB 0x58
+#define SENSOR_REG_RAW_DATA_GRAB_STATUS 0x59
+// Resolution registers, the CPI is (value + 1) * 50.
+#define SENSOR_REG_RESOLUTION_X_LOW 0x48
+#define SENSOR_REG_RESOLUTION_X_HIGH 0x49
+#define SENSOR_REG_RESOLUTION_Y_LOW 0x4A
+#define SENSOR_REG_RESOLUTION_Y_HIGH 0x4B
+// Rest mode registers. Without motion the sensor steps down from run to rest 1, 2 and 3,
+// each rest mode taking a frame every rest period. The mode sequences also write the rest 1 pair.
+#define SENSOR_REG_RUN_DOWNSHIFT 0x77
+#define SENSOR_REG_REST1_PERIOD 0x78
+#define SENSOR_REG_REST1_DOWNSHIFT 0x79
+#define SENSOR_REG_REST2_PERIOD 0x7A
+#define SENSOR_REG_REST2_DOWNSHIFT 0x7B
+#define SENSOR_REG_REST3_PERIOD 0x7C
+
+#define SENSOR_PRODUCT_ID 0x51
+#define SENSOR_INVERSE_PRODUCT_ID 0xAE
+// Writing this to the shutdown register stops the sensor, it comes back with the power up sequence.
+#define SENSOR_SHUTDOWN_VALUE 0xB6
+
+// Raw frame grab. Writing the grab register holds the next frame, the status register reads
+// SENSOR_RAW_DATA_GRAB_READY once it is held, then the pixels are read from the grab register in one burst,
+// row by row. Navigation stops for the grab, the power up sequence restarts it.
+#define SENSOR_RAW_DATA_GRAB_START 0x00
+#define SENSOR_RAW_DATA_GRAB_READY 0xC0
+#define SENSOR_RAW_FRAME_WIDTH 36
+#define SENSOR_RAW_FRAME_HEIGHT 36
+#define SENSOR_RAW_FRAME_PIXELS (SENSOR_RAW_FRAME_WIDTH * SENSOR_RAW_FRAME_HEIGHT)
+
+// Only bits [1:0] of the performance register select the mode, the other bits must be preserved.
+#define SENSOR_PERFORMANCE_MODE_MASK 0x03
+
+#define SENSOR_CPI_STEP 50
+// Register writes of a resolution change.
+#define SENSOR_RESOLUTION_SEQUENCE_LENGTH 5
+
+// Rest mode timing encoding.
+// Run downshift time = Run_Downshift * 10 ms.
+// Rest period = RestN_Period * 1 ms, the frame rate in that rest mode.
+// Rest downshift time = RestN_Downshift * 32 * rest period, 32 frames of the rest mode per step.
+#define SENSOR_RUN_DOWNSHIFT_UNIT_MS 10
+#define SENSOR_REST_DOWNSHIFT_FRAMES 32
+#define SENSOR_REST_REG_MAX 255
+#define SENSOR_RUN_DOWNSHIFT_MS_MAX (SENSOR_REST_REG_MAX * SENSOR_RUN_DOWNSHIFT_UNIT_MS)
+// Register writes of a rest timing change, the bank select included.
+#define SENSOR_REST_SEQUENCE_LENGTH 7
+
+// SPI link calibration. Every clock of the sweep is tried with MISO input delays from 0 in
+// SENSOR_LINK_DELAY_STEP_NS steps, and the product ID and its inverse are read back at each setting.
+// The clocks are the 80 MHz divisions from 8 MHz up, the datasheet allows 10 MHz. A faster one is only taken
+// with the same margin as any other.
+#define SENSOR_LINK_CLOCKS 5
+#define SENSOR_LINK_DELAYS 16
+#define SENSOR_LINK_DELAY_STEP_NS 5
+// Reads of each ID register per setting of the sweep, and at the picked setting and both ends of its margin
+// before it is accepted.
+#define SENSOR_LINK_SWEEP_READS 128
+#define SENSOR_LINK_CONFIRM_READS 4096
+// Error free input delays needed on both sides of the picked one.
+#define SENSOR_LINK_MARGIN_NS 10
+// Bit errors of a setting the SPI driver refused.
+#define SENSOR_LINK_REFUSED UINT32_MAX
+
+typedef enum
+{
+	SENSOR_LINK_IDLE,		// No calibration ran since boot.
+	SENSOR_LINK_RUNNING,
+	SENSOR_LINK_DONE,		// A setting was picked and stored.
+	SENSOR_LINK_FAILED,		// No setting had the margin, the datasheet one stays.
+} sensor_link_state_t;
+
+// SPI clock and MISO input delay of the sensor link, stored in the settings.
+typedef struct
+{
+	uint32_t clock_hz;
+	uint8_t input_delay_ns;
+	// 0 until a calibration picked this setting, the datasheet setting is used until then.
+	uint8_t calibrated;
+	uint8_t reserved[2];
+} sensor_link_t;
+
+// Result of the last calibration.
+// The layout is part of the vendor protocol.
+typedef struct
+{
+	uint8_t state;				// sensor_link_state_t
+	uint8_t delay_step_ns;
+	uint8_t reserved[2];
+	uint32_t clock_hz[SENSOR_LINK_CLOCKS];
+	// Bits read at each setting, and the bit errors among them.
+	uint32_t bits;
+	uint32_t bit_errors[SENSOR_LINK_CLOCKS][SENSOR_LINK_DELAYS];
+	sensor_link_t link;			// Picked setting.
+	// Bits read back at the picked setting and both ends of its margin, and the bit errors among them.
+	// The bit error rate the link was accepted with, or the one of the last pick turned down.
+	uint32_t confirm_bits;
+	uint32_t confirm_bit_errors;
+	// Picks the confirmation turned down.
+	uint32_t rejected;
+	uint32_t duration_us;
+} sensor_link_report_t;
+
+// Switch the SPI link to a clock and input delay, returns 0 if the driver accepted them.
+typedef int (*sensor_link_configure_t)(void *context, uint32_t clock_hz, uint8_t input_delay_ns);
+
+// How a write goes through the shadow.
+typedef enum
+{
+	SENSOR_WRITE_RAW,	  // Write the value as is, used by the datasheet power-up sequences.
+	SENSOR_WRITE_CHANGED, // Apply the register field masks and skip writes of values the register already holds.
+} sensor_write_policy_t;
+
+// Operation mode of the sensor, from bits [2:1] of the motion register.
+typedef enum
+{
+	SENSOR_REST_RUN,
+	SENSOR_REST_1,
+	SENSOR_REST_2,
+	SENSOR_REST_3,
+	SENSOR_REST_COUNT,
+} sensor_rest_state_t;
+
+// Rest mode timing in milliseconds, see the encoding above.
+typedef struct
+{
+	uint16_t run_downshift_ms;		// Run to rest 1 without motion.
+	uint16_t rest1_downshift_ms;	// Rest 1 to rest 2.
+	uint16_t rest2_downshift_ms;	// Rest 2 to rest 3.
+	uint8_t rest1_period_ms;
+	uint8_t rest2_period_ms;
+	uint8_t rest3_period_ms;
+} sensor_rest_t;
+
+// SPI access to the sensor, the callbacks return 0 on success.
+typedef struct
+{
+	int (*write)(void *context, uint8_t address, uint8_t value);
+	int (*read)(void *context, uint8_t address, uint8_t *value);
+	void *context;
+} sensor_bus_t;
+
+// A programming sequence of [address, value] pairs, 0x7F entries select the bank of the pairs that follow.
+typedef struct
+{
+	const uint8_t (*writes)[2];
+	size_t length;
+} sensor_sequence_t;
+
+// Shadow of the selected bank and of every register value written or read since the last reset.
+typedef struct
+{
+	const sensor_bus_t *bus;
+	// Bank the sensor has selected.
+	uint8_t bank;
+	// Bank the sequence being written refers to, only selected on the sensor once a register in it is written.
+	uint8_t pending_bank;
+	uint8_t values[SENSOR_REG_BANKS][SENSOR_REG_COUNT];
+	uint32_t known[SENSOR_REG_BANKS][SENSOR_REG_COUNT / 32];
+	// SPI transactions issued and register writes skipped.
+	uint32_t transactions;
+	uint32_t skipped;
+} sensor_shadow_t;
+
+// Datasheet programming sequences.
+extern const sensor_sequence_t sensor_sequence_first;
+extern const sensor_sequence_t sensor_sequence_0x6C_fail;
+extern const sensor_sequence_t sensor_sequence_second;
+// Indexed by MouseMode.
+extern const sensor_sequence_t sensor_sequence_modes[4];
+// Clocks of the link calibration, slowest first.
+extern const uint32_t sensor_link_clocks_hz[SENSOR_LINK_CLOCKS];
+
+// Pre declarations
+// Non static functions visible outside file
+void sensor_shadow_init(sensor_shadow_t *shadow, const sensor_bus_t *bus);
+void sensor_shadow_reset(sensor_shadow_t *shadow);
+int sensor_shadow_select_bank(sensor_shadow_t *shadow, uint8_t bank);
+int sensor_shadow_write(sensor_shadow_t *shadow, uint8_t address, uint8_t value, sensor_write_policy_t policy);
+int sensor_shadow_write_sequence(sensor_shadow_t *shadow, const sensor_sequence_t *sequence, sensor_write_policy_t policy);
+void sensor_resolution_sequence(uint16_t cpi, uint8_t writes[SENSOR_RESOLUTION_SEQUENCE_LENGTH][2]);
+bool sensor_rest_valid(const sensor_rest_t *rest);
+void sensor_rest_sequence(const sensor_rest_t *rest, uint8_t writes[SENSOR_REST_SEQUENCE_LENGTH][2]);
+uint32_t sensor_link_dummy_bits(uint32_t clock_hz, uint32_t setup_us);
+bool sensor_link_valid(const sensor_link_t *link);
+uint32_t sensor_link_read_errors(const sensor_bus_t *bus, uint32_t reads);
+bool sensor_link_pick(const sensor_link_report_t *report, sensor_link_t *link);
+bool sensor_link_calibrate(sensor_link_report_t *report, const sensor_bus_t *bus, sensor_link_configure_t configure);
@@ -0,0 +1,127 @@
+/**************** Settings ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "header/motion_sensor.h"
+#include "header/eager_debounce_switch.h"
+#include "header/scroll_wheel.h"
+#include "header/input_pipeline.h"
+#include "header/energy_model.h"
+
+// The PAW3395 resolution is set in 50 CPI steps.
+#define SETTINGS_CPI_STEP SENSOR_CPI_STEP
+#define SETTINGS_CPI_MIN 50
+#define SETTINGS_CPI_MAX 26000
+// Power-up resolution of the sensor.
+#define SETTINGS_CPI_DEFAULT 1600
+
+// 8kHz is the fastest rate the report path can be asked for, 125Hz the slowest.
+#define SETTINGS_REPORT_RATE_US_MIN 125
+#define SETTINGS_REPORT_RATE_US_MAX 8000
+
+#define SETTINGS_DEBOUNCE_MS_MIN 1
+#define SETTINGS_DEBOUNCE_MS_MAX 50
+
+#define SETTINGS_SCROLL_SPEED_LIMIT 127
+#define SETTINGS_SCROLL_PAUSE_MS_MAX 2000
+
+// Power downshift ladder, time without input before the CPU is let go and before light sleep.
+#define SETTINGS_POWER_IDLE_MS_DEFAULT 100
+#define SETTINGS_POWER_SLEEP_MS_DEFAULT 2000
+#define SETTINGS_POWER_MS_MAX 60000
+
+// Sensor rest timing of the gaming profiles, rest is left late and the rest modes still take frames often,
+// so the first motion after a pause is seen within a few milliseconds.
+#define SETTINGS_REST_GAMING_RUN_MS 1000
+#define SETTINGS_REST_GAMING_REST1_MS 5000
+#define SETTINGS_REST_GAMING_REST2_MS 30000
+#define SETTINGS_REST_GAMING_REST1_PERIOD_MS 1
+#define SETTINGS_REST_GAMING_REST2_PERIOD_MS 4
+#define SETTINGS_REST_GAMING_REST3_PERIOD_MS 10
+// Sensor rest timing of the office profile, rest is entered early and the frames are sparse.
+#define SETTINGS_REST_OFFICE_RUN_MS 250
+#define SETTINGS_REST_OFFICE_REST1_MS 4800
+#define SETTINGS_REST_OFFICE_REST2_MS 60000
+#define SETTINGS_REST_OFFICE_REST1_PERIOD_MS 10
+#define SETTINGS_REST_OFFICE_REST2_PERIOD_MS 50
+#define SETTINGS_REST_OFFICE_REST3_PERIOD_MS 100
+
+// Number of onboard profiles.
+#define SETTINGS_PROFILE_COUNT 4
+// The last profile defaults to office use, the others to gaming.
+#define SETTINGS_PROFILE_OFFICE (SETTINGS_PROFILE_COUNT - 1)
+
+// NVS location of the settings blob.
+#define SETTINGS_NVS_NAMESPACE "kami"
+#define SETTINGS_NVS_KEY "settings"
+// Bump when the blob layout changes, older blobs are replaced by the defaults.
+#define SETTINGS_VERSION 7
+// Changes are written to flash once no further change arrived for this long.
+#define SETTINGS_SAVE_DELAY_MS 2000
+
+// Runtime tunables of one profile.
+typedef struct
+{
+	uint16_t cpi;
+	uint16_t report_rate_us;
+	uint8_t sensor_mode;
+	uint8_t debounce_ms;
+	uint8_t scroll_speed_min;
+	uint8_t scroll_speed_max;
+	uint16_t scroll_pause_ms;
+	bool scroll_accel;
+	// Lower bound of the learned release hold time, debounce_ms is the upper one.
+	uint8_t debounce_min_ms;
+	uint16_t power_idle_ms;
+	uint16_t power_sleep_ms;
+	// Sensor rest timing, see sensor_rest_t.
+	uint16_t rest_run_ms;
+	uint16_t rest1_ms;
+	uint16_t rest2_ms;
+	uint8_t rest1_period_ms;
+	uint8_t rest2_period_ms;
+	uint8_t rest3_period_ms;
+	uint8_t reserved2;
+	// Action of each physical button, see INPUT_REMAP_MACRO.
+	uint8_t button_map[INPUT_BUTTON_COUNT];
+	uint8_t reserved3;
+} settings_t;
+
+// The blob stored in NVS.
+typedef struct
+{
+	uint16_t version;
+	uint8_t active_profile;
+	uint8_t reserved;
+	settings_t profiles[SETTINGS_PROFILE_COUNT];
+	// Shared by all profiles, a button map picks them by index.
+	input_macro_table_t macros;
+	// SPI link setting of the sensor, picked by the link calibration.
+	sensor_link_t link;
+	// Cost table of the energy model, measured on the board.
+	energy_costs_t energy;
+} settings_store_t;
+
+// Bumped on every change so tasks can pick up settings that need hardware writes (CPI, sensor mode).
+extern volatile uint32_t settings_generation;
+
+// Pre declarations
+// Non static functions visible outside file
+void settings_init(void);
+bool settings_validate(const settings_t *candidate);
+uint32_t settings_snapshot(settings_t *out);
+uint8_t settings_active_profile(void);
+void settings_get_profile(uint8_t profile, settings_t *out);
+void settings_commit(uint8_t profile, const settings_t *candidate);
+void settings_sensor_rest(const settings_t *source, sensor_rest_t *rest);
+void settings_get_macro(uint8_t index, input_macro_t *out);
+void settings_get_macros(input_macro_table_t *out);
+void settings_commit_macros(const input_macro_table_t *table);
+void settings_get_link(sensor_link_t *out);
+void settings_commit_link(const sensor_link_t *link);
+void settings_get_energy_costs(energy_costs_t *out);
+void settings_commit_energy_costs(const energy_costs_t *costs);
+void settings_task(void *arg);
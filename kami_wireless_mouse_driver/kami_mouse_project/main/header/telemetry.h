@@ -0,0 +1,21 @@
+/**************** Telemetry ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/telemetry_format.h"
+
+extern telemetry_counters_t telemetry_counters;
+
+// Counters are bumped from ISRs and tasks on both cores.
+#define TELEMETRY_COUNT(counter) __atomic_fetch_add(&telemetry_counters.counter, 1, __ATOMIC_RELAXED)
+#define TELEMETRY_ADD(counter, n) __atomic_fetch_add(&telemetry_counters.counter, (n), __ATOMIC_RELAXED)
+
+// Pre declarations
+// Non static functions visible outside file
+void telemetry_record_latency(telemetry_latency_t histogram, uint32_t latency_us);
+void telemetry_snapshot(telemetry_counters_t *counters, telemetry_latency_histograms_t *histograms);
+void telemetry_reset(void);
+void telemetry_boot_mark(telemetry_boot_t milestone);
+void telemetry_boot_report(uint8_t buttons, int16_t x, int16_t y);
+void telemetry_boot_snapshot(telemetry_boot_times_t *times);
@@ -0,0 +1,119 @@
+/**************** Telemetry Format ****************/
+
+#pragma once
+
+// The telemetry blocks are read by host tools over the vendor report, so they must not depend on ESP-IDF.
+#include <stdint.h>
+
+// Latency histograms use log2 microsecond buckets, bucket 0 is < 2us and the last bucket collects everything above.
+#define TELEMETRY_LATENCY_BUCKETS 16
+
+// Histograms kept by the firmware.
+typedef enum
+{
+	TELEMETRY_LATENCY_MOTION,	// Motion burst read to HID report.
+	TELEMETRY_LATENCY_BUTTON,	// Button ISR to HID report.
+	TELEMETRY_LATENCY_WHEEL,	// Scroll wheel ISR to HID report.
+	TELEMETRY_LATENCY_FRAME,	// Duration of one sensor task frame.
+	TELEMETRY_LATENCY_COUNT,
+} telemetry_latency_t;
+
+// Event counters.
+// The layout is part of the vendor protocol, only append new counters.
+typedef struct
+{
+	uint32_t uptime_ms;
+	uint32_t reports_sent;
+	uint32_t reports_failed;
+	uint32_t bursts_read;
+	uint32_t motion_bursts;
+	uint32_t motion_buffer_overflows;
+	uint32_t button_events;
+	uint32_t wheel_events;
+	uint32_t spi_errors;
+	uint32_t frame_overruns;
+	uint32_t sensor_faults;
+	uint32_t sensor_recoveries;
+	uint32_t sensor_recovery_last_us;
+	uint32_t sensor_recovery_max_us;
+	uint32_t radio_packets_sent;
+	uint32_t radio_send_failures;
+	uint32_t transport_switches;
+	uint32_t transport_switch_last_us;
+	uint32_t transport_switch_max_us;
+	uint32_t transport_stale_motion;
+	uint32_t power_suspends;
+	uint32_t power_wakeups;
+	uint32_t power_resume_last_us;
+	uint32_t power_resume_max_us;
+	uint32_t power_resume_over_budget;
+	uint32_t power_time_full_ms;
+	uint32_t power_time_idle_ms;
+	uint32_t power_time_sleep_ms;
+	uint32_t power_wake_last_us;
+	uint32_t power_wake_max_us;
+	uint32_t power_wake_over_budget;
+	uint32_t sensor_rest_state;
+	uint32_t sensor_rest_exits;
+	uint32_t sensor_run_ms;
+	uint32_t sensor_rest1_ms;
+	uint32_t sensor_rest2_ms;
+	uint32_t sensor_rest3_ms;
+	uint32_t trace_dropped;
+	uint32_t frame_cycles_last;
+	uint32_t frame_cycles_max;
+	uint32_t macros_played;
+	uint32_t macro_steps;
+	uint32_t macro_late_last_us;
+	uint32_t macro_late_max_us;
+	uint32_t macro_late_steps;
+	uint32_t ulp_handovers;
+	uint32_t ulp_wakes;
+	uint32_t ulp_events;
+	uint32_t ulp_glitches;
+	uint32_t ulp_overflows;
+	// SPI link calibrations run, and the ID register bits the health check read with the bit errors among them.
+	uint32_t link_calibrations;
+	uint32_t link_bits;
+	uint32_t link_bit_errors;
+	// Inputs of the energy model. The time the counters cover since boot or the last reset, the SPI transactions
+	// to the sensor, the wakeups of the input tasks, and the sensor run time split by tracking mode.
+	uint32_t counted_ms;
+	uint32_t spi_transactions;
+	uint32_t task_wakeups;
+	uint32_t sensor_run_hpm_ms;
+	uint32_t sensor_run_lpm_ms;
+	uint32_t sensor_run_wrk_ms;
+	uint32_t sensor_run_crd_ms;
+	// Motion and wheel input added to a report still waiting for the transport.
+	uint32_t transport_motion_merged;
+	// Button changes lost because too many were waiting for the radio.
+	uint32_t radio_button_overflows;
+	// Reports whose transport went away before completing them, their motion went to the new transport.
+	uint32_t transport_motion_recovered;
+	// Sensor recoveries that ran out of attempts, and 1 while the sensor is reported failed.
+	uint32_t sensor_recovery_failures;
+	uint32_t sensor_failed;
+} telemetry_counters_t;
+
+typedef struct
+{
+	uint32_t buckets[TELEMETRY_LATENCY_COUNT][TELEMETRY_LATENCY_BUCKETS];
+} telemetry_latency_histograms_t;
+
+// Boot milestones in microseconds since boot, 0 until reached.
+typedef enum
+{
+	TELEMETRY_BOOT_BUTTONS_READY,	// Button and wheel tasks running.
+	TELEMETRY_BOOT_USB_MOUNTED,		// Host finished enumeration.
+	TELEMETRY_BOOT_SENSOR_READY,	// Sensor powered up and configured.
+	TELEMETRY_BOOT_FIRST_CLICK,		// First button report delivered.
+	TELEMETRY_BOOT_FIRST_MOTION,	// First motion report delivered.
+	TELEMETRY_BOOT_COUNT,
+} telemetry_boot_t;
+
+// The layout is part of the vendor protocol, only append new milestones.
+typedef struct
+{
+	uint32_t us[TELEMETRY_BOOT_COUNT];
+} telemetry_boot_times_t;
@@ -0,0 +1,62 @@
+/**************** Input Trace ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/trace_format.h"
+
+// Records captured, picked with CONFIG_KAMI_TRACE_*. The hooks below the level compile to nothing,
+// their arguments are not evaluated either.
+#define TRACE_LEVEL_OFF 0
+#define TRACE_LEVEL_EVENTS 1	// GPIO edges and reports.
+#define TRACE_LEVEL_BURSTS 2	// And every motion burst.
+#if CONFIG_KAMI_TRACE_OFF
+#define TRACE_LEVEL TRACE_LEVEL_OFF
+#elif CONFIG_KAMI_TRACE_EVENTS
+#define TRACE_LEVEL TRACE_LEVEL_EVENTS
+#else
+#define TRACE_LEVEL TRACE_LEVEL_BURSTS
+#endif
+#define TRACE_ENABLED (TRACE_LEVEL != TRACE_LEVEL_OFF)
+
+// Number of records held in the capture ring, must be a power of 2.
+// 20 bytes per record, so 128k records is ~2.5MB of PSRAM or ~30s of 4kHz tracking.
+#define TRACE_RING_RECORDS 131072
+
+// Bytes per hex line when dumping over the console.
+#define TRACE_DUMP_LINE_BYTES 32
+
+// A read that is not continued within this time is abandoned, capture resumes.
+#define TRACE_READ_IDLE_TIMEOUT_MS 2000
+
+// Readers of the ring, one read is in progress at a time.
+typedef enum
+{
+	TRACE_READER_NONE = 0,
+	TRACE_READER_CONSOLE,
+	TRACE_READER_VENDOR,
+} trace_reader_t;
+
+// trace_read errors.
+#define TRACE_READ_BAD_OFFSET -1
+#define TRACE_READ_BUSY -2
+
+// Pre declarations
+// Non static functions visible outside file
+void trace_init(void);
+#if TRACE_LEVEL >= TRACE_LEVEL_EVENTS
+void trace_record(trace_record_type_t type, const uint8_t *payload, uint8_t length);
+void trace_record_gpio(uint8_t pin, uint8_t levels);
+void trace_record_report(uint8_t buttons, int16_t x, int16_t y, int8_t wheel, int8_t pan);
+#else
+#define trace_record_gpio(pin, levels) ((void)0)
+#define trace_record_report(buttons, x, y, wheel, pan) ((void)0)
+#endif
+#if TRACE_LEVEL >= TRACE_LEVEL_BURSTS
+void trace_record_burst(const uint8_t *response);
+#else
+#define trace_record_burst(response) ((void)0)
+#endif
+int trace_read(trace_reader_t reader, uint32_t offset, uint8_t *out, uint32_t length, uint32_t *total);
+void trace_request_dump(void);
+void trace_task(void *arg);
@@ -0,0 +1,97 @@
+/**************** Input Trace Format ****************/
+
+#pragma once
+
+// The trace format is shared with the host replay tool, so it must not depend on ESP-IDF.
+#include <stdint.h>
+
+#include "header/input_pipeline.h"
+
+/*
+A dumped trace is a file header followed by variable length records.
+All fields are little endian.
+
+Record layout:
+BYTE[0] = Record type (trace_record_type_t)
+BYTE[1] = Payload length
+BYTE[2..5] = Timestamp in microseconds since boot (wraps after ~71 minutes)
+BYTE[6..] = Payload
+
+Payloads:
+TRACE_RECORD_BURST  : The raw 12 byte PAW3395 motion burst.
+TRACE_RECORD_GPIO   : Pin number, pin levels (bit 0 = the pin, bit 1 = its partner pin).
+TRACE_RECORD_REPORT : Buttons, X (int16), Y (int16), wheel (int8), pan (int8). A report as submitted to the active
+                      transport, inputs that arrived while it was busy are merged into one report.
+*/
+
+#define TRACE_MAGIC 0x52544D4B // "KMTR"
+#define TRACE_VERSION 2
+
+typedef enum
+{
+	TRACE_RECORD_NONE = 0,
+	TRACE_RECORD_BURST = 1,
+	TRACE_RECORD_GPIO = 2,
+	TRACE_RECORD_REPORT = 3,
+} trace_record_type_t;
+
+#define TRACE_RECORD_HEADER_SIZE 6
+#define TRACE_PAYLOAD_MAX SENSOR_MOTION_BURST_SIZE
+#define TRACE_GPIO_PAYLOAD_SIZE 2
+#define TRACE_REPORT_PAYLOAD_SIZE 7
+
+// GPIO level bits.
+#define TRACE_GPIO_LEVEL 0x01
+#define TRACE_GPIO_PARTNER_LEVEL 0x02
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t record_count;
+	// Records overwritten in the ring before they could be dumped.
+	uint32_t dropped_count;
+} trace_file_header_t;
+
+// In RAM record, fixed size so the ring can be written from an ISR without any framing.
+typedef struct
+{
+	uint32_t timestamp_us;
+	uint8_t type;
+	uint8_t length;
+	uint8_t payload[TRACE_PAYLOAD_MAX];
+} trace_record_t;
+
+// Decoded HID report payload.
+typedef struct
+{
+	uint8_t buttons;
+	int16_t x;
+	int16_t y;
+	int8_t wheel;
+	int8_t pan;
+} trace_report_t;
+
+// Pack a report into a record payload, returns the payload length.
+static inline uint8_t trace_pack_report(uint8_t *payload, const trace_report_t *report)
+{
+	payload[0] = report->buttons;
+	payload[1] = (uint8_t)report->x;
+	payload[2] = (uint8_t)((uint16_t)report->x >> 8);
+	payload[3] = (uint8_t)report->y;
+	payload[4] = (uint8_t)((uint16_t)report->y >> 8);
+	payload[5] = (uint8_t)report->wheel;
+	payload[6] = (uint8_t)report->pan;
+	return TRACE_REPORT_PAYLOAD_SIZE;
+}
+
+// Unpack a report record payload.
+static inline void trace_unpack_report(const uint8_t *payload, trace_report_t *report)
+{
+	report->buttons = payload[0];
+	report->x = (int16_t)(payload[1] | payload[2] << 8);
+	report->y = (int16_t)(payload[3] | payload[4] << 8);
+	report->wheel = (int8_t)payload[5];
+	report->pan = (int8_t)payload[6];
+}
@@ -0,0 +1,85 @@
+/**************** Transport ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/input_pipeline.h"
+#include "header/transport_mux.h"
+
+// The transport task polls at this interval when nothing wakes it, so a lost link is noticed even without input.
+#define TRANSPORT_POLL_MS 10
+
+// Backends in order of preference, USB whenever a host has the cable.
+typedef enum
+{
+	TRANSPORT_USB,
+	TRANSPORT_RADIO,
+	TRANSPORT_COUNT,
+} transport_id_t;
+
+#if TRANSPORT_MOTION_16BIT
+// Mouse input report with 16 bit X and Y, the layout of TUD_HID_REPORT_DESC_MOUSE16.
+typedef struct __attribute__((packed))
+{
+	uint8_t buttons;
+	int16_t x;
+	int16_t y;
+	int8_t wheel;
+	int8_t pan;
+} transport_usb_report_t;
+
+// TUD_HID_REPORT_DESC_MOUSE with 16 bit X and Y, for high CPI motion that overflows 8 bit deltas.
+#define TUD_HID_REPORT_DESC_MOUSE16(...)                                     \
+    HID_USAGE_PAGE(HID_USAGE_PAGE_DESKTOP),                                  \
+    HID_USAGE(HID_USAGE_DESKTOP_MOUSE),                                      \
+    HID_COLLECTION(HID_COLLECTION_APPLICATION),                              \
+    __VA_ARGS__                                                              \
+    HID_USAGE(HID_USAGE_DESKTOP_POINTER),                                    \
+    HID_COLLECTION(HID_COLLECTION_PHYSICAL),                                 \
+    HID_USAGE_PAGE(HID_USAGE_PAGE_BUTTON),                                   \
+    HID_USAGE_MIN(1),                                                        \
+    HID_USAGE_MAX(5),                                                        \
+    HID_LOGICAL_MIN(0),                                                      \
+    HID_LOGICAL_MAX(1),                                                      \
+    HID_REPORT_COUNT(5),                                                     \
+    HID_REPORT_SIZE(1),                                                      \
+    HID_INPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE),                       \
+    HID_REPORT_COUNT(1),                                                     \
+    HID_REPORT_SIZE(3),                                                      \
+    HID_INPUT(HID_CONSTANT),                                                 \
+    HID_USAGE_PAGE(HID_USAGE_PAGE_DESKTOP),                                  \
+    HID_USAGE(HID_USAGE_DESKTOP_X),                                          \
+    HID_USAGE(HID_USAGE_DESKTOP_Y),                                          \
+    HID_LOGICAL_MIN_N(-TRANSPORT_MOTION_MAX, 2),                             \
+    HID_LOGICAL_MAX_N(TRANSPORT_MOTION_MAX, 2),                              \
+    HID_REPORT_COUNT(2),                                                     \
+    HID_REPORT_SIZE(16),                                                     \
+    HID_INPUT(HID_DATA | HID_VARIABLE | HID_RELATIVE),                       \
+    HID_USAGE(HID_USAGE_DESKTOP_WHEEL),                                      \
+    HID_LOGICAL_MIN(0x81),                                                   \
+    HID_LOGICAL_MAX(0x7f),                                                   \
+    HID_REPORT_COUNT(1),                                                     \
+    HID_REPORT_SIZE(8),                                                      \
+    HID_INPUT(HID_DATA | HID_VARIABLE | HID_RELATIVE),                       \
+    HID_USAGE_PAGE(HID_USAGE_PAGE_CONSUMER),                                 \
+    HID_USAGE_N(HID_USAGE_CONSUMER_AC_PAN, 2),                               \
+    HID_LOGICAL_MIN(0x81),                                                   \
+    HID_LOGICAL_MAX(0x7f),                                                   \
+    HID_REPORT_COUNT(1),                                                     \
+    HID_REPORT_SIZE(8),                                                      \
+    HID_INPUT(HID_DATA | HID_VARIABLE | HID_RELATIVE),                       \
+    HID_COLLECTION_END,                                                      \
+    HID_COLLECTION_END
+#define TUD_HID_REPORT_DESC_KAMI_MOUSE(...) TUD_HID_REPORT_DESC_MOUSE16(__VA_ARGS__)
+#else
+#define TUD_HID_REPORT_DESC_KAMI_MOUSE(...) TUD_HID_REPORT_DESC_MOUSE(__VA_ARGS__)
+#endif
+
+// Pre declarations
+// Non static functions visible outside file
+void transport_init(void);
+void transport_report_button(input_button_t button, bool pressed);
+void transport_report_motion(int16_t x, int16_t y, int8_t wheel, int8_t pan);
+void transport_report_macro(const input_macro_step_t *step, uint8_t buttons);
+void transport_notify(void);
+void transport_task(void *arg);
@@ -0,0 +1,108 @@
+/**************** Transport Mux ****************/
+
+#pragma once
+
+// The transport mux is plain C with no ESP-IDF dependencies, the backends are passed in as transport_t.
+// It is shared by the firmware and the host failover test, which drives it with mock transports.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "header/hot_path.h"
+
+#define TRANSPORT_MAX 2
+#define TRANSPORT_NONE -1
+
+// Motion still waiting when the transport changes is dropped if it is older than this,
+// the host on the other side should not see a jump made of movement from before the switch.
+#define TRANSPORT_STALE_MOTION_US 20000
+
+// Width of X and Y in a report. The firmware sets TRANSPORT_MOTION_16BIT from CONFIG_KAMI_REPORT_16BIT,
+// the host tools use the 8 bit boot protocol layout. Motion that does not fit waits for the next report.
+#ifndef TRANSPORT_MOTION_16BIT
+#define TRANSPORT_MOTION_16BIT 0
+#endif
+#if TRANSPORT_MOTION_16BIT
+typedef int16_t transport_motion_t;
+#define TRANSPORT_MOTION_MAX 32767
+#else
+typedef int8_t transport_motion_t;
+#define TRANSPORT_MOTION_MAX 127
+#endif
+// Wheel and pan are always 8 bit.
+#define TRANSPORT_WHEEL_MAX 127
+
+// One HID mouse report, the button state is absolute and the deltas are relative.
+typedef struct
+{
+	uint8_t buttons;
+	transport_motion_t x;
+	transport_motion_t y;
+	int8_t wheel;
+	int8_t pan;
+} transport_report_t;
+
+// A report backend, listed in order of preference.
+// A backend signals completion of a submitted report by becoming ready again, the owner then polls the mux.
+typedef struct
+{
+	const char *name;
+	// True while the link to a host is up.
+	bool (*available)(void *context);
+	// True if a report can be submitted now.
+	bool (*ready)(void *context);
+	// Hand over a report, returns false if the backend did not take it.
+	bool (*submit)(void *context, const transport_report_t *report);
+	void *context;
+} transport_t;
+
+typedef struct
+{
+	const transport_t *transports;
+	int count;
+	int active;
+	// Called with every report submitted to the active transport, after merging. Optional, the firmware traces them.
+	void (*observe)(const transport_report_t *report);
+	// Input state, the held buttons and the motion not yet submitted.
+	uint8_t buttons;
+	int32_t x;
+	int32_t y;
+	int32_t wheel;
+	int32_t pan;
+	bool motion_pending;
+	uint32_t motion_us;
+	// Button state the active transport's host has been sent.
+	uint8_t sent_buttons;
+	bool buttons_dirty;
+	// Transport left with buttons held, it is sent a release so its host does not keep them pressed.
+	int release;
+	// Transport and motion of the last report submitted, until the transport is ready again. A transport that goes
+	// away first may never have delivered it, the motion is then carried over to the new transport.
+	int inflight;
+	int32_t inflight_x;
+	int32_t inflight_y;
+	int32_t inflight_wheel;
+	int32_t inflight_pan;
+	uint32_t inflight_us;
+	// Switch in progress, from the poll that saw the change until the first report on the new transport.
+	bool switching;
+	uint32_t switch_start_us;
+	// Statistics.
+	uint32_t switches;
+	uint32_t switch_last_us;
+	uint32_t switch_max_us;
+	uint32_t stale_motion_dropped;
+	uint32_t motion_merged;
+	uint32_t motion_recovered;
+	uint32_t submitted;
+	uint32_t submit_failed;
+} transport_mux_t;
+
+// Pre declarations
+// Non static functions visible outside file
+void transport_mux_init(transport_mux_t *mux, const transport_t *transports, int count);
+void transport_mux_button(transport_mux_t *mux, uint8_t mask, bool pressed);
+void transport_mux_buttons(transport_mux_t *mux, uint8_t buttons);
+void transport_mux_motion(transport_mux_t *mux, int16_t x, int16_t y, int8_t wheel, int8_t pan, uint32_t now_us);
+bool transport_mux_pending(const transport_mux_t *mux);
+int transport_mux_poll(transport_mux_t *mux, uint32_t now_us);
@@ -0,0 +1,101 @@
+/**************** ULP Mailbox ****************/
+
+#pragma once
+
+// The mailbox is plain C with no ESP-IDF dependencies. It is shared by the ULP-RISC-V scanner, which fills it while
+// the main CPU sleeps, the firmware, which replays it on wake, and the host mailbox test, which drives both sides.
+// It lives in RTC slow memory, so every field is a 32 bit word.
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "header/switch.h"
+
+// Pin changes kept until the main CPU takes the pins back. A full buffer merges later changes into its last entry,
+// the ULP wakes the main CPU long before that.
+#define ULP_MAILBOX_EVENTS 32
+// A button pin has to hold a new level for this many scans before it wakes the main CPU, shorter pulses are glitches.
+#define ULP_MAILBOX_CONFIRM_SCANS 2
+
+// The levels of the scanned pins after a change, and the scan that saw it.
+typedef struct
+{
+	uint32_t scan;
+	uint32_t pins;
+} ulp_event_t;
+
+typedef struct
+{
+	// Written by the main CPU at handover.
+	uint32_t mask;			// Pins scanned, bit per GPIO.
+	uint32_t wheel_mask;	// The two wheel phases among them.
+	uint32_t rest;			// Levels the main CPU last saw.
+	// Written by the ULP.
+	uint32_t busy;			// A scan is running.
+	uint32_t scans;
+	uint32_t pins;			// Levels at the last scan.
+	uint32_t held;			// Scans since the last change.
+	uint32_t wheel_toggled;	// Wheel phases that changed since the levels were last at rest.
+	uint32_t woken;			// The main CPU was asked to wake.
+	uint32_t glitches;		// Changes back to rest before they woke the main CPU, dropped.
+	uint32_t overflows;
+	uint32_t count;
+	ulp_event_t events[ULP_MAILBOX_EVENTS];
+} ulp_mailbox_t;
+
+// Decoding on the main CPU, the ULP build leaves it out.
+#ifndef IS_ULP_COCPU
+
+// Inputs watched by the ULP, the main buttons are latched NO/NC pairs.
+#define ULP_LATCH_BUTTONS 2
+#define ULP_DEBOUNCED_BUTTONS 3
+// Most inputs one change can decode to, a step of each latch, an edge of each debounced button and the wheel.
+#define ULP_INPUTS_PER_EVENT (ULP_LATCH_BUTTONS + ULP_DEBOUNCED_BUTTONS + 1)
+
+// GPIO numbers of the watched inputs.
+typedef struct
+{
+	uint8_t latch_no[ULP_LATCH_BUTTONS];
+	uint8_t latch_nc[ULP_LATCH_BUTTONS];
+	uint8_t debounced[ULP_DEBOUNCED_BUTTONS];
+	uint8_t wheel_a;
+	uint8_t wheel_b;
+} ulp_pins_t;
+
+typedef enum
+{
+	ULP_INPUT_LATCH,	// A main button changed, value is the new mouse_button_state_t.
+	ULP_INPUT_EDGE,		// A debounced button pin changed, value is its level. The debouncer decides.
+	ULP_INPUT_WHEEL,	// The wheel phases changed, value is the steps taken, in units of QUADRATURE_STEP_UP.
+} ulp_input_kind_t;
+
+// One input decoded from the mailbox, with the time of the scan that saw it.
+typedef struct
+{
+	uint32_t time_us;
+	uint8_t kind;
+	uint8_t index;		// Latch or debounced button.
+	int8_t value;
+} ulp_input_t;
+
+// Levels and states the changes are decoded against, starting from the handover.
+typedef struct
+{
+	const ulp_pins_t *map;
+	uint32_t pins;
+	mouse_button_state_t latch[ULP_LATCH_BUTTONS];
+	// Direction of the last wheel step, for a scan that saw both phases change.
+	int wheel_dir;
+} ulp_decoder_t;
+
+#endif
+
+// Pre declarations
+// Non static functions visible outside file
+void ulp_mailbox_arm(ulp_mailbox_t *mailbox, uint32_t mask, uint32_t wheel_mask, uint32_t rest);
+bool ulp_mailbox_scan(ulp_mailbox_t *mailbox, uint32_t levels);
+#ifndef IS_ULP_COCPU
+uint32_t ulp_mailbox_mask(const ulp_pins_t *map);
+uint32_t ulp_mailbox_event_us(const ulp_mailbox_t *mailbox, const ulp_event_t *event, uint32_t now_us, uint32_t period_us);
+void ulp_decoder_init(ulp_decoder_t *decoder, const ulp_pins_t *map, uint32_t pins, const mouse_button_state_t *latch);
+int ulp_decoder_change(ulp_decoder_t *decoder, uint32_t pins, uint32_t time_us, ulp_input_t *inputs);
+#endif
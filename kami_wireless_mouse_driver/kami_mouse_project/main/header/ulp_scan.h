@@ -0,0 +1,30 @@
+/**************** ULP Scan ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/ulp_mailbox.h"
+
+// Scanning of the buttons and the wheel by the ULP-RISC-V while the main CPU light sleeps, picked with
+// CONFIG_KAMI_ULP_SCAN. Without it the pins are armed as GPIO wake sources like the sensor MOTION pin.
+#if CONFIG_KAMI_ULP_SCAN
+#define ULP_SCAN 1
+#include "driver/rtc_io.h"
+#include "esp_rom_sys.h"
+#include "ulp_riscv.h"
+#include "ulp_kami_scan.h"
+#else
+#define ULP_SCAN 0
+#endif
+
+// Period of the ULP timer. A click holds for tens of milliseconds, a wheel detent for a few.
+#define ULP_SCAN_PERIOD_US 1000
+// Longest the handback waits for a scan that already started.
+#define ULP_SCAN_BUSY_TIMEOUT_US 200
+
+// Pre declarations
+// Non static functions visible outside file
+void ulp_scan_init(void);
+bool ulp_scan_owns(gpio_num_t pin);
+void ulp_scan_start(void);
+void ulp_scan_stop(void);
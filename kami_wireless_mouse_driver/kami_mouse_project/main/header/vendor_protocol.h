@@ -0,0 +1,148 @@
+/**************** Vendor Feature Report Protocol ****************/
+
+#pragma once
+
+// The protocol definitions are shared with host tools, so they must not depend on ESP-IDF.
+#include <stdint.h>
+
+/*
+Configuration and telemetry use a vendor defined feature report on its own report ID.
+Feature reports travel over the control endpoint, so they never queue behind or delay the mouse input reports.
+
+The host writes a request with SET_REPORT(Feature) and reads the response with GET_REPORT(Feature).
+All multi byte values are little endian.
+
+Request:
+BYTE[0] = Command (vendor_command_t)
+BYTE[1] = Sequence number, echoed in the response
+BYTE[2] = Payload length
+BYTE[3..] = Payload
+
+Response:
+BYTE[0] = Command
+BYTE[1] = Sequence number
+BYTE[2] = Status (vendor_status_t)
+BYTE[3] = Payload length
+BYTE[4..] = Payload
+
+VENDOR_CMD_GET   : Payload is a list of tags, the response is a list of TLVs [tag][length][value].
+VENDOR_CMD_SET   : Payload is a list of TLVs. The whole batch is validated before any of it is applied.
+                   The batch edits the active profile unless it starts with VENDOR_TAG_PROFILE,
+                   the edited profile becomes the active one. Changes are saved to flash a moment later.
+VENDOR_CMD_READ  : Payload is [block][offset (u32)], the response is [total size (u32)][data].
+                   Reading offset 0 takes a fresh snapshot of the block.
+                   VENDOR_BLOCK_TRACE answers BUSY while the console dump reads the trace.
+VENDOR_CMD_RESET : Clears the counters and latency histograms.
+VENDOR_CMD_WRITE : Payload is [block][offset (u32)][data], for the writable blocks. A block is written in order
+                   from offset 0, each chunk where the last one ended. The chunk that completes the block has it
+                   validated and applied, a bad block is dropped as a whole.
+VENDOR_CMD_CALIBRATE : Starts the SPI link calibration of the sensor, tracking pauses for one to two seconds.
+                       BUSY while a calibration or a frame capture runs. The result is read from
+                       VENDOR_BLOCK_SPI_LINK, which also answers BUSY until the calibration is done.
+*/
+
+#define VENDOR_REPORT_ID 3
+// Payload size of the feature report, not counting the report ID.
+#define VENDOR_REPORT_SIZE 63
+
+#define VENDOR_REQUEST_HEADER_SIZE 3
+#define VENDOR_RESPONSE_HEADER_SIZE 4
+#define VENDOR_REQUEST_PAYLOAD_MAX (VENDOR_REPORT_SIZE - VENDOR_REQUEST_HEADER_SIZE)
+#define VENDOR_RESPONSE_PAYLOAD_MAX (VENDOR_REPORT_SIZE - VENDOR_RESPONSE_HEADER_SIZE)
+// Block reads spend 4 bytes of the response on the total size.
+#define VENDOR_READ_CHUNK_MAX (VENDOR_RESPONSE_PAYLOAD_MAX - 4)
+// Block writes spend 5 bytes of the request on the block and offset.
+#define VENDOR_WRITE_CHUNK_MAX (VENDOR_REQUEST_PAYLOAD_MAX - 5)
+
+typedef enum
+{
+	VENDOR_CMD_NONE = 0x00,
+	VENDOR_CMD_GET = 0x01,
+	VENDOR_CMD_SET = 0x02,
+	VENDOR_CMD_READ = 0x03,
+	VENDOR_CMD_RESET = 0x04,
+	VENDOR_CMD_WRITE = 0x05,
+	VENDOR_CMD_CALIBRATE = 0x06,
+} vendor_command_t;
+
+typedef enum
+{
+	VENDOR_STATUS_OK = 0x00,
+	VENDOR_STATUS_UNKNOWN_COMMAND = 0x01,
+	VENDOR_STATUS_UNKNOWN_TAG = 0x02,
+	VENDOR_STATUS_BAD_LENGTH = 0x03,
+	VENDOR_STATUS_BAD_VALUE = 0x04,
+	VENDOR_STATUS_BAD_OFFSET = 0x05,
+	VENDOR_STATUS_BUSY = 0x06,
+} vendor_status_t;
+
+// Settings tags, the value length is fixed per tag.
+typedef enum
+{
+	VENDOR_TAG_CPI = 0x01,				// u16, counts per inch in steps of 50
+	VENDOR_TAG_REPORT_RATE_US = 0x02,	// u16, report interval in microseconds
+	VENDOR_TAG_SENSOR_MODE = 0x03,		// u8, MouseMode
+	VENDOR_TAG_DEBOUNCE_MS = 0x04,		// u8, longest release hold time of the debounced buttons
+	VENDOR_TAG_SCROLL_SPEED_MIN = 0x05, // u8, scroll curve start multiplier
+	VENDOR_TAG_SCROLL_SPEED_MAX = 0x06, // u8, scroll curve end multiplier
+	VENDOR_TAG_SCROLL_PAUSE_MS = 0x07,	// u16, idle time before the multiplier steps down
+	VENDOR_TAG_SCROLL_ACCEL = 0x08,		// u8, scroll acceleration on/off
+	VENDOR_TAG_PROFILE = 0x09,			// u8, active profile, in a SET the following tags edit this profile
+	VENDOR_TAG_POWER_IDLE_MS = 0x0A,	// u16, time without input before the CPU clock drops
+	VENDOR_TAG_POWER_SLEEP_MS = 0x0B,	// u16, time without input before light sleep
+	VENDOR_TAG_REST_RUN_MS = 0x0C,		// u16, time without motion before the sensor enters rest 1
+	VENDOR_TAG_REST1_MS = 0x0D,			// u16, time in rest 1 before rest 2
+	VENDOR_TAG_REST2_MS = 0x0E,			// u16, time in rest 2 before rest 3
+	VENDOR_TAG_REST1_PERIOD_MS = 0x0F,	// u8, frame period in rest 1
+	VENDOR_TAG_REST2_PERIOD_MS = 0x10,	// u8, frame period in rest 2
+	VENDOR_TAG_REST3_PERIOD_MS = 0x11,	// u8, frame period in rest 3
+	VENDOR_TAG_DEBOUNCE_MIN_MS = 0x12,	// u8, shortest release hold time the buttons may learn
+	VENDOR_TAG_BUTTON_MAP = 0x13,		// u8[5], action of left, right, middle, back and forward, see INPUT_REMAP_MACRO
+} vendor_tag_t;
+
+// Blocks readable with VENDOR_CMD_READ, the macros and the energy costs writable with VENDOR_CMD_WRITE too.
+typedef enum
+{
+	VENDOR_BLOCK_COUNTERS = 0x01,	// telemetry_counters_t
+	VENDOR_BLOCK_LATENCY = 0x02,	// telemetry_latency_histograms_t
+	VENDOR_BLOCK_TRACE = 0x03,		// Input trace in the dump format of trace_format.h
+	VENDOR_BLOCK_BOOT = 0x04,		// telemetry_boot_times_t
+	VENDOR_BLOCK_TASKS = 0x05,		// profiler_stats_t
+	VENDOR_BLOCK_SWITCHES = 0x06,	// switch_wear_stats_t
+	VENDOR_BLOCK_MACROS = 0x07,		// input_macro_table_t
+	VENDOR_BLOCK_SPI_LINK = 0x08,	// sensor_link_report_t
+	VENDOR_BLOCK_ENERGY_COSTS = 0x09,	// energy_costs_t
+	VENDOR_BLOCK_ENERGY = 0x0A,		// energy_report_t, the counts since the last RESET and their estimate
+} vendor_block_t;
+
+// Value length of a settings tag, 0 for unknown tags.
+static inline uint8_t vendor_tag_length(uint8_t tag)
+{
+	switch (tag)
+	{
+	case VENDOR_TAG_BUTTON_MAP:
+		return 5;
+	case VENDOR_TAG_CPI:
+	case VENDOR_TAG_REPORT_RATE_US:
+	case VENDOR_TAG_SCROLL_PAUSE_MS:
+	case VENDOR_TAG_POWER_IDLE_MS:
+	case VENDOR_TAG_POWER_SLEEP_MS:
+	case VENDOR_TAG_REST_RUN_MS:
+	case VENDOR_TAG_REST1_MS:
+	case VENDOR_TAG_REST2_MS:
+		return 2;
+	case VENDOR_TAG_SENSOR_MODE:
+	case VENDOR_TAG_DEBOUNCE_MS:
+	case VENDOR_TAG_SCROLL_SPEED_MIN:
+	case VENDOR_TAG_SCROLL_SPEED_MAX:
+	case VENDOR_TAG_SCROLL_ACCEL:
+	case VENDOR_TAG_PROFILE:
+	case VENDOR_TAG_REST1_PERIOD_MS:
+	case VENDOR_TAG_REST2_PERIOD_MS:
+	case VENDOR_TAG_REST3_PERIOD_MS:
+	case VENDOR_TAG_DEBOUNCE_MIN_MS:
+		return 1;
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,11 @@
+/**************** Vendor Feature Report ****************/
+
+#pragma once
+
+#include "header/common.h"
+#include "header/vendor_protocol.h"
+
+// Pre declarations
+// Non static functions visible outside file
+void vendor_report_set(const uint8_t *buffer, uint16_t bufsize);
+uint16_t vendor_report_get(uint8_t *buffer, uint16_t reqlen);
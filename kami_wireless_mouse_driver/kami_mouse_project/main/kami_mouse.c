@@ -6,45 +6,91 @@
 #include "kami_mouse.h"
 
 // Source includes are a dangerous form of modularity but best option with compiler.
+#include "source/input_pipeline.c"
+#include "source/ulp_mailbox.c"
+#include "source/sensor_registers.c"
+#include "source/energy_model.c"
+#include "source/settings.c"
+#include "source/telemetry.c"
+#include "source/profiler.c"
+#include "source/heap_guard.c"
+#include "source/radio_protocol.c"
+#include "source/radio_link.c"
+#include "source/transport_mux.c"
+#include "source/transport.c"
+#include "source/macro.c"
+#include "source/power_policy.c"
+#include "source/power.c"
+#include "source/trace.c"
+#include "source/frame_capture.c"
 #include "source/latch_switch.c"
 #include "source/eager_debounce_switch.c"
 #include "source/scroll_wheel.c"
+#include "source/ulp_scan.c"
 #include "source/motion_sensor.c"
+#include "source/vendor_report.c"
+#include "source/latency_bench.c"
+#include "source/load_gen.c"
 
 /************* TinyUSB descriptors ****************/
 
 /**
  * @brief HID report descriptor
  *
- * In this example we implement Keyboard + Mouse HID device,
- * so we must define both report descriptors
+ * The mouse input report plus a vendor defined feature report for configuration and telemetry.
+ * The mouse report has 8 or 16 bit X and Y, picked with CONFIG_KAMI_REPORT_16BIT.
+ * The vendor report has its own report ID so host tools can open it without touching the mouse report.
  */
 static const uint8_t hid_report_descriptor[] = {
-    TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(HID_ITF_PROTOCOL_MOUSE))};
+    TUD_HID_REPORT_DESC_KAMI_MOUSE(HID_REPORT_ID(HID_ITF_PROTOCOL_MOUSE)),
+    HID_USAGE_PAGE_N(HID_USAGE_PAGE_VENDOR, 2),
+    HID_USAGE(0x01),
+    HID_COLLECTION(HID_COLLECTION_APPLICATION),
+    HID_REPORT_ID(VENDOR_REPORT_ID)
+    HID_USAGE(0x02),
+    HID_LOGICAL_MIN(0x00),
+    HID_LOGICAL_MAX_N(0xff, 2),
+    HID_REPORT_SIZE(8),
+    HID_REPORT_COUNT(VENDOR_REPORT_SIZE),
+    HID_FEATURE(HID_DATA | HID_ARRAY | HID_ABSOLUTE),
+    HID_COLLECTION_END,
+};
+
+/**
+ * @brief Frame capture report descriptor
+ *
+ * Raw sensor frames for the host receiver, on their own interface so the mouse reports never wait behind them.
+ */
+static const uint8_t capture_report_descriptor[] = {
+    TUD_HID_REPORT_DESC_FRAME_CAPTURE(),
+};
 
 /**
  * @brief String descriptor
  */
-static const char *hid_string_descriptor[5] = {
+static const char *hid_string_descriptor[6] = {
     // array of pointer to string descriptors
     (char[]){0x09, 0x04}, // 0: is supported language is English (0x0409)
     "Kami",               // 1: Manufacturer
     "Komplex Mouse",      // 2: Product
     "123456",             // 3: Serials, should use chip ID
     "HID interface",      // 4: HID
+    "Frame capture",      // 5: Frame capture HID
 };
 
 /**
  * @brief Configuration descriptor
  *
- * This is a simple configuration descriptor that defines 1 configuration and 1 HID interface
+ * One configuration with the mouse HID interface and the frame capture HID interface.
  */
 static const uint8_t hid_configuration_descriptor[] = {
     // Configuration number, interface count, string index, total length, attribute, power in mA
-    TUD_CONFIG_DESCRIPTOR(1, 1, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, MAX_POWER_MA),
+    TUD_CONFIG_DESCRIPTOR(1, CFG_TUD_HID, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, MAX_POWER_MA),
 
     // Interface number, string index, boot protocol, report descriptor len, EP In address, size & polling interval
     TUD_HID_DESCRIPTOR(0, 4, false, sizeof(hid_report_descriptor), HID_EP_IN_ADDR, HID_EP_IN_SIZE, HID_EP_IN_INTERVAL),
+    TUD_HID_DESCRIPTOR(FRAME_CAPTURE_HID_INSTANCE, 5, false, sizeof(capture_report_descriptor), FRAME_CAPTURE_EP_IN_ADDR,
+                       FRAME_CAPTURE_EP_IN_SIZE, FRAME_CAPTURE_EP_IN_INTERVAL),
 };
 
 // Mouse Protocol 1, HID 1.11 spec, Appendix B, page 59-60, with wheel extension
@@ -93,7 +139,11 @@ static const uint8_t mouse_hid_report_desc[] =
 // Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
 uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance)
 {
-    // We use only one interface and one HID report descriptor, so we can ignore parameter 'instance'
+    // The interface number is the instance, one report descriptor each.
+    if (instance == FRAME_CAPTURE_HID_INSTANCE)
+    {
+        return capture_report_descriptor;
+    }
     return hid_report_descriptor;
 }
 
@@ -102,11 +152,15 @@ uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance)
 // Return zero will cause the stack to STALL request
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen)
 {
-    (void)instance;
-    (void)report_id;
-    (void)report_type;
-    (void)buffer;
-    (void)reqlen;
+    if (instance == FRAME_CAPTURE_HID_INSTANCE)
+    {
+        return 0;
+    }
+
+    if (report_id == VENDOR_REPORT_ID && report_type == HID_REPORT_TYPE_FEATURE)
+    {
+        return vendor_report_get(buffer, reqlen);
+    }
 
     return 0;
 }
@@ -115,20 +169,108 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_t
 // received data on OUT endpoint ( Report ID = 0, Type = 0 )
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize)
 {
+    if (instance == FRAME_CAPTURE_HID_INSTANCE)
+    {
+        if (report_type == HID_REPORT_TYPE_OUTPUT)
+        {
+            frame_capture_command(buffer, bufsize);
+        }
+        return;
+    }
+
+    if (report_id == VENDOR_REPORT_ID && report_type == HID_REPORT_TYPE_FEATURE)
+    {
+        vendor_report_set(buffer, bufsize);
+    }
+}
+
+// Invoked when sent REPORT successfully to host
+// The IN endpoint is free again, so merged motion or the next frame packet can go out.
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len)
+{
+    (void)report;
+    (void)len;
+
+    if (instance == FRAME_CAPTURE_HID_INSTANCE)
+    {
+        frame_capture_notify();
+        return;
+    }
+    transport_notify();
+}
+
+// Invoked when the host has configured the device.
+void tud_mount_cb(void)
+{
+    telemetry_boot_mark(TELEMETRY_BOOT_USB_MOUNTED);
+    transport_notify();
+    power_usb_event();
+}
+
+// Invoked when the device is unplugged or the host resets it, reports move to the radio link.
+void tud_umount_cb(void)
+{
+    transport_notify();
+    power_usb_event();
+}
+
+// Invoked when the bus has been idle for 3 ms, the host is suspending the device.
+// remote_wakeup_en is set if the host allows the device to wake it.
+void tud_suspend_cb(bool remote_wakeup_en)
+{
+    power_usb_suspend(remote_wakeup_en);
+}
+
+// Invoked when the host resumes the bus, either on its own or after a remote wakeup.
+void tud_resume_cb(void)
+{
+    power_usb_resume();
 }
 
 /************* IO Configs ****************/
 
-/*
-// TODO: Update the mode based on if the usb is connected once wifi is implemented.
-static bool wifi_report = USB_REPORT;
-*/
+// Reports go over USB while a host is mounted and over the radio link otherwise, see transport.c.
 
 /********* Application ***************/
 
+// Staged startup.
+// The buttons and wheel only need their GPIOs, so they come up first and are ready by the time the host mounts.
+// USB enumeration and the sensor power-up sequence (well over 150 ms of delays) then run in parallel.
+// Input tasks report through the transport mux, which holds the button state until a host is reachable.
 void app_main(void)
 {
-    // Initialize the USB stack.
+    // Load the stored settings before the input sources read them.
+    settings_init();
+    // Allocate the input trace ring before any input source can record into it.
+    trace_init();
+    // Set up the report transports before any input source can report.
+    transport_init();
+    // Set up the macro timer before a button can start a macro.
+    macro_init();
+    // Set up the raw frame buffers before the capture interface can be started by the host.
+    frame_capture_init();
+    // Set up the suspend state and CPU frequency control before the tasks that wait on it.
+    power_init();
+    // Initialize the software latches for the mouse buttons.
+    mb_latch_init();
+    // Initialize the software debouncing for the mouse wheel button and side buttons.
+    button_debounce_init();
+    // Initialize the rotary encoder for the scroll wheel.
+    swheel_init();
+#if ULP_SCAN
+    // Load the ULP program that watches the buttons and the wheel while the main CPU light sleeps.
+    ulp_scan_init();
+#endif
+
+    // Create the tasks for the software latches for the mouse buttons.
+    TASK_CREATE_STATIC(mb_latch_task, MB_LATCH_TASK_STACK_SIZE, 1);
+    // Create the tasks for the software debouncing for the mouse wheel button and side buttons.
+    TASK_CREATE_STATIC(button_debounce_task, BUTTON_DEBOUNCE_TASK_STACK_SIZE, 1);
+    // Create the tasks for the scroll wheel.
+    TASK_CREATE_STATIC(swheel_task, SWHEEL_TASK_STACK_SIZE, 1);
+    telemetry_boot_mark(TELEMETRY_BOOT_BUTTONS_READY);
+
+    // Initialize the USB stack, enumeration continues in the TinyUSB task.
     ESP_LOGI(TAG, "USB initialization");
     const tinyusb_config_t tusb_cfg =
         {
@@ -142,32 +284,33 @@ void app_main(void)
     ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
     ESP_LOGI(TAG, "USB initialization DONE");
 
-    if (!tud_mounted())
-    {
-        ESP_LOGI(TAG, "USB not mounted");
-        return;
-    }
+    // Create the tasks for the Pixart PAW3395 sensor, it powers up and configures the sensor in the background.
+    TASK_CREATE_STATIC(sensor_task, SENSOR_TASK_STACK_SIZE, 1);
+    // Create the task that follows USB suspend and resume and wakes the host on input.
+    TASK_CREATE_STATIC(power_task, POWER_TASK_STACK_SIZE, 2);
+    // Create the task that drains merged motion and follows USB plug and unplug.
+    TASK_CREATE_STATIC(transport_task, TRANSPORT_TASK_STACK_SIZE, 2);
+    // Create the task that plays the button macros, above the input tasks so the steps go out on time.
+    TASK_CREATE_STATIC(macro_task, MACRO_TASK_STACK_SIZE, 2);
+    // Create the task for the ESP-NOW link to the receiver dongle, it brings up Wi-Fi in the background.
+    TASK_CREATE_STATIC(radio_task, RADIO_TASK_STACK_SIZE, 1);
+    // Create the task that saves changed settings to flash.
+    TASK_CREATE_STATIC(settings_task, SETTINGS_TASK_STACK_SIZE, 0);
+    // Create the task that dumps the input trace on request.
+    TASK_CREATE_STATIC(trace_task, TRACE_TASK_STACK_SIZE, 0);
+    // Create the task that streams raw sensor frames while the host captures them.
+    TASK_CREATE_STATIC(frame_capture_task, FRAME_CAPTURE_TASK_STACK_SIZE, 1);
+    // Create the task that measures CPU load and stack use per task.
+    TASK_CREATE_STATIC(profiler_task, PROFILER_TASK_STACK_SIZE, 0);
+#if LATENCY_BENCH
+    // Benchmark builds only, measures the input ISR latency while flash is written.
+    TASK_CREATE_STATIC(latency_bench_task, LATENCY_BENCH_TASK_STACK_SIZE, 0);
+#endif
+#if LOAD_GEN
+    // Saturation test builds only, swaps the sensor bursts and input pins for generated ones at rising rates.
+    // Above the input tasks, so a phase still ends on time when they take all of the CPU.
+    TASK_CREATE_STATIC(load_gen_task, LOAD_GEN_TASK_STACK_SIZE, 3);
+#endif
 
-    // Initialize the software latches for the mouse buttons.
-    mb_latch_init();
-    // Initialize the software debouncing for the mouse wheel button and side buttons.
-    button_debounce_init();
-    // Initialize the rotary encoder for the scroll wheel.
-    swheel_init();
-    // Initialize the IO pins for the sensor.
-    sensor_init();
-
-    // Create the tasks for the software latches for the mouse buttons.
-    xTaskCreate(mb_latch_task, "mb_latch_task", 2048, NULL, 1, NULL);
-    // Create the tasks for the software debouncing for the mouse wheel button and side buttons.
-    xTaskCreate(button_debounce_task, "button_debounce_task", 2048, NULL, 1, NULL);
-    // Create the tasks for the scroll wheel.
-    xTaskCreate(swheel_task, "swheel_task", 2048, NULL, 1, NULL);
-    // Create the tasks for the Pixart PAW3395 sensor.
-    xTaskCreate(sensor_task, "sensor_task", 4096, NULL, 1, NULL);
-
-    // Main loop
-    while (1)
-    {
-    }
-}
+    // Everything runs in the tasks, returning frees the main task.
+}
\ No newline at end of file
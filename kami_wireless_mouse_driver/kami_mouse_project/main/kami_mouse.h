@@ -24,9 +24,42 @@ typedef enum {
 
 #define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN)
 
+/**************** Tasks ****************/
+
+// Stack sizes in bytes, check the stack high-water marks in the profiler block before shrinking them.
+#define MB_LATCH_TASK_STACK_SIZE 2048
+#define BUTTON_DEBOUNCE_TASK_STACK_SIZE 2048
+#define SWHEEL_TASK_STACK_SIZE 2048
+#define SENSOR_TASK_STACK_SIZE 4096
+#define POWER_TASK_STACK_SIZE 3072
+#define TRANSPORT_TASK_STACK_SIZE 3072
+#define MACRO_TASK_STACK_SIZE 2048
+#define RADIO_TASK_STACK_SIZE 4096
+#define SETTINGS_TASK_STACK_SIZE 3072
+#define TRACE_TASK_STACK_SIZE 4096
+#define PROFILER_TASK_STACK_SIZE 3072
+#define FRAME_CAPTURE_TASK_STACK_SIZE 3072
+#define LATENCY_BENCH_TASK_STACK_SIZE 4096
+#define LOAD_GEN_TASK_STACK_SIZE 4096
+
+// Tasks live in static memory, the stack and control block of each are in .bss and counted at link time.
+// The task is named after its function.
+#define TASK_CREATE_STATIC(task, stack_size, priority)                                         \
+    do                                                                                         \
+    {                                                                                          \
+        static StackType_t task##_stack[stack_size];                                           \
+        static StaticTask_t task##_tcb;                                                        \
+        xTaskCreateStatic(task, #task, stack_size, NULL, priority, task##_stack, &task##_tcb); \
+    } while (0)
+
 // Pre declarations
 // Non static functions visible outside file
 uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance);
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen);
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize);
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len);
+void tud_mount_cb(void);
+void tud_umount_cb(void);
+void tud_suspend_cb(bool remote_wakeup_en);
+void tud_resume_cb(void);
 void app_main(void);
\ No newline at end of file
@@ -1,11 +1,19 @@
 #include "header/eager_debounce_switch.h"
-
+#include "header/heap_guard.h"
+#include "header/load_gen.h"
+#include "header/power.h"
+#include "header/settings.h"
+#include "header/telemetry.h"
+#include "header/trace.h"
+#include "header/transport.h"
+
+static void button_edge(debounced_button_t *button);
+static void button_feed(debounced_button_t *button, int level, uint32_t now_us);
 static void mmb_isr(void *arg);
 static void smb4_isr(void *arg);
 static void smb5_isr(void *arg);
-static void mmb_debounce_task_report(void);
-static void smb4_debounce_task_report(void);
-static void smb5_debounce_task_report(void);
+static bool button_debounce_task_report(debounced_button_t *button, uint32_t now_us);
+static void button_debounce_tune_init(debounced_button_t *button);
 
 /************* IO Configs ****************/
 
@@ -28,188 +36,185 @@ static const gpio_config_t side_button_config = {
     .pull_down_en = false,
 };
 
+static debounced_button_t mmb = {.pin = GPIO_NUM_10, .button = INPUT_BUTTON_MIDDLE, .name = "MMB"};
+static debounced_button_t smb4 = {.pin = GPIO_NUM_18, .button = INPUT_BUTTON_BACK, .name = "SMB4"};
+static debounced_button_t smb5 = {.pin = GPIO_NUM_19, .button = INPUT_BUTTON_FORWARD, .name = "SMB5"};
+static debounced_button_t *const debounced_buttons[DEBOUNCED_BUTTON_COUNT] = {&mmb, &smb4, &smb5};
+
+// The ISRs and the task may run on different cores.
+static portMUX_TYPE button_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Start each button at the configured upper bound, settings are loaded by now.
+static void button_debounce_tune_init(debounced_button_t *button)
+{
+    settings_t current;
+    settings_snapshot(&current);
+    input_debounce_tune_init(&button->tune, current.debounce_min_ms * 1000, current.debounce_ms * 1000);
+}
+
 // Initialize the software debouncing for the mouse wheel button and side buttons.
 void button_debounce_init(void)
 {
     ESP_ERROR_CHECK(gpio_config(&wheel_button_config));
     ESP_ERROR_CHECK(gpio_config(&side_button_config));
+    for (int i = 0; i < DEBOUNCED_BUTTON_COUNT; i++)
+    {
+        button_debounce_tune_init(debounced_buttons[i]);
+        debounced_buttons[i]->level = INPUT_PIN_LEVEL(debounced_buttons[i]->pin);
+    }
     ESP_LOGI(TAG, "USB button_debounce_init");
 }
 
-static bool mmb_event = false;
-static bool smb4_event = false;
-static bool smb5_event = false;
-
-static mouse_button_state_t mmb_state = MOUSE_BUTTON_UP;
-static mouse_button_state_t smb4_state = MOUSE_BUTTON_UP;
-static mouse_button_state_t smb5_state = MOUSE_BUTTON_UP;
-
-// Global variables for the button debouncing.
-static uint8_t mmb_hold_start = 0;
-static uint8_t smb4_hold_start = 0;
-static uint8_t smb5_hold_start = 0;
-
-static void mmb_isr(void *arg)
+// Copy the wear statistics out for the host.
+void button_debounce_wear_snapshot(switch_wear_stats_t *stats)
 {
-    // Don't allow button unpressed events to be sent if the hold time has not been met.
-    // Eager debounce for DOWN events.
-    if (mmb_state == MOUSE_BUTTON_DOWN)
+    portENTER_CRITICAL(&button_lock);
+    for (int i = 0; i < DEBOUNCED_BUTTON_COUNT; i++)
     {
-        // The button is debounced by waiting for it to be stable for STABLE_POLL_TIME_MS.
-        // But we take samples every 1ms to check for glitches.
-        // Since this is the UP state, we should get low glitching.
-        for (int i = 0; i < STABLE_POLL_TIME_MS; i++)
-        {
-            bool observed_mmb_state = gpio_get_level(GPIO_NUM_10);
-            if (observed_mmb_state == mmb_state)
-            {
-                return;
-            }
-            vTaskDelay(pdMS_TO_TICKS(1));
-        }
-    }
-    else
-    {
-        // Track the time the button was pressed.
-        mmb_hold_start = esp_timer_get_time();
+        stats->switches[i] = debounced_buttons[i]->tune.wear;
     }
+    portEXIT_CRITICAL(&button_lock);
+}
 
-    mmb_state = !mmb_state;
-    mmb_event = true;
+// Feed a pin edge into the button's debouncer.
+// The ISR never waits, the stable time is checked by button_debounce_task.
+static void HOT_PATH button_edge(debounced_button_t *button)
+{
+    // First, so a pin armed for light sleep is back on its edge interrupt before it can fire again.
+    power_wake_from_isr();
+    int level = INPUT_PIN_LEVEL(button->pin);
+    trace_record_gpio(button->pin, level);
+    button_feed(button, level, esp_timer_get_time());
 }
 
-static void smb4_isr(void *arg)
+static void HOT_PATH button_feed(debounced_button_t *button, int level, uint32_t now_us)
 {
-    // Don't allow button unpressed events to be sent if the hold time has not been met.
-    // Eager debounce for DOWN events.
-    if (smb4_state == MOUSE_BUTTON_DOWN)
-    {
-        // The button is debounced by waiting for it to be stable for STABLE_POLL_TIME_MS.
-        // But we take samples every 1ms to check for glitches.
-        // Since this is the UP state, we should get low glitching.
-        for (int i = 0; i < STABLE_POLL_TIME_MS; i++)
-        {
-            bool observed_smb4_state = gpio_get_level(GPIO_NUM_18);
-            if (observed_smb4_state == smb4_state)
-            {
-                return;
-            }
-            vTaskDelay(pdMS_TO_TICKS(1));
-        }
-    }
-    else
+    portENTER_CRITICAL_ISR(&button_lock);
+    button->level = level;
+    input_debounce_tune_edge(&button->tune, now_us);
+#if BUTTON_DEBOUNCE_DEFERRED
+    input_deferred_debounce_edge(&button->debounce, level, now_us);
+#else
+    if (input_eager_debounce_edge(&button->debounce, level, now_us))
     {
-        // Track the time the button was pressed.
-        smb4_hold_start = esp_timer_get_time();
+        button->pressed = true;
+        button->event_us = now_us;
     }
+#endif
+    portEXIT_CRITICAL_ISR(&button_lock);
+}
 
-    smb4_state = !smb4_state;
-    smb4_event = true;
+static void HOT_PATH mmb_isr(void *arg)
+{
+    button_edge(&mmb);
 }
 
-static void smb5_isr(void *arg)
+static void HOT_PATH smb4_isr(void *arg)
 {
-    // Don't allow button unpressed events to be sent if the hold time has not been met.
-    // Eager debounce for DOWN events.
-    if (smb5_state == MOUSE_BUTTON_DOWN)
-    {
-        // The button is debounced by waiting for it to be stable for STABLE_POLL_TIME_MS.
-        // But we take samples every 1ms to check for glitches.
-        // Since this is the UP state, we should get low glitching.
-        for (int i = 0; i < STABLE_POLL_TIME_MS; i++)
-        {
-            bool observed_smb5_state = gpio_get_level(GPIO_NUM_19);
-            if (observed_smb5_state == smb5_state)
-            {
-                return;
-            }
-            vTaskDelay(pdMS_TO_TICKS(1));
-        }
-    }
-    else
-    {
-        // Track the time the button was pressed.
-        smb5_hold_start = esp_timer_get_time();
-    }
+    button_edge(&smb4);
+}
 
-    smb5_state = !smb5_state;
-    smb5_event = true;
+static void HOT_PATH smb5_isr(void *arg)
+{
+    button_edge(&smb5);
 }
 
-// Report the mmb button state.
-static void mmb_debounce_task_report(void)
+// Report a button whose debounced state changed.
+// Returns true if a report was made.
+static bool button_debounce_task_report(debounced_button_t *button, uint32_t now_us)
 {
-    // Send a mouse report to the host when the mouse button is pressed or released.
-    if (mmb_event == MOUSE_BUTTON_DOWN)
+    bool changed = false;
+    settings_t current;
+    settings_snapshot(&current);
+    portENTER_CRITICAL(&button_lock);
+    // The hold time learned from this button's bounce, within the configured bounds.
+    uint32_t stable_us = input_debounce_tune_poll(&button->tune, now_us, current.debounce_min_ms * 1000, current.debounce_ms * 1000);
+#if BUTTON_DEBOUNCE_DEFERRED
+    changed = input_deferred_debounce_poll(&button->debounce, now_us, stable_us);
+    button->event_us = button->debounce.edge_us;
+#else
+    if (button->pressed)
     {
-        ESP_LOGI(TAG, "MMB: DOWN");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x01, 0, 0, 0, 0);
+        button->pressed = false;
+        changed = true;
     }
-    else
+    else if (input_eager_debounce_poll(&button->debounce, now_us, stable_us))
     {
-        ESP_LOGI(TAG, "MMB: UP");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x01, 0, 0, 0, 0);
+        changed = true;
+        button->event_us = button->debounce.release_start_us;
     }
-}
+#endif
+    bool down = button->debounce.state == MOUSE_BUTTON_DOWN;
+    if (changed && !down)
+    {
+        input_debounce_tune_release(&button->tune);
+    }
+    uint32_t chatter = button->tune.wear.chatter;
+    uint32_t hold_us = button->tune.wear.hold_us;
+    portEXIT_CRITICAL(&button_lock);
 
-// Report the smb4 button state.
-static void smb4_debounce_task_report(void)
-{
-    // Send a mouse report to the host when the mouse button is pressed or released.
-    if (smb4_event == MOUSE_BUTTON_DOWN)
+    if (changed)
     {
-        ESP_LOGI(TAG, "SMB4: DOWN");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x02, 0, 0, 0, 0);
+        // Send a mouse report to the host when the mouse button is pressed or released.
+        HOT_PATH_LOGI(TAG, "%s: %s", button->name, down ? "DOWN" : "UP");
+        transport_report_button(button->button, down);
+        TELEMETRY_COUNT(button_events);
+        telemetry_record_latency(TELEMETRY_LATENCY_BUTTON, esp_timer_get_time() - button->event_us);
     }
-    else
+    // The warning is a blocking UART write, it goes out after the report it would otherwise hold up.
+    if (chatter != button->chatter_logged)
     {
-        ESP_LOGI(TAG, "SMB4: UP");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x02, 0, 0, 0, 0);
+        button->chatter_logged = chatter;
+        ESP_LOGW(TAG, "%s chatter, release hold now %lu us", button->name, hold_us);
     }
+    return changed;
 }
 
-// Report the smb5 button state.
-static void smb5_debounce_task_report(void)
+// Feed a pin change the ULP saw while the main CPU slept, index is in MMB, SMB4, SMB5 order.
+// The debouncer is polled at the time of the change first, as the task would have, so a press and
+// a release in the ULP buffer are reported as two events.
+void button_debounce_replay(int index, int level, uint32_t event_us)
 {
-    // Send a mouse report to the host when the mouse button is pressed or released.
-    if (smb5_event == MOUSE_BUTTON_DOWN)
-    {
-        ESP_LOGI(TAG, "SMB5: DOWN");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x04, 0, 0, 0, 0);
-    }
-    else
+    debounced_button_t *button = debounced_buttons[index];
+    portENTER_CRITICAL(&button_lock);
+    bool seen = level == button->level;
+    portEXIT_CRITICAL(&button_lock);
+    // The ISR got there first.
+    if (seen)
     {
-        ESP_LOGI(TAG, "SMB5: UP");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x04, 0, 0, 0, 0);
+        return;
     }
+    button_debounce_task_report(button, event_us);
+    trace_record_gpio(button->pin, level);
+    button_feed(button, level, event_us);
 }
 
 // Implement a software debounce for the mouse wheel button and side buttons.
-// The mouse button is debounced when the mouse button is pressed.
-// The mouse button is debounced when the mouse button is released.
+// The ISRs feed the edges in, this task reports the debounced state once per millisecond.
 void button_debounce_task(void *arg)
 {
-    gpio_install_isr_service(0);
-    gpio_isr_handler_add(GPIO_NUM_10, mmb_isr, NULL);
-    gpio_isr_handler_add(GPIO_NUM_18, smb4_isr, NULL);
-    gpio_isr_handler_add(GPIO_NUM_19, smb5_isr, NULL);
+    gpio_install_isr_service(HOT_PATH_ISR_FLAGS);
+    profiler_isr_handler_add(GPIO_NUM_10, mmb_isr, NULL);
+    profiler_isr_handler_add(GPIO_NUM_18, smb4_isr, NULL);
+    profiler_isr_handler_add(GPIO_NUM_19, smb5_isr, NULL);
+    power_add_wake_pin(GPIO_NUM_10, GPIO_INTR_ANYEDGE);
+    power_add_wake_pin(GPIO_NUM_18, GPIO_INTR_ANYEDGE);
+    power_add_wake_pin(GPIO_NUM_19, GPIO_INTR_ANYEDGE);
+    heap_guard_watch();
 
     while (1)
     {
-        if (mmb_event)
-        {
-            mmb_event = false;
-            mmb_debounce_task_report();
-        }
-        if (smb4_event)
-        {
-            smb4_event = false;
-            smb4_debounce_task_report();
-        }
-        if (smb5_event)
+        // Parked while the host is suspended, a press still wakes it through the ISR.
+        power_wait_active();
+        TELEMETRY_COUNT(task_wakeups);
+        uint32_t now_us = esp_timer_get_time();
+        button_debounce_task_report(&mmb, now_us);
+        button_debounce_task_report(&smb4, now_us);
+        // Pressing both side buttons together dumps the input trace.
+        if (button_debounce_task_report(&smb5, now_us) && smb4.debounce.state == MOUSE_BUTTON_DOWN &&
+            smb5.debounce.state == MOUSE_BUTTON_DOWN)
         {
-            smb5_event = false;
-            smb5_debounce_task_report();
+            trace_request_dump();
         }
         vTaskDelay(pdMS_TO_TICKS(1));
     }
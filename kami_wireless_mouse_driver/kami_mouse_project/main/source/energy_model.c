@@ -0,0 +1,140 @@
+#include "header/energy_model.h"
+
+// Nanocoulombs in a microamp hour.
+#define ENERGY_NC_PER_UAH 3600000ull
+
+static uint64_t energy_sum_ms(const uint32_t *ms, int count);
+static uint32_t energy_uah(uint64_t nc);
+
+// Typical figures from the ESP32-S3 and PAW3395 datasheets, to be replaced by measurements of the board.
+// The CPU levels are 240 MHz, 80 MHz and light sleep with the radio off, the radio packet is one ESP-NOW frame
+// with its wake of the RF. A wakeup is the context switch and cache refill of a task, an SPI transaction the
+// CPU time around one DMA transfer.
+const energy_costs_t energy_costs_default = {
+    .cpu_ua = {
+        [POWER_LEVEL_FULL] = 45000,
+        [POWER_LEVEL_IDLE] = 20000,
+        [POWER_LEVEL_SLEEP] = 1000,
+    },
+    .sensor_ua = {
+        [ENERGY_SENSOR_HPM] = 6500,
+        [ENERGY_SENSOR_LPM] = 4000,
+        [ENERGY_SENSOR_WRK] = 3000,
+        [ENERGY_SENSOR_CRD] = 9000,
+        [ENERGY_SENSOR_REST1] = 1000,
+        [ENERGY_SENSOR_REST2] = 300,
+        [ENERGY_SENSOR_REST3] = 100,
+        [ENERGY_SENSOR_PARKED] = 100,
+    },
+    .spi_transaction_nc = 60,
+    .task_wakeup_nc = 100,
+    .radio_packet_nc = 50000,
+    .battery_mah = 500,
+};
+
+// A cost table from the host, every current and charge bounded and a battery to drain.
+bool energy_costs_valid(const energy_costs_t *costs)
+{
+    for (int i = 0; i < POWER_LEVEL_COUNT; i++)
+    {
+        if (costs->cpu_ua[i] > ENERGY_CURRENT_UA_MAX)
+        {
+            return false;
+        }
+    }
+    for (int i = 0; i < ENERGY_SENSOR_COUNT; i++)
+    {
+        if (costs->sensor_ua[i] > ENERGY_CURRENT_UA_MAX)
+        {
+            return false;
+        }
+    }
+    return costs->spi_transaction_nc <= ENERGY_CHARGE_NC_MAX && costs->task_wakeup_nc <= ENERGY_CHARGE_NC_MAX &&
+           costs->radio_packet_nc <= ENERGY_CHARGE_NC_MAX && costs->battery_mah != 0 &&
+           costs->battery_mah <= ENERGY_BATTERY_MAH_MAX;
+}
+
+// Counts since boot or the last telemetry reset. Time the sensor was parked is not tracked and left to the estimate.
+void energy_counts_from_telemetry(energy_counts_t *counts, const telemetry_counters_t *counters)
+{
+    *counts = (energy_counts_t){
+        .elapsed_ms = counters->counted_ms,
+        .cpu_ms = {
+            [POWER_LEVEL_FULL] = counters->power_time_full_ms,
+            [POWER_LEVEL_IDLE] = counters->power_time_idle_ms,
+            [POWER_LEVEL_SLEEP] = counters->power_time_sleep_ms,
+        },
+        .sensor_ms = {
+            [ENERGY_SENSOR_HPM] = counters->sensor_run_hpm_ms,
+            [ENERGY_SENSOR_LPM] = counters->sensor_run_lpm_ms,
+            [ENERGY_SENSOR_WRK] = counters->sensor_run_wrk_ms,
+            [ENERGY_SENSOR_CRD] = counters->sensor_run_crd_ms,
+            [ENERGY_SENSOR_REST1] = counters->sensor_rest1_ms,
+            [ENERGY_SENSOR_REST2] = counters->sensor_rest2_ms,
+            [ENERGY_SENSOR_REST3] = counters->sensor_rest3_ms,
+        },
+        .spi_transactions = counters->spi_transactions,
+        .task_wakeups = counters->task_wakeups,
+        .radio_packets = counters->radio_packets_sent,
+    };
+}
+
+static uint64_t energy_sum_ms(const uint32_t *ms, int count)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < count; i++)
+    {
+        sum += ms[i];
+    }
+    return sum;
+}
+
+static uint32_t energy_uah(uint64_t nc)
+{
+    uint64_t uah = (nc + ENERGY_NC_PER_UAH / 2) / ENERGY_NC_PER_UAH;
+    return uah > UINT32_MAX ? UINT32_MAX : (uint32_t)uah;
+}
+
+// Estimate the charge drawn over the counts, a microamp for a millisecond is a nanocoulomb.
+// Elapsed time the CPU residency leaves out is charged at full speed, the sensor's at the parked current.
+void energy_estimate(energy_estimate_t *estimate, const energy_counts_t *counts, const energy_costs_t *costs)
+{
+    uint64_t cpu_ms = energy_sum_ms(counts->cpu_ms, POWER_LEVEL_COUNT);
+    uint64_t sensor_ms = energy_sum_ms(counts->sensor_ms, ENERGY_SENSOR_COUNT);
+    uint64_t elapsed_ms = counts->elapsed_ms;
+    elapsed_ms = cpu_ms > elapsed_ms ? cpu_ms : elapsed_ms;
+    elapsed_ms = sensor_ms > elapsed_ms ? sensor_ms : elapsed_ms;
+
+    uint64_t cpu_nc = (elapsed_ms - cpu_ms) * costs->cpu_ua[POWER_LEVEL_FULL];
+    for (int i = 0; i < POWER_LEVEL_COUNT; i++)
+    {
+        cpu_nc += (uint64_t)counts->cpu_ms[i] * costs->cpu_ua[i];
+    }
+    uint64_t sensor_nc = (elapsed_ms - sensor_ms) * costs->sensor_ua[ENERGY_SENSOR_PARKED];
+    for (int i = 0; i < ENERGY_SENSOR_COUNT; i++)
+    {
+        sensor_nc += (uint64_t)counts->sensor_ms[i] * costs->sensor_ua[i];
+    }
+    uint64_t spi_nc = (uint64_t)counts->spi_transactions * costs->spi_transaction_nc;
+    uint64_t wakeup_nc = (uint64_t)counts->task_wakeups * costs->task_wakeup_nc;
+    uint64_t radio_nc = (uint64_t)counts->radio_packets * costs->radio_packet_nc;
+    uint64_t total_nc = cpu_nc + sensor_nc + spi_nc + wakeup_nc + radio_nc;
+
+    *estimate = (energy_estimate_t){
+        .cpu_uah = energy_uah(cpu_nc),
+        .sensor_uah = energy_uah(sensor_nc),
+        .spi_uah = energy_uah(spi_nc),
+        .wakeup_uah = energy_uah(wakeup_nc),
+        .radio_uah = energy_uah(radio_nc),
+        .total_uah = energy_uah(total_nc),
+    };
+    if (elapsed_ms == 0)
+    {
+        return;
+    }
+    uint64_t average_ua = total_nc / elapsed_ms;
+    estimate->average_ua = average_ua > UINT32_MAX ? UINT32_MAX : (uint32_t)average_ua;
+    // Minutes until the battery is drained, unbounded when nothing draws current.
+    uint64_t life_min = average_ua ? (uint64_t)costs->battery_mah * 1000 * 60 / average_ua : UINT32_MAX;
+    estimate->battery_life_min = life_min > UINT32_MAX ? UINT32_MAX : (uint32_t)life_min;
+}
@@ -0,0 +1,234 @@
+#include "header/frame_capture.h"
+#include "header/power.h"
+
+#include "freertos/queue.h"
+
+static bool frame_capture_send(const uint8_t *frame);
+static void frame_capture_stop(const char *reason);
+static void frame_capture_log(void);
+
+/************* Buffers ****************/
+
+// Header and pixels of each frame, the pixels are the SPI DMA target.
+static DMA_ATTR uint8_t frame_capture_buffers[FRAME_CAPTURE_BUFFERS][FRAME_CAPTURE_BUFFER_SIZE];
+ESP_STATIC_ASSERT(sizeof(frame_header_t) % 4 == 0, "the pixels must start word aligned for the DMA");
+
+// Buffer indices, free ones wait for the sensor task and filled ones for the capture task.
+static QueueHandle_t frame_capture_free = NULL;
+static QueueHandle_t frame_capture_ready = NULL;
+static StaticQueue_t frame_capture_free_queue;
+static StaticQueue_t frame_capture_ready_queue;
+static uint8_t frame_capture_free_storage[FRAME_CAPTURE_BUFFERS * sizeof(int)];
+static uint8_t frame_capture_ready_storage[FRAME_CAPTURE_BUFFERS * sizeof(int)];
+// Buffer the sensor task is grabbing into, only touched by the sensor task.
+static int frame_capture_claimed = -1;
+
+// Set by the host's start command, cleared by its stop command or when the host stops reading.
+static volatile bool frame_capture_running = false;
+static TaskHandle_t frame_capture_task_handle = NULL;
+
+// Statistics since the start command.
+static uint32_t frame_capture_sequence = 0;
+static uint32_t frame_capture_stalls = 0;
+static uint32_t frame_capture_sent = 0;
+static uint32_t frame_capture_grab_us_sum = 0;
+// Statistics since the last log line.
+static uint32_t frame_capture_log_us = 0;
+static uint32_t frame_capture_log_sent = 0;
+static uint32_t frame_capture_log_grab_us = 0;
+
+void frame_capture_init(void)
+{
+    frame_capture_free = xQueueCreateStatic(FRAME_CAPTURE_BUFFERS, sizeof(int), frame_capture_free_storage, &frame_capture_free_queue);
+    frame_capture_ready = xQueueCreateStatic(FRAME_CAPTURE_BUFFERS, sizeof(int), frame_capture_ready_storage, &frame_capture_ready_queue);
+    for (int i = 0; i < FRAME_CAPTURE_BUFFERS; i++)
+    {
+        xQueueSend(frame_capture_free, &i, 0);
+    }
+    ESP_LOGI(TAG, "USB frame_capture_init");
+}
+
+/************* Host Commands ****************/
+
+// Output report on the capture interface, called from tud_hid_set_report_cb in the TinyUSB task.
+void frame_capture_command(const uint8_t *buffer, uint16_t bufsize)
+{
+    if (bufsize < 1)
+    {
+        return;
+    }
+    if (buffer[0] == FRAME_COMMAND_START && !frame_capture_running)
+    {
+        frame_capture_sequence = 0;
+        frame_capture_stalls = 0;
+        frame_capture_sent = 0;
+        frame_capture_grab_us_sum = 0;
+        frame_capture_log_us = esp_timer_get_time();
+        frame_capture_log_sent = 0;
+        frame_capture_log_grab_us = 0;
+        frame_capture_running = true;
+        // Brings a parked sensor task back, it starts grabbing on its next frame.
+        power_activity();
+        ESP_LOGI(TAG, "Frame capture requested");
+    }
+    else if (buffer[0] == FRAME_COMMAND_STOP)
+    {
+        frame_capture_stop("host request");
+    }
+}
+
+bool frame_capture_active(void)
+{
+    return frame_capture_running;
+}
+
+static void frame_capture_stop(const char *reason)
+{
+    if (!frame_capture_running)
+    {
+        return;
+    }
+    frame_capture_running = false;
+    ESP_LOGI(TAG, "Frame capture stopped by %s, %lu frames sent, %lu grabbed, %lu stalls", reason, frame_capture_sent,
+             frame_capture_sequence, frame_capture_stalls);
+}
+
+/************* Sensor Side ****************/
+
+// Take a free buffer for the next grab and return where its pixels go.
+// Returns NULL after FRAME_CAPTURE_CLAIM_MS with both buffers still going out, so the caller can check for a stop.
+uint8_t *frame_capture_claim(void)
+{
+    if (frame_capture_claimed < 0)
+    {
+        if (xQueueReceive(frame_capture_free, &frame_capture_claimed, 0) != pdTRUE)
+        {
+            // USB is the limit, the grab waits for it.
+            frame_capture_stalls++;
+            if (xQueueReceive(frame_capture_free, &frame_capture_claimed, pdMS_TO_TICKS(FRAME_CAPTURE_CLAIM_MS)) != pdTRUE)
+            {
+                frame_capture_claimed = -1;
+                return NULL;
+            }
+        }
+    }
+    return frame_capture_buffers[frame_capture_claimed] + sizeof(frame_header_t);
+}
+
+// Give back a claimed buffer without sending it, after a failed grab or when capture ended.
+void frame_capture_release(void)
+{
+    if (frame_capture_claimed >= 0)
+    {
+        xQueueSend(frame_capture_free, &frame_capture_claimed, 0);
+        frame_capture_claimed = -1;
+    }
+}
+
+// Hand the claimed buffer with a complete grab to the capture task.
+void frame_capture_submit(uint32_t timestamp_us, uint32_t grab_us)
+{
+    if (frame_capture_claimed < 0)
+    {
+        return;
+    }
+    const frame_header_t header = {
+        .magic = FRAME_MAGIC,
+        .sequence = frame_capture_sequence++,
+        .timestamp_us = timestamp_us,
+        .grab_us = min(grab_us, UINT16_MAX),
+        .width = SENSOR_RAW_FRAME_WIDTH,
+        .height = SENSOR_RAW_FRAME_HEIGHT,
+        .stalls = frame_capture_stalls,
+    };
+    memcpy(frame_capture_buffers[frame_capture_claimed], &header, sizeof(header));
+    frame_capture_grab_us_sum += grab_us;
+    xQueueSend(frame_capture_ready, &frame_capture_claimed, 0);
+    frame_capture_claimed = -1;
+}
+
+/************* USB Side ****************/
+
+// Called from tud_hid_report_complete_cb, the capture endpoint takes the next packet.
+void frame_capture_notify(void)
+{
+    if (frame_capture_task_handle != NULL)
+    {
+        xTaskNotifyGive(frame_capture_task_handle);
+    }
+}
+
+// Send one frame as FRAME_CHUNKS packets, returns false if capture stopped or the host took no packet in time.
+static bool frame_capture_send(const uint8_t *frame)
+{
+    uint8_t packet[FRAME_PACKET_SIZE];
+    packet[0] = frame[offsetof(frame_header_t, sequence)];
+    for (uint32_t chunk = 0; chunk < FRAME_CHUNKS; chunk++)
+    {
+        uint32_t offset = chunk * FRAME_CHUNK_SIZE;
+        uint32_t length = min(FRAME_CHUNK_SIZE, FRAME_SIZE - offset);
+        packet[1] = chunk;
+        memcpy(&packet[FRAME_PACKET_HEADER_SIZE], frame + offset, length);
+        memset(&packet[FRAME_PACKET_HEADER_SIZE + length], 0, FRAME_CHUNK_SIZE - length);
+
+        // TinyUSB copies the packet, the endpoint is free again once the host polled the previous one.
+        while (!tud_hid_n_ready(FRAME_CAPTURE_HID_INSTANCE))
+        {
+            if (!frame_capture_running || !tud_mounted())
+            {
+                return false;
+            }
+            if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(FRAME_CAPTURE_HOST_TIMEOUT_MS)) == 0)
+            {
+                return false;
+            }
+        }
+        if (!tud_hid_n_report(FRAME_CAPTURE_HID_INSTANCE, 0, packet, sizeof(packet)))
+        {
+            return false;
+        }
+    }
+    frame_capture_sent++;
+    return true;
+}
+
+// Frames per second and the mean grab time over the last interval.
+static void frame_capture_log(void)
+{
+    uint32_t now_us = esp_timer_get_time();
+    uint32_t elapsed_us = now_us - frame_capture_log_us;
+    if (!frame_capture_running || elapsed_us < FRAME_CAPTURE_LOG_MS * 1000)
+    {
+        return;
+    }
+    uint32_t frames = frame_capture_sent - frame_capture_log_sent;
+    uint32_t grab_us = frame_capture_grab_us_sum - frame_capture_log_grab_us;
+    ESP_LOGI(TAG, "Frame capture: %lu fps, %lu bytes/s, grab %lu us, %lu stalls",
+             (uint32_t)((uint64_t)frames * 1000000 / elapsed_us), (uint32_t)((uint64_t)frames * FRAME_SIZE * 1000000 / elapsed_us),
+             frames ? grab_us / frames : 0, frame_capture_stalls);
+    frame_capture_log_us = now_us;
+    frame_capture_log_sent = frame_capture_sent;
+    frame_capture_log_grab_us = frame_capture_grab_us_sum;
+}
+
+// Capture task
+// Streams the grabbed frames while the sensor task fills the other buffer.
+void frame_capture_task(void *arg)
+{
+    frame_capture_task_handle = xTaskGetCurrentTaskHandle();
+
+    while (1)
+    {
+        int index;
+        if (xQueueReceive(frame_capture_ready, &index, pdMS_TO_TICKS(FRAME_CAPTURE_LOG_MS)) == pdTRUE)
+        {
+            // A frame grabbed just before a stop is dropped.
+            if (frame_capture_running && !frame_capture_send(frame_capture_buffers[index]))
+            {
+                frame_capture_stop(tud_mounted() ? "host timeout" : "unplug");
+            }
+            xQueueSend(frame_capture_free, &index, 0);
+        }
+        frame_capture_log();
+    }
+}
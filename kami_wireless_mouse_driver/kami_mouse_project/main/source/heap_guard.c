@@ -0,0 +1,83 @@
+#include "header/heap_guard.h"
+
+#if HEAP_GUARD_ENABLED
+
+#include "esp_heap_caps.h"
+#include "esp_rom_sys.h"
+
+/************* Watched Tasks ****************/
+
+// Input tasks past their setup, a task is added once and never removed.
+static TaskHandle_t heap_guard_tasks[HEAP_GUARD_TASKS_MAX];
+static volatile int heap_guard_task_count = 0;
+static portMUX_TYPE heap_guard_lock = portMUX_INITIALIZER_UNLOCKED;
+// A watched task redoing part of its setup, its allocations are let through until it resumes the guard.
+static volatile TaskHandle_t heap_guard_paused = NULL;
+
+// Called by an input task once its setup is done, any allocation it makes from then on aborts.
+// Interrupts are watched from the first call on.
+void heap_guard_watch(void)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    bool added = false;
+    portENTER_CRITICAL(&heap_guard_lock);
+    if (heap_guard_task_count < HEAP_GUARD_TASKS_MAX)
+    {
+        heap_guard_tasks[heap_guard_task_count] = task;
+        heap_guard_task_count++;
+        added = true;
+    }
+    portEXIT_CRITICAL(&heap_guard_lock);
+
+    if (!added)
+    {
+        ESP_LOGE(TAG, "Heap guard full, %s is not watched", pcTaskGetName(task));
+        return;
+    }
+    ESP_LOGI(TAG, "Heap guard watching %s", pcTaskGetName(task));
+}
+
+// Let the calling task allocate until heap_guard_resume, for setup it redoes outside the input path,
+// e.g. the sensor task re-adding its SPI device during a link calibration.
+void heap_guard_pause(void)
+{
+    heap_guard_paused = xTaskGetCurrentTaskHandle();
+}
+
+void heap_guard_resume(void)
+{
+    heap_guard_paused = NULL;
+}
+
+/************* Heap Hook ****************/
+
+// Called by ESP-IDF after every allocation with CONFIG_HEAP_USE_HOOKS, in any task or interrupt.
+// The abort prints the backtrace, the frame above the heap functions is the caller.
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    int count = heap_guard_task_count;
+    if (count == 0)
+    {
+        return;
+    }
+    if (xPortInIsrContext())
+    {
+        esp_rom_printf(DRAM_STR("heap guard: %u bytes allocated in an interrupt\n"), size);
+        abort();
+    }
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    if (task == heap_guard_paused)
+    {
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (heap_guard_tasks[i] == task)
+        {
+            esp_rom_printf(DRAM_STR("heap guard: %u bytes allocated by %s after its setup\n"), size, pcTaskGetName(task));
+            abort();
+        }
+    }
+}
+
+#endif
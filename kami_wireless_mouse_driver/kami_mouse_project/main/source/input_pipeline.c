@@ -0,0 +1,388 @@
+#include "header/input_pipeline.h"
+
+/************* Motion Burst ****************/
+
+// Decode a 12 byte motion burst.
+// Returns false if the motion bit is not set, in which case the deltas are zero.
+bool HOT_PATH input_decode_motion_burst(const uint8_t *response, motion_burst_t *burst)
+{
+    burst->motion = response[SENSOR_BURST_MOTION];
+    burst->op_mode = (burst->motion & SENSOR_MOTION_OP_MODE_MASK) >> SENSOR_MOTION_OP_MODE_SHIFT;
+    burst->squal = response[SENSOR_BURST_SQUAL];
+    // The operation mode bits are set in every rest mode, only the motion bit means new deltas.
+    if (!(burst->motion & SENSOR_MOTION_BIT))
+    {
+        burst->delta_x = 0;
+        burst->delta_y = 0;
+        return false;
+    }
+
+    // The motion data is a 16 bit signed integer.
+    burst->delta_x = (int16_t)(response[SENSOR_BURST_DELTA_X_L] | response[SENSOR_BURST_DELTA_X_H] << 8);
+    burst->delta_y = (int16_t)(response[SENSOR_BURST_DELTA_Y_L] | response[SENSOR_BURST_DELTA_Y_H] << 8);
+    return true;
+}
+
+// Check that a motion burst looks like it came from a working sensor.
+// A stuck or unpowered MISO line reads as all zeros or all ones, which a running sensor never reports
+// because the shutter is never zero and the unused motion register bits are never all set.
+// Deltas are only latched together with the motion bit.
+bool HOT_PATH input_motion_burst_plausible(const uint8_t *response)
+{
+    bool all_zero = true;
+    bool all_ones = true;
+    for (int i = 0; i < SENSOR_MOTION_BURST_SIZE; i++)
+    {
+        all_zero = all_zero && response[i] == 0x00;
+        all_ones = all_ones && response[i] == 0xFF;
+    }
+    if (all_zero || all_ones)
+    {
+        return false;
+    }
+
+    bool has_delta = response[SENSOR_BURST_DELTA_X_L] | response[SENSOR_BURST_DELTA_X_H] |
+                     response[SENSOR_BURST_DELTA_Y_L] | response[SENSOR_BURST_DELTA_Y_H];
+    return !has_delta || (response[SENSOR_BURST_MOTION] & SENSOR_MOTION_BIT);
+}
+
+/************* Motion Ring ****************/
+
+// Queue a motion sample for the transport.
+// Returns false if the ring was full and its two oldest samples were merged to make room.
+bool HOT_PATH input_motion_ring_push(motion_ring_t *ring, int16_t motion_x, int16_t motion_y, uint32_t timestamp)
+{
+    ring->samples[ring->write_index].motion_x = motion_x;
+    ring->samples[ring->write_index].motion_y = motion_y;
+    ring->samples[ring->write_index].timestamp = timestamp;
+
+    bool merged = false;
+    int next_write_index = (ring->write_index + 1) % MOTION_RING_SIZE;
+    if (next_write_index == ring->read_index)
+    {
+        // Drop the oldest sample by adding its motion to the second oldest.
+        int next_read_index = (ring->read_index + 1) % MOTION_RING_SIZE;
+        ring->samples[next_read_index].motion_x += ring->samples[ring->read_index].motion_x;
+        ring->samples[next_read_index].motion_y += ring->samples[ring->read_index].motion_y;
+        ring->read_index = next_read_index;
+        merged = true;
+    }
+    ring->write_index = next_write_index;
+    return !merged;
+}
+
+// Take the oldest motion sample, returns false if the ring is empty.
+bool HOT_PATH input_motion_ring_pop(motion_ring_t *ring, motion_sample_t *sample)
+{
+    if (ring->read_index == ring->write_index)
+    {
+        return false;
+    }
+    *sample = ring->samples[ring->read_index];
+    ring->read_index = (ring->read_index + 1) % MOTION_RING_SIZE;
+    return true;
+}
+
+// Drop every queued sample, e.g. motion from before a sensor recovery.
+void input_motion_ring_clear(motion_ring_t *ring)
+{
+    ring->read_index = ring->write_index;
+}
+
+/************* Latch Switch ****************/
+
+// Calculate the next state of a latched button from its NO and NC pins.
+mouse_button_state_t HOT_PATH input_latch_state(int no_level, int nc_level, mouse_button_state_t current_state)
+{
+    // Check for a valid transition.
+    if (no_level == nc_level)
+    {
+        return current_state;
+    }
+
+    // Pins are active low, so the observed state should be 1 for pressed and 0 for released.
+    return no_level ? MOUSE_BUTTON_DOWN : MOUSE_BUTTON_UP;
+}
+
+/************* Scroll Wheel ****************/
+
+// Decode one edge of the rotary encoder.
+// Direction is determined by the active level of the other pin.
+int HOT_PATH input_quadrature_step(bool a_changed, int a_level, int b_level)
+{
+    if (a_changed)
+    {
+        // An A transition is up when both pins end at the same level.
+        return (a_level == b_level) ? QUADRATURE_STEP_UP : QUADRATURE_STEP_DOWN;
+    }
+    // A B transition is up when the pins end at different levels.
+    return (a_level != b_level) ? QUADRATURE_STEP_UP : QUADRATURE_STEP_DOWN;
+}
+
+/************* Eager Debounce ****************/
+
+// Feed an edge into the debouncer.
+// Returns true if the button state changed.
+bool HOT_PATH input_eager_debounce_edge(eager_debounce_t *debounce, int level, uint32_t now_us)
+{
+    // Eager debounce for DOWN events.
+    if (debounce->state == MOUSE_BUTTON_UP)
+    {
+        debounce->state = MOUSE_BUTTON_DOWN;
+        debounce->release_pending = false;
+        return true;
+    }
+
+    // Don't allow button unpressed events to be sent if the hold time has not been met.
+    if (level == (int)debounce->state)
+    {
+        // The pin glitched back, so restart the hold time on the next edge.
+        debounce->release_pending = false;
+    }
+    else if (!debounce->release_pending)
+    {
+        debounce->release_pending = true;
+        debounce->release_start_us = now_us;
+    }
+    return false;
+}
+
+// Poll the debouncer for a pending release.
+// Returns true if the button state changed.
+bool input_eager_debounce_poll(eager_debounce_t *debounce, uint32_t now_us, uint32_t stable_us)
+{
+    if (!debounce->release_pending || (uint32_t)(now_us - debounce->release_start_us) < stable_us)
+    {
+        return false;
+    }
+
+    debounce->release_pending = false;
+    debounce->state = MOUSE_BUTTON_UP;
+    return true;
+}
+
+/************* Deferred Debounce ****************/
+
+// Feed an edge into the debouncer, every edge restarts the stable time.
+void HOT_PATH input_deferred_debounce_edge(deferred_debounce_t *debounce, int level, uint32_t now_us)
+{
+    debounce->level = level;
+    debounce->edge_us = now_us;
+    debounce->pending = true;
+}
+
+// Poll the debouncer for a level that has settled.
+// Returns true if the button state changed.
+bool input_deferred_debounce_poll(deferred_debounce_t *debounce, uint32_t now_us, uint32_t stable_us)
+{
+    if (!debounce->pending || (uint32_t)(now_us - debounce->edge_us) < stable_us)
+    {
+        return false;
+    }
+
+    debounce->pending = false;
+    mouse_button_state_t state = debounce->level ? MOUSE_BUTTON_DOWN : MOUSE_BUTTON_UP;
+    if (state == debounce->state)
+    {
+        // The pin bounced back before it settled.
+        return false;
+    }
+    debounce->state = state;
+    return true;
+}
+
+/************* Debounce Tuning ****************/
+
+// Hold time from the bounce peak, the upper bound until enough transitions were measured.
+static void HOT_PATH input_debounce_tune_learn(debounce_tuner_t *tuner)
+{
+    uint32_t hold_us = tuner->wear.bounce_peak_us * 2 + DEBOUNCE_TUNE_MARGIN_US;
+    if (tuner->wear.transitions < DEBOUNCE_TUNE_WARMUP || hold_us > tuner->max_us)
+    {
+        hold_us = tuner->max_us;
+    }
+    tuner->wear.hold_us = hold_us < tuner->min_us ? tuner->min_us : hold_us;
+}
+
+// The pin stayed quiet long enough, the transition is over and its bounce is known.
+static void HOT_PATH input_debounce_tune_close(debounce_tuner_t *tuner)
+{
+    uint32_t bounce_us = tuner->last_edge_us - tuner->start_us;
+    tuner->open = false;
+    tuner->wear.transitions++;
+    tuner->wear.glitches += tuner->edges - 1;
+    tuner->wear.bounce_last_us = bounce_us;
+    if (bounce_us > tuner->wear.bounce_max_us)
+    {
+        tuner->wear.bounce_max_us = bounce_us;
+    }
+    tuner->wear.bounce_peak_us -= tuner->wear.bounce_peak_us >> DEBOUNCE_TUNE_DECAY_SHIFT;
+    if (bounce_us > tuner->wear.bounce_peak_us)
+    {
+        tuner->wear.bounce_peak_us = bounce_us;
+    }
+    input_debounce_tune_learn(tuner);
+}
+
+// Start at the upper bound until the switch has been measured.
+void input_debounce_tune_init(debounce_tuner_t *tuner, uint32_t min_us, uint32_t max_us)
+{
+    *tuner = (debounce_tuner_t){.min_us = min_us, .max_us = max_us};
+    input_debounce_tune_learn(tuner);
+}
+
+// Measure an edge of the switch, called next to the debouncer's edge.
+void HOT_PATH input_debounce_tune_edge(debounce_tuner_t *tuner, uint32_t now_us)
+{
+    if (tuner->open && (uint32_t)(now_us - tuner->last_edge_us) >= tuner->max_us)
+    {
+        input_debounce_tune_close(tuner);
+    }
+    if (!tuner->open)
+    {
+        tuner->open = true;
+        tuner->released = false;
+        tuner->start_us = now_us;
+        tuner->last_edge_us = now_us;
+        tuner->edges = 1;
+        return;
+    }
+    if (tuner->released)
+    {
+        // The contacts were still bouncing when the release was accepted, at least double the hold.
+        tuner->released = false;
+        tuner->wear.chatter++;
+        if (tuner->wear.bounce_peak_us < tuner->wear.hold_us)
+        {
+            tuner->wear.bounce_peak_us = tuner->wear.hold_us;
+        }
+        input_debounce_tune_learn(tuner);
+    }
+    tuner->edges++;
+    tuner->last_edge_us = now_us;
+}
+
+// The debouncer accepted a release.
+void input_debounce_tune_release(debounce_tuner_t *tuner)
+{
+    tuner->released = tuner->open;
+}
+
+// Close a transition that went quiet and follow changed bounds.
+// Returns the release hold time to debounce with.
+uint32_t input_debounce_tune_poll(debounce_tuner_t *tuner, uint32_t now_us, uint32_t min_us, uint32_t max_us)
+{
+    if (min_us != tuner->min_us || max_us != tuner->max_us)
+    {
+        tuner->min_us = min_us;
+        tuner->max_us = max_us;
+        input_debounce_tune_learn(tuner);
+    }
+    if (tuner->open && (uint32_t)(now_us - tuner->last_edge_us) >= tuner->max_us)
+    {
+        input_debounce_tune_close(tuner);
+    }
+    return tuner->wear.hold_us;
+}
+
+/************* Button Remap ****************/
+
+// Check a button map, every action is HID buttons or one of the macros.
+bool input_remap_valid(const uint8_t *map)
+{
+    for (int i = 0; i < INPUT_BUTTON_COUNT; i++)
+    {
+        uint8_t action = map[i];
+        if (action & INPUT_REMAP_MACRO ? (action & ~INPUT_REMAP_MACRO) >= INPUT_MACRO_COUNT : (action & ~INPUT_HID_BUTTONS) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compile a checked button map into the lookup tables, the held buttons are kept.
+void input_remap_build(input_remap_t *remap, const uint8_t *map)
+{
+    for (int held = 0; held < (1 << INPUT_BUTTON_COUNT); held++)
+    {
+        uint8_t buttons = 0;
+        for (int i = 0; i < INPUT_BUTTON_COUNT; i++)
+        {
+            if ((held & (1 << i)) && !(map[i] & INPUT_REMAP_MACRO))
+            {
+                buttons |= map[i];
+            }
+        }
+        remap->buttons[held] = buttons;
+    }
+    for (int i = 0; i < INPUT_BUTTON_COUNT; i++)
+    {
+        remap->macros[i] = map[i] & INPUT_REMAP_MACRO ? map[i] & ~INPUT_REMAP_MACRO : INPUT_REMAP_NONE;
+    }
+}
+
+// Press or release a physical button, returns the HID buttons now held.
+uint8_t HOT_PATH input_remap_button(input_remap_t *remap, input_button_t button, bool pressed)
+{
+    uint8_t bit = 1 << button;
+    remap->held = pressed ? (remap->held | bit) : (remap->held & ~bit);
+    return remap->buttons[remap->held];
+}
+
+/************* Macro Player ****************/
+
+// Check a macro, the steps are known, their delays in range and an END step comes before the table runs out.
+bool input_macro_valid(const input_macro_t *macro)
+{
+    for (int i = 0; i < INPUT_MACRO_STEPS; i++)
+    {
+        const input_macro_step_t *step = &macro->steps[i];
+        if (step->op >= INPUT_MACRO_OP_COUNT || step->delay_us > INPUT_MACRO_DELAY_MAX_US ||
+            (step->buttons & ~INPUT_HID_BUTTONS) != 0)
+        {
+            return false;
+        }
+        if (step->op == INPUT_MACRO_END)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Start a checked macro, its first step is due after its delay from now.
+void input_macro_start(input_macro_player_t *player, const input_macro_t *macro, uint32_t now_us)
+{
+    player->macro = macro;
+    player->next = 0;
+    player->buttons = 0;
+    player->due_us = now_us + macro->steps[0].delay_us;
+}
+
+// Take the next step if it is due by now_us, its schedule goes to *due_us. Returns NULL while none is due.
+// The END step is returned as well, it lets go of the buttons the macro still held and leaves the player idle.
+const input_macro_step_t *input_macro_step(input_macro_player_t *player, uint32_t now_us, uint32_t *due_us)
+{
+    if (player->macro == NULL || (int32_t)(now_us - player->due_us) < 0)
+    {
+        return NULL;
+    }
+    const input_macro_step_t *step = &player->macro->steps[player->next++];
+    *due_us = player->due_us;
+    switch (step->op)
+    {
+    case INPUT_MACRO_PRESS:
+        player->buttons |= step->buttons;
+        break;
+    case INPUT_MACRO_RELEASE:
+        player->buttons &= ~step->buttons;
+        break;
+    case INPUT_MACRO_END:
+        player->buttons = 0;
+        player->macro = NULL;
+        return step;
+    }
+    player->due_us += player->macro->steps[player->next].delay_us;
+    return step;
+}
@@ -1,4 +1,11 @@
 #include "header/latch_switch.h"
+#include "header/heap_guard.h"
+#include "header/input_pipeline.h"
+#include "header/load_gen.h"
+#include "header/power.h"
+#include "header/telemetry.h"
+#include "header/trace.h"
+#include "header/transport.h"
 
 static mouse_button_state_t calculate_lmb_state(void);
 static mouse_button_state_t calculate_rmb_state(void);
@@ -39,44 +46,36 @@ void mb_latch_init(void)
 static latch_event_t lmb_latch_event = LATCH_EVENT_CLEAR;
 static latch_event_t rmb_latch_event = LATCH_EVENT_CLEAR;
 
+// Time of the last latch event, for the button latency histogram.
+static uint32_t lmb_latch_event_us = 0;
+static uint32_t rmb_latch_event_us = 0;
+
 static mouse_button_state_t current_lmb_state = MOUSE_BUTTON_UP;
 static mouse_button_state_t current_rmb_state = MOUSE_BUTTON_UP;
 
 // Get current mouse button state.
-static mouse_button_state_t calculate_lmb_state(void)
+static mouse_button_state_t HOT_PATH calculate_lmb_state(void)
 {
     // Check if the mouse button is pressed or released.
-    mouse_button_state_t observed_lmb_no_state = gpio_get_level(GPIO_NUM_4);
-    mouse_button_state_t observed_lmb_nc_state = gpio_get_level(GPIO_NUM_5);
-    // Check for a valid transition.
-    if (observed_lmb_no_state == observed_lmb_nc_state)
-    {
-        return current_lmb_state;
-    }
-
-    // Pins are active low, so the observed state should be 1 for pressed and 0 for released.
-    // Change the mouse button state.
-    return observed_lmb_no_state;
+    int observed_lmb_no_state = INPUT_PIN_LEVEL(GPIO_NUM_4);
+    int observed_lmb_nc_state = INPUT_PIN_LEVEL(GPIO_NUM_5);
+    trace_record_gpio(GPIO_NUM_4, observed_lmb_no_state | observed_lmb_nc_state << 1);
+    return input_latch_state(observed_lmb_no_state, observed_lmb_nc_state, current_lmb_state);
 }
 
-static mouse_button_state_t calculate_rmb_state(void)
+static mouse_button_state_t HOT_PATH calculate_rmb_state(void)
 {
     // Check if the mouse button is pressed or released.
-    mouse_button_state_t observed_rmb_no_state = gpio_get_level(GPIO_NUM_6);
-    mouse_button_state_t observed_rmb_nc_state = gpio_get_level(GPIO_NUM_7);
-    // Check for a valid transition.
-    if (observed_rmb_no_state == observed_rmb_nc_state)
-    {
-        return current_lmb_state;
-    }
-
-    // Pins are active low, so the observed state should be 1 for pressed and 0 for released.
-    // Change the mouse button state.
-    return observed_rmb_no_state;
+    int observed_rmb_no_state = INPUT_PIN_LEVEL(GPIO_NUM_6);
+    int observed_rmb_nc_state = INPUT_PIN_LEVEL(GPIO_NUM_7);
+    trace_record_gpio(GPIO_NUM_6, observed_rmb_no_state | observed_rmb_nc_state << 1);
+    return input_latch_state(observed_rmb_no_state, observed_rmb_nc_state, current_rmb_state);
 }
 
-static void lmb_isr(void *arg)
+static void HOT_PATH lmb_isr(void *arg)
 {
+    // First, so a pin armed for light sleep is back on its edge interrupt before it can fire again.
+    power_wake_from_isr();
     mouse_button_state_t next_lmb_state = calculate_lmb_state();
 
     // Make sure the state is actually changing.
@@ -86,12 +85,14 @@ static void lmb_isr(void *arg)
     }
 
     // Set the latch event.
+    lmb_latch_event_us = esp_timer_get_time();
     lmb_latch_event = LATCH_EVENT_SET;
     current_lmb_state = next_lmb_state;
 }
 
-static void rmb_isr(void *arg)
+static void HOT_PATH rmb_isr(void *arg)
 {
+    power_wake_from_isr();
     mouse_button_state_t next_rmb_state = calculate_rmb_state();
 
     // Make sure the state is actually changing.
@@ -101,6 +102,7 @@ static void rmb_isr(void *arg)
     }
 
     // Set the latch event.
+    rmb_latch_event_us = esp_timer_get_time();
     rmb_latch_event = LATCH_EVENT_SET;
     current_rmb_state = next_rmb_state;
 }
@@ -111,13 +113,13 @@ static void lmb_latch_task_report(void)
     // Send a mouse report to the host when the mouse button is pressed or released.
     if (current_lmb_state == MOUSE_BUTTON_DOWN)
     {
-        ESP_LOGI(TAG, "LMB: DOWN");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x01, 0, 0, 0, 0);
+        HOT_PATH_LOGI(TAG, "LMB: DOWN");
+        transport_report_button(INPUT_BUTTON_LEFT, true);
     }
     else
     {
-        ESP_LOGI(TAG, "LMB: UP");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x01, 0, 0, 0, 0);
+        HOT_PATH_LOGI(TAG, "LMB: UP");
+        transport_report_button(INPUT_BUTTON_LEFT, false);
     }
 }
 
@@ -127,14 +129,44 @@ static void rmb_latch_task_report(void)
     // Send a mouse report to the host when the mouse button is pressed or released.
     if (current_rmb_state == MOUSE_BUTTON_DOWN)
     {
-        ESP_LOGI(TAG, "RMB: DOWN");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x02, 0, 0, 0, 0);
+        HOT_PATH_LOGI(TAG, "RMB: DOWN");
+        transport_report_button(INPUT_BUTTON_RIGHT, true);
+    }
+    else
+    {
+        HOT_PATH_LOGI(TAG, "RMB: UP");
+        transport_report_button(INPUT_BUTTON_RIGHT, false);
+    }
+}
+
+// State of a main button, 0 is LMB and 1 is RMB. The ULP handback decodes against it.
+mouse_button_state_t mb_latch_state(int index)
+{
+    return index == 0 ? current_lmb_state : current_rmb_state;
+}
+
+// Report a main button change the ULP saw while the main CPU slept, 0 is LMB and 1 is RMB.
+// Reported right away rather than through the latch event, so a click that started and ended
+// in the ULP buffer stays a press and a release.
+void mb_latch_replay(int index, mouse_button_state_t state, uint32_t event_us)
+{
+    mouse_button_state_t *current = index == 0 ? &current_lmb_state : &current_rmb_state;
+    // The ISR got there first.
+    if (state == *current)
+    {
+        return;
+    }
+    *current = state;
+    if (index == 0)
+    {
+        lmb_latch_task_report();
     }
     else
     {
-        ESP_LOGI(TAG, "RMB: UP");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x02, 0, 0, 0, 0);
+        rmb_latch_task_report();
     }
+    TELEMETRY_COUNT(button_events);
+    telemetry_record_latency(TELEMETRY_LATENCY_BUTTON, esp_timer_get_time() - event_us);
 }
 
 // Implement a software latch for the mouse buttons.
@@ -142,18 +174,28 @@ static void rmb_latch_task_report(void)
 // The mouse button is unlatched when the mouse button is released.
 void mb_latch_task(void *arg)
 {
-    gpio_install_isr_service(0);
-    gpio_isr_handler_add(GPIO_NUM_4, lmb_isr, NULL);
-    gpio_isr_handler_add(GPIO_NUM_5, lmb_isr, NULL);
-    gpio_isr_handler_add(GPIO_NUM_6, rmb_isr, NULL);
-    gpio_isr_handler_add(GPIO_NUM_7, rmb_isr, NULL);
+    gpio_install_isr_service(HOT_PATH_ISR_FLAGS);
+    profiler_isr_handler_add(GPIO_NUM_4, lmb_isr, NULL);
+    profiler_isr_handler_add(GPIO_NUM_5, lmb_isr, NULL);
+    profiler_isr_handler_add(GPIO_NUM_6, rmb_isr, NULL);
+    profiler_isr_handler_add(GPIO_NUM_7, rmb_isr, NULL);
+    power_add_wake_pin(GPIO_NUM_4, GPIO_INTR_NEGEDGE);
+    power_add_wake_pin(GPIO_NUM_5, GPIO_INTR_NEGEDGE);
+    power_add_wake_pin(GPIO_NUM_6, GPIO_INTR_NEGEDGE);
+    power_add_wake_pin(GPIO_NUM_7, GPIO_INTR_NEGEDGE);
+    heap_guard_watch();
 
     while (1)
     {
+        // Parked while the host is suspended, a click still wakes it through the ISR.
+        power_wait_active();
+        TELEMETRY_COUNT(task_wakeups);
         if (lmb_latch_event == LATCH_EVENT_SET)
         {
             lmb_latch_event = LATCH_EVENT_READ;
             lmb_latch_task_report();
+            TELEMETRY_COUNT(button_events);
+            telemetry_record_latency(TELEMETRY_LATENCY_BUTTON, esp_timer_get_time() - lmb_latch_event_us);
             // Only clear if the state is matching the current state.
             if (lmb_latch_event == LATCH_EVENT_READ)
             {
@@ -164,6 +206,8 @@ void mb_latch_task(void *arg)
         {
             rmb_latch_event = LATCH_EVENT_READ;
             rmb_latch_task_report();
+            TELEMETRY_COUNT(button_events);
+            telemetry_record_latency(TELEMETRY_LATENCY_BUTTON, esp_timer_get_time() - rmb_latch_event_us);
             // Only clear if the state is matching the current state.
             if (rmb_latch_event == LATCH_EVENT_READ)
             {
@@ -0,0 +1,161 @@
+#include "header/latency_bench.h"
+#include "header/power.h"
+#include "header/profiler.h"
+#include "header/trace.h"
+
+static void latency_bench_isr(void *arg);
+static void latency_bench_start_clock(void);
+static int latency_bench_compare(const void *a, const void *b);
+static void latency_bench_run(bool flash_writes, latency_bench_result_t *result);
+
+// ISR entry times of the current phase.
+static volatile uint32_t latency_bench_edges_us[LATENCY_BENCH_EDGES];
+static volatile uint32_t latency_bench_edge_count = 0;
+
+static uint32_t latency_bench_latencies[LATENCY_BENCH_EDGES];
+static uint8_t latency_bench_blob[LATENCY_BENCH_BLOB_SIZE];
+
+// Takes the time first, then makes the same calls as a button ISR.
+static void HOT_PATH latency_bench_isr(void *arg)
+{
+    uint32_t now_us = esp_timer_get_time();
+    power_wake_from_isr();
+    trace_record_gpio(LATENCY_BENCH_PIN, 1);
+    if (latency_bench_edge_count < LATENCY_BENCH_EDGES)
+    {
+        latency_bench_edges_us[latency_bench_edge_count++] = now_us;
+    }
+}
+
+// Square wave on the bench pin, read back through the same GPIO interrupt service as the buttons.
+static void latency_bench_start_clock(void)
+{
+    const ledc_timer_config_t timer_config = {
+        .speed_mode = LEDC_LOW_SPEED_MODE,
+        .duty_resolution = LATENCY_BENCH_DUTY_BITS,
+        .timer_num = LEDC_TIMER_0,
+        .freq_hz = LATENCY_BENCH_FREQ_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    const ledc_channel_config_t channel_config = {
+        .gpio_num = LATENCY_BENCH_PIN,
+        .speed_mode = LEDC_LOW_SPEED_MODE,
+        .channel = LEDC_CHANNEL_0,
+        .timer_sel = LEDC_TIMER_0,
+        .duty = 1 << (LATENCY_BENCH_DUTY_BITS - 1),
+        .hpoint = 0,
+    };
+    ESP_ERROR_CHECK(ledc_timer_config(&timer_config));
+    ESP_ERROR_CHECK(ledc_channel_config(&channel_config));
+
+    // LEDC only drives the pin, the input has to be enabled for the interrupt to see the edges.
+    gpio_ll_input_enable(&GPIO, LATENCY_BENCH_PIN);
+    gpio_set_intr_type(LATENCY_BENCH_PIN, GPIO_INTR_POSEDGE);
+    gpio_install_isr_service(HOT_PATH_ISR_FLAGS);
+    profiler_isr_handler_add(LATENCY_BENCH_PIN, latency_bench_isr, NULL);
+    gpio_intr_enable(LATENCY_BENCH_PIN);
+}
+
+static int latency_bench_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Collect one phase of edges, rewriting the NVS blob in a loop if flash_writes is set.
+static void latency_bench_run(bool flash_writes, latency_bench_result_t *result)
+{
+    memset(result, 0, sizeof(*result));
+    nvs_handle_t handle = 0;
+    if (flash_writes && nvs_open(LATENCY_BENCH_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Latency bench: NVS not available");
+        flash_writes = false;
+    }
+
+    latency_bench_edge_count = 0;
+    uint32_t deadline_us = esp_timer_get_time() + 2 * LATENCY_BENCH_EDGES * LATENCY_BENCH_PERIOD_US;
+    while (latency_bench_edge_count < LATENCY_BENCH_EDGES && (int32_t)(esp_timer_get_time() - deadline_us) < 0)
+    {
+        // Keep the power ladder at full, LEDC stops in light sleep.
+        power_activity();
+        if (flash_writes)
+        {
+            // NVS skips unchanged data, so every write differs.
+            memcpy(latency_bench_blob, &result->flash_writes, sizeof(result->flash_writes));
+            if (nvs_set_blob(handle, LATENCY_BENCH_NVS_KEY, latency_bench_blob, sizeof(latency_bench_blob)) == ESP_OK &&
+                nvs_commit(handle) == ESP_OK)
+            {
+                result->flash_writes++;
+            }
+            vTaskDelay(1);
+        }
+        else
+        {
+            vTaskDelay(pdMS_TO_TICKS(LATENCY_BENCH_PERIOD_US / 1000));
+        }
+    }
+    if (flash_writes)
+    {
+        nvs_erase_key(handle, LATENCY_BENCH_NVS_KEY);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+
+    // Edge k should have come at first + k periods, the offset from that is the latency plus a constant.
+    uint32_t count = latency_bench_edge_count;
+    if (count == 0)
+    {
+        return;
+    }
+    uint32_t first_us = latency_bench_edges_us[0];
+    uint32_t fastest_us = UINT32_MAX;
+    uint32_t last_edge = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t since_us = latency_bench_edges_us[i] - first_us;
+        uint32_t edge = (since_us + LATENCY_BENCH_PERIOD_US / 2) / LATENCY_BENCH_PERIOD_US;
+        latency_bench_latencies[i] = since_us - edge * LATENCY_BENCH_PERIOD_US + LATENCY_BENCH_PERIOD_US / 2;
+        fastest_us = min(fastest_us, latency_bench_latencies[i]);
+        last_edge = edge;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        latency_bench_latencies[i] -= fastest_us;
+    }
+    qsort(latency_bench_latencies, count, sizeof(latency_bench_latencies[0]), latency_bench_compare);
+
+    result->edges = count;
+    // Edges that came while the interrupt was still pending merge into one.
+    result->missed = last_edge + 1 - count;
+    result->p50_us = latency_bench_latencies[count / 2];
+    result->p99_us = latency_bench_latencies[count * 99 / 100];
+    result->max_us = latency_bench_latencies[count - 1];
+}
+
+// Latency benchmark task
+// Measures the GPIO ISR latency once without and once with flash writes going on, then stops.
+void latency_bench_task(void *arg)
+{
+    vTaskDelay(pdMS_TO_TICKS(LATENCY_BENCH_START_DELAY_MS));
+    latency_bench_start_clock();
+
+    const char *placement = HOT_PATH_ISR_FLAGS ? "IRAM" : "flash";
+    for (int phase = 0; phase < 2; phase++)
+    {
+        latency_bench_result_t result;
+        latency_bench_run(phase == 1, &result);
+        ESP_LOGI(TAG, "Latency bench, hot path in %s, %s: %lu edges, %lu missed, p50 %lu us, p99 %lu us, max %lu us",
+                 placement, phase ? "flash writes" : "idle", result.edges, result.missed, result.p50_us, result.p99_us,
+                 result.max_us);
+        if (phase == 1)
+        {
+            ESP_LOGI(TAG, "Latency bench: %lu NVS commits during the run", result.flash_writes);
+        }
+    }
+
+    gpio_intr_disable(LATENCY_BENCH_PIN);
+    ledc_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, 0);
+    vTaskDelete(NULL);
+}
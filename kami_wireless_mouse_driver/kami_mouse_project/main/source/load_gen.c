@@ -0,0 +1,355 @@
+#include "header/load_gen.h"
+#include "header/input_pipeline.h"
+#include "header/motion_sensor.h"
+#include "header/power.h"
+#include "header/profiler.h"
+#include "header/settings.h"
+#include "header/telemetry.h"
+
+#if LOAD_GEN && SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_IRQ
+#error "The load generator starts frames on a clock, pick the polled or motion sync acquisition"
+#endif
+ESP_STATIC_ASSERT(LOAD_GEN_BOUNCE_EDGES % 2 == 0, "a press or release ends at its new level");
+
+static void load_gen_edge(gpio_num_t pin, int level);
+static void load_gen_click(void);
+static void load_gen_wheel_edge(void);
+static bool load_gen_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg);
+static void load_gen_pattern_step(int16_t *x, int16_t *y);
+static void load_gen_start(uint32_t multiplier);
+static void load_gen_stop(void);
+static void load_gen_run(uint32_t multiplier, load_gen_result_t *result);
+static const char *load_gen_saturation(const load_gen_result_t *result);
+static void load_gen_log(const load_gen_result_t *result);
+
+// Pins of each button in input_button_t order, and the NC pin of the latched ones.
+static const HOT_PATH_DATA gpio_num_t load_gen_button_pins[INPUT_BUTTON_COUNT] = {
+    GPIO_NUM_4, GPIO_NUM_6, GPIO_NUM_10, GPIO_NUM_18, GPIO_NUM_19};
+static const HOT_PATH_DATA gpio_num_t load_gen_nc_pins[INPUT_BUTTON_COUNT] = {
+    GPIO_NUM_5, GPIO_NUM_7, GPIO_NUM_NC, GPIO_NUM_NC, GPIO_NUM_NC};
+
+// Generated pin levels, bit per GPIO. Released buttons and the wheel at rest, only the NC contacts are closed.
+static volatile uint32_t load_gen_pins = BIT(GPIO_NUM_5) | BIT(GPIO_NUM_7);
+
+// Rate multiple of the running phase, 0 while the real sensor and pins are read.
+static volatile uint32_t load_gen_multiplier = 0;
+
+// Edge generator, only touched by its alarm while a phase runs. Times are in timer ticks since the phase started.
+static gptimer_handle_t load_gen_timer = NULL;
+static uint64_t load_gen_click_due;
+static uint64_t load_gen_click_period;
+static uint64_t load_gen_wheel_due;
+static uint64_t load_gen_wheel_period;
+static int load_gen_button = INPUT_BUTTON_LEFT;
+static bool load_gen_held = false;
+static volatile uint32_t load_gen_transitions;
+static volatile uint32_t load_gen_wheel_edges;
+
+// Motion pattern, only touched by sensor_task. The circle turns its velocity in 1/256 counts.
+static int32_t load_gen_velocity_x = LOAD_GEN_MOTION_STEP << 8;
+static int32_t load_gen_velocity_y = 0;
+static uint32_t load_gen_frames = 0;
+static uint32_t load_gen_random = 0x4B4D;
+
+/************* Pins ****************/
+
+// Level of a generated pin, read by the button and wheel ISRs in place of the GPIO.
+int HOT_PATH load_gen_pin_level(gpio_num_t pin)
+{
+    return (load_gen_pins >> pin) & 1;
+}
+
+// Change a pin and run its handler, as the edge interrupt would.
+static void HOT_PATH load_gen_edge(gpio_num_t pin, int level)
+{
+    load_gen_pins = level ? (load_gen_pins | BIT(pin)) : (load_gen_pins & ~BIT(pin));
+    profiler_isr_raise(pin);
+}
+
+// Next button transition, a press of the current button or its release. The buttons take turns,
+// so no two are held together and the side button combination never dumps the trace.
+static void HOT_PATH load_gen_click(void)
+{
+    bool press = !load_gen_held;
+    gpio_num_t pin = load_gen_button_pins[load_gen_button];
+    gpio_num_t nc_pin = load_gen_nc_pins[load_gen_button];
+    if (nc_pin != GPIO_NUM_NC)
+    {
+        // The contact that opens breaks before the other one makes, the latch keeps its state in between.
+        load_gen_edge(press ? nc_pin : pin, 0);
+        load_gen_edge(press ? pin : nc_pin, 1);
+    }
+    else
+    {
+        // Even edges go to the new level, odd ones bounce back.
+        for (int i = 0; i <= LOAD_GEN_BOUNCE_EDGES; i++)
+        {
+            load_gen_edge(pin, (i % 2 == 0) == press);
+        }
+    }
+    load_gen_transitions++;
+    load_gen_held = press;
+    if (!press)
+    {
+        load_gen_button = (load_gen_button + 1) % INPUT_BUTTON_COUNT;
+    }
+}
+
+// Next wheel edge. B and A toggle in turn, which the quadrature decoder reads as a step up on every edge.
+static void HOT_PATH load_gen_wheel_edge(void)
+{
+    gpio_num_t pin = load_gen_wheel_edges % 2 == 0 ? GPIO_NUM_12 : GPIO_NUM_11;
+    load_gen_edge(pin, !load_gen_pin_level(pin));
+    load_gen_wheel_edges++;
+}
+
+// Timer alarm, makes the edges that are due and sets the alarm for the next one.
+// An alarm set behind the count fires at once, so a late generator catches up one edge per alarm.
+static bool HOT_PATH load_gen_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg)
+{
+    uint64_t now = edata->alarm_value;
+    if (now >= load_gen_click_due)
+    {
+        load_gen_click();
+        load_gen_click_due += load_gen_click_period;
+    }
+    if (now >= load_gen_wheel_due)
+    {
+        load_gen_wheel_edge();
+        load_gen_wheel_due += load_gen_wheel_period;
+    }
+    const gptimer_alarm_config_t alarm = {
+        .alarm_count = min(load_gen_click_due, load_gen_wheel_due),
+    };
+    gptimer_set_alarm_action(timer, &alarm);
+    // The button and wheel handlers only set flags their tasks poll, none of them wakes a task.
+    return false;
+}
+
+/************* Motion ****************/
+
+// Deltas of the next frame.
+static void HOT_PATH load_gen_pattern_step(int16_t *x, int16_t *y)
+{
+    load_gen_frames++;
+#if LOAD_GEN_PATTERN == LOAD_GEN_PATTERN_CIRCLE
+    // Minsky's circle, a turn of 1/16 radian per frame that keeps the speed without any trigonometry.
+    load_gen_velocity_x -= load_gen_velocity_y >> 4;
+    load_gen_velocity_y += load_gen_velocity_x >> 4;
+    *x = load_gen_velocity_x >> 8;
+    *y = load_gen_velocity_y >> 8;
+#elif LOAD_GEN_PATTERN == LOAD_GEN_PATTERN_ZIGZAG
+    *x = (load_gen_frames / LOAD_GEN_ZIGZAG_FRAMES) % 2 ? -LOAD_GEN_MOTION_STEP : LOAD_GEN_MOTION_STEP;
+    *y = 0;
+#else
+    // Xorshift, the same sequence on every boot.
+    load_gen_random ^= load_gen_random << 13;
+    load_gen_random ^= load_gen_random >> 17;
+    load_gen_random ^= load_gen_random << 5;
+    *x = (int16_t)(load_gen_random % (2 * LOAD_GEN_MOTION_STEP + 1)) - LOAD_GEN_MOTION_STEP;
+    *y = (int16_t)((load_gen_random >> 16) % (2 * LOAD_GEN_MOTION_STEP + 1)) - LOAD_GEN_MOTION_STEP;
+#endif
+}
+
+// Frame interval of the sensor task, shortened by the multiple of the running phase.
+uint32_t HOT_PATH load_gen_frame_us(uint32_t report_rate_us)
+{
+    uint32_t multiplier = load_gen_multiplier;
+    if (multiplier == 0)
+    {
+        return report_rate_us;
+    }
+    return max(report_rate_us / multiplier, LOAD_GEN_FRAME_US_MIN);
+}
+
+// Replace a motion burst with the pattern's next frame while a phase runs, in run mode with a good surface.
+void HOT_PATH load_gen_motion_burst(uint8_t *burst)
+{
+    if (load_gen_multiplier == 0)
+    {
+        return;
+    }
+    int16_t x;
+    int16_t y;
+    load_gen_pattern_step(&x, &y);
+    memset(burst, 0, SENSOR_MOTION_BURST_SIZE);
+    burst[SENSOR_BURST_MOTION] = SENSOR_MOTION_BIT;
+    burst[SENSOR_BURST_DELTA_X_L] = (uint16_t)x & 0xFF;
+    burst[SENSOR_BURST_DELTA_X_H] = (uint16_t)x >> 8;
+    burst[SENSOR_BURST_DELTA_Y_L] = (uint16_t)y & 0xFF;
+    burst[SENSOR_BURST_DELTA_Y_H] = (uint16_t)y >> 8;
+    burst[SENSOR_BURST_SQUAL] = 0x40;
+    burst[SENSOR_BURST_SHUTTER_LOWER] = 0x80;
+}
+
+/************* Phases ****************/
+
+// Start the edge generator and the fast frames at a multiple of the real rates.
+static void load_gen_start(uint32_t multiplier)
+{
+    if (load_gen_timer == NULL)
+    {
+        const gptimer_config_t timer_config = {
+            .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+            .direction = GPTIMER_COUNT_UP,
+            .resolution_hz = LOAD_GEN_TIMER_HZ,
+        };
+        const gptimer_event_callbacks_t callbacks = {
+            .on_alarm = load_gen_alarm,
+        };
+        ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &load_gen_timer));
+        ESP_ERROR_CHECK(gptimer_register_event_callbacks(load_gen_timer, &callbacks, NULL));
+        ESP_ERROR_CHECK(gptimer_enable(load_gen_timer));
+    }
+
+    // Two transitions make a click.
+    load_gen_click_period = LOAD_GEN_TIMER_HZ / (2 * LOAD_GEN_CLICKS_HZ * multiplier);
+    load_gen_wheel_period = LOAD_GEN_TIMER_HZ / (LOAD_GEN_WHEEL_EDGES_HZ * multiplier);
+    load_gen_click_due = load_gen_click_period;
+    load_gen_wheel_due = load_gen_wheel_period;
+    load_gen_transitions = 0;
+    load_gen_wheel_edges = 0;
+    const gptimer_alarm_config_t alarm = {
+        .alarm_count = min(load_gen_click_due, load_gen_wheel_due),
+    };
+    ESP_ERROR_CHECK(gptimer_set_raw_count(load_gen_timer, 0));
+    ESP_ERROR_CHECK(gptimer_set_alarm_action(load_gen_timer, &alarm));
+    load_gen_multiplier = multiplier;
+    ESP_ERROR_CHECK(gptimer_start(load_gen_timer));
+}
+
+// Back to the real sensor and pins. A button held at the stop is released by the next phase.
+static void load_gen_stop(void)
+{
+    ESP_ERROR_CHECK(gptimer_stop(load_gen_timer));
+    load_gen_multiplier = 0;
+}
+
+// Run one phase and take the counters before and after it.
+static void load_gen_run(uint32_t multiplier, load_gen_result_t *result)
+{
+    static telemetry_counters_t start;
+    static telemetry_counters_t stop;
+    static telemetry_counters_t settled;
+    static profiler_stats_t profile;
+
+    memset(result, 0, sizeof(*result));
+    result->multiplier = multiplier;
+    telemetry_snapshot(&start, NULL);
+    uint64_t start_us = esp_timer_get_time();
+    load_gen_start(multiplier);
+    settings_t current;
+    settings_snapshot(&current);
+    result->frame_us = load_gen_frame_us(current.report_rate_us);
+    while (esp_timer_get_time() - start_us < LOAD_GEN_PHASE_MS * 1000ull)
+    {
+        // Keep the power ladder at full, a saturated pipeline may not get its reports out to do it.
+        power_activity();
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    // The last profiler window lies within the phase.
+    profiler_snapshot(&profile);
+    load_gen_stop();
+    uint64_t phase_us = esp_timer_get_time() - start_us;
+    telemetry_snapshot(&stop, NULL);
+    // Button releases are only reported once they held for the debounce time.
+    vTaskDelay(pdMS_TO_TICKS(LOAD_GEN_SETTLE_MS));
+    telemetry_snapshot(&settled, NULL);
+
+    uint32_t expected = phase_us / result->frame_us;
+    result->frames = stop.bursts_read - start.bursts_read;
+    result->frames_missed = expected > result->frames ? expected - result->frames : 0;
+    result->frame_overruns = stop.frame_overruns - start.frame_overruns;
+    result->ring_overflows = stop.motion_buffer_overflows - start.motion_buffer_overflows;
+    result->transitions = load_gen_transitions;
+    result->button_events = settled.button_events - start.button_events;
+    result->wheel_edges = load_gen_wheel_edges;
+    result->wheel_events = settled.wheel_events - start.wheel_events;
+    result->reports_sent = stop.reports_sent - start.reports_sent;
+    result->reports_failed = stop.reports_failed - start.reports_failed;
+    result->reports_coalesced = stop.transport_motion_merged - start.transport_motion_merged;
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        result->idle_load[core] = profile.idle_load[core];
+        result->isr_load[core] = profile.isr_load[core];
+    }
+}
+
+// The first sign of saturation in a phase, NULL if the pipeline kept up. Motion merged into a waiting report
+// and wheel edges within one poll of the wheel task are expected and not counted, the sums still go out.
+static const char *load_gen_saturation(const load_gen_result_t *result)
+{
+    uint32_t frames = result->frames + result->frames_missed;
+    if (result->ring_overflows != 0)
+    {
+        return "motion ring overflows";
+    }
+    if ((result->frames_missed + result->frame_overruns) * 1000ull > (uint64_t)frames * LOAD_GEN_MISSED_FRAMES_PERMILLE)
+    {
+        return "missed frames";
+    }
+    if (result->button_events < result->transitions)
+    {
+        return "lost button transitions";
+    }
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        if (result->idle_load[core] < LOAD_GEN_HEADROOM_MIN)
+        {
+            return "CPU headroom";
+        }
+    }
+    return NULL;
+}
+
+static void load_gen_log(const load_gen_result_t *result)
+{
+    ESP_LOGI(TAG, "Load gen %lux: frame %lu us, %lu frames, %lu missed, %lu overruns, %lu ring overflows",
+             result->multiplier, result->frame_us, result->frames, result->frames_missed, result->frame_overruns,
+             result->ring_overflows);
+    ESP_LOGI(TAG, "Load gen %lux: %lu of %lu button transitions, %lu of %lu wheel edges reported",
+             result->multiplier, result->button_events, result->transitions, result->wheel_events, result->wheel_edges);
+    ESP_LOGI(TAG, "Load gen %lux: %lu reports sent, %lu failed, %lu inputs coalesced", result->multiplier,
+             result->reports_sent, result->reports_failed, result->reports_coalesced);
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        ESP_LOGI(TAG, "Load gen %lux: core %d idle %u.%02u %%, ISRs %u.%02u %%", result->multiplier, core,
+                 result->idle_load[core] / 100, result->idle_load[core] % 100, result->isr_load[core] / 100,
+                 result->isr_load[core] % 100);
+    }
+}
+
+// Load generator task
+// Steps the generated input through the rate multiples, logs each phase and where the pipeline saturated, then stops.
+void load_gen_task(void *arg)
+{
+    static const uint32_t multipliers[] = LOAD_GEN_MULTIPLIERS;
+    const int phases = sizeof(multipliers) / sizeof(multipliers[0]);
+    vTaskDelay(pdMS_TO_TICKS(LOAD_GEN_START_DELAY_MS));
+
+    int saturated = -1;
+    const char *reason = NULL;
+    for (int phase = 0; phase < phases; phase++)
+    {
+        load_gen_result_t result;
+        load_gen_run(multipliers[phase], &result);
+        load_gen_log(&result);
+        const char *phase_reason = load_gen_saturation(&result);
+        if (phase_reason != NULL && saturated < 0)
+        {
+            saturated = phase;
+            reason = phase_reason;
+        }
+    }
+
+    if (saturated < 0)
+    {
+        ESP_LOGI(TAG, "Load gen: no saturation up to %lux", multipliers[phases - 1]);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Load gen: saturates at %lux, %s", multipliers[saturated], reason);
+    }
+    ESP_ERROR_CHECK(gptimer_disable(load_gen_timer));
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,96 @@
+#include "header/macro.h"
+#include "header/heap_guard.h"
+#include "header/settings.h"
+#include "header/telemetry.h"
+#include "header/transport.h"
+
+static void macro_tick(void *arg);
+static void macro_count_step(uint32_t late_us);
+
+// Copy of the macro being played, an upload during playback does not change it.
+static input_macro_t macro_playing;
+static input_macro_player_t macro_player;
+// Macro asked for by a button press, INPUT_REMAP_NONE once the task took it.
+static volatile uint8_t macro_requested = INPUT_REMAP_NONE;
+
+// One shot timer armed for the next step, esp_timer runs on the systimer alarm.
+static esp_timer_handle_t macro_timer = NULL;
+static TaskHandle_t macro_task_handle = NULL;
+
+void macro_init(void)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = macro_tick,
+        .name = "macro",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &macro_timer));
+    ESP_LOGI(TAG, "USB macro_init");
+}
+
+// Called from transport_report_button on the press of a button mapped to a macro.
+// A press while a macro plays is ignored, the macro is not restarted or queued.
+void HOT_PATH macro_trigger(uint8_t index)
+{
+    if (macro_task_handle == NULL || macro_player.macro != NULL || macro_requested != INPUT_REMAP_NONE)
+    {
+        return;
+    }
+    macro_requested = index;
+    xTaskNotifyGive(macro_task_handle);
+}
+
+static void macro_tick(void *arg)
+{
+    xTaskNotifyGive(macro_task_handle);
+}
+
+// A step went out, late_us after its schedule.
+// Steps later than one report interval count as missed, the playback guarantee.
+static void macro_count_step(uint32_t late_us)
+{
+    TELEMETRY_COUNT(macro_steps);
+    telemetry_counters.macro_late_last_us = late_us;
+    telemetry_counters.macro_late_max_us = max(telemetry_counters.macro_late_max_us, late_us);
+    settings_t current;
+    settings_snapshot(&current);
+    if (late_us > current.report_rate_us)
+    {
+        TELEMETRY_COUNT(macro_late_steps);
+    }
+}
+
+// Task that plays the macros.
+// Each step is handed to the transport as soon as it is due. The timer is then armed for the next one,
+// steps due together go out back to back.
+void macro_task(void *arg)
+{
+    macro_task_handle = xTaskGetCurrentTaskHandle();
+    heap_guard_watch();
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        TELEMETRY_COUNT(task_wakeups);
+        uint8_t index = macro_requested;
+        if (macro_player.macro == NULL && index != INPUT_REMAP_NONE)
+        {
+            settings_get_macro(index, &macro_playing);
+            input_macro_start(&macro_player, &macro_playing, esp_timer_get_time());
+            TELEMETRY_COUNT(macros_played);
+        }
+        macro_requested = INPUT_REMAP_NONE;
+
+        uint32_t due_us;
+        const input_macro_step_t *step;
+        while ((step = input_macro_step(&macro_player, esp_timer_get_time(), &due_us)) != NULL)
+        {
+            transport_report_macro(step, macro_player.buttons);
+            macro_count_step((uint32_t)esp_timer_get_time() - due_us);
+        }
+        if (macro_player.macro != NULL)
+        {
+            int32_t wait_us = (int32_t)(macro_player.due_us - (uint32_t)esp_timer_get_time());
+            esp_timer_stop(macro_timer);
+            esp_timer_start_once(macro_timer, max(wait_us, 0));
+        }
+    }
+}
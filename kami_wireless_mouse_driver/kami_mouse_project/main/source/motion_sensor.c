@@ -1,23 +1,77 @@
 #include "header/motion_sensor.h"
+#include "header/frame_capture.h"
+#include "header/heap_guard.h"
+#include "header/input_pipeline.h"
+#include "header/load_gen.h"
+#include "header/power.h"
+#include "header/sensor_registers.h"
+#include "header/settings.h"
+#include "header/telemetry.h"
+#include "header/trace.h"
+#include "header/transport.h"
 
 #include "driver/spi_common.h"
 #include "driver/spi_master.h"
 #include "hal/spi_types.h"
+#include "soc/spi_periph.h"
+#include "esp_rom_gpio.h"
+#include "esp_rom_sys.h"
 
-static void add_motion_data_to_buffer(uint8_t motion_x, uint8_t motion_y, uint32_t timestamp);
-static MotionData read_oldest_motion_data_from_buffer(void);
+static void add_motion_data_to_buffer(int16_t motion_x, int16_t motion_y, uint32_t timestamp);
 static void process_motion_data(void);
-static void sensor_read_register(uint8_t address, uint8_t *response, size_t response_size);
-static void sensor_read_motion_burst(void);
-static void sensor_write_register(uint8_t address, uint8_t value);
-static void sensor_configure(void);
+static esp_err_t sensor_read_register(uint8_t address, uint8_t *response, size_t response_size);
+static esp_err_t sensor_transmit_read(uint8_t address, uint8_t *response, size_t response_size);
+static void sensor_spi_pre(spi_transaction_t *transaction);
+static void sensor_spi_post(spi_transaction_t *transaction);
+static void sensor_burst_queue(void);
+static void sensor_burst_collect(void);
+static void sensor_burst_flush(void);
+static void sensor_burst_discard(void);
+static void sensor_decode_motion_burst(void);
+static esp_err_t sensor_write_register(uint8_t address, uint8_t value);
+static esp_err_t sensor_transmit_write(uint8_t address, uint8_t value);
+static bool sensor_configure(void);
+static int sensor_bus_write(void *context, uint8_t address, uint8_t value);
+static int sensor_bus_read(void *context, uint8_t address, uint8_t *value);
+static esp_err_t sensor_write_sequence(const sensor_sequence_t *sequence, sensor_write_policy_t policy);
+static esp_err_t sensor_set_cpi(uint16_t cpi);
+static esp_err_t sensor_set_mode(MouseMode mode);
+static esp_err_t sensor_set_rest(const sensor_rest_t *rest);
+static void sensor_track_rest(uint8_t op_mode);
+static void sensor_apply_settings(void);
+static void sensor_invalidate_settings(void);
+static bool sensor_verify_id(void);
+static bool sensor_power_up(bool power_cycle);
+static void sensor_release_pins(bool release);
+static void sensor_check_health(void);
+static bool sensor_recover(void);
+static void sensor_motion_isr(void *arg);
+static void sensor_park(void);
+static void sensor_resume(void);
+static void sensor_acquisition_start(void);
+static void sensor_acquisition_stop(void);
+static uint32_t sensor_frame_us(void);
+static void sensor_wait_frame(uint32_t start_us);
+static void sensor_delay_us(uint32_t delay_us);
+static void sensor_count_frame_cycles(int start_core, uint32_t start_cycles);
+static esp_err_t sensor_grab_frame(uint8_t *pixels);
+static void sensor_capture_frames(void);
+static esp_err_t sensor_link_apply(uint32_t clock_hz, uint8_t input_delay_ns);
+static int sensor_link_configure(void *context, uint32_t clock_hz, uint8_t input_delay_ns);
+static void sensor_link_fallback(void);
+static void sensor_link_lose(esp_err_t err);
+static bool sensor_link_restore(void);
+static void sensor_calibrate_link(void);
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_SYNC
+static void sensor_frame_tick(void *arg);
+#endif
 
 /************* IO Configs ****************/
 
 // Our mouse used a Pixart PAW3395DM-T6QU optical sensor.
 // The sensor is connected to the ESP32-S3 via SPI.
 // The sensor is configured to use SPI mode 3.
-// The sensor is configured to use a clock speed of 10MHz.
+// The sensor is configured to use a clock speed of 10MHz, or the one the link calibration picked.
 // The sensor is configured to use a 16 bit word size. (default)
 // The sensor is configured to use MSB first. (default)
 // The sensor is configured to use a 4 wire interface. (default)
@@ -40,29 +94,8 @@ static const gpio_config_t sensor_ncs_config = {
     .pull_down_en = false,
 };
 
-static const gpio_config_t sensor_mosi_config = {
-    .pin_bit_mask = BIT64(GPIO_NUM_28),
-    .mode = GPIO_MODE_OUTPUT,
-    .intr_type = GPIO_INTR_DISABLE,
-    .pull_up_en = false,
-    .pull_down_en = false,
-};
-
-static const gpio_config_t sensor_sclk_config = {
-    .pin_bit_mask = BIT64(GPIO_NUM_29),
-    .mode = GPIO_MODE_OUTPUT,
-    .intr_type = GPIO_INTR_DISABLE,
-    .pull_up_en = false,
-    .pull_down_en = false,
-};
-
-static const gpio_config_t sensor_miso_config = {
-    .pin_bit_mask = BIT64(GPIO_NUM_30),
-    .mode = GPIO_MODE_INPUT,
-    .intr_type = GPIO_INTR_DISABLE,
-    .pull_up_en = false,
-    .pull_down_en = false,
-};
+// MOSI, SCLK and MISO are set up by spi_bus_initialize, which routes them to SPI3 through the GPIO matrix.
+// A gpio_config on them would route them back to the plain GPIO output.
 
 static const gpio_config_t sensor_nreset_config = {
     .pin_bit_mask = BIT64(GPIO_NUM_31),
@@ -95,14 +128,18 @@ static const spi_bus_config_t sensor_spi_bus_config = {
     .sclk_io_num = GPIO_NUM_29,
     .quadwp_io_num = -1,
     .quadhd_io_num = -1,
-    .max_transfer_sz = 0,
+    // Raw frames are read in a single DMA transfer.
+    .max_transfer_sz = SENSOR_RAW_FRAME_PIXELS,
     .flags = 0,
     .intr_flags = 0,
 };
 
 // Set up the SPI device for the sensor.
 // 1 bit for direction, 7 bits for address, and dummy bits will be 0 for writes or overriden for reads.
-static const spi_device_interface_config_t sensor_spi_device_config = {
+// The clock and input delay are those of the datasheet until sensor_link_apply sets the link's.
+// NCS is a plain GPIO that the SPI callbacks drive around every transaction, never the hardware CS, so adding
+// the device again does not take the pin over. The power up sequence toggles it directly as well.
+static spi_device_interface_config_t sensor_spi_device_config = {
     .command_bits = 1,
     .address_bits = 7,
     .dummy_bits = 0,
@@ -112,373 +149,156 @@ static const spi_device_interface_config_t sensor_spi_device_config = {
     .cs_ena_posttrans = 0,
     .clock_speed_hz = SENSOR_SPI_CLOCK_SPEED_HZ,
     .input_delay_ns = SENSOR_INPUT_DELAY_NS,
-    .spics_io_num = GPIO_NUM_27,
+    .spics_io_num = -1,
     .flags = 0,
-    .queue_size = 1,
-    .pre_cb = NULL,
-    .post_cb = NULL,
+    // A burst on the bus and a register transfer queued behind it.
+    .queue_size = SENSOR_BURST_BUFFERS,
+    .pre_cb = sensor_spi_pre,
+    .post_cb = sensor_spi_post,
 };
 
-/************* Programming Sequences *************/
+spi_device_handle_t sensor_spi_device;
 
-// Define the configuration for the Pixart PAW3395 sensor.
-/*
-6.2 Power-Up Initialization Register Setting
-*/
-static const uint8_t sensor_prog_seq_first[][2] = {
-	{0x7F, 0x07}, // 0x7F with value 0x07
-	{0x40, 0x41}, // 0x40 with value 0x41
-	{0x7F, 0x00}, // 0x7F with value 0x00
-	{0x40, 0x80}, // 0x40 with value 0x80
-	{0x7F, 0x0E}, // 0x7F with value 0x0E
-	{0x55, 0x0D}, // 0x55 with value 0x0D
-	{0x56, 0x1B}, // 0x56 with value 0x1B
-	{0x57, 0xE8}, // 0x57 with value 0xE8
-	{0x58, 0xD5}, // 0x58 with value 0xD5
-	{0x7F, 0x14}, // 0x7F with value 0x14
-	{0x42, 0xBC}, // 0x42 with value 0xBC
-	{0x43, 0x74}, // 0x43 with value 0x74
-	{0x4B, 0x20}, // 0x4B with value 0x20
-	{0x4D, 0x00}, // 0x4D with value 0x00
-	{0x53, 0x0E}, // 0x53 with value 0x0E
-	{0x7F, 0x05}, // 0x7F with value 0x05
-	{0x44, 0x04}, // 0x44 with value 0x04
-	{0x4D, 0x06}, // 0x4D with value 0x06
-	{0x51, 0x40}, // 0x51 with value 0x40
-	{0x53, 0x40}, // 0x53 with value 0x40
-	{0x55, 0xCA}, // 0x55 with value 0xCA
-	{0x5A, 0xE8}, // 0x5A with value 0xE8
-	{0x5B, 0xEA}, // 0x5B with value 0xEA
-	{0x61, 0x31}, // 0x61 with value 0x31
-	{0x62, 0x64}, // 0x62 with value 0x64
-	{0x6D, 0xB8}, // 0x6D with value 0xB8
-	{0x6E, 0x0F}, // 0x6E with value 0x0F
-	{0x70, 0x02}, // 0x70 with value 0x02
-	{0x4A, 0x2A}, // 0x4A with value 0x2A
-	{0x60, 0x26}, // 0x60 with value 0x26
-	{0x7F, 0x06}, // 0x7F with value 0x06
-	{0x6D, 0x70}, // 0x6D with value 0x70
-	{0x6E, 0x60}, // 0x6E with value 0x60
-	{0x6F, 0x04}, // 0x6F with value 0x04
-	{0x53, 0x02}, // 0x53 with value 0x02
-	{0x55, 0x11}, // 0x55 with value 0x11
-	{0x7A, 0x01}, // 0x7A with value 0x01
-	{0x7D, 0x51}, // 0x7D with value 0x51
-	{0x7F, 0x07}, // 0x7F with value 0x07
-	{0x41, 0x10}, // 0x41 with value 0x10
-	{0x42, 0x32}, // 0x42 with value 0x32
-	{0x43, 0x00}, // 0x43 with value 0x00
-	{0x7F, 0x08}, // 0x7F with value 0x08
-	{0x71, 0x4F}, // 0x71 with value 0x4F
-	{0x7F, 0x09}, // 0x7F with value 0x09
-	{0x62, 0x1F}, // 0x62 with value 0x1F
-	{0x63, 0x1F}, // 0x63 with value 0x1F
-	{0x65, 0x03}, // 0x65 with value 0x03
-	{0x66, 0x03}, // 0x66 with value 0x03
-	{0x67, 0x1F}, // 0x67 with value 0x1F
-	{0x68, 0x1F}, // 0x68 with value 0x1F
-	{0x69, 0x03}, // 0x69 with value 0x03
-	{0x6A, 0x03}, // 0x6A with value 0x03
-	{0x6C, 0x1F}, // 0x6C with value 0x1F
-	{0x6D, 0x1F}, // 0x6D with value 0x1F
-	{0x51, 0x04}, // 0x51 with value 0x04
-	{0x53, 0x20}, // 0x53 with value 0x20
-	{0x54, 0x20}, // 0x54 with value 0x20
-	{0x71, 0x0C}, // 0x71 with value 0x0C
-	{0x72, 0x07}, // 0x72 with value 0x07
-	{0x73, 0x07}, // 0x73 with value 0x07
-	{0x7F, 0x0A}, // 0x7F with value 0x0A
-	{0x4A, 0x14}, // 0x4A with value 0x14
-	{0x4C, 0x14}, // 0x4C with value 0x14
-	{0x55, 0x19}, // 0x55 with value 0x19
-	{0x7F, 0x14}, // 0x7F with value 0x14
-	{0x4B, 0x30}, // 0x4B with value 0x30
-	{0x4C, 0x03}, // 0x4C with value 0x03
-	{0x61, 0x0B}, // 0x61 with value 0x0B
-	{0x62, 0x0A}, // 0x62 with value 0x0A
-	{0x63, 0x02}, // 0x63 with value 0x02
-	{0x7F, 0x15}, // 0x7F with value 0x15
-	{0x4C, 0x02}, // 0x4C with value 0x02
-	{0x56, 0x02}, // 0x56 with value 0x02
-	{0x41, 0x91}, // 0x41 with value 0x91
-	{0x4D, 0x0A}, // 0x4D with value 0x0A
-	{0x7F, 0x0C}, // 0x7F with value 0x0C
-	{0x4A, 0x10}, // 0x4A with value 0x10
-	{0x4B, 0x0C}, // 0x4B with value 0x0C
-	{0x4C, 0x40}, // 0x4C with value 0x40
-	{0x41, 0x25}, // 0x41 with value 0x25
-	{0x55, 0x18}, // 0x55 with value 0x18
-	{0x56, 0x14}, // 0x56 with value 0x14
-	{0x49, 0x0A}, // 0x49 with value 0x0A
-	{0x42, 0x00}, // 0x42 with value 0x00
-	{0x43, 0x2D}, // 0x43 with value 0x2D
-	{0x44, 0x0C}, // 0x44 with value 0x0C
-	{0x54, 0x1A}, // 0x54 with value 0x1A
-	{0x5A, 0x0D}, // 0x5A with value 0x0D
-	{0x5F, 0x1E}, // 0x5F with value 0x1E
-	{0x5B, 0x05}, // 0x5B with value 0x05
-	{0x5E, 0x0F}, // 0x5E with value 0x0F
-	{0x7F, 0x0D}, // 0x7F with value 0x0D
-	{0x48, 0xDD}, // 0x48 with value 0xDD
-	{0x4F, 0x03}, // 0x4F with value 0x03
-	{0x52, 0x49}, // 0x52 with value 0x49
-	{0x51, 0x00}, // 0x51 with value 0x00
-	{0x54, 0x5B}, // 0x54 with value 0x5B
-	{0x53, 0x00}, // 0x53 with value 0x00
-	{0x56, 0x64}, // 0x56 with value 0x64
-	{0x55, 0x00}, // 0x55 with value 0x00
-	{0x58, 0xA5}, // 0x58 with value 0xA5
-	{0x57, 0x02}, // 0x57 with value 0x02
-	{0x5A, 0x29}, // 0x5A with value 0x29
-	{0x5B, 0x47}, // 0x5B with value 0x47
-	{0x5C, 0x81}, // 0x5C with value 0x81
-	{0x5D, 0x40}, // 0x5D with value 0x40
-	{0x71, 0xDC}, // 0x71 with value 0xDC
-	{0x70, 0x07}, // 0x70 with value 0x07
-	{0x73, 0x00}, // 0x73 with value 0x00
-	{0x72, 0x08}, // 0x72 with value 0x08
-	{0x75, 0xDC}, // 0x75 with value 0xDC
-	{0x74, 0x07}, // 0x74 with value 0x07
-	{0x77, 0x00}, // 0x77 with value 0x00
-	{0x76, 0x08}, // 0x76 with value 0x08
-	{0x7F, 0x10}, // 0x7F with value 0x10
-	{0x4C, 0xD0}, // 0x4C with value 0xD0
-	{0x7F, 0x00}, // 0x7F with value 0x00
-	{0x4F, 0x63}, // 0x4F with value 0x63
-	{0x4E, 0x00}, // 0x4E with value 0x00
-	{0x52, 0x63}, // 0x52 with value 0x63
-	{0x51, 0x00}, // 0x51 with value 0x00
-	{0x54, 0x54}, // 0x54 with value 0x54
-	{0x5A, 0x10}, // 0x5A with value 0x10
-	{0x77, 0x4F}, // 0x77 with value 0x4F
-	{0x47, 0x01}, // 0x47 with value 0x01
-	{0x5B, 0x40}, // 0x5B with value 0x40
-	{0x64, 0x60}, // 0x64 with value 0x60
-	{0x65, 0x06}, // 0x65 with value 0x06
-	{0x66, 0x13}, // 0x66 with value 0x13
-	{0x67, 0x0F}, // 0x67 with value 0x0F
-	{0x78, 0x01}, // 0x78 with value 0x01
-	{0x79, 0x9C}, // 0x79 with value 0x9C
-	{0x40, 0x00}, // 0x40 with value 0x00
-	{0x55, 0x02}, // 0x55 with value 0x02
-	{0x23, 0x70}, // 0x23 with value 0x70
-	{0x22, 0x01}, // 0x22 with value 0x01
+// SPI link setting the device runs on, and the dummy bits that cover tSRAD at its clock.
+static const sensor_link_t sensor_link_datasheet = {
+    .clock_hz = SENSOR_SPI_CLOCK_SPEED_HZ,
+    .input_delay_ns = SENSOR_INPUT_DELAY_NS,
+    .calibrated = 0,
 };
+static sensor_link_t sensor_link;
+static uint32_t sensor_dummy_bits = 0;
+// Set when the driver refused a link switch after boot, sensor_recover applies the datasheet setting again.
+static bool sensor_link_lost = false;
+// Last link calibration. Only the sensor task writes it, and only while its state is SENSOR_LINK_RUNNING.
+static sensor_link_report_t sensor_link_report;
+// Set by the host's calibrate command, taken by the sensor task.
+static volatile bool sensor_link_requested = false;
 
-static const uint8_t sensor_prog_seq_0x6C_fail[][2] = {
-	{0x7F, 0x14}, // 0x7F with value 0x14
-	{0x6C, 0x00}, // 0x6C with value 0x00
-	{0x7F, 0x00}, // 0x7F with value 0x00
+// Register shadow, every configuration write goes through it.
+static const sensor_bus_t sensor_bus = {
+    .write = sensor_bus_write,
+    .read = sensor_bus_read,
+    .context = NULL,
 };
+static sensor_shadow_t sensor_shadow;
 
-static const uint8_t sensor_prog_seq_second[][2] = {
-	{0x22, 0x00}, // 0x22 with value 0x00
-	{0x55, 0x00}, // 0x55 with value 0x00
-	{0x7F, 0x07}, // 0x7F with value 0x07
-	{0x40, 0x40}, // 0x40 with value 0x40
-	{0x7F, 0x00}, // 0x7F with value 0x00
-};
+// Motion read by the sensor task and not yet handed to the transport.
+static motion_ring_t motion_ring;
 
-/*
-Note:
-Special precaution needs to be taken for register 0x40 to avoid overwrite other bits in the register. When writing
-the bit[1:0] to configure to different modes, one need to read and store its current value first, then apply bit
-masking and write back the new value into the register.
-I'm not sure if this is necessary, because we just wrote the value 0x40 to the register in the previous step.
-So I will use the previous value. This assumes we only change the mode once out of reset.
-*/
+// Motion burst buffers, the SPI DMA target, and their transactions.
+static DMA_ATTR uint8_t sensor_burst_buffers[SENSOR_BURST_BUFFERS][SENSOR_MOTION_BURST_SIZE];
+ESP_STATIC_ASSERT(SENSOR_MOTION_BURST_SIZE % 4 == 0, "DMA reads whole words");
+static spi_transaction_ext_t sensor_burst_transactions[SENSOR_BURST_BUFFERS];
+// End of each buffer's transfer, written by the post callback. The transaction's user field points here.
+static volatile uint32_t sensor_burst_done_us[SENSOR_BURST_BUFFERS];
+// Buffer of the burst on the bus and of the finished one waiting to be decoded, -1 for none.
+// The buffers are used in turn, so the two are never the same.
+static int sensor_burst_in_flight = -1;
+static int sensor_burst_ready = -1;
+static int sensor_burst_next = 0;
 
-/*
-High Performance Mode (Default)
-*/
-/*
-static const uint8_t sensor_prog_seq_hpm[][2] = {
-	{0x7F, 0x05}, // 0x7F with value 0x05
-	{0x51, 0x40}, // 0x51 with value 0x40
-	{0x53, 0x40}, // 0x53 with value 0x40
-	{0x61, 0x31}, // 0x61 with value 0x31
-	{0x6E, 0x0F}, // 0x6E with value 0x0F
-	{0x7F, 0x07}, // 0x7F with value 0x07
-	{0x42, 0x32}, // 0x42 with value 0x32
-	{0x43, 0x00}, // 0x43 with value 0x00
-	{0x7F, 0x0D}, // 0x7F with value 0x0D
-	{0x51, 0x00}, // 0x51 with value 0x00
-	{0x52, 0x49}, // 0x52 with value 0x49
-	{0x53, 0x00}, // 0x53 with value 0x00
-	{0x54, 0x5B}, // 0x54 with value 0x5B
-	{0x55, 0x00}, // 0x55 with value 0x00
-	{0x56, 0x64}, // 0x56 with value 0x64
-	{0x57, 0x02}, // 0x57 with value 0x02
-	{0x58, 0xA5}, // 0x58 with value 0xA5
-	{0x7F, 0x00}, // 0x7F with value 0x00
-	{0x54, 0x54}, // 0x54 with value 0x54
-	{0x78, 0x01}, // 0x78 with value 0x01
-	{0x79, 0x9C}, // 0x79 with value 0x9C
-	{0x40, 0x40}, // 0x40 with value 0x00 | 0x40
-};
-*/
-
-/*
-Low Power Mode
-*/
-/*
-static const uint8_t sensor_prog_seq_lpm[][2] = {
-	{0x7F, 0x05}, // 0x7F with value 0x05
-	{0x51, 0x40}, // 0x51 with value 0x40
-	{0x53, 0x40}, // 0x53 with value 0x40
-	{0x61, 0x3B}, // 0x61 with value 0x3B
-	{0x6E, 0x1F}, // 0x6E with value 0x1F
-	{0x7F, 0x07}, // 0x7F with value 0x07
-	{0x42, 0x32}, // 0x42 with value 0x32
-	{0x43, 0x00}, // 0x43 with value 0x00
-	{0x7F, 0x0D}, // 0x7F with value 0x0D
-	{0x51, 0x00}, // 0x51 with value 0x00
-	{0x52, 0x49}, // 0x52 with value 0x49
-	{0x53, 0x00}, // 0x53 with value 0x00
-	{0x54, 0x5B}, // 0x54 with value 0x5B
-	{0x55, 0x00}, // 0x55 with value 0x00
-	{0x56, 0x64}, // 0x56 with value 0x64
-	{0x57, 0x02}, // 0x57 with value 0x02
-	{0x58, 0xA5}, // 0x58 with value 0xA5
-	{0x7F, 0x00}, // 0x7F with value 0x00
-	{0x54, 0x54}, // 0x54 with value 0x54
-	{0x78, 0x01}, // 0x78 with value 0x01
-	{0x79, 0x9C}, // 0x79 with value 0x9C
-	{0x40, 0x41}, // 0x40 with value 0x01 | 0x40
-};
-*/
-
-/*
-Office Mode
-*/
-/*
-static const uint8_t sensor_prog_seq_wrk[][2] = {
-	{0x7F, 0x05}, // 0x7F with value 0x05
-	{0x51, 0x28}, // 0x51 with value 0x28
-	{0x53, 0x30}, // 0x53 with value 0x30
-	{0x61, 0x3B}, // 0x61 with value 0x3B
-	{0x6E, 0x1F}, // 0x6E with value 0x1F
-	{0x7F, 0x07}, // 0x7F with value 0x07
-	{0x42, 0x32}, // 0x42 with value 0x32
-	{0x43, 0x00}, // 0x43 with value 0x00
-	{0x7F, 0x0D}, // 0x7F with value 0x0D
-	{0x51, 0x00}, // 0x51 with value 0x00
-	{0x52, 0x49}, // 0x52 with value 0x49
-	{0x53, 0x00}, // 0x53 with value 0x00
-	{0x54, 0x5B}, // 0x54 with value 0x5B
-	{0x55, 0x00}, // 0x55 with value 0x00
-	{0x56, 0x64}, // 0x56 with value 0x64
-	{0x57, 0x02}, // 0x57 with value 0x02
-	{0x58, 0xA5}, // 0x58 with value 0xA5
-	{0x7F, 0x00}, // 0x7F with value 0x00
-	{0x54, 0x52}, // 0x54 with value 0x52
-	{0x78, 0x0A}, // 0x78 with value 0x0A
-	{0x79, 0x0F}, // 0x79 with value 0x0F
-	{0x40, 0x42}, // 0x40 with value 0x02 | 0x40
-};
-*/
+// Health of the sensor link, only touched by sensor_task.
+// Counts failed SPI transfers and implausible bursts in a row.
+static int sensor_bad_bursts = 0;
+static uint32_t sensor_health_check_us = 0;
+// Recovery of a faulted sensor, one attempt per sensor_task iteration once the delay has passed.
+static int sensor_recovery_attempts = 0;
+static uint32_t sensor_recovery_start_us = 0;
+static uint32_t sensor_recovery_failed_us = 0;
+static uint32_t sensor_recovery_delay_ms = 0;
 
-/*
-Corded Gaming Mode
-*/
-/*
-static const uint8_t sensor_prog_seq_crd[][2] = {
-	{0x7F, 0x05}, // 0x7F with value 0x05
-	{0x51, 0x40}, // 0x51 with value 0x40
-	{0x53, 0x40}, // 0x53 with value 0x40
-	{0x61, 0x31}, // 0x61 with value 0x31
-	{0x6E, 0x0F}, // 0x6E with value 0x0F
-	{0x7F, 0x07}, // 0x7F with value 0x07
-	{0x42, 0x2F}, // 0x42 with value 0x2F
-	{0x43, 0x00}, // 0x43 with value 0x00
-	{0x7F, 0x0D}, // 0x7F with value 0x0D
-	{0x51, 0x12}, // 0x51 with value 0x12
-	{0x52, 0xDB}, // 0x52 with value 0xDB
-	{0x53, 0x12}, // 0x53 with value 0x12
-	{0x54, 0xDC}, // 0x54 with value 0xDC
-	{0x55, 0x12}, // 0x55 with value 0x12
-	{0x56, 0xEA}, // 0x56 with value 0xEA
-	{0x57, 0x15}, // 0x57 with value 0x15
-	{0x58, 0x2D}, // 0x58 with value 0x2D
-	{0x7F, 0x00}, // 0x7F with value 0x00
-	{0x54, 0x55}, // 0x54 with value 0x55
-	{0x40, 0x83}, // 0x40 with value 0x83 (Note: We are writing the entire register)
-};
-*/
+// Set while the sensor is in its shutdown state, leaving it takes the power up sequence.
+static bool sensor_shut_down = false;
+// Set while the sensor is held in low power mode for a suspended host.
+static bool sensor_resting = false;
 
-spi_device_handle_t sensor_spi_device;
+static TaskHandle_t sensor_task_handle = NULL;
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_IRQ
+// MOTION is a wake source while parked and starts frames while tracking.
+static volatile bool sensor_parked = false;
+#elif SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_SYNC
+// Frame clock and the period it runs at, restarted when the report rate changes.
+static esp_timer_handle_t sensor_frame_timer = NULL;
+static uint32_t sensor_frame_period_us = 0;
+#endif
 
-MotionData motion_data_buffer[MOTION_DATA_BUFFER_SIZE];
-int motion_data_buffer_write_index = 0;
-int motion_data_buffer_read_index = 0;
+// Frame cycle statistics since the last log line.
+static uint64_t sensor_frame_cycles_sum = 0;
+static uint32_t sensor_frame_cycles_frames = 0;
 
 // Function to add motion data to the buffer
-static void add_motion_data_to_buffer(uint8_t motion_x, uint8_t motion_y, uint32_t timestamp)
+static void HOT_PATH add_motion_data_to_buffer(int16_t motion_x, int16_t motion_y, uint32_t timestamp)
 {
-    motion_data_buffer[motion_data_buffer_write_index].motion_x = motion_x;
-    motion_data_buffer[motion_data_buffer_write_index].motion_y = motion_y;
-    motion_data_buffer[motion_data_buffer_write_index].timestamp = timestamp;
-
-    // Check if the buffer is full
-    // Next write index
-    int next_write_index = (motion_data_buffer_write_index + 1) % MOTION_DATA_BUFFER_SIZE;
-    if (motion_data_buffer_write_index == motion_data_buffer_read_index)
+    if (!input_motion_ring_push(&motion_ring, motion_x, motion_y, timestamp))
     {
-        int next_read_index = (motion_data_buffer_read_index + 1) % MOTION_DATA_BUFFER_SIZE;
-        // If the buffer is full, then drop the oldest data by combining it with the second oldest data
-        motion_data_buffer[next_read_index].motion_x += motion_data_buffer[motion_data_buffer_read_index].motion_x;
-        motion_data_buffer[next_read_index].motion_y += motion_data_buffer[motion_data_buffer_read_index].motion_y;
-        motion_data_buffer_read_index = next_read_index;
+        TELEMETRY_COUNT(motion_buffer_overflows);
     }
-    motion_data_buffer_write_index = next_write_index;
-}
-
-// Function to read the oldest motion data from the buffer
-static MotionData read_oldest_motion_data_from_buffer(void)
-{
-    MotionData oldest_data = motion_data_buffer[motion_data_buffer_read_index];
-
-    motion_data_buffer_read_index = (motion_data_buffer_read_index + 1) % MOTION_DATA_BUFFER_SIZE;
-
-    return oldest_data;
 }
 
 // Function to process motion data
-static void process_motion_data(void)
+static void HOT_PATH process_motion_data(void)
 {
     // Catch up to the new data by processing the remaining motion data in the buffer
-    while (motion_data_buffer_read_index != motion_data_buffer_write_index)
+    motion_sample_t data;
+    while (input_motion_ring_pop(&motion_ring, &data))
     {
-        MotionData data = read_oldest_motion_data_from_buffer();
 
         // Process the motion data by moving the mouse cursor
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x00, data.motion_x, data.motion_y, 0, 0);
+        transport_report_motion(data.motion_x, data.motion_y, 0, 0);
+        telemetry_record_latency(TELEMETRY_LATENCY_MOTION, esp_timer_get_time() - data.timestamp);
     }
 }
 
 // Function to read a register on the Pixart PAW3395 sensor.
-static void sensor_read_register(uint8_t address, uint8_t *response, size_t response_size)
+static esp_err_t HOT_PATH sensor_read_register(uint8_t address, uint8_t *response, size_t response_size)
 {
+    esp_err_t err = sensor_transmit_read(address, response, response_size);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    // Log the response.
+    HOT_PATH_LOGI(TAG, "Read register 0x%02X", address);
+    HOT_PATH_LOG_BUFFER_HEX(TAG, response, response_size);
+    return ESP_OK;
+}
+
+// The register read transaction without the log lines, the link calibration reads tens of thousands of times.
+static esp_err_t HOT_PATH sensor_transmit_read(uint8_t address, uint8_t *response, size_t response_size)
+{
+    // A blocking transfer would take the result of a queued burst, so that one is finished first.
+    sensor_burst_collect();
+
     spi_transaction_t transaction;
     spi_transaction_ext_t transaction_ext;
 
     // Read the response from the sensor.
     memset(&transaction, 0, sizeof(transaction));
     memset(&transaction_ext, 0, sizeof(transaction_ext));
-    // Set flag to use extended SPI transaction and set dummy bits
-    transaction.flags = SPI_TRANS_VARIABLE_DUMMY;
+    // Set flag to use extended SPI transaction and set dummy bits.
+    // The response comes back in rx_data, with DMA on the bus a short or unaligned rx_buffer would make the
+    // driver allocate a bounce buffer for every read.
+    response_size = min(response_size, sizeof(transaction.rx_data));
+    transaction.flags = SPI_TRANS_VARIABLE_DUMMY | SPI_TRANS_USE_RXDATA;
     transaction.cmd = 0;
     transaction.addr = address & 0x7F;
     transaction.length = response_size * 8;
-    transaction.rx_buffer = response;
     transaction_ext.base = transaction;
-    transaction_ext.dummy_bits = SENSOR_DUMMY_BITS;
-
-    ESP_ERROR_CHECK(spi_device_transmit(sensor_spi_device, (spi_transaction_t *)(&transaction_ext)));
+    transaction_ext.dummy_bits = sensor_dummy_bits;
 
-    // Log the response.
-    ESP_LOGI(TAG, "Read register 0x%02X", address);
-    ESP_LOG_BUFFER_HEX(TAG, response, response_size);
+    TELEMETRY_COUNT(spi_transactions);
+    esp_err_t err = spi_device_transmit(sensor_spi_device, (spi_transaction_t *)(&transaction_ext));
+    if (err != ESP_OK)
+    {
+        // Transient bus errors are handled by the health monitor, never by aborting.
+        TELEMETRY_COUNT(spi_errors);
+        sensor_bad_bursts++;
+        memset(response, 0, response_size);
+        return err;
+    }
+    memcpy(response, transaction_ext.base.rx_data, response_size);
+    return ESP_OK;
 }
 
 // Function to set the sensor into motion burst mode from the Pixart PAW3395 sensor.
@@ -527,56 +347,359 @@ into the output buffer after the last address bit is received. After the burst t
 microcontroller must raise the NCS line for at least tBEXIT to terminate burst mode. The serial port is not available for
 use until it is reset with NCS, even for a second burst transmission.
 */
-static void sensor_read_motion_burst(void)
+// The task never waits for a burst. The SPI callbacks drive NCS around it and stamp its end, the task queues
+// the next burst at the start of a frame and decodes and reports the previous one while it is on the bus.
+
+// SPI callbacks, run in the SPI interrupt. They frame every transaction with NCS, only bursts carry a user pointer.
+// Always in IRAM, also without the hot path, the interrupt is placed in IRAM through sdkconfig and stays on during flash writes.
+// Lower NCS and wait for tNCS-SCLK.
+static void IRAM_ATTR sensor_spi_pre(spi_transaction_t *transaction)
 {
-    // SPI Interface will Lower NCS and wait for tNCS-SCLK.
-    // Send Motion_Burst address (0x16). After sending this address, MOSI must be held static (either high or low)
-    uint8_t motion_burst_reg_address = 0x16;
-    uint8_t response[12];
-    sensor_read_register(motion_burst_reg_address, response, sizeof(response));
-    // Wait
-    vTaskDelay(pdUS_TO_TICKS(SENSOR_READ_DELAY_US));
+    gpio_ll_set_level(&GPIO, GPIO_NUM_27, 0);
+    esp_rom_delay_us(SENSOR_NCS_SCLK_DELAY_US);
+}
+
+// Raise NCS after tSCLK-NCS, which also terminates burst mode, and note when a burst arrived.
+static void IRAM_ATTR sensor_spi_post(spi_transaction_t *transaction)
+{
+    // The direction bit is the command phase, set for writes.
+    if (transaction->cmd != 0)
+    {
+        esp_rom_delay_us(SENSOR_SCLK_NCS_WRITE_DELAY_US);
+    }
+    gpio_ll_set_level(&GPIO, GPIO_NUM_27, 1);
+    if (transaction->user != NULL)
+    {
+        *(volatile uint32_t *)transaction->user = esp_timer_get_time();
+    }
+}
+
+// Start the next burst into the free buffer and return, the transfer runs without the CPU.
+static void HOT_PATH sensor_burst_queue(void)
+{
+    int buffer = sensor_burst_next;
+    TELEMETRY_COUNT(spi_transactions);
+    esp_err_t err = spi_device_queue_trans(sensor_spi_device, &sensor_burst_transactions[buffer].base, 0);
+    if (err != ESP_OK)
+    {
+        TELEMETRY_COUNT(spi_errors);
+        sensor_bad_bursts++;
+        return;
+    }
+    sensor_burst_in_flight = buffer;
+    sensor_burst_next = (buffer + 1) % SENSOR_BURST_BUFFERS;
+}
+
+// Take the burst off the bus, its buffer is then ready to decode and the bus is free for register transfers.
+// Only waits while the transfer is still running, a burst queued in the previous frame finished long ago.
+static void HOT_PATH sensor_burst_collect(void)
+{
+    if (sensor_burst_in_flight < 0)
+    {
+        return;
+    }
+    int buffer = sensor_burst_in_flight;
+    sensor_burst_in_flight = -1;
+    spi_transaction_t *transaction;
+    esp_err_t err = spi_device_get_trans_result(sensor_spi_device, &transaction, portMAX_DELAY);
+    if (err != ESP_OK)
+    {
+        TELEMETRY_COUNT(spi_errors);
+        sensor_bad_bursts++;
+        return;
+    }
+    // The serial port is not available until NCS was high for tBEXIT.
+    if ((uint32_t)esp_timer_get_time() - sensor_burst_done_us[buffer] < SENSOR_BURST_EXIT_DELAY_US)
+    {
+        esp_rom_delay_us(SENSOR_BURST_EXIT_DELAY_US);
+    }
+#if LOAD_GEN
+    // The transfer ran for its timing, the generator's motion replaces what the sensor saw.
+    load_gen_motion_burst(sensor_burst_buffers[buffer]);
+#endif
+    sensor_burst_ready = buffer;
+}
+
+// Finish and report the burst in flight, before the task blocks for longer than a frame.
+static void sensor_burst_flush(void)
+{
+    sensor_burst_collect();
+    sensor_decode_motion_burst();
+    process_motion_data();
+}
+
+// Drop the burst in flight and an undecoded one, they are stale after a power cycle.
+static void sensor_burst_discard(void)
+{
+    sensor_burst_collect();
+    sensor_burst_ready = -1;
+}
+
+// Decode the finished burst, its motion goes to the ring.
+static void HOT_PATH sensor_decode_motion_burst(void)
+{
+    if (sensor_burst_ready < 0)
+    {
+        return;
+    }
+    int buffer = sensor_burst_ready;
+    sensor_burst_ready = -1;
+    const uint8_t *response = sensor_burst_buffers[buffer];
+    HOT_PATH_LOGI(TAG, "Read register 0x%02X", SENSOR_REG_MOTION_BURST);
+    HOT_PATH_LOG_BUFFER_HEX(TAG, response, SENSOR_MOTION_BURST_SIZE);
+    trace_record_burst(response);
+    TELEMETRY_COUNT(bursts_read);
+
+    // Drop bursts that could not have come from a working sensor, enough of them in a row trigger a recovery.
+    if (!input_motion_burst_plausible(response))
+    {
+        sensor_bad_bursts++;
+        return;
+    }
+    sensor_bad_bursts = 0;
 
     // If there was no motion data then return.
-    if (response[0] == 0)
+    motion_burst_t burst;
+    bool moved = input_decode_motion_burst(response, &burst);
+    sensor_track_rest(burst.op_mode);
+    if (!moved)
     {
         return;
     }
 
     // Process the motion data
-    // The motion data is a 16 bit signed integer.
-    int16_t motion_x = response[2] | response[3] << 8;
-    int16_t motion_y = response[4] | response[5] << 8;
-    int32_t timestamp = esp_timer_get_time();
-    ESP_LOGI(TAG, "Motion data: %d, %d", motion_x, motion_y);
-    // Add motion data to the buffer
-    add_motion_data_to_buffer(motion_x, motion_y, timestamp);
+    TELEMETRY_COUNT(motion_bursts);
+    int16_t motion_x = burst.delta_x;
+    int16_t motion_y = burst.delta_y;
+    HOT_PATH_LOGI(TAG, "Motion data: %d, %d", motion_x, motion_y);
+    // Add motion data to the buffer, stamped with the end of its transfer.
+    add_motion_data_to_buffer(motion_x, motion_y, sensor_burst_done_us[buffer]);
 }
 
 // Function to write a register on the Pixart PAW3395 sensor.
-static void sensor_write_register(uint8_t address, uint8_t value)
+static esp_err_t sensor_write_register(uint8_t address, uint8_t value)
+{
+    esp_err_t err = sensor_transmit_write(address, value);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Register 0x%02X written with value 0x%02X", address, value);
+    return ESP_OK;
+}
+
+// The register write transaction without the log line, frame grabs write once per frame.
+static esp_err_t sensor_transmit_write(uint8_t address, uint8_t value)
 {
     // Send the command to write the register.
     // The first byte contains the address (7-bit) and has a “1” as its MSB to indicate data direction.
     // The second byte contains the data.
-    uint8_t command[1] = {value};
+    // The data goes out of tx_data, like the reads this keeps the driver from allocating a DMA bounce buffer.
+    sensor_burst_collect();
     spi_transaction_t transaction;
     memset(&transaction, 0, sizeof(transaction));
+    transaction.flags = SPI_TRANS_USE_TXDATA;
     transaction.cmd = 1;
     transaction.addr = address & 0x7F;
-    transaction.length = sizeof(command) * 8;
-    transaction.tx_buffer = command;
-    ESP_ERROR_CHECK(spi_device_transmit(sensor_spi_device, &transaction));
+    transaction.length = 8;
+    transaction.tx_data[0] = value;
+    TELEMETRY_COUNT(spi_transactions);
+    esp_err_t err = spi_device_transmit(sensor_spi_device, &transaction);
+    if (err != ESP_OK)
+    {
+        TELEMETRY_COUNT(spi_errors);
+        sensor_bad_bursts++;
+    }
+    return err;
+}
 
-    ESP_LOGI(TAG, "Register 0x%02X written with value 0x%02X", address, value);
+// Register shadow and link calibration bus callbacks. Reads go without the log lines.
+static int sensor_bus_write(void *context, uint8_t address, uint8_t value)
+{
+    esp_err_t err = sensor_write_register(address, value);
+    // Wait
+    esp_rom_delay_us(SENSOR_WRITE_DELAY_US);
+    return err != ESP_OK;
+}
+
+static int sensor_bus_read(void *context, uint8_t address, uint8_t *value)
+{
+    esp_err_t err = sensor_transmit_read(address, value, 1);
+    // Wait
+    esp_rom_delay_us(SENSOR_READ_DELAY_US);
+    return err != ESP_OK;
+}
+
+// Function to write a programming sequence to the Pixart PAW3395 sensor through the register shadow.
+// Stops at the first failed write.
+static esp_err_t sensor_write_sequence(const sensor_sequence_t *sequence, sensor_write_policy_t policy)
+{
+    return sensor_shadow_write_sequence(&sensor_shadow, sequence, policy) ? ESP_FAIL : ESP_OK;
+}
+
+// Function to set the resolution of the Pixart PAW3395 sensor.
+// Only the resolution bytes that change are written, followed by the Set_Resolution trigger.
+static esp_err_t sensor_set_cpi(uint16_t cpi)
+{
+    uint8_t writes[SENSOR_RESOLUTION_SEQUENCE_LENGTH][2];
+    sensor_resolution_sequence(cpi, writes);
+    const sensor_sequence_t sequence = {writes, SENSOR_RESOLUTION_SEQUENCE_LENGTH};
+    uint32_t transactions = sensor_shadow.transactions;
+    esp_err_t err = sensor_write_sequence(&sequence, SENSOR_WRITE_CHANGED);
+    ESP_LOGI(TAG, "Sensor CPI set to %d, %lu SPI transactions", cpi, sensor_shadow.transactions - transactions);
+    return err;
+}
+
+// Function to switch the Pixart PAW3395 sensor between its performance modes.
+// Registers that already hold the mode's value and redundant bank switches are skipped.
+static esp_err_t sensor_set_mode(MouseMode mode)
+{
+    uint32_t transactions = sensor_shadow.transactions;
+    esp_err_t err = sensor_write_sequence(&sensor_sequence_modes[mode], SENSOR_WRITE_CHANGED);
+    ESP_LOGI(TAG, "Sensor mode set to %d, %lu SPI transactions", mode, sensor_shadow.transactions - transactions);
+    return err;
 }
 
-// Initialize the SPI device for the sensor.
+// Function to program the rest mode timing of the Pixart PAW3395 sensor.
+// Rest 1 is also part of the mode sequences, so this follows every mode change.
+static esp_err_t sensor_set_rest(const sensor_rest_t *rest)
+{
+    uint8_t writes[SENSOR_REST_SEQUENCE_LENGTH][2];
+    sensor_rest_sequence(rest, writes);
+    const sensor_sequence_t sequence = {writes, SENSOR_REST_SEQUENCE_LENGTH};
+    uint32_t transactions = sensor_shadow.transactions;
+    esp_err_t err = sensor_write_sequence(&sequence, SENSOR_WRITE_CHANGED);
+    ESP_LOGI(TAG, "Sensor rest set to %u/%u/%u ms, periods %u/%u/%u ms, %lu SPI transactions", rest->run_downshift_ms,
+             rest->rest1_downshift_ms, rest->rest2_downshift_ms, rest->rest1_period_ms, rest->rest2_period_ms,
+             rest->rest3_period_ms, sensor_shadow.transactions - transactions);
+    return err;
+}
+
+// The settings generation last applied to the sensor.
+static uint32_t sensor_settings_generation = 0;
+// CPI and mode the sensor is known to hold, a CPI of 0 or an unknown mode forces the next write.
+static uint16_t sensor_cpi = 0;
+static uint8_t sensor_mode = MOUSE_MODE_HPM;
+
+// Rest state of the last burst and when the sensor entered it.
+static uint8_t sensor_rest_state = SENSOR_REST_RUN;
+static uint32_t sensor_rest_since_us = 0;
+static uint32_t sensor_rest_time_us[SENSOR_REST_COUNT];
+
+// Follow the rest state the sensor reports in every burst, and the time it spends in each.
+static void sensor_track_rest(uint8_t op_mode)
+{
+    uint32_t now_us = esp_timer_get_time();
+    sensor_rest_time_us[sensor_rest_state] += now_us - sensor_rest_since_us;
+    sensor_rest_since_us = now_us;
+    if (op_mode != sensor_rest_state)
+    {
+        if (op_mode == SENSOR_REST_RUN)
+        {
+            TELEMETRY_COUNT(sensor_rest_exits);
+        }
+        sensor_rest_state = op_mode;
+        telemetry_counters.sensor_rest_state = op_mode;
+    }
+    // Whole milliseconds are moved to the counters, the remainder stays for the next burst.
+    uint32_t run_ms = sensor_rest_time_us[SENSOR_REST_RUN] / 1000;
+    telemetry_counters.sensor_run_ms += run_ms;
+    // The run time by tracking mode, for the energy model. A mode the sensor may not hold counts as HPM, the default.
+    switch (sensor_mode)
+    {
+    case MOUSE_MODE_LPM:
+        telemetry_counters.sensor_run_lpm_ms += run_ms;
+        break;
+    case MOUSE_MODE_WRK:
+        telemetry_counters.sensor_run_wrk_ms += run_ms;
+        break;
+    case MOUSE_MODE_CRD:
+        telemetry_counters.sensor_run_crd_ms += run_ms;
+        break;
+    default:
+        telemetry_counters.sensor_run_hpm_ms += run_ms;
+        break;
+    }
+    telemetry_counters.sensor_rest1_ms += sensor_rest_time_us[SENSOR_REST_1] / 1000;
+    telemetry_counters.sensor_rest2_ms += sensor_rest_time_us[SENSOR_REST_2] / 1000;
+    telemetry_counters.sensor_rest3_ms += sensor_rest_time_us[SENSOR_REST_3] / 1000;
+    for (int i = 0; i < SENSOR_REST_COUNT; i++)
+    {
+        sensor_rest_time_us[i] %= 1000;
+    }
+}
+
+// Apply the sensor side settings if they changed since the last frame.
+static void sensor_apply_settings(void)
+{
+    if (settings_generation == sensor_settings_generation)
+    {
+        return;
+    }
+    // One snapshot for the whole frame, so mode, rest timing and CPI all come from the same profile.
+    settings_t current;
+    sensor_settings_generation = settings_snapshot(&current);
+
+    if (current.sensor_mode != sensor_mode)
+    {
+        sensor_mode = current.sensor_mode;
+        if (sensor_set_mode(sensor_mode) != ESP_OK)
+        {
+            sensor_invalidate_settings();
+            return;
+        }
+    }
+    // Unchanged rest registers are skipped by the shadow.
+    sensor_rest_t rest;
+    settings_sensor_rest(&current, &rest);
+    if (sensor_set_rest(&rest) != ESP_OK)
+    {
+        sensor_invalidate_settings();
+        return;
+    }
+    if (current.cpi != sensor_cpi)
+    {
+        sensor_cpi = current.cpi;
+        if (sensor_set_cpi(sensor_cpi) != ESP_OK)
+        {
+            sensor_invalidate_settings();
+            return;
+        }
+    }
+}
+
+// Forget what the sensor holds so the next frame rewrites CPI and mode.
+static void sensor_invalidate_settings(void)
+{
+    sensor_settings_generation = settings_generation - 1;
+    sensor_cpi = 0;
+    sensor_mode = SENSOR_MODE_UNKNOWN;
+}
+
+// Initialize the SPI device for the sensor, on the stored link setting if there is one.
 void sensor_spi_init(void)
 {
-    ESP_ERROR_CHECK(spi_bus_initialize(SPI3_HOST, &sensor_spi_bus_config, 1));
-    ESP_ERROR_CHECK(spi_bus_add_device(SPI3_HOST, &sensor_spi_device_config, &sensor_spi_device));
-    ESP_LOGI(TAG, "SPI device initialized");
+    ESP_ERROR_CHECK(spi_bus_initialize(SPI3_HOST, &sensor_spi_bus_config, SPI_DMA_CH_AUTO));
+    // Send Motion_Burst address (0x16), then read the burst after tSRAD.
+    for (int i = 0; i < SENSOR_BURST_BUFFERS; i++)
+    {
+        spi_transaction_ext_t *transaction_ext = &sensor_burst_transactions[i];
+        memset(transaction_ext, 0, sizeof(*transaction_ext));
+        transaction_ext->base.flags = SPI_TRANS_VARIABLE_DUMMY;
+        transaction_ext->base.addr = SENSOR_REG_MOTION_BURST;
+        transaction_ext->base.length = SENSOR_MOTION_BURST_SIZE * 8;
+        transaction_ext->base.rx_buffer = sensor_burst_buffers[i];
+        transaction_ext->base.user = (void *)&sensor_burst_done_us[i];
+    }
+    settings_get_link(&sensor_link);
+    if (!sensor_link.calibrated)
+    {
+        sensor_link = sensor_link_datasheet;
+    }
+    ESP_ERROR_CHECK(sensor_link_apply(sensor_link.clock_hz, sensor_link.input_delay_ns));
+    ESP_LOGI(TAG, "SPI device initialized, %lu Hz, input delay %u ns%s", sensor_link.clock_hz, sensor_link.input_delay_ns,
+             sensor_link.calibrated ? " (calibrated)" : "");
 }
 
 // Function to configure the Pixart PAW3395 sensor.
@@ -584,14 +707,13 @@ void sensor_spi_init(void)
 Please note that upon chip start-up per the recommended Power-Up Sequence, the chip is set to High Performance
 Mode as default.
 */
-static void sensor_configure(void)
+// Returns false if a register write failed.
+static bool sensor_configure(void)
 {
     // Configure the sensor's first set of registers.
-    for (int i = 0; i < sizeof(sensor_prog_seq_first) / sizeof(sensor_prog_seq_first[0]); i++)
+    if (sensor_write_sequence(&sensor_sequence_first, SENSOR_WRITE_RAW) != ESP_OK)
     {
-        sensor_write_register(sensor_prog_seq_first[i][0], sensor_prog_seq_first[i][1]);
-        // Wait
-        vTaskDelay(pdUS_TO_TICKS(SENSOR_WRITE_DELAY_US));
+        return false;
     }
 
     // Wait for the sensor to initialize.
@@ -599,9 +721,9 @@ static void sensor_configure(void)
     while (attempts < SENSOR_0x6C_READ_ATTEMPTS)
     {
         uint8_t response[1];
-        sensor_read_register(0x6C, response, sizeof(response));
+        esp_err_t err = sensor_read_register(0x6C, response, sizeof(response));
         vTaskDelay(pdMS_TO_TICKS(SENSOR_0x6C_READ_INTERVAL_MS));
-        if (response[0] == SENSOR_0x6C_READ_VALUE)
+        if (err == ESP_OK && response[0] == SENSOR_0x6C_READ_VALUE)
         {
             break;
         }
@@ -612,26 +734,50 @@ static void sensor_configure(void)
     {
         ESP_LOGE(TAG, "Failed to initialize sensor");
         // Configure the sensor's fail registers.
-        for (int i = 0; i < sizeof(sensor_prog_seq_0x6C_fail) / sizeof(sensor_prog_seq_0x6C_fail[0]); i++)
+        if (sensor_write_sequence(&sensor_sequence_0x6C_fail, SENSOR_WRITE_RAW) != ESP_OK)
         {
-            sensor_write_register(sensor_prog_seq_0x6C_fail[i][0], sensor_prog_seq_0x6C_fail[i][1]);
-            // Wait
-            vTaskDelay(pdUS_TO_TICKS(SENSOR_WRITE_DELAY_US));
+            return false;
         }
     }
 
     // Configure the sensor's second set of registers.
-    for (int i = 0; i < sizeof(sensor_prog_seq_second) / sizeof(sensor_prog_seq_second[0]); i++)
+    if (sensor_write_sequence(&sensor_sequence_second, SENSOR_WRITE_RAW) != ESP_OK)
     {
-        sensor_write_register(sensor_prog_seq_second[i][0], sensor_prog_seq_second[i][1]);
-        // Wait
-        vTaskDelay(pdUS_TO_TICKS(SENSOR_WRITE_DELAY_US));
+        return false;
     }
 
     ESP_LOGI(TAG, "SPI device configured");
+    return true;
 }
 
-// Initialize the IO pins for the sensor.
+// Check the product ID and its inverse, a mismatch means the sensor is missing, unpowered or the bus is corrupted.
+static bool sensor_verify_id(void)
+{
+    uint8_t product_id[1];
+    uint8_t inverse_product_id[1];
+    if (sensor_read_register(SENSOR_REG_PRODUCT_ID, product_id, sizeof(product_id)) != ESP_OK)
+    {
+        return false;
+    }
+    esp_rom_delay_us(SENSOR_READ_DELAY_US);
+    if (sensor_read_register(SENSOR_REG_INVERSE_PRODUCT_ID, inverse_product_id, sizeof(inverse_product_id)) != ESP_OK)
+    {
+        return false;
+    }
+    esp_rom_delay_us(SENSOR_READ_DELAY_US);
+    // The bit error rate of the link in use, next to the one the calibration accepted it with.
+    TELEMETRY_ADD(link_bits, 16);
+    TELEMETRY_ADD(link_bit_errors, __builtin_popcount(product_id[0] ^ SENSOR_PRODUCT_ID) +
+                                       __builtin_popcount(inverse_product_id[0] ^ SENSOR_INVERSE_PRODUCT_ID));
+    if (product_id[0] != SENSOR_PRODUCT_ID || inverse_product_id[0] != SENSOR_INVERSE_PRODUCT_ID)
+    {
+        ESP_LOGE(TAG, "Unexpected sensor ID 0x%02X/0x%02X", product_id[0], inverse_product_id[0]);
+        return false;
+    }
+    return true;
+}
+
+// Run the power on sequence of the sensor.
 /*
 6.1 Power on Sequence
 Although the chip performs an internal power up self-reset, it is still recommended that the Power_Up_Reset
@@ -645,42 +791,50 @@ Ensure all supplies are stable.
 6. Load Power-up initialization register setting.
 7. Read registers 0x02, 0x03, 0x04, 0x05 and 0x06 one time regardless of the motion bit state.
 */
-void sensor_init(void)
+// With power_cycle set the supply is switched off first, which is how a hung sensor is recovered.
+// Returns true once the sensor is configured and reports the expected product ID.
+static bool sensor_power_up(bool power_cycle)
 {
-    // Initialize the SPI device for the sensor.
-    sensor_spi_init();
-
-    ESP_ERROR_CHECK(gpio_config(&sensor_ncs_config));
-    ESP_ERROR_CHECK(gpio_config(&sensor_mosi_config));
-    ESP_ERROR_CHECK(gpio_config(&sensor_sclk_config));
-    ESP_ERROR_CHECK(gpio_config(&sensor_miso_config));
-    ESP_ERROR_CHECK(gpio_config(&sensor_nreset_config));
-    ESP_ERROR_CHECK(gpio_config(&sensor_motion_config));
-    ESP_ERROR_CHECK(gpio_config(&sensor_pwr_en_config));
+    // gpio_set_level only fails for invalid pins, so the results are not checked here.
+    if (power_cycle)
+    {
+        sensor_release_pins(true);
+        gpio_set_level(GPIO_NUM_39, 0);
+        vTaskDelay(pdMS_TO_TICKS(SENSOR_POWER_OFF_DELAY_MS));
+    }
 
     // Excess delays are assumed fine in this sequence.
 
     // Power up the sensor.
-    ESP_ERROR_CHECK(gpio_set_level(GPIO_NUM_39, 1));
+    gpio_set_level(GPIO_NUM_39, 1);
     // Wait for the sensor to power up.
     vTaskDelay(pdMS_TO_TICKS(SENSOR_WAKEUP_DELAY_MS));
+    if (power_cycle)
+    {
+        sensor_release_pins(false);
+    }
     // Reset the SPI port.
-    ESP_ERROR_CHECK(gpio_set_level(GPIO_NUM_27, 1));
-    vTaskDelay(pdUS_TO_TICKS(SENSOR_RESET_DELAY_US));
-    ESP_ERROR_CHECK(gpio_set_level(GPIO_NUM_27, 0));
-    vTaskDelay(pdUS_TO_TICKS(SENSOR_RESET_DELAY_US));
+    gpio_set_level(GPIO_NUM_27, 1);
+    esp_rom_delay_us(SENSOR_RESET_DELAY_US);
+    gpio_set_level(GPIO_NUM_27, 0);
+    esp_rom_delay_us(SENSOR_RESET_DELAY_US);
     // Toggle the reset pin.
     // The NRESET pin needs to be asserted (held to logic 0) for at least
     // 100 ns duration for the chip to reset.
-    ESP_ERROR_CHECK(gpio_set_level(GPIO_NUM_31, 1));
-    vTaskDelay(pdUS_TO_TICKS(SENSOR_RESET_DELAY_US));
-    ESP_ERROR_CHECK(gpio_set_level(GPIO_NUM_31, 0));
-    vTaskDelay(pdUS_TO_TICKS(SENSOR_RESET_DELAY_US));
-    ESP_ERROR_CHECK(gpio_set_level(GPIO_NUM_31, 1));
+    gpio_set_level(GPIO_NUM_31, 1);
+    esp_rom_delay_us(SENSOR_RESET_DELAY_US);
+    gpio_set_level(GPIO_NUM_31, 0);
+    esp_rom_delay_us(SENSOR_RESET_DELAY_US);
+    gpio_set_level(GPIO_NUM_31, 1);
     // Wait for the sensor/spi to reset.
     vTaskDelay(pdMS_TO_TICKS(5));
+    // The reset cleared every register and selected bank 0.
+    sensor_shadow_reset(&sensor_shadow);
     // Load the power-up initialization register settings.
-    sensor_configure();
+    if (!sensor_configure())
+    {
+        return false;
+    }
     // Read registers 0x02, 0x03, 0x04, 0x05 and 0x06 one time regardless of the motion bit state.
     uint8_t regs[5] =
         {0x02, 0x03, 0x04, 0x05, 0x06};
@@ -691,42 +845,690 @@ void sensor_init(void)
         sensor_read_register(reg, response, sizeof(response));
         ESP_LOGI(TAG, "Register 0x%02X: 0x%02X", reg, response[0]);
         // Wait
-        vTaskDelay(pdUS_TO_TICKS(SENSOR_READ_DELAY_US));
+        esp_rom_delay_us(SENSOR_READ_DELAY_US);
     }
 
     // Wait for the sensor to initialize.
     vTaskDelay(pdMS_TO_TICKS(SENSOR_MOTION_DELAY_MS));
 
+    // The power cycle returned the sensor to its power-up CPI and mode.
+    sensor_invalidate_settings();
+    sensor_mode = MOUSE_MODE_HPM;
+    sensor_bad_bursts = 0;
+    sensor_health_check_us = esp_timer_get_time();
+    if (!sensor_verify_id())
+    {
+        return false;
+    }
+    // A resume may bring back a sensor the recovery had given up on.
+    sensor_recovery_attempts = 0;
+    telemetry_counters.sensor_failed = 0;
+    telemetry_boot_mark(TELEMETRY_BOOT_SENSOR_READY);
+    return true;
+}
+
+// Stop driving the sensor's inputs while its supply is off, or drive them again once it is back on.
+// Driven lines would back power the sensor through its IO pins and keep it from resetting.
+// Releasing a pin to input also disconnects its output in the GPIO matrix. NCS and NRESET are plain GPIOs and
+// only get their output back. MOSI and SCLK have to be connected to the SPI3 outputs again, the way
+// spi_bus_initialize routes them. gpio_set_direction to output connects the plain GPIO output instead, and every
+// transfer after the power cycle would go nowhere.
+static void sensor_release_pins(bool release)
+{
+    // gpio_set_direction only fails for invalid pins, so the results are not checked here.
+    if (release)
+    {
+        gpio_set_direction(GPIO_NUM_27, GPIO_MODE_INPUT);
+        gpio_set_direction(GPIO_NUM_28, GPIO_MODE_INPUT);
+        gpio_set_direction(GPIO_NUM_29, GPIO_MODE_INPUT);
+        gpio_set_direction(GPIO_NUM_31, GPIO_MODE_INPUT);
+        return;
+    }
+    gpio_set_direction(GPIO_NUM_27, GPIO_MODE_OUTPUT);
+    gpio_set_direction(GPIO_NUM_31, GPIO_MODE_OUTPUT);
+    gpio_set_direction(GPIO_NUM_28, GPIO_MODE_INPUT_OUTPUT);
+    esp_rom_gpio_connect_out_signal(GPIO_NUM_28, spi_periph_signal[SPI3_HOST].spid_out, false, false);
+    gpio_set_direction(GPIO_NUM_29, GPIO_MODE_INPUT_OUTPUT);
+    esp_rom_gpio_connect_out_signal(GPIO_NUM_29, spi_periph_signal[SPI3_HOST].spiclk_out, false, false);
+}
+
+// Initialize the IO pins for the sensor.
+void sensor_init(void)
+{
+    ESP_ERROR_CHECK(gpio_config(&sensor_ncs_config));
+    ESP_ERROR_CHECK(gpio_config(&sensor_nreset_config));
+    ESP_ERROR_CHECK(gpio_config(&sensor_motion_config));
+    ESP_ERROR_CHECK(gpio_config(&sensor_pwr_en_config));
+
+    // Initialize the SPI device for the sensor, the bus takes over MOSI, SCLK and MISO.
+    sensor_spi_init();
+    sensor_shadow_init(&sensor_shadow, &sensor_bus);
+    // MOTION wakes the mouse while parked. While tracking it starts the frames with SENSOR_ACQUISITION_MOTION_IRQ
+    // and is ignored otherwise.
+    gpio_install_isr_service(HOT_PATH_ISR_FLAGS);
+    profiler_isr_handler_add(GPIO_NUM_38, sensor_motion_isr, NULL);
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_SYNC
+    const esp_timer_create_args_t frame_timer_args = {
+        .callback = sensor_frame_tick,
+        .name = "sensor_frame",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&frame_timer_args, &sensor_frame_timer));
+#endif
+
+    // A sensor that fails here is recovered by sensor_task, the buttons and wheel work without it.
+    if (!sensor_power_up(false))
+    {
+        ESP_LOGE(TAG, "Sensor failed to come up");
+        sensor_bad_bursts = SENSOR_FAULT_BURSTS;
+    }
+    else if (!sensor_link.calibrated)
+    {
+        // First boot, or the last calibrated setting stopped working.
+        sensor_calibrate_link();
+    }
+    sensor_acquisition_start();
+
     ESP_LOGI(TAG, "USB sensor_init");
 }
 
+/************* Health Monitor ****************/
+
+// Periodically check the product ID while tracking.
+static void sensor_check_health(void)
+{
+    uint32_t now_us = esp_timer_get_time();
+    if (now_us - sensor_health_check_us < SENSOR_HEALTH_CHECK_INTERVAL_MS * 1000)
+    {
+        return;
+    }
+    sensor_health_check_us = now_us;
+    if (!sensor_verify_id())
+    {
+        sensor_bad_bursts = SENSOR_FAULT_BURSTS;
+    }
+}
+
+// Power cycle and reconfigure a faulted sensor, one attempt per call once the retry delay has passed.
+// The delay doubles after each failed attempt, after SENSOR_RECOVERY_ATTEMPTS the sensor is reported failed.
+// Runs in sensor_task, so the button and wheel tasks keep reporting throughout.
+// Returns true once the sensor responds again.
+static bool sensor_recover(void)
+{
+    uint32_t now_us = esp_timer_get_time();
+    if (sensor_recovery_attempts == 0)
+    {
+        sensor_recovery_start_us = now_us;
+        TELEMETRY_COUNT(sensor_faults);
+        ESP_LOGW(TAG, "Sensor fault, power cycling");
+    }
+    else if (now_us - sensor_recovery_failed_us < sensor_recovery_delay_ms * 1000)
+    {
+        return false;
+    }
+
+    // A successful power up clears the attempts.
+    int attempts = ++sensor_recovery_attempts;
+    if (!sensor_link_restore() || !sensor_power_up(true))
+    {
+        if (attempts == SENSOR_LINK_FALLBACK_ATTEMPTS && sensor_link.calibrated)
+        {
+            sensor_link_fallback();
+        }
+        if (attempts == SENSOR_RECOVERY_ATTEMPTS)
+        {
+            telemetry_counters.sensor_failed = 1;
+            TELEMETRY_COUNT(sensor_recovery_failures);
+            ESP_LOGE(TAG, "Sensor failed, %d attempts, retrying every %d ms", attempts, SENSOR_RECOVERY_RETRY_MAX_MS);
+        }
+        sensor_recovery_failed_us = esp_timer_get_time();
+        sensor_recovery_delay_ms = (attempts == 1) ? SENSOR_RECOVERY_RETRY_MS
+                                                   : min(sensor_recovery_delay_ms * 2, SENSOR_RECOVERY_RETRY_MAX_MS);
+        return false;
+    }
+
+    // Motion queued before the fault is stale by now.
+    sensor_burst_discard();
+    input_motion_ring_clear(&motion_ring);
+
+    uint32_t recovery_us = esp_timer_get_time() - sensor_recovery_start_us;
+    telemetry_counters.sensor_recovery_last_us = recovery_us;
+    telemetry_counters.sensor_recovery_max_us = max(telemetry_counters.sensor_recovery_max_us, recovery_us);
+    TELEMETRY_COUNT(sensor_recoveries);
+    ESP_LOGW(TAG, "Sensor recovered in %lu us, %d attempts", recovery_us, attempts);
+    return true;
+}
+
+/************* Suspend ****************/
+
+// MOTION went low while parked. It is a level interrupt, so it is switched off until sensor_resume.
+// With SENSOR_ACQUISITION_MOTION_IRQ its falling edge while tracking starts the next frame instead.
+static void HOT_PATH sensor_motion_isr(void *arg)
+{
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_IRQ
+    if (!sensor_parked)
+    {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(sensor_task_handle, &woken);
+        portYIELD_FROM_ISR(woken);
+        return;
+    }
+#endif
+    // The HAL call, gpio_intr_disable is not safe while the flash cache is off.
+    gpio_ll_intr_disable(&GPIO, GPIO_NUM_38);
+    power_wake_from_isr();
+}
+
+// Park the sensor while the input tasks wait for a wake.
+// At POWER_LEVEL_SLEEP the sensor keeps its mode, it drops to its own rest modes between motion anyway.
+// While the host is suspended with remote wakeup allowed the sensor keeps tracking in low power mode.
+// Otherwise nothing may wake the host and the sensor is shut down. The supply stays on,
+// cutting it while the SPI lines are driven would back power the sensor through its IO pins.
+static void sensor_park(void)
+{
+    sensor_acquisition_stop();
+    sensor_burst_flush();
+    if (power_suspended() && !power_remote_wakeup_armed())
+    {
+        sensor_write_register(SENSOR_REG_SHUTDOWN, SENSOR_SHUTDOWN_VALUE);
+        sensor_shut_down = true;
+        ESP_LOGI(TAG, "Sensor shut down");
+        return;
+    }
+
+    if (power_suspended())
+    {
+        sensor_mode = MOUSE_MODE_LPM;
+        if (sensor_set_mode(MOUSE_MODE_LPM) != ESP_OK)
+        {
+            sensor_invalidate_settings();
+        }
+        sensor_resting = true;
+        ESP_LOGI(TAG, "Sensor resting");
+    }
+    // Release MOTION, it then asserts on the first movement.
+    for (uint8_t reg = SENSOR_MOTION_REGS_FIRST; reg <= SENSOR_MOTION_REGS_LAST; reg++)
+    {
+        uint8_t response[1];
+        sensor_read_register(reg, response, sizeof(response));
+        esp_rom_delay_us(SENSOR_READ_DELAY_US);
+    }
+    // Low level rather than an edge, GPIO wake from light sleep only knows levels.
+    gpio_set_intr_type(GPIO_NUM_38, GPIO_INTR_LOW_LEVEL);
+    gpio_wakeup_enable(GPIO_NUM_38, GPIO_INTR_LOW_LEVEL);
+    gpio_intr_enable(GPIO_NUM_38);
+}
+
+// Restore full tracking after a wake or resume.
+static void sensor_resume(void)
+{
+    gpio_wakeup_disable(GPIO_NUM_38);
+    gpio_set_intr_type(GPIO_NUM_38, GPIO_INTR_DISABLE);
+    if (sensor_shut_down)
+    {
+        sensor_shut_down = false;
+        sensor_resting = true;
+        if (!sensor_power_up(false))
+        {
+            sensor_bad_bursts = SENSOR_FAULT_BURSTS;
+        }
+    }
+    if (sensor_resting)
+    {
+        sensor_resting = false;
+        // The next frame puts back the configured mode and CPI.
+        sensor_invalidate_settings();
+    }
+    sensor_health_check_us = esp_timer_get_time();
+    // Time parked is not counted as rest.
+    sensor_rest_since_us = sensor_health_check_us;
+    sensor_acquisition_start();
+}
+
+/************* Acquisition ****************/
+
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_SYNC
+// Frame clock, runs in the esp_timer task.
+static void sensor_frame_tick(void *arg)
+{
+    xTaskNotifyGive(sensor_task_handle);
+}
+#endif
+
+// Start taking frames, after init and on every resume.
+static void sensor_acquisition_start(void)
+{
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_IRQ
+    // Cleared first, an edge between the two would otherwise switch the interrupt off as a wake.
+    sensor_parked = false;
+    gpio_set_intr_type(GPIO_NUM_38, GPIO_INTR_NEGEDGE);
+    gpio_intr_enable(GPIO_NUM_38);
+#elif SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_SYNC
+    sensor_frame_period_us = sensor_frame_us();
+    esp_timer_start_periodic(sensor_frame_timer, sensor_frame_period_us);
+#endif
+}
+
+// Stop taking frames before parking.
+static void sensor_acquisition_stop(void)
+{
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_IRQ
+    sensor_parked = true;
+#elif SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_SYNC
+    esp_timer_stop(sensor_frame_timer);
+    // Drop a tick that came in before the stop.
+    ulTaskNotifyTake(pdTRUE, 0);
+#endif
+}
+
+// Frame interval, the report interval unless the load generator runs the frames faster.
+static uint32_t sensor_frame_us(void)
+{
+    settings_t current;
+    settings_snapshot(&current);
+#if LOAD_GEN
+    return load_gen_frame_us(current.report_rate_us);
+#else
+    return current.report_rate_us;
+#endif
+}
+
+// Wait for the next frame, compiled for the acquisition mode picked in menuconfig.
+static void sensor_wait_frame(uint32_t start_us)
+{
+    uint32_t frame_us = sensor_frame_us();
+    uint32_t diff_us = (esp_timer_get_time() - start_us);
+    telemetry_record_latency(TELEMETRY_LATENCY_FRAME, diff_us);
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_SYNC
+    // The timer keeps the period. After an overrun its tick is already pending and the next frame starts at once.
+    if (diff_us >= frame_us)
+    {
+        TELEMETRY_COUNT(frame_overruns);
+    }
+    if (sensor_frame_period_us != frame_us)
+    {
+        esp_timer_stop(sensor_frame_timer);
+        sensor_frame_period_us = frame_us;
+        esp_timer_start_periodic(sensor_frame_timer, sensor_frame_period_us);
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#else
+    // Time stamp to ensure we do not exceed REPORT_RATE_MS
+    // Wait until REPORT_RATE_MS has elapsed
+    if (diff_us < frame_us)
+    {
+        sensor_delay_us(frame_us - diff_us);
+    }
+    else
+    {
+        TELEMETRY_COUNT(frame_overruns);
+    }
+#if SENSOR_ACQUISITION == SENSOR_ACQUISITION_MOTION_IRQ
+    // MOTION stays low while deltas are waiting, then the next burst is read right away.
+    // The burst in flight releases it, so it is finished before MOTION is checked.
+    // The timeout keeps the health check running while the mouse is still.
+    ulTaskNotifyTake(pdTRUE, 0);
+    sensor_burst_collect();
+    if (gpio_get_level(GPIO_NUM_38) != 0)
+    {
+        // No frame comes until the next movement, the last burst is reported now instead of with it.
+        sensor_burst_flush();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SENSOR_HEALTH_CHECK_INTERVAL_MS));
+    }
+#endif
+#endif
+}
+
+// Sleep whole ticks and spin the rest, the 1 ms tick is longer than a report interval.
+static void sensor_delay_us(uint32_t delay_us)
+{
+    uint32_t start_us = esp_timer_get_time();
+    TickType_t ticks = pdUS_TO_TICKS(delay_us);
+    if (ticks > 0)
+    {
+        // The first tick may come early, the spin below makes up for it.
+        vTaskDelay(ticks);
+    }
+    uint32_t elapsed_us = esp_timer_get_time() - start_us;
+    if (elapsed_us < delay_us)
+    {
+        esp_rom_delay_us(delay_us - elapsed_us);
+    }
+}
+
+// CPU cycles from the start of a frame to the end of its reports. The burst transfer runs alongside
+// and only counts if the task had to wait for it.
+// A frame that moved to the other core is skipped, the cycle counters of the cores are not in step.
+static void sensor_count_frame_cycles(int start_core, uint32_t start_cycles)
+{
+    uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+    if (xPortGetCoreID() != start_core)
+    {
+        return;
+    }
+    telemetry_counters.frame_cycles_last = cycles;
+    telemetry_counters.frame_cycles_max = max(telemetry_counters.frame_cycles_max, cycles);
+    sensor_frame_cycles_sum += cycles;
+    if (++sensor_frame_cycles_frames == SENSOR_FRAME_CYCLES_LOG_FRAMES)
+    {
+        ESP_LOGI(TAG, "Frame cycles: mean %lu, max %lu over %d frames", (uint32_t)(sensor_frame_cycles_sum / SENSOR_FRAME_CYCLES_LOG_FRAMES),
+                 telemetry_counters.frame_cycles_max, SENSOR_FRAME_CYCLES_LOG_FRAMES);
+        sensor_frame_cycles_sum = 0;
+        sensor_frame_cycles_frames = 0;
+    }
+}
+
+/************* Frame Capture ****************/
+
+// Grab one raw frame, the pixels are read in a single DMA transfer straight into the capture buffer.
+static esp_err_t sensor_grab_frame(uint8_t *pixels)
+{
+    if (sensor_shadow_select_bank(&sensor_shadow, 0) != 0)
+    {
+        return ESP_FAIL;
+    }
+    esp_err_t err = sensor_transmit_write(SENSOR_REG_RAW_DATA_GRAB, SENSOR_RAW_DATA_GRAB_START);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    // The grab holds the next frame the sensor takes.
+    uint32_t start_us = esp_timer_get_time();
+    uint8_t status = 0;
+    while ((status & SENSOR_RAW_DATA_GRAB_READY) != SENSOR_RAW_DATA_GRAB_READY)
+    {
+        if (esp_timer_get_time() - start_us > SENSOR_RAW_GRAB_TIMEOUT_US)
+        {
+            return ESP_ERR_TIMEOUT;
+        }
+        esp_rom_delay_us(SENSOR_WRITE_DELAY_US);
+        err = sensor_read_register(SENSOR_REG_RAW_DATA_GRAB_STATUS, &status, sizeof(status));
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+    esp_rom_delay_us(SENSOR_READ_DELAY_US);
+
+    // Like a motion burst, the address goes out once and the sensor steps through the pixels.
+    spi_transaction_ext_t transaction_ext;
+    memset(&transaction_ext, 0, sizeof(transaction_ext));
+    transaction_ext.base.flags = SPI_TRANS_VARIABLE_DUMMY;
+    transaction_ext.base.addr = SENSOR_REG_RAW_DATA_GRAB;
+    transaction_ext.base.length = SENSOR_RAW_FRAME_PIXELS * 8;
+    transaction_ext.base.rx_buffer = pixels;
+    transaction_ext.dummy_bits = sensor_dummy_bits;
+    sensor_burst_collect();
+    TELEMETRY_COUNT(spi_transactions);
+    err = spi_device_transmit(sensor_spi_device, (spi_transaction_t *)(&transaction_ext));
+    if (err != ESP_OK)
+    {
+        TELEMETRY_COUNT(spi_errors);
+        sensor_bad_bursts++;
+        return err;
+    }
+    esp_rom_delay_us(SENSOR_READ_DELAY_US);
+    return ESP_OK;
+}
+
+// Stream raw frames instead of motion until the host stops the capture.
+// The next frame is grabbed into one buffer while the capture task sends the other,
+// so frames come at the rate of the slower side. The stalls in the frame header tell which one it was.
+static void sensor_capture_frames(void)
+{
+    ESP_LOGI(TAG, "Frame capture started");
+    sensor_acquisition_stop();
+    sensor_burst_flush();
+    while (frame_capture_active() && sensor_bad_bursts < SENSOR_FAULT_BURSTS)
+    {
+        uint8_t *pixels = frame_capture_claim();
+        if (pixels == NULL)
+        {
+            continue;
+        }
+        uint32_t start_us = esp_timer_get_time();
+        if (sensor_grab_frame(pixels) != ESP_OK)
+        {
+            frame_capture_release();
+            continue;
+        }
+        sensor_bad_bursts = 0;
+        frame_capture_submit(start_us, esp_timer_get_time() - start_us);
+        // No input while capturing, this keeps the power ladder from parking the sensor task.
+        power_activity();
+    }
+    frame_capture_release();
+
+    // Grabs stop navigation, the power up sequence restarts it with the configured settings.
+    if (!sensor_power_up(false))
+    {
+        sensor_bad_bursts = SENSOR_FAULT_BURSTS;
+    }
+    sensor_burst_discard();
+    input_motion_ring_clear(&motion_ring);
+    sensor_acquisition_start();
+    ESP_LOGI(TAG, "Frame capture ended, tracking again");
+}
+
+/************* SPI Link ****************/
+
+// Switch the SPI device to a clock and input delay. The driver only takes them when a device is added,
+// so the device is removed and added again. Fails if the device cannot be removed, it is then kept as it was,
+// or if the driver refuses the pair, the device is then gone until the next call that succeeds.
+// The pins are the same afterwards as at boot. The device has no hardware CS, so NCS stays the GPIO the SPI
+// callbacks drive, and MOSI, SCLK and MISO belong to the bus, which is kept.
+static esp_err_t sensor_link_apply(uint32_t clock_hz, uint8_t input_delay_ns)
+{
+    if (sensor_spi_device != NULL)
+    {
+        esp_err_t err = spi_bus_remove_device(sensor_spi_device);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        sensor_spi_device = NULL;
+    }
+    sensor_spi_device_config.clock_speed_hz = clock_hz;
+    sensor_spi_device_config.input_delay_ns = input_delay_ns;
+    esp_err_t err = spi_bus_add_device(SPI3_HOST, &sensor_spi_device_config, &sensor_spi_device);
+    if (err != ESP_OK)
+    {
+        sensor_spi_device = NULL;
+        return err;
+    }
+    sensor_dummy_bits = sensor_link_dummy_bits(clock_hz, SENSOR_READ_SETUP_US);
+    for (int i = 0; i < SENSOR_BURST_BUFFERS; i++)
+    {
+        sensor_burst_transactions[i].dummy_bits = sensor_dummy_bits;
+    }
+    return ESP_OK;
+}
+
+// Link calibration callback.
+static int sensor_link_configure(void *context, uint32_t clock_hz, uint8_t input_delay_ns)
+{
+    return sensor_link_apply(clock_hz, input_delay_ns) != ESP_OK;
+}
+
+// Go back to the datasheet setting after the calibrated one failed to bring the sensor up.
+// The stored setting is dropped too, the next boot calibrates again.
+static void sensor_link_fallback(void)
+{
+    ESP_LOGW(TAG, "SPI link at %lu Hz, input delay %u ns failed, back to %lu Hz", sensor_link.clock_hz,
+             sensor_link.input_delay_ns, sensor_link_datasheet.clock_hz);
+    sensor_link = sensor_link_datasheet;
+    heap_guard_pause();
+    esp_err_t err = sensor_link_apply(sensor_link.clock_hz, sensor_link.input_delay_ns);
+    heap_guard_resume();
+    if (err != ESP_OK)
+    {
+        sensor_link_lose(err);
+    }
+    settings_commit_link(&sensor_link);
+}
+
+// The driver refused a link switch after boot. The sensor is handed to the health monitor as faulted, and
+// sensor_recover applies the datasheet setting again with its backoff. Only the boot setting aborts on failure.
+static void sensor_link_lose(esp_err_t err)
+{
+    ESP_LOGE(TAG, "SPI link switch failed: %s, back to %lu Hz on recovery", esp_err_to_name(err),
+             sensor_link_datasheet.clock_hz);
+    TELEMETRY_COUNT(spi_errors);
+    sensor_link = sensor_link_datasheet;
+    sensor_link_lost = true;
+    sensor_bad_bursts = SENSOR_FAULT_BURSTS;
+}
+
+// Apply the datasheet setting again after a refused link switch, from sensor_recover.
+// Returns false if the driver still refuses it, the recovery attempt then counts as failed.
+static bool sensor_link_restore(void)
+{
+    if (!sensor_link_lost)
+    {
+        return true;
+    }
+    // A burst still queued keeps the device from being removed.
+    sensor_burst_discard();
+    heap_guard_pause();
+    esp_err_t err = sensor_link_apply(sensor_link.clock_hz, sensor_link.input_delay_ns);
+    heap_guard_resume();
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "SPI link at %lu Hz still refused: %s", sensor_link.clock_hz, esp_err_to_name(err));
+        return false;
+    }
+    sensor_link_lost = false;
+    return true;
+}
+
+// Sweep the SPI link, switch to the fastest setting with margin and store it for the next boots.
+// Reads at a bad setting can reach the sensor as writes, so it is powered up again afterwards.
+// Takes one to two seconds, the caller has stopped the bursts.
+static void sensor_calibrate_link(void)
+{
+    uint32_t start_us = esp_timer_get_time();
+    sensor_link_report.state = SENSOR_LINK_RUNNING;
+    sensor_link_requested = false;
+    ESP_LOGI(TAG, "SPI link calibration started");
+
+    // The ID registers are in bank 0.
+    sensor_shadow_select_bank(&sensor_shadow, 0);
+    // Re-adding the device allocates, which is setup rather than the input path.
+    heap_guard_pause();
+    bool found = sensor_link_calibrate(&sensor_link_report, &sensor_bus, sensor_link_configure);
+    if (found)
+    {
+        sensor_link = sensor_link_report.link;
+    }
+    esp_err_t err = sensor_link_apply(sensor_link.clock_hz, sensor_link.input_delay_ns);
+    heap_guard_resume();
+    TELEMETRY_COUNT(link_calibrations);
+    sensor_link_report.duration_us = esp_timer_get_time() - start_us;
+
+    if (err != ESP_OK)
+    {
+        // The recovery powers the sensor up again once the datasheet setting is back.
+        sensor_link_lose(err);
+        sensor_link_report.state = SENSOR_LINK_FAILED;
+        return;
+    }
+    if (found)
+    {
+        settings_commit_link(&sensor_link);
+        ESP_LOGI(TAG, "SPI link calibrated in %lu us: %lu Hz, input delay %u ns, %lu bit errors in %lu bits, %lu picks rejected",
+                 sensor_link_report.duration_us, sensor_link.clock_hz, sensor_link.input_delay_ns,
+                 sensor_link_report.confirm_bit_errors, sensor_link_report.confirm_bits, sensor_link_report.rejected);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "SPI link calibration found no setting with %d ns margin, staying at %lu Hz", SENSOR_LINK_MARGIN_NS,
+                 sensor_link.clock_hz);
+    }
+    sensor_link_report.state = found ? SENSOR_LINK_DONE : SENSOR_LINK_FAILED;
+
+    if (!sensor_power_up(false))
+    {
+        sensor_bad_bursts = SENSOR_FAULT_BURSTS;
+    }
+}
+
+// Ask the sensor task for a link calibration, from the vendor report in the TinyUSB task.
+void sensor_link_request(void)
+{
+    sensor_link_requested = true;
+    // Brings a parked sensor task back.
+    power_activity();
+}
+
+// A calibration is waiting or running, its report is not complete.
+bool sensor_link_busy(void)
+{
+    return sensor_link_requested || sensor_link_report.state == SENSOR_LINK_RUNNING;
+}
+
+// Copy out the report of the last calibration, only while none is busy.
+void sensor_link_snapshot(sensor_link_report_t *out)
+{
+    *out = sensor_link_report;
+}
+
 // Sensor task
+// Brings the sensor up first, so the power-up delays run in parallel with USB enumeration and never hold up the buttons.
 void sensor_task(void *arg)
 {
+    sensor_task_handle = xTaskGetCurrentTaskHandle();
+    sensor_init();
+    // The SPI bus and device, the MOTION handler and the frame timer are allocated by now.
+    heap_guard_watch();
+
     while (1)
     {
+        // Park the sensor and wait while the host is suspended or the input has gone idle.
+        if (power_parked())
+        {
+            sensor_park();
+            power_wait_active();
+            sensor_resume();
+        }
+        // Recover a faulted sensor before touching it again. While it is down parking is still checked.
+        if (sensor_bad_bursts >= SENSOR_FAULT_BURSTS && !sensor_recover())
+        {
+            vTaskDelay(pdMS_TO_TICKS(SENSOR_RECOVERY_POLL_MS));
+            continue;
+        }
+        // Raw frames for the capture tool, tracking pauses until it is done.
+        if (frame_capture_active())
+        {
+            sensor_capture_frames();
+            continue;
+        }
+        // SPI link calibration for the host, tracking pauses until it is done.
+        if (sensor_link_requested)
+        {
+            sensor_acquisition_stop();
+            sensor_burst_flush();
+            sensor_calibrate_link();
+            sensor_burst_discard();
+            input_motion_ring_clear(&motion_ring);
+            sensor_acquisition_start();
+            continue;
+        }
+        TELEMETRY_COUNT(task_wakeups);
         // Time stamp to ensure we do not exceed REPORT_RATE_MS
         uint32_t start_us = esp_timer_get_time();
+        int start_core = xPortGetCoreID();
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        // Take the burst queued in the previous frame off the bus.
+        sensor_burst_collect();
+        // Pick up CPI and mode changes between bursts, while the bus is free.
+        sensor_apply_settings();
+        // Read the next motion burst from the Pixart PAW3395 sensor, it transfers while the previous one is processed.
+        sensor_burst_queue();
+        sensor_decode_motion_burst();
         // Process motion data
         process_motion_data();
-        // Lower NCS.
-        ESP_ERROR_CHECK(gpio_set_level(GPIO_NUM_27, 0));
-        // Wait for tNCS-SCLK
-        vTaskDelay(pdNS_TO_TICKS(SENSOR_NCS_SCLK_DELAY_NS));
-        // Read the motion data from the Pixart PAW3395 sensor.
-        sensor_read_motion_burst();
-        // After the burst transmission is complete, the
-        // microcontroller must raise the NCS line for at least tBEXIT to terminate burst mode. The serial port is not available for
-        // use until it is reset with NCS, even for a second burst transmission.
-        ESP_ERROR_CHECK(gpio_set_level(GPIO_NUM_27, 1));
-        // Wait until SENSOR_BURST_EXIT_DELAY_NS has elapsed
-        vTaskDelay(pdNS_TO_TICKS(SENSOR_BURST_EXIT_DELAY_NS));
-        // Time stamp to ensure we do not exceed REPORT_RATE_MS
-        // Wait until REPORT_RATE_MS has elapsed
-        uint32_t diff_us = (esp_timer_get_time() - start_us);
-        if (diff_us < REPORT_RATE_US)
-        {
-            vTaskDelay(pdUS_TO_TICKS(REPORT_RATE_US - diff_us));
-        }
+        sensor_count_frame_cycles(start_core, start_cycles);
+        // Validate the sensor outside of the burst.
+        sensor_check_health();
+        sensor_wait_frame(start_us);
     }
 }
\ No newline at end of file
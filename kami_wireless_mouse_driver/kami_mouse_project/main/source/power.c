@@ -0,0 +1,497 @@
+#include "header/power.h"
+#include "header/heap_guard.h"
+#include "header/motion_sensor.h"
+#include "header/settings.h"
+#include "header/telemetry.h"
+#include "header/transport.h"
+#include "header/ulp_scan.h"
+
+static bool power_should_suspend(void);
+static bool power_light_sleep_allowed(void);
+static void power_apply(bool full_speed, bool light_sleep, bool parked);
+static void power_arm_wake_pins(void);
+static void power_disarm_wake_pins(void);
+static void power_set_level(power_level_t level);
+static void power_enter_suspend(void);
+static void power_wake(void);
+static void power_exit_suspend(void);
+static void power_update_telemetry(uint32_t now_us);
+
+// A light sleep wake has to be over before the next radio packet is due.
+_Static_assert(POWER_LIGHT_SLEEP_WAKE_US + POWER_WAKE_DISPATCH_US < POWER_WAKE_BUDGET_US, "light sleep wake exceeds one report interval");
+
+static volatile power_state_t power_state = POWER_ACTIVE;
+// Bus state as last reported by TinyUSB.
+static volatile bool power_host_suspended = false;
+// The host allowed remote wakeup when it suspended the bus.
+static volatile bool power_remote_wakeup = false;
+// Time of the input that woke the mouse, until the first report after it reaches the host.
+static volatile bool power_resume_pending = false;
+static volatile uint32_t power_wake_us = 0;
+// Time of the input that ended a light sleep, until the first report after it.
+static volatile bool power_sleep_wake_pending = false;
+static volatile uint32_t power_sleep_wake_us = 0;
+
+// Downshift ladder, updated by the input tasks and the power task.
+static power_policy_t power_policy;
+static volatile power_level_t power_level = POWER_LEVEL_FULL;
+// Guards power_policy and the wake pins, the ISRs take it too.
+static portMUX_TYPE power_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Resources as last applied by power_apply.
+static bool power_full_speed = true;
+static bool power_light_sleep = false;
+static volatile bool power_is_parked = false;
+
+static power_wake_pin_t power_wake_pins[POWER_WAKE_PINS_MAX];
+static int power_wake_pin_count = 0;
+static bool power_wake_pins_armed = false;
+
+static EventGroupHandle_t power_events = NULL;
+static StaticEventGroup_t power_events_buffer;
+static TaskHandle_t power_task_handle = NULL;
+
+#if CONFIG_PM_ENABLE
+// Held at POWER_LEVEL_FULL, releasing it lets the CPU drop to POWER_IDLE_CPU_MHZ.
+static esp_pm_lock_handle_t power_cpu_lock = NULL;
+// Held unless the ladder reached POWER_LEVEL_SLEEP on the radio link.
+static esp_pm_lock_handle_t power_sleep_lock = NULL;
+#endif
+
+void power_init(void)
+{
+    power_events = xEventGroupCreateStatic(&power_events_buffer);
+    xEventGroupSetBits(power_events, POWER_EVENT_ACTIVE);
+    settings_t current;
+    settings_snapshot(&current);
+    power_policy_init(&power_policy, current.power_idle_ms * 1000, current.power_sleep_ms * 1000, esp_timer_get_time());
+
+#if CONFIG_PM_ENABLE
+    const esp_pm_config_t pm_config = {
+        .max_freq_mhz = POWER_ACTIVE_CPU_MHZ,
+        .min_freq_mhz = POWER_IDLE_CPU_MHZ,
+        .light_sleep_enable = true,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "power_cpu", &power_cpu_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "power_sleep", &power_sleep_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_acquire(power_cpu_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_acquire(power_sleep_lock));
+    // The armed pins wake the chip, each with the level opposite to the one it rests at.
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+#endif
+
+    ESP_LOGI(TAG, "USB power_init");
+}
+
+// Register a button or wheel pin as a light sleep wake source.
+// intr_type is the interrupt the pin normally uses, it is restored as soon as the pin wakes the chip.
+void power_add_wake_pin(gpio_num_t pin, gpio_int_type_t intr_type)
+{
+    portENTER_CRITICAL(&power_lock);
+    if (power_wake_pin_count < POWER_WAKE_PINS_MAX)
+    {
+        power_wake_pins[power_wake_pin_count].pin = pin;
+        power_wake_pins[power_wake_pin_count].intr_type = intr_type;
+        power_wake_pin_count++;
+    }
+    portEXIT_CRITICAL(&power_lock);
+}
+
+/************* Events ****************/
+
+// Called from tud_mount_cb and tud_umount_cb, light sleep is only allowed without a host.
+void power_usb_event(void)
+{
+    if (power_task_handle != NULL)
+    {
+        xTaskNotify(power_task_handle, POWER_NOTIFY_USB, eSetBits);
+    }
+}
+
+// Called from tud_suspend_cb in the TinyUSB task.
+void power_usb_suspend(bool remote_wakeup_en)
+{
+    power_remote_wakeup = remote_wakeup_en;
+    power_host_suspended = true;
+    power_usb_event();
+}
+
+// Called from tud_resume_cb in the TinyUSB task.
+void power_usb_resume(void)
+{
+    power_host_suspended = false;
+    power_usb_event();
+}
+
+// Called first thing from the button, wheel and MOTION ISRs.
+// Wakes the parked tasks and, while suspended with remote wakeup allowed, the host.
+void HOT_PATH power_wake_from_isr(void)
+{
+    if (!power_is_parked)
+    {
+        return;
+    }
+
+    BaseType_t woken = pdFALSE;
+    portENTER_CRITICAL_ISR(&power_lock);
+    // Put the edge interrupts back before the pin fires again as a level.
+    power_disarm_wake_pins();
+    portEXIT_CRITICAL_ISR(&power_lock);
+
+    if (power_state == POWER_SUSPENDED)
+    {
+        if (!power_remote_wakeup || power_resume_pending)
+        {
+            return;
+        }
+        power_wake_us = esp_timer_get_time();
+        power_resume_pending = true;
+        xTaskNotifyFromISR(power_task_handle, POWER_NOTIFY_WAKE, eSetBits, &woken);
+    }
+    else
+    {
+        if (!power_sleep_wake_pending)
+        {
+            power_sleep_wake_us = esp_timer_get_time();
+            power_sleep_wake_pending = true;
+        }
+        portENTER_CRITICAL_ISR(&power_lock);
+        power_policy_activity(&power_policy, esp_timer_get_time());
+        portEXIT_CRITICAL_ISR(&power_lock);
+        xTaskNotifyFromISR(power_task_handle, POWER_NOTIFY_ACTIVITY, eSetBits, &woken);
+    }
+    portYIELD_FROM_ISR(woken);
+}
+
+// Called by the transport for every button change and motion report.
+void HOT_PATH power_activity(void)
+{
+    portENTER_CRITICAL(&power_lock);
+    power_policy_activity(&power_policy, esp_timer_get_time());
+    portEXIT_CRITICAL(&power_lock);
+    if (power_level != POWER_LEVEL_FULL && power_task_handle != NULL)
+    {
+        xTaskNotify(power_task_handle, POWER_NOTIFY_ACTIVITY, eSetBits);
+    }
+}
+
+// Called by the transport after every poll, reports held for a transport keep the CPU at full speed.
+void power_reports_pending(bool pending)
+{
+    bool drained = false;
+    portENTER_CRITICAL(&power_lock);
+    drained = power_policy.pending && !pending;
+    power_policy_pending(&power_policy, pending, esp_timer_get_time());
+    portEXIT_CRITICAL(&power_lock);
+    // The ladder restarts from here, the power task has to pick a new deadline.
+    if (drained && power_task_handle != NULL)
+    {
+        xTaskNotify(power_task_handle, POWER_NOTIFY_ACTIVITY, eSetBits);
+    }
+}
+
+// Block the calling task while parked.
+void power_wait_active(void)
+{
+    xEventGroupWaitBits(power_events, POWER_EVENT_ACTIVE, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+// True while the input tasks should wait for a wake, either suspended or at POWER_LEVEL_SLEEP.
+bool power_parked(void)
+{
+    return power_is_parked;
+}
+
+bool power_suspended(void)
+{
+    return power_state == POWER_SUSPENDED;
+}
+
+// True while the host is asleep and expects the mouse to wake it, USB then keeps the reports instead of the radio.
+bool power_remote_wakeup_armed(void)
+{
+    return power_host_suspended && power_remote_wakeup;
+}
+
+// Called for every report a transport accepted, the first one after a wake closes the wake measurements.
+void power_report_sent(void)
+{
+    if (power_resume_pending)
+    {
+        power_resume_pending = false;
+        uint32_t resume_us = esp_timer_get_time() - power_wake_us;
+        telemetry_counters.power_resume_last_us = resume_us;
+        telemetry_counters.power_resume_max_us = max(telemetry_counters.power_resume_max_us, resume_us);
+        if (resume_us > T_WAKEUP_MS * 1000)
+        {
+            TELEMETRY_COUNT(power_resume_over_budget);
+        }
+    }
+    if (power_sleep_wake_pending)
+    {
+        power_sleep_wake_pending = false;
+        uint32_t wake_us = esp_timer_get_time() - power_sleep_wake_us;
+        telemetry_counters.power_wake_last_us = wake_us;
+        telemetry_counters.power_wake_max_us = max(telemetry_counters.power_wake_max_us, wake_us);
+        if (wake_us > POWER_WAKE_BUDGET_US)
+        {
+            TELEMETRY_COUNT(power_wake_over_budget);
+        }
+    }
+}
+
+/************* Resources ****************/
+
+// Suspend only when no transport is left: the host keeps USB to itself by allowing remote wakeup,
+// or the radio link is down as well. Otherwise a suspend looks like an unplug and the radio takes over.
+static bool power_should_suspend(void)
+{
+    return power_host_suspended && (power_remote_wakeup || !radio_link_available());
+}
+
+// USB stops without its clocks and can not wake the chip, so light sleep waits until no host has the device.
+static bool power_light_sleep_allowed(void)
+{
+    return !tud_mounted();
+}
+
+// Hold or release the CPU frequency and light sleep locks, and park or release the input tasks.
+static void power_apply(bool full_speed, bool light_sleep, bool parked)
+{
+#if CONFIG_PM_ENABLE
+    if (full_speed != power_full_speed)
+    {
+        full_speed ? esp_pm_lock_acquire(power_cpu_lock) : esp_pm_lock_release(power_cpu_lock);
+    }
+    if (light_sleep != power_light_sleep)
+    {
+        light_sleep ? esp_pm_lock_release(power_sleep_lock) : esp_pm_lock_acquire(power_sleep_lock);
+    }
+#endif
+    if (light_sleep != power_light_sleep)
+    {
+        // Without the modem held awake the radio powers up for each packet only.
+        radio_link_power_save(light_sleep);
+    }
+    power_full_speed = full_speed;
+    power_light_sleep = light_sleep;
+
+    if (parked && !power_is_parked)
+    {
+        xEventGroupClearBits(power_events, POWER_EVENT_ACTIVE);
+        power_is_parked = true;
+        if (light_sleep)
+        {
+#if ULP_SCAN
+            // The ULP watches the buttons and the wheel, the sensor MOTION pin stays a GPIO wake source.
+            ulp_scan_start();
+#endif
+            portENTER_CRITICAL(&power_lock);
+            power_arm_wake_pins();
+            portEXIT_CRITICAL(&power_lock);
+        }
+    }
+    else if (!parked && power_is_parked)
+    {
+        portENTER_CRITICAL(&power_lock);
+        power_disarm_wake_pins();
+        portEXIT_CRITICAL(&power_lock);
+#if ULP_SCAN
+        // Replays what the ULP buffered before the tasks see new edges.
+        ulp_scan_stop();
+#endif
+        power_is_parked = false;
+        xEventGroupSetBits(power_events, POWER_EVENT_ACTIVE);
+    }
+}
+
+// GPIO wake is level triggered, each pin wakes on the level opposite to the one it is at now.
+// The caller holds power_lock.
+static void power_arm_wake_pins(void)
+{
+    for (int i = 0; i < power_wake_pin_count; i++)
+    {
+        gpio_num_t pin = power_wake_pins[i].pin;
+#if ULP_SCAN
+        if (ulp_scan_owns(pin))
+        {
+            continue;
+        }
+#endif
+        gpio_wakeup_enable(pin, gpio_get_level(pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+    }
+    power_wake_pins_armed = true;
+}
+
+// The caller holds power_lock.
+static void HOT_PATH power_disarm_wake_pins(void)
+{
+    if (!power_wake_pins_armed)
+    {
+        return;
+    }
+    power_wake_pins_armed = false;
+    // Runs in the ISRs, so it uses the HAL directly, the driver calls are not safe while the flash cache is off.
+    for (int i = 0; i < power_wake_pin_count; i++)
+    {
+        gpio_ll_wakeup_disable(&GPIO, power_wake_pins[i].pin);
+        gpio_ll_set_intr_type(&GPIO, power_wake_pins[i].pin, power_wake_pins[i].intr_type);
+    }
+}
+
+/************* State ****************/
+
+static void power_set_level(power_level_t level)
+{
+    if (level != POWER_LEVEL_SLEEP)
+    {
+        // A wake that led to no report is not measured.
+        power_sleep_wake_pending = power_sleep_wake_pending && level == POWER_LEVEL_FULL;
+    }
+    power_level = level;
+    switch (level)
+    {
+    case POWER_LEVEL_FULL:
+        power_apply(true, false, false);
+        break;
+    case POWER_LEVEL_IDLE:
+        power_apply(false, false, false);
+        break;
+    default:
+        power_apply(false, power_light_sleep_allowed(), true);
+        break;
+    }
+}
+
+// Park the input tasks, sensor_task rests the sensor on its way out.
+static void power_enter_suspend(void)
+{
+    power_state = POWER_SUSPENDED;
+    power_apply(false, false, true);
+    TELEMETRY_COUNT(power_suspends);
+    ESP_LOGI(TAG, "Suspended, remote wakeup %s", power_remote_wakeup ? "on" : "off");
+}
+
+// Input while suspended, restart the tasks right away so the sensor is tracking again by the time the host resumes.
+static void power_wake(void)
+{
+    power_state = POWER_WAKING;
+    power_apply(true, false, false);
+    if (!tud_remote_wakeup())
+    {
+        ESP_LOGW(TAG, "Remote wakeup failed");
+    }
+    TELEMETRY_COUNT(power_wakeups);
+}
+
+static void power_exit_suspend(void)
+{
+    power_state = POWER_ACTIVE;
+    power_level = POWER_LEVEL_FULL;
+    power_apply(true, false, false);
+    ESP_LOGI(TAG, "Resumed");
+}
+
+// Level time already moved to the telemetry counters.
+static uint64_t power_counted_us[POWER_LEVEL_COUNT];
+
+// Time spent at each level, including the current one.
+// Only whole milliseconds not yet counted are added, so the counters restart with a telemetry reset like the others.
+static void power_update_telemetry(uint32_t now_us)
+{
+    uint32_t level_ms[POWER_LEVEL_COUNT];
+    portENTER_CRITICAL(&power_lock);
+    for (int i = 0; i < POWER_LEVEL_COUNT; i++)
+    {
+        uint64_t level_time_us = power_policy.level_time_us[i];
+        if (i == power_policy.level)
+        {
+            level_time_us += (uint32_t)(now_us - power_policy.level_since_us);
+        }
+        level_ms[i] = (level_time_us - power_counted_us[i]) / 1000;
+        power_counted_us[i] += (uint64_t)level_ms[i] * 1000;
+    }
+    portEXIT_CRITICAL(&power_lock);
+    TELEMETRY_ADD(power_time_full_ms, level_ms[POWER_LEVEL_FULL]);
+    TELEMETRY_ADD(power_time_idle_ms, level_ms[POWER_LEVEL_IDLE]);
+    TELEMETRY_ADD(power_time_sleep_ms, level_ms[POWER_LEVEL_SLEEP]);
+}
+
+// Bring the level times up to now, the power task only updates them when it wakes.
+void power_sync_telemetry(void)
+{
+    power_update_telemetry(esp_timer_get_time());
+}
+
+// Power task
+// Follows the bus state from the TinyUSB callbacks and walks the downshift ladder while no input arrives.
+void power_task(void *arg)
+{
+    power_task_handle = xTaskGetCurrentTaskHandle();
+    heap_guard_watch();
+    while (1)
+    {
+        uint32_t now_us = esp_timer_get_time();
+        TickType_t timeout = portMAX_DELAY;
+        if (power_state == POWER_WAKING)
+        {
+            timeout = pdMS_TO_TICKS(POWER_WAKE_TIMEOUT_MS);
+        }
+        else if (power_state == POWER_ACTIVE)
+        {
+            portENTER_CRITICAL(&power_lock);
+            uint32_t next_us = power_policy_next_us(&power_policy, now_us);
+            portEXIT_CRITICAL(&power_lock);
+            // Round up, waking early would only find the same level.
+            timeout = next_us == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(next_us / 1000 + 1);
+        }
+
+        uint32_t events = 0;
+        if (xTaskNotifyWait(0, UINT32_MAX, &events, timeout) != pdTRUE && power_state == POWER_WAKING &&
+            power_host_suspended)
+        {
+            // The host never answered, it is gone or ignores us. Handle it like an unplug so the radio can take over.
+            ESP_LOGW(TAG, "No resume after remote wakeup");
+            power_remote_wakeup = false;
+            power_resume_pending = false;
+            power_state = POWER_ACTIVE;
+        }
+        now_us = esp_timer_get_time();
+
+        if ((events & POWER_NOTIFY_WAKE) && power_state == POWER_SUSPENDED && power_host_suspended)
+        {
+            power_wake();
+        }
+        if (!power_host_suspended && power_state != POWER_ACTIVE)
+        {
+            power_exit_suspend();
+        }
+        else if (power_state == POWER_ACTIVE && power_should_suspend())
+        {
+            power_enter_suspend();
+        }
+
+        if (power_state == POWER_ACTIVE)
+        {
+            // USB events restart the ladder, the transport has to follow a plug or unplug.
+            settings_t current;
+            settings_snapshot(&current);
+            portENTER_CRITICAL(&power_lock);
+            if (events & POWER_NOTIFY_USB)
+            {
+                power_policy_activity(&power_policy, now_us);
+            }
+            power_policy_set_ladder(&power_policy, current.power_idle_ms * 1000, current.power_sleep_ms * 1000);
+            power_level_t level = power_policy_update(&power_policy, now_us);
+            portEXIT_CRITICAL(&power_lock);
+            if (level != power_level || (level == POWER_LEVEL_SLEEP && power_light_sleep != power_light_sleep_allowed()))
+            {
+                power_set_level(level);
+            }
+        }
+        power_update_telemetry(now_us);
+        // Availability of USB depends on the remote wakeup state.
+        transport_notify();
+    }
+}
@@ -0,0 +1,109 @@
+#include "header/power_policy.h"
+
+static void power_policy_enter(power_policy_t *policy, power_level_t level, uint32_t now_us);
+static power_level_t power_policy_target(const power_policy_t *policy, uint32_t now_us);
+
+void power_policy_init(power_policy_t *policy, uint32_t idle_us, uint32_t sleep_us, uint32_t now_us)
+{
+    power_policy_set_ladder(policy, idle_us, sleep_us);
+    policy->level = POWER_LEVEL_FULL;
+    policy->activity_us = now_us;
+    policy->pending = false;
+    policy->level_since_us = now_us;
+    for (int i = 0; i < POWER_LEVEL_COUNT; i++)
+    {
+        policy->level_time_us[i] = 0;
+    }
+    policy->downshifts = 0;
+    policy->upshifts = 0;
+}
+
+// Set the time without input before the CPU is let go and before light sleep.
+// A sleep step shorter than the idle step is raised to it.
+void power_policy_set_ladder(power_policy_t *policy, uint32_t idle_us, uint32_t sleep_us)
+{
+    policy->downshift_us[POWER_LEVEL_FULL] = 0;
+    policy->downshift_us[POWER_LEVEL_IDLE] = idle_us;
+    policy->downshift_us[POWER_LEVEL_SLEEP] = sleep_us > idle_us ? sleep_us : idle_us;
+}
+
+/************* Input ****************/
+
+// Input arrived, the next update returns to full.
+void HOT_PATH power_policy_activity(power_policy_t *policy, uint32_t now_us)
+{
+    policy->activity_us = now_us;
+}
+
+// Reports are waiting for a transport, or the last of them was taken.
+// Draining the reports counts as activity, the ladder restarts from there.
+void power_policy_pending(power_policy_t *policy, bool pending, uint32_t now_us)
+{
+    if (policy->pending && !pending)
+    {
+        policy->activity_us = now_us;
+    }
+    policy->pending = pending;
+}
+
+/************* Level ****************/
+
+static void power_policy_enter(power_policy_t *policy, power_level_t level, uint32_t now_us)
+{
+    policy->level_time_us[policy->level] += (uint32_t)(now_us - policy->level_since_us);
+    policy->level_since_us = now_us;
+    if (level > policy->level)
+    {
+        policy->downshifts++;
+    }
+    else
+    {
+        policy->upshifts++;
+    }
+    policy->level = level;
+}
+
+// The level the ladder asks for at now_us.
+static power_level_t power_policy_target(const power_policy_t *policy, uint32_t now_us)
+{
+    if (policy->pending)
+    {
+        return POWER_LEVEL_FULL;
+    }
+    uint32_t idle_us = now_us - policy->activity_us;
+    power_level_t level = POWER_LEVEL_FULL;
+    for (int i = POWER_LEVEL_FULL + 1; i < POWER_LEVEL_COUNT; i++)
+    {
+        if (idle_us >= policy->downshift_us[i])
+        {
+            level = (power_level_t)i;
+        }
+    }
+    return level;
+}
+
+// Move to the level the ladder asks for, returns the level to run at.
+power_level_t power_policy_update(power_policy_t *policy, uint32_t now_us)
+{
+    power_level_t level = power_policy_target(policy, now_us);
+    if (level != policy->level)
+    {
+        power_policy_enter(policy, level, now_us);
+    }
+    return level;
+}
+
+// Time until the next downshift, UINT32_MAX at the deepest level or while pending reports hold the level.
+// The caller updates the policy again then, and whenever power_policy_activity or power_policy_pending
+// changed something in between.
+uint32_t power_policy_next_us(const power_policy_t *policy, uint32_t now_us)
+{
+    int next = policy->level + 1;
+    if (policy->pending || next >= POWER_LEVEL_COUNT)
+    {
+        return UINT32_MAX;
+    }
+    uint32_t idle_us = now_us - policy->activity_us;
+    uint32_t due_us = policy->downshift_us[next];
+    return idle_us >= due_us ? 0 : due_us - idle_us;
+}
@@ -0,0 +1,196 @@
+#include "header/profiler.h"
+
+static void profiler_isr(void *arg);
+static uint16_t profiler_load(uint32_t busy_us, uint32_t window_us);
+static uint32_t profiler_previous_runtime(TaskHandle_t handle);
+static void profiler_sample(void);
+
+static profiler_isr_t profiler_isrs[PROFILER_ISRS_MAX];
+static int profiler_isr_registered = 0;
+
+// Time spent in the wrapped GPIO handlers since boot, per core.
+static volatile uint32_t profiler_isr_us[portNUM_PROCESSORS];
+static volatile uint32_t profiler_isr_count = 0;
+static volatile uint32_t profiler_isr_max_us = 0;
+
+// Scratch for uxTaskGetSystemState and the run time of each task at the start of the window.
+static TaskStatus_t profiler_status[PROFILER_TASKS_MAX];
+static struct
+{
+	TaskHandle_t handle;
+	uint32_t runtime;
+} profiler_previous[PROFILER_TASKS_MAX];
+static int profiler_previous_count = 0;
+static uint32_t profiler_previous_total = 0;
+static uint32_t profiler_previous_isr_us[portNUM_PROCESSORS];
+static uint32_t profiler_previous_isr_count = 0;
+
+// Last complete window, copied out by the vendor report.
+static profiler_stats_t profiler_stats;
+static portMUX_TYPE profiler_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/************* Interrupts ****************/
+
+// Time a GPIO handler. esp_timer is the clock of the FreeRTOS run time stats too,
+// a single handler often takes less than a microsecond, but the sum over a window is still right on average.
+static void HOT_PATH profiler_isr(void *arg)
+{
+    const profiler_isr_t *isr = arg;
+    uint32_t start_us = esp_timer_get_time();
+    isr->handler(isr->arg);
+    uint32_t isr_us = esp_timer_get_time() - start_us;
+
+    __atomic_fetch_add(&profiler_isr_us[xPortGetCoreID()], isr_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&profiler_isr_count, 1, __ATOMIC_RELAXED);
+    if (isr_us > profiler_isr_max_us)
+    {
+        profiler_isr_max_us = isr_us;
+    }
+}
+
+// Add a GPIO handler through the profiler, the drop-in for gpio_isr_handler_add.
+esp_err_t profiler_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void *arg)
+{
+    profiler_isr_t *isr = NULL;
+    portENTER_CRITICAL(&profiler_lock);
+    if (profiler_isr_registered < PROFILER_ISRS_MAX)
+    {
+        isr = &profiler_isrs[profiler_isr_registered++];
+        isr->pin = pin;
+        isr->handler = handler;
+        isr->arg = arg;
+    }
+    portEXIT_CRITICAL(&profiler_lock);
+
+    if (isr == NULL)
+    {
+        // Out of slots, the handler still runs but is not timed.
+        return gpio_isr_handler_add(pin, handler, arg);
+    }
+    return gpio_isr_handler_add(pin, profiler_isr, isr);
+}
+
+// Run the handler of a pin as its interrupt would, for the load generator. Call from an interrupt.
+void HOT_PATH profiler_isr_raise(gpio_num_t pin)
+{
+    for (int i = 0; i < profiler_isr_registered; i++)
+    {
+        if (profiler_isrs[i].pin == pin)
+        {
+            profiler_isr(&profiler_isrs[i]);
+            return;
+        }
+    }
+}
+
+/************* Tasks ****************/
+
+static uint16_t profiler_load(uint32_t busy_us, uint32_t window_us)
+{
+    if (window_us == 0)
+    {
+        return 0;
+    }
+    uint64_t load = (uint64_t)busy_us * PROFILER_LOAD_SCALE / window_us;
+    return load > PROFILER_LOAD_SCALE ? PROFILER_LOAD_SCALE : (uint16_t)load;
+}
+
+// Run time of a task at the start of the window, 0 for tasks created since.
+static uint32_t profiler_previous_runtime(TaskHandle_t handle)
+{
+    for (int i = 0; i < profiler_previous_count; i++)
+    {
+        if (profiler_previous[i].handle == handle)
+        {
+            return profiler_previous[i].runtime;
+        }
+    }
+    return 0;
+}
+
+// Close the window: per task loads from the run time counters, idle from the idle tasks of each core.
+static void profiler_sample(void)
+{
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    UBaseType_t count = uxTaskGetSystemState(profiler_status, PROFILER_TASKS_MAX, &total);
+    if (count == 0)
+    {
+        ESP_LOGW(TAG, "Profiler: more than %d tasks", PROFILER_TASKS_MAX);
+        return;
+    }
+
+    static profiler_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.window_us = total - profiler_previous_total;
+    for (UBaseType_t i = 0; i < count; i++)
+    {
+        const TaskStatus_t *status = &profiler_status[i];
+        profiler_task_t *task = &stats.tasks[i];
+        uint32_t busy_us = status->ulRunTimeCounter - profiler_previous_runtime(status->xHandle);
+        strncpy(task->name, status->pcTaskName, PROFILER_TASK_NAME_LENGTH - 1);
+        task->load = profiler_load(busy_us, stats.window_us);
+        // The high-water mark counts StackType_t, which is a byte on this port.
+        task->stack_free = status->usStackHighWaterMark * sizeof(StackType_t);
+        task->core = status->xCoreID < portNUM_PROCESSORS ? status->xCoreID : PROFILER_CORE_ANY;
+        task->priority = status->uxCurrentPriority;
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+        {
+            if (status->xHandle == xTaskGetIdleTaskHandleForCPU(core))
+            {
+                stats.idle_load[core] = task->load;
+            }
+        }
+    }
+    stats.task_count = count;
+
+    uint32_t isr_count = profiler_isr_count;
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        uint32_t isr_us = profiler_isr_us[core];
+        stats.isr_load[core] = profiler_load(isr_us - profiler_previous_isr_us[core], stats.window_us);
+        profiler_previous_isr_us[core] = isr_us;
+    }
+    stats.isr_count = isr_count - profiler_previous_isr_count;
+    stats.isr_max_us = profiler_isr_max_us;
+    profiler_previous_isr_count = isr_count;
+
+    for (UBaseType_t i = 0; i < count; i++)
+    {
+        profiler_previous[i].handle = profiler_status[i].xHandle;
+        profiler_previous[i].runtime = profiler_status[i].ulRunTimeCounter;
+    }
+    profiler_previous_count = count;
+    profiler_previous_total = total;
+
+    portENTER_CRITICAL(&profiler_lock);
+    profiler_stats = stats;
+    portEXIT_CRITICAL(&profiler_lock);
+}
+
+// Copy out the last complete window.
+void profiler_snapshot(profiler_stats_t *stats)
+{
+    portENTER_CRITICAL(&profiler_lock);
+    *stats = profiler_stats;
+    portEXIT_CRITICAL(&profiler_lock);
+}
+
+// Profiler task
+// Samples the FreeRTOS run time stats once per window, at the lowest priority so it never delays input.
+void profiler_task(void *arg)
+{
+    TickType_t wake = xTaskGetTickCount();
+    while (1)
+    {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(PROFILER_WINDOW_MS));
+        profiler_sample();
+        for (int i = 0; i < profiler_stats.task_count; i++)
+        {
+            const profiler_task_t *task = &profiler_stats.tasks[i];
+            if (task->stack_free < PROFILER_STACK_MARGIN)
+            {
+                ESP_LOGW(TAG, "Profiler: %s has %u bytes of stack left", task->name, task->stack_free);
+            }
+        }
+    }
+}
@@ -0,0 +1,198 @@
+#include "header/radio_link.h"
+#include "header/power.h"
+#include "header/telemetry.h"
+
+static esp_err_t radio_link_init(void);
+static void radio_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status);
+static void radio_send(void);
+
+// Packets are broadcast, the dongle filters them by link ID.
+static const uint8_t radio_broadcast_mac[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+static radio_tx_t radio_tx;
+static portMUX_TYPE radio_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool radio_ready = false;
+// Set while ESP-NOW holds a packet, new samples are packed into the next one meanwhile.
+static bool radio_in_flight = false;
+
+static TaskHandle_t radio_task_handle = NULL;
+
+// Bring up Wi-Fi in station mode on the fixed channel and register the broadcast peer.
+static esp_err_t radio_link_init(void)
+{
+    radio_tx_init(&radio_tx, RADIO_LINK_ID_DEFAULT);
+
+    // NVS is already initialized by settings_init.
+    wifi_init_config_t wifi_config = WIFI_INIT_CONFIG_DEFAULT();
+    esp_err_t ret = esp_event_loop_create_default();
+    if (ret == ESP_OK || ret == ESP_ERR_INVALID_STATE)
+    {
+        ret = esp_wifi_init(&wifi_config);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_set_storage(WIFI_STORAGE_RAM);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_set_mode(WIFI_MODE_STA);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_start();
+    }
+    if (ret == ESP_OK)
+    {
+        // Modem sleep would hold packets until the next DTIM.
+        ret = esp_wifi_set_ps(WIFI_PS_NONE);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_set_channel(RADIO_CHANNEL, WIFI_SECOND_CHAN_NONE);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_now_init();
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_wifi_config_espnow_rate(WIFI_IF_STA, RADIO_PHY_RATE);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_now_register_send_cb(radio_send_cb);
+    }
+    if (ret == ESP_OK)
+    {
+        esp_now_peer_info_t peer = {
+            .channel = RADIO_CHANNEL,
+            .ifidx = WIFI_IF_STA,
+            .encrypt = false,
+        };
+        memcpy(peer.peer_addr, radio_broadcast_mac, ESP_NOW_ETH_ALEN);
+        ret = esp_now_add_peer(&peer);
+    }
+    return ret;
+}
+
+// Called from the Wi-Fi task once a packet has left the radio.
+// Broadcasts are never acknowledged, so a success only means the packet was transmitted.
+static void radio_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+    (void)mac_addr;
+    if (status != ESP_NOW_SEND_SUCCESS)
+    {
+        TELEMETRY_COUNT(radio_send_failures);
+    }
+    radio_in_flight = false;
+    xTaskNotifyGive(radio_task_handle);
+}
+
+// Send the queued samples and button state, unless a packet is still in flight.
+static void radio_send(void)
+{
+    uint8_t packet[RADIO_PACKET_MAX];
+    size_t length = 0;
+
+    portENTER_CRITICAL(&radio_lock);
+    if (!radio_in_flight)
+    {
+        length = radio_tx_build(&radio_tx, esp_timer_get_time(), packet);
+        radio_in_flight = length != 0;
+    }
+    portEXIT_CRITICAL(&radio_lock);
+
+    if (length == 0)
+    {
+        return;
+    }
+    if (esp_now_send(radio_broadcast_mac, packet, length) == ESP_OK)
+    {
+        TELEMETRY_COUNT(radio_packets_sent);
+    }
+    else
+    {
+        TELEMETRY_COUNT(radio_send_failures);
+        radio_in_flight = false;
+    }
+}
+
+// True once Wi-Fi is up, the dongle may still be out of range since broadcasts are never acknowledged.
+bool radio_link_available(void)
+{
+    return radio_ready;
+}
+
+// Let the modem sleep between packets while the mouse light sleeps, and keep it awake again on wake.
+// Called by the power task, ignored until the link is up.
+void radio_link_power_save(bool enable)
+{
+    if (radio_ready)
+    {
+        esp_wifi_set_ps(enable ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE);
+    }
+}
+
+// Queue a report for the dongle.
+// Returns false while the link is down, the report is then dropped like an unmounted USB report.
+bool radio_link_report(uint8_t buttons, int16_t x, int16_t y, int8_t wheel, int8_t pan)
+{
+    if (!radio_ready)
+    {
+        return false;
+    }
+
+    bool button_change = false;
+    portENTER_CRITICAL(&radio_lock);
+    // A packet only carries the latest button state, a change behind one not sent yet is queued for the radio task.
+    // The input tasks never wait here and never call into ESP-NOW, which allocates its packet buffers.
+    button_change = buttons != radio_tx.buttons || radio_tx.button_queue_count != 0;
+    if (!radio_tx_queue_buttons(&radio_tx, buttons))
+    {
+        TELEMETRY_COUNT(radio_button_overflows);
+    }
+    if (x != 0 || y != 0 || wheel != 0 || pan != 0)
+    {
+        radio_sample_t sample = {
+            .timestamp_us = esp_timer_get_time(),
+            .x = x,
+            .y = y,
+            .wheel = wheel,
+            .pan = pan,
+        };
+        radio_tx_add_sample(&radio_tx, &sample);
+    }
+    portEXIT_CRITICAL(&radio_lock);
+
+    // Clicks skip the send interval.
+    if (button_change)
+    {
+        xTaskNotifyGive(radio_task_handle);
+    }
+    return true;
+}
+
+// Task that owns the ESP-NOW link.
+// It sends whenever the previous packet has left the radio, so under load each packet carries several samples.
+void radio_task(void *arg)
+{
+    radio_task_handle = xTaskGetCurrentTaskHandle();
+    // Bringing up Wi-Fi takes a while, the rest of the boot does not wait for it.
+    esp_err_t ret = radio_link_init();
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Radio link init failed: %s", esp_err_to_name(ret));
+        vTaskDelete(NULL);
+        return;
+    }
+    radio_ready = true;
+    ESP_LOGI(TAG, "USB radio_init");
+
+    while (1)
+    {
+        power_wait_active();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RADIO_SEND_INTERVAL_MS));
+        TELEMETRY_COUNT(task_wakeups);
+        radio_send();
+    }
+}
@@ -0,0 +1,320 @@
+#include "header/radio_protocol.h"
+
+static void radio_put_u16(uint8_t *out, uint16_t value);
+static void radio_put_u32(uint8_t *out, uint32_t value);
+static uint16_t radio_get_u16(const uint8_t *in);
+static uint32_t radio_get_u32(const uint8_t *in);
+static int16_t radio_add_saturated(int16_t a, int16_t b);
+static int8_t radio_add_saturated8(int8_t a, int8_t b);
+static void radio_tx_next_buttons(radio_tx_t *tx);
+
+static void radio_put_u16(uint8_t *out, uint16_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static void radio_put_u32(uint8_t *out, uint32_t value)
+{
+    radio_put_u16(out, (uint16_t)value);
+    radio_put_u16(&out[2], (uint16_t)(value >> 16));
+}
+
+static uint16_t radio_get_u16(const uint8_t *in)
+{
+    return (uint16_t)(in[0] | in[1] << 8);
+}
+
+static uint32_t radio_get_u32(const uint8_t *in)
+{
+    return radio_get_u16(in) | (uint32_t)radio_get_u16(&in[2]) << 16;
+}
+
+static int16_t radio_add_saturated(int16_t a, int16_t b)
+{
+    int32_t sum = (int32_t)a + b;
+    if (sum > INT16_MAX)
+    {
+        return INT16_MAX;
+    }
+    if (sum < INT16_MIN)
+    {
+        return INT16_MIN;
+    }
+    return (int16_t)sum;
+}
+
+// Wheel and pan steps saturate at the HID report range, a plain cast of the sum would wrap.
+static int8_t radio_add_saturated8(int8_t a, int8_t b)
+{
+    int16_t sum = (int16_t)a + b;
+    if (sum > 127)
+    {
+        return 127;
+    }
+    if (sum < -127)
+    {
+        return -127;
+    }
+    return (int8_t)sum;
+}
+
+/************* Sender ****************/
+
+void radio_tx_init(radio_tx_t *tx, uint16_t link_id)
+{
+    tx->link_id = link_id;
+    tx->sequence = 0;
+    tx->buttons = 0;
+    tx->button_sequence = 0;
+    tx->button_repeats = 0;
+    tx->keepalive_left = 0;
+    tx->button_queue_head = 0;
+    tx->button_queue_count = 0;
+    tx->button_overflows = 0;
+    tx->last_send_us = 0;
+    tx->sample_count = 0;
+    tx->merged = 0;
+}
+
+// True while a button change has not been sent yet.
+// A packet only carries the latest button state, so another change has to wait for a send,
+// otherwise a short click could be lost entirely. radio_tx_queue_buttons holds it back meanwhile.
+bool radio_tx_button_pending(const radio_tx_t *tx)
+{
+    return tx->button_repeats == RADIO_BUTTON_REPEATS;
+}
+
+// Apply a new button state, it is repeated in the next RADIO_BUTTON_REPEATS packets.
+void radio_tx_set_buttons(radio_tx_t *tx, uint8_t buttons)
+{
+    if (buttons == tx->buttons)
+    {
+        return;
+    }
+    tx->buttons = buttons;
+    tx->button_sequence++;
+    tx->button_repeats = RADIO_BUTTON_REPEATS;
+    tx->keepalive_left = RADIO_KEEPALIVE_PACKETS;
+}
+
+// Apply a new button state, or queue it behind a change that has not been sent yet.
+// Never waits, the queued states go out one per packet as radio_tx_build sends them.
+// Returns false if the queue was full, the newest state then replaces the last queued one and a click is lost.
+bool radio_tx_queue_buttons(radio_tx_t *tx, uint8_t buttons)
+{
+    if (tx->button_queue_count == 0 && !radio_tx_button_pending(tx))
+    {
+        radio_tx_set_buttons(tx, buttons);
+        return true;
+    }
+    uint8_t last = tx->buttons;
+    if (tx->button_queue_count != 0)
+    {
+        last = tx->button_queue[(tx->button_queue_head + tx->button_queue_count - 1) % RADIO_BUTTON_QUEUE];
+    }
+    if (buttons == last)
+    {
+        return true;
+    }
+    if (tx->button_queue_count == RADIO_BUTTON_QUEUE)
+    {
+        tx->button_queue[(tx->button_queue_head + RADIO_BUTTON_QUEUE - 1) % RADIO_BUTTON_QUEUE] = buttons;
+        tx->button_overflows++;
+        return false;
+    }
+    tx->button_queue[(tx->button_queue_head + tx->button_queue_count) % RADIO_BUTTON_QUEUE] = buttons;
+    tx->button_queue_count++;
+    return true;
+}
+
+// Apply the next queued button state once the current change has been sent.
+static void radio_tx_next_buttons(radio_tx_t *tx)
+{
+    if (tx->button_queue_count == 0 || radio_tx_button_pending(tx))
+    {
+        return;
+    }
+    radio_tx_set_buttons(tx, tx->button_queue[tx->button_queue_head]);
+    tx->button_queue_head = (tx->button_queue_head + 1) % RADIO_BUTTON_QUEUE;
+    tx->button_queue_count--;
+}
+
+// Queue a motion sample for the next packet.
+// Once the packet is full the two oldest samples are merged, so no motion is dropped on the sender.
+void radio_tx_add_sample(radio_tx_t *tx, const radio_sample_t *sample)
+{
+    if (tx->sample_count == RADIO_MAX_SAMPLES)
+    {
+        radio_sample_t *oldest = &tx->samples[0];
+        radio_sample_t *next = &tx->samples[1];
+        next->x = radio_add_saturated(next->x, oldest->x);
+        next->y = radio_add_saturated(next->y, oldest->y);
+        next->wheel = radio_add_saturated8(next->wheel, oldest->wheel);
+        next->pan = radio_add_saturated8(next->pan, oldest->pan);
+        // Keep the older timestamp so the reported latency stays honest.
+        next->timestamp_us = oldest->timestamp_us;
+        for (int i = 1; i < RADIO_MAX_SAMPLES; i++)
+        {
+            tx->samples[i - 1] = tx->samples[i];
+        }
+        tx->sample_count--;
+        tx->merged++;
+    }
+    tx->samples[tx->sample_count++] = *sample;
+}
+
+// True if there is motion, a button change or a keepalive to send.
+bool radio_tx_due(const radio_tx_t *tx, uint32_t now_us)
+{
+    if (tx->sample_count != 0 || tx->button_repeats != 0)
+    {
+        return true;
+    }
+    bool keepalive = tx->buttons != 0 || tx->keepalive_left != 0;
+    return keepalive && (uint32_t)(now_us - tx->last_send_us) >= RADIO_KEEPALIVE_US;
+}
+
+// Build the next packet into packet, which must hold RADIO_PACKET_MAX bytes.
+// Returns the packet length, or 0 if there is nothing to send.
+size_t radio_tx_build(radio_tx_t *tx, uint32_t now_us, uint8_t *packet)
+{
+    if (!radio_tx_due(tx, now_us))
+    {
+        return 0;
+    }
+
+    radio_put_u16(&packet[0], tx->link_id);
+    packet[2] = RADIO_PROTOCOL_VERSION;
+    radio_put_u16(&packet[3], tx->sequence++);
+    radio_put_u32(&packet[5], now_us);
+    packet[9] = tx->buttons;
+    packet[10] = tx->button_sequence;
+    packet[11] = tx->sample_count;
+
+    uint8_t *out = &packet[RADIO_HEADER_SIZE];
+    for (int i = 0; i < tx->sample_count; i++)
+    {
+        const radio_sample_t *sample = &tx->samples[i];
+        uint32_t age_us = now_us - sample->timestamp_us;
+        radio_put_u16(&out[0], age_us > UINT16_MAX ? UINT16_MAX : (uint16_t)age_us);
+        radio_put_u16(&out[2], (uint16_t)sample->x);
+        radio_put_u16(&out[4], (uint16_t)sample->y);
+        out[6] = (uint8_t)sample->wheel;
+        out[7] = (uint8_t)sample->pan;
+        out += RADIO_SAMPLE_SIZE;
+    }
+
+    size_t length = RADIO_HEADER_SIZE + tx->sample_count * RADIO_SAMPLE_SIZE;
+    tx->sample_count = 0;
+    if (tx->button_repeats != 0)
+    {
+        tx->button_repeats--;
+    }
+    else if (tx->buttons == 0 && tx->keepalive_left != 0)
+    {
+        tx->keepalive_left--;
+    }
+    tx->last_send_us = now_us;
+    radio_tx_next_buttons(tx);
+    return length;
+}
+
+/************* Receiver ****************/
+
+void radio_rx_init(radio_rx_t *rx, uint16_t link_id)
+{
+    rx->link_id = link_id;
+    rx->synced = false;
+    rx->sequence = 0;
+    rx->buttons = 0;
+    rx->button_sequence = 0;
+    rx->received = 0;
+    rx->lost = 0;
+    rx->rejected = 0;
+    rx->resyncs = 0;
+    rx->timeouts = 0;
+}
+
+// Decode a packet into reports, reports must hold RADIO_MAX_SAMPLES entries.
+// Returns the number of reports to emit: one per sample, or a single button report if only the buttons changed.
+// Duplicated, reordered and foreign packets return 0.
+int radio_rx_packet(radio_rx_t *rx, const uint8_t *packet, size_t length, radio_report_t *reports)
+{
+    if (length < RADIO_HEADER_SIZE || radio_get_u16(&packet[0]) != rx->link_id || packet[2] != RADIO_PROTOCOL_VERSION)
+    {
+        rx->rejected++;
+        return 0;
+    }
+    uint8_t sample_count = packet[11];
+    if (sample_count > RADIO_MAX_SAMPLES || length != (size_t)(RADIO_HEADER_SIZE + sample_count * RADIO_SAMPLE_SIZE))
+    {
+        rx->rejected++;
+        return 0;
+    }
+
+    uint16_t sequence = radio_get_u16(&packet[3]);
+    if (rx->synced)
+    {
+        int16_t gap = (int16_t)(sequence - rx->sequence);
+        if (gap <= 0 && gap > -RADIO_REORDER_WINDOW)
+        {
+            rx->rejected++;
+            return 0;
+        }
+        if (gap > 0)
+        {
+            rx->lost += gap - 1;
+        }
+        else
+        {
+            rx->resyncs++;
+        }
+    }
+    rx->synced = true;
+    rx->sequence = sequence;
+    rx->received++;
+
+    // The button state is absolute, so any packet that gets through corrects earlier losses.
+    uint8_t buttons = packet[9];
+    bool buttons_changed = packet[10] != rx->button_sequence || buttons != rx->buttons;
+    rx->buttons = buttons;
+    rx->button_sequence = packet[10];
+
+    uint32_t timestamp_us = radio_get_u32(&packet[5]);
+    const uint8_t *in = &packet[RADIO_HEADER_SIZE];
+    for (int i = 0; i < sample_count; i++)
+    {
+        radio_report_t *report = &reports[i];
+        report->buttons = buttons;
+        report->sample.timestamp_us = timestamp_us - radio_get_u16(&in[0]);
+        report->sample.x = (int16_t)radio_get_u16(&in[2]);
+        report->sample.y = (int16_t)radio_get_u16(&in[4]);
+        report->sample.wheel = (int8_t)in[6];
+        report->sample.pan = (int8_t)in[7];
+        in += RADIO_SAMPLE_SIZE;
+    }
+    if (sample_count == 0 && buttons_changed)
+    {
+        reports[0].buttons = buttons;
+        reports[0].sample.timestamp_us = timestamp_us;
+        reports[0].sample.x = 0;
+        reports[0].sample.y = 0;
+        reports[0].sample.wheel = 0;
+        reports[0].sample.pan = 0;
+        return 1;
+    }
+    return sample_count;
+}
+
+// Drop the link after RADIO_RX_TIMEOUT_US without a valid packet, the sender is gone or out of range.
+// The buttons are released and the next packet resyncs. Returns true if buttons were held,
+// the caller then sends the host a report with all of them released.
+bool radio_rx_timeout(radio_rx_t *rx)
+{
+    bool held = rx->buttons != 0;
+    rx->synced = false;
+    rx->buttons = 0;
+    rx->timeouts++;
+    return held;
+}
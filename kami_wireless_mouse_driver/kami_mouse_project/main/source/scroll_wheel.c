@@ -1,9 +1,18 @@
 #include "header/scroll_wheel.h"
+#include "header/heap_guard.h"
+#include "header/input_pipeline.h"
+#include "header/load_gen.h"
+#include "header/power.h"
+#include "header/settings.h"
+#include "header/telemetry.h"
+#include "header/trace.h"
+#include "header/transport.h"
 
 static void swheel_a_isr(void *arg);
 static void swheel_b_isr(void *arg);
+static void swheel_edge(bool a_pin, int level);
 static void swheel_task_report(void);
-static void swheel_speed_adjust(bool swheel_event);
+static void swheel_speed_adjust(bool swheel_event, const settings_t *current);
 
 /************* IO Configs ****************/
 
@@ -40,110 +49,107 @@ static swheel_active_t swheel_b_state = SWHEEL_B_LOW;
 static scroll_wheel_dir_t swheel_dir = SCROLL_WHEEL_NONE;
 
 static bool swheel_event = false;
+// Time of the last edge, for the wheel latency histogram.
+static uint32_t swheel_event_us = 0;
+
+// The ISRs and the ULP handback may run on different cores.
+static portMUX_TYPE swheel_lock = portMUX_INITIALIZER_UNLOCKED;
 
 // The rotary encoder is debounced in hardware, so no software debouncing is needed.
-static void swheel_a_isr(void *arg)
+static void HOT_PATH swheel_a_isr(void *arg)
 {
-    swheel_a_state = gpio_get_level(GPIO_NUM_11);
-    // Direction is determined by the active level of the other pin.
-    if (swheel_a_state == SWHEEL_A_HIGH)
-    {
-        if (swheel_b_state == SWHEEL_B_HIGH)
-        {
-            // A Low to High transition when B is High is a scroll wheel up event.
-            swheel_dir = SCROLL_WHEEL_UP;
-        }
-        else
-        {
-            // A Low to High transition when B is Low is a scroll wheel down event.
-            swheel_dir = SCROLL_WHEEL_DOWN;
-        }
-    }
-    else
+    // First, so a pin armed for light sleep is back on its edge interrupt before it can fire again.
+    power_wake_from_isr();
+    swheel_edge(true, INPUT_PIN_LEVEL(GPIO_NUM_11));
+}
+
+static void HOT_PATH swheel_b_isr(void *arg)
+{
+    power_wake_from_isr();
+    swheel_edge(false, INPUT_PIN_LEVEL(GPIO_NUM_12));
+}
+
+// Step on an edge of either phase.
+static void HOT_PATH swheel_edge(bool a_pin, int level)
+{
+    portENTER_CRITICAL_ISR(&swheel_lock);
+    swheel_active_t *state = a_pin ? &swheel_a_state : &swheel_b_state;
+    swheel_active_t next = a_pin ? (level ? SWHEEL_A_HIGH : SWHEEL_A_LOW) : (level ? SWHEEL_B_HIGH : SWHEEL_B_LOW);
+    // The pin is where it was, the ULP handback already stepped for this edge.
+    if (next == *state)
     {
-        if (swheel_b_state == SWHEEL_B_HIGH)
-        {
-            // A High to Low transition when B is High is a scroll wheel down event.
-            swheel_dir = SCROLL_WHEEL_DOWN;
-        }
-        else
-        {
-            // A High to Low transition when B is Low is a scroll wheel up event.
-            swheel_dir = SCROLL_WHEEL_UP;
-        }
+        portEXIT_CRITICAL_ISR(&swheel_lock);
+        return;
     }
+    *state = next;
+    bool a_high = swheel_a_state == SWHEEL_A_HIGH;
+    bool b_high = swheel_b_state == SWHEEL_B_HIGH;
+    // Direction is determined by the active level of the other pin.
+    swheel_dir = (input_quadrature_step(a_pin, a_high, b_high) == QUADRATURE_STEP_UP) ? SCROLL_WHEEL_UP : SCROLL_WHEEL_DOWN;
+    swheel_event_us = esp_timer_get_time();
     swheel_event = true;
+    portEXIT_CRITICAL_ISR(&swheel_lock);
+    trace_record_gpio(a_pin ? GPIO_NUM_11 : GPIO_NUM_12, a_pin ? (a_high | b_high << 1) : (b_high | a_high << 1));
 }
 
-static void swheel_b_isr(void *arg)
+// Report wheel steps the ULP saw while the main CPU slept, with the phase levels after them.
+// Reported right away at the slowest speed, the acceleration starts again with the next edge.
+void swheel_replay(int steps, int a_level, int b_level, uint32_t event_us)
 {
-    swheel_b_state = gpio_get_level(GPIO_NUM_12);
-    // Direction is determined by the active level of the other pin.
-    if (swheel_b_state == SWHEEL_B_HIGH)
+    swheel_active_t a_state = a_level ? SWHEEL_A_HIGH : SWHEEL_A_LOW;
+    swheel_active_t b_state = b_level ? SWHEEL_B_HIGH : SWHEEL_B_LOW;
+    portENTER_CRITICAL(&swheel_lock);
+    // The ISR got there first.
+    bool seen = a_state == swheel_a_state && b_state == swheel_b_state;
+    swheel_a_state = a_state;
+    swheel_b_state = b_state;
+    portEXIT_CRITICAL(&swheel_lock);
+    if (seen || steps == 0)
     {
-        if (swheel_a_state == SWHEEL_A_HIGH)
-        {
-            // B Low to High transition when A is High is a scroll wheel down event.
-            swheel_dir = SCROLL_WHEEL_DOWN;
-        }
-        else
-        {
-            // B Low to High transition when A is Low is a scroll wheel up event.
-            swheel_dir = SCROLL_WHEEL_UP;
-        }
+        return;
     }
-    else
-    {
-        if (swheel_a_state == SWHEEL_A_HIGH)
-        {
-            // B High to Low transition when A is High is a scroll wheel up event.
-            swheel_dir = SCROLL_WHEEL_UP;
-        }
-        else
-        {
-            // B High to Low transition when A is Low is a scroll wheel down event.
-            swheel_dir = SCROLL_WHEEL_DOWN;
-        }
-    }
-    swheel_event = true;
+    HOT_PATH_LOGI(TAG, "SWHEEL: %d", steps);
+    settings_t current;
+    settings_snapshot(&current);
+    transport_report_motion(0, 0, steps * current.scroll_speed_min, 0);
+    TELEMETRY_COUNT(wheel_events);
+    telemetry_record_latency(TELEMETRY_LATENCY_WHEEL, esp_timer_get_time() - event_us);
 }
 
 static int scroll_wheel_speed = SCROLL_WHEEL_SPEED_MIN;
 static int scroll_stopped_cnt = 0;
 
-static bool scroll_wheel_speed_adjustable = false;
-
 // Report the scroll wheel state.
 static void swheel_task_report(void)
 {
     // Send a mouse report to the host when the scroll wheel is scrolled.
     if (swheel_dir == SCROLL_WHEEL_UP)
     {
-        ESP_LOGI(TAG, "SWHEEL: UP");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x00, 0, 0, scroll_wheel_speed, 0);
+        HOT_PATH_LOGI(TAG, "SWHEEL: UP");
+        transport_report_motion(0, 0, scroll_wheel_speed, 0);
     }
     else if (swheel_dir == SCROLL_WHEEL_DOWN)
     {
-        ESP_LOGI(TAG, "SWHEEL: DOWN");
-        tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, 0x00, 0, 0, -scroll_wheel_speed, 0);
+        HOT_PATH_LOGI(TAG, "SWHEEL: DOWN");
+        transport_report_motion(0, 0, -scroll_wheel_speed, 0);
     }
 }
 
 // Function to adjust the scroll wheel speed.
-static void swheel_speed_adjust(bool swheel_event)
+static void swheel_speed_adjust(bool swheel_event, const settings_t *current)
 {
     if (swheel_event)
     {
         scroll_stopped_cnt = 0;
-        if (scroll_wheel_speed < SCROLL_WHEEL_SPEED_MAX)
+        if (scroll_wheel_speed < current->scroll_speed_max)
         {
             // If there is a scroll wheel event, then increase the scroll wheel speed.
             scroll_wheel_speed++;
         }
     }
-    else if (scroll_wheel_speed > SCROLL_WHEEL_SPEED_MIN)
+    else if (scroll_wheel_speed > current->scroll_speed_min)
     {
-        if (scroll_stopped_cnt > SCROLL_WHEEL_PAUSE_MS)
+        if (scroll_stopped_cnt > current->scroll_pause_ms)
         {
             // If there is no scroll wheel event, then decrease the scroll wheel speed.
             scroll_wheel_speed--;
@@ -159,23 +165,37 @@ static void swheel_speed_adjust(bool swheel_event)
 // Tasks for the scroll wheel.
 void swheel_task(void *arg)
 {
-    gpio_install_isr_service(0);
-    gpio_isr_handler_add(GPIO_NUM_11, swheel_a_isr, NULL);
-    gpio_isr_handler_add(GPIO_NUM_12, swheel_b_isr, NULL);
+    gpio_install_isr_service(HOT_PATH_ISR_FLAGS);
+    profiler_isr_handler_add(GPIO_NUM_11, swheel_a_isr, NULL);
+    profiler_isr_handler_add(GPIO_NUM_12, swheel_b_isr, NULL);
+    power_add_wake_pin(GPIO_NUM_11, GPIO_INTR_ANYEDGE);
+    power_add_wake_pin(GPIO_NUM_12, GPIO_INTR_ANYEDGE);
     // Initialize the scroll wheel state.
-    swheel_a_state = gpio_get_level(GPIO_NUM_11);
-    swheel_b_state = gpio_get_level(GPIO_NUM_12);
+    swheel_a_state = INPUT_PIN_LEVEL(GPIO_NUM_11) ? SWHEEL_A_HIGH : SWHEEL_A_LOW;
+    swheel_b_state = INPUT_PIN_LEVEL(GPIO_NUM_12) ? SWHEEL_B_HIGH : SWHEEL_B_LOW;
+    heap_guard_watch();
 
     while (1)
     {
-        if (scroll_wheel_speed_adjustable)
+        // Parked while the host is suspended, a wheel step still wakes it through the ISR.
+        power_wait_active();
+        TELEMETRY_COUNT(task_wakeups);
+        settings_t current;
+        settings_snapshot(&current);
+        if (current.scroll_accel)
+        {
+            swheel_speed_adjust(swheel_event, &current);
+        }
+        else
         {
-            swheel_speed_adjust(swheel_event);
+            scroll_wheel_speed = current.scroll_speed_min;
         }
         if (swheel_event)
         {
             swheel_event = false;
             swheel_task_report();
+            TELEMETRY_COUNT(wheel_events);
+            telemetry_record_latency(TELEMETRY_LATENCY_WHEEL, esp_timer_get_time() - swheel_event_us);
         }
         vTaskDelay(pdMS_TO_TICKS(1));
     }
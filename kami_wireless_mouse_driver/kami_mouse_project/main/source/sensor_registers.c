@@ -0,0 +1,693 @@
+#include "header/sensor_registers.h"
+
+static bool sensor_shadow_is_known(const sensor_shadow_t *shadow, uint8_t bank, uint8_t address);
+static void sensor_shadow_store(sensor_shadow_t *shadow, uint8_t bank, uint8_t address, uint8_t value);
+static void sensor_shadow_forget(sensor_shadow_t *shadow, uint8_t bank, uint8_t address);
+static uint8_t sensor_register_mask(uint8_t bank, uint8_t address);
+static bool sensor_register_is_volatile(uint8_t bank, uint8_t address);
+static uint8_t sensor_rest_register(uint32_t value, uint32_t unit);
+static int sensor_link_clock_index(uint32_t clock_hz);
+static bool sensor_link_pick_cell(const sensor_link_report_t *report, int *clock, int *delay);
+
+/************* Programming Sequences ****************/
+
+// Define the configuration for the Pixart PAW3395 sensor.
+/*
+6.2 Power-Up Initialization Register Setting
+*/
+static const uint8_t sensor_prog_seq_first[][2] = {
+	{0x7F, 0x07}, // 0x7F with value 0x07
+	{0x40, 0x41}, // 0x40 with value 0x41
+	{0x7F, 0x00}, // 0x7F with value 0x00
+	{0x40, 0x80}, // 0x40 with value 0x80
+	{0x7F, 0x0E}, // 0x7F with value 0x0E
+	{0x55, 0x0D}, // 0x55 with value 0x0D
+	{0x56, 0x1B}, // 0x56 with value 0x1B
+	{0x57, 0xE8}, // 0x57 with value 0xE8
+	{0x58, 0xD5}, // 0x58 with value 0xD5
+	{0x7F, 0x14}, // 0x7F with value 0x14
+	{0x42, 0xBC}, // 0x42 with value 0xBC
+	{0x43, 0x74}, // 0x43 with value 0x74
+	{0x4B, 0x20}, // 0x4B with value 0x20
+	{0x4D, 0x00}, // 0x4D with value 0x00
+	{0x53, 0x0E}, // 0x53 with value 0x0E
+	{0x7F, 0x05}, // 0x7F with value 0x05
+	{0x44, 0x04}, // 0x44 with value 0x04
+	{0x4D, 0x06}, // 0x4D with value 0x06
+	{0x51, 0x40}, // 0x51 with value 0x40
+	{0x53, 0x40}, // 0x53 with value 0x40
+	{0x55, 0xCA}, // 0x55 with value 0xCA
+	{0x5A, 0xE8}, // 0x5A with value 0xE8
+	{0x5B, 0xEA}, // 0x5B with value 0xEA
+	{0x61, 0x31}, // 0x61 with value 0x31
+	{0x62, 0x64}, // 0x62 with value 0x64
+	{0x6D, 0xB8}, // 0x6D with value 0xB8
+	{0x6E, 0x0F}, // 0x6E with value 0x0F
+	{0x70, 0x02}, // 0x70 with value 0x02
+	{0x4A, 0x2A}, // 0x4A with value 0x2A
+	{0x60, 0x26}, // 0x60 with value 0x26
+	{0x7F, 0x06}, // 0x7F with value 0x06
+	{0x6D, 0x70}, // 0x6D with value 0x70
+	{0x6E, 0x60}, // 0x6E with value 0x60
+	{0x6F, 0x04}, // 0x6F with value 0x04
+	{0x53, 0x02}, // 0x53 with value 0x02
+	{0x55, 0x11}, // 0x55 with value 0x11
+	{0x7A, 0x01}, // 0x7A with value 0x01
+	{0x7D, 0x51}, // 0x7D with value 0x51
+	{0x7F, 0x07}, // 0x7F with value 0x07
+	{0x41, 0x10}, // 0x41 with value 0x10
+	{0x42, 0x32}, // 0x42 with value 0x32
+	{0x43, 0x00}, // 0x43 with value 0x00
+	{0x7F, 0x08}, // 0x7F with value 0x08
+	{0x71, 0x4F}, // 0x71 with value 0x4F
+	{0x7F, 0x09}, // 0x7F with value 0x09
+	{0x62, 0x1F}, // 0x62 with value 0x1F
+	{0x63, 0x1F}, // 0x63 with value 0x1F
+	{0x65, 0x03}, // 0x65 with value 0x03
+	{0x66, 0x03}, // 0x66 with value 0x03
+	{0x67, 0x1F}, // 0x67 with value 0x1F
+	{0x68, 0x1F}, // 0x68 with value 0x1F
+	{0x69, 0x03}, // 0x69 with value 0x03
+	{0x6A, 0x03}, // 0x6A with value 0x03
+	{0x6C, 0x1F}, // 0x6C with value 0x1F
+	{0x6D, 0x1F}, // 0x6D with value 0x1F
+	{0x51, 0x04}, // 0x51 with value 0x04
+	{0x53, 0x20}, // 0x53 with value 0x20
+	{0x54, 0x20}, // 0x54 with value 0x20
+	{0x71, 0x0C}, // 0x71 with value 0x0C
+	{0x72, 0x07}, // 0x72 with value 0x07
+	{0x73, 0x07}, // 0x73 with value 0x07
+	{0x7F, 0x0A}, // 0x7F with value 0x0A
+	{0x4A, 0x14}, // 0x4A with value 0x14
+	{0x4C, 0x14}, // 0x4C with value 0x14
+	{0x55, 0x19}, // 0x55 with value 0x19
+	{0x7F, 0x14}, // 0x7F with value 0x14
+	{0x4B, 0x30}, // 0x4B with value 0x30
+	{0x4C, 0x03}, // 0x4C with value 0x03
+	{0x61, 0x0B}, // 0x61 with value 0x0B
+	{0x62, 0x0A}, // 0x62 with value 0x0A
+	{0x63, 0x02}, // 0x63 with value 0x02
+	{0x7F, 0x15}, // 0x7F with value 0x15
+	{0x4C, 0x02}, // 0x4C with value 0x02
+	{0x56, 0x02}, // 0x56 with value 0x02
+	{0x41, 0x91}, // 0x41 with value 0x91
+	{0x4D, 0x0A}, // 0x4D with value 0x0A
+	{0x7F, 0x0C}, // 0x7F with value 0x0C
+	{0x4A, 0x10}, // 0x4A with value 0x10
+	{0x4B, 0x0C}, // 0x4B with value 0x0C
+	{0x4C, 0x40}, // 0x4C with value 0x40
+	{0x41, 0x25}, // 0x41 with value 0x25
+	{0x55, 0x18}, // 0x55 with value 0x18
+	{0x56, 0x14}, // 0x56 with value 0x14
+	{0x49, 0x0A}, // 0x49 with value 0x0A
+	{0x42, 0x00}, // 0x42 with value 0x00
+	{0x43, 0x2D}, // 0x43 with value 0x2D
+	{0x44, 0x0C}, // 0x44 with value 0x0C
+	{0x54, 0x1A}, // 0x54 with value 0x1A
+	{0x5A, 0x0D}, // 0x5A with value 0x0D
+	{0x5F, 0x1E}, // 0x5F with value 0x1E
+	{0x5B, 0x05}, // 0x5B with value 0x05
+	{0x5E, 0x0F}, // 0x5E with value 0x0F
+	{0x7F, 0x0D}, // 0x7F with value 0x0D
+	{0x48, 0xDD}, // 0x48 with value 0xDD
+	{0x4F, 0x03}, // 0x4F with value 0x03
+	{0x52, 0x49}, // 0x52 with value 0x49
+	{0x51, 0x00}, // 0x51 with value 0x00
+	{0x54, 0x5B}, // 0x54 with value 0x5B
+	{0x53, 0x00}, // 0x53 with value 0x00
+	{0x56, 0x64}, // 0x56 with value 0x64
+	{0x55, 0x00}, // 0x55 with value 0x00
+	{0x58, 0xA5}, // 0x58 with value 0xA5
+	{0x57, 0x02}, // 0x57 with value 0x02
+	{0x5A, 0x29}, // 0x5A with value 0x29
+	{0x5B, 0x47}, // 0x5B with value 0x47
+	{0x5C, 0x81}, // 0x5C with value 0x81
+	{0x5D, 0x40}, // 0x5D with value 0x40
+	{0x71, 0xDC}, // 0x71 with value 0xDC
+	{0x70, 0x07}, // 0x70 with value 0x07
+	{0x73, 0x00}, // 0x73 with value 0x00
+	{0x72, 0x08}, // 0x72 with value 0x08
+	{0x75, 0xDC}, // 0x75 with value 0xDC
+	{0x74, 0x07}, // 0x74 with value 0x07
+	{0x77, 0x00}, // 0x77 with value 0x00
+	{0x76, 0x08}, // 0x76 with value 0x08
+	{0x7F, 0x10}, // 0x7F with value 0x10
+	{0x4C, 0xD0}, // 0x4C with value 0xD0
+	{0x7F, 0x00}, // 0x7F with value 0x00
+	{0x4F, 0x63}, // 0x4F with value 0x63
+	{0x4E, 0x00}, // 0x4E with value 0x00
+	{0x52, 0x63}, // 0x52 with value 0x63
+	{0x51, 0x00}, // 0x51 with value 0x00
+	{0x54, 0x54}, // 0x54 with value 0x54
+	{0x5A, 0x10}, // 0x5A with value 0x10
+	{0x77, 0x4F}, // 0x77 with value 0x4F
+	{0x47, 0x01}, // 0x47 with value 0x01
+	{0x5B, 0x40}, // 0x5B with value 0x40
+	{0x64, 0x60}, // 0x64 with value 0x60
+	{0x65, 0x06}, // 0x65 with value 0x06
+	{0x66, 0x13}, // 0x66 with value 0x13
+	{0x67, 0x0F}, // 0x67 with value 0x0F
+	{0x78, 0x01}, // 0x78 with value 0x01
+	{0x79, 0x9C}, // 0x79 with value 0x9C
+	{0x40, 0x00}, // 0x40 with value 0x00
+	{0x55, 0x02}, // 0x55 with value 0x02
+	{0x23, 0x70}, // 0x23 with value 0x70
+	{0x22, 0x01}, // 0x22 with value 0x01
+};
+
+static const uint8_t sensor_prog_seq_0x6C_fail[][2] = {
+	{0x7F, 0x14}, // 0x7F with value 0x14
+	{0x6C, 0x00}, // 0x6C with value 0x00
+	{0x7F, 0x00}, // 0x7F with value 0x00
+};
+
+static const uint8_t sensor_prog_seq_second[][2] = {
+	{0x22, 0x00}, // 0x22 with value 0x00
+	{0x55, 0x00}, // 0x55 with value 0x00
+	{0x7F, 0x07}, // 0x7F with value 0x07
+	{0x40, 0x40}, // 0x40 with value 0x40
+	{0x7F, 0x00}, // 0x7F with value 0x00
+};
+
+/*
+Note:
+Special precaution needs to be taken for register 0x40 to avoid overwrite other bits in the register. When writing
+the bit[1:0] to configure to different modes, one need to read and store its current value first, then apply bit
+masking and write back the new value into the register.
+The mode sequences are written with SENSOR_WRITE_CHANGED, which applies SENSOR_PERFORMANCE_MODE_MASK to bank 0
+register 0x40 against the shadowed value, so only the mode bits of the last entry are used.
+*/
+
+/*
+High Performance Mode (Default)
+*/
+static const uint8_t sensor_prog_seq_hpm[][2] = {
+	{0x7F, 0x05}, // 0x7F with value 0x05
+	{0x51, 0x40}, // 0x51 with value 0x40
+	{0x53, 0x40}, // 0x53 with value 0x40
+	{0x61, 0x31}, // 0x61 with value 0x31
+	{0x6E, 0x0F}, // 0x6E with value 0x0F
+	{0x7F, 0x07}, // 0x7F with value 0x07
+	{0x42, 0x32}, // 0x42 with value 0x32
+	{0x43, 0x00}, // 0x43 with value 0x00
+	{0x7F, 0x0D}, // 0x7F with value 0x0D
+	{0x51, 0x00}, // 0x51 with value 0x00
+	{0x52, 0x49}, // 0x52 with value 0x49
+	{0x53, 0x00}, // 0x53 with value 0x00
+	{0x54, 0x5B}, // 0x54 with value 0x5B
+	{0x55, 0x00}, // 0x55 with value 0x00
+	{0x56, 0x64}, // 0x56 with value 0x64
+	{0x57, 0x02}, // 0x57 with value 0x02
+	{0x58, 0xA5}, // 0x58 with value 0xA5
+	{0x7F, 0x00}, // 0x7F with value 0x00
+	{0x54, 0x54}, // 0x54 with value 0x54
+	{0x78, 0x01}, // 0x78 with value 0x01
+	{0x79, 0x9C}, // 0x79 with value 0x9C
+	{0x40, 0x00}, // 0x40 bits [1:0] with value 0x00
+};
+
+/*
+Low Power Mode
+*/
+static const uint8_t sensor_prog_seq_lpm[][2] = {
+	{0x7F, 0x05}, // 0x7F with value 0x05
+	{0x51, 0x40}, // 0x51 with value 0x40
+	{0x53, 0x40}, // 0x53 with value 0x40
+	{0x61, 0x3B}, // 0x61 with value 0x3B
+	{0x6E, 0x1F}, // 0x6E with value 0x1F
+	{0x7F, 0x07}, // 0x7F with value 0x07
+	{0x42, 0x32}, // 0x42 with value 0x32
+	{0x43, 0x00}, // 0x43 with value 0x00
+	{0x7F, 0x0D}, // 0x7F with value 0x0D
+	{0x51, 0x00}, // 0x51 with value 0x00
+	{0x52, 0x49}, // 0x52 with value 0x49
+	{0x53, 0x00}, // 0x53 with value 0x00
+	{0x54, 0x5B}, // 0x54 with value 0x5B
+	{0x55, 0x00}, // 0x55 with value 0x00
+	{0x56, 0x64}, // 0x56 with value 0x64
+	{0x57, 0x02}, // 0x57 with value 0x02
+	{0x58, 0xA5}, // 0x58 with value 0xA5
+	{0x7F, 0x00}, // 0x7F with value 0x00
+	{0x54, 0x54}, // 0x54 with value 0x54
+	{0x78, 0x01}, // 0x78 with value 0x01
+	{0x79, 0x9C}, // 0x79 with value 0x9C
+	{0x40, 0x01}, // 0x40 bits [1:0] with value 0x01
+};
+
+/*
+Office Mode
+*/
+static const uint8_t sensor_prog_seq_wrk[][2] = {
+	{0x7F, 0x05}, // 0x7F with value 0x05
+	{0x51, 0x28}, // 0x51 with value 0x28
+	{0x53, 0x30}, // 0x53 with value 0x30
+	{0x61, 0x3B}, // 0x61 with value 0x3B
+	{0x6E, 0x1F}, // 0x6E with value 0x1F
+	{0x7F, 0x07}, // 0x7F with value 0x07
+	{0x42, 0x32}, // 0x42 with value 0x32
+	{0x43, 0x00}, // 0x43 with value 0x00
+	{0x7F, 0x0D}, // 0x7F with value 0x0D
+	{0x51, 0x00}, // 0x51 with value 0x00
+	{0x52, 0x49}, // 0x52 with value 0x49
+	{0x53, 0x00}, // 0x53 with value 0x00
+	{0x54, 0x5B}, // 0x54 with value 0x5B
+	{0x55, 0x00}, // 0x55 with value 0x00
+	{0x56, 0x64}, // 0x56 with value 0x64
+	{0x57, 0x02}, // 0x57 with value 0x02
+	{0x58, 0xA5}, // 0x58 with value 0xA5
+	{0x7F, 0x00}, // 0x7F with value 0x00
+	{0x54, 0x52}, // 0x54 with value 0x52
+	{0x78, 0x0A}, // 0x78 with value 0x0A
+	{0x79, 0x0F}, // 0x79 with value 0x0F
+	{0x40, 0x02}, // 0x40 bits [1:0] with value 0x02
+};
+
+/*
+Corded Gaming Mode
+*/
+static const uint8_t sensor_prog_seq_crd[][2] = {
+	{0x7F, 0x05}, // 0x7F with value 0x05
+	{0x51, 0x40}, // 0x51 with value 0x40
+	{0x53, 0x40}, // 0x53 with value 0x40
+	{0x61, 0x31}, // 0x61 with value 0x31
+	{0x6E, 0x0F}, // 0x6E with value 0x0F
+	{0x7F, 0x07}, // 0x7F with value 0x07
+	{0x42, 0x2F}, // 0x42 with value 0x2F
+	{0x43, 0x00}, // 0x43 with value 0x00
+	{0x7F, 0x0D}, // 0x7F with value 0x0D
+	{0x51, 0x12}, // 0x51 with value 0x12
+	{0x52, 0xDB}, // 0x52 with value 0xDB
+	{0x53, 0x12}, // 0x53 with value 0x12
+	{0x54, 0xDC}, // 0x54 with value 0xDC
+	{0x55, 0x12}, // 0x55 with value 0x12
+	{0x56, 0xEA}, // 0x56 with value 0xEA
+	{0x57, 0x15}, // 0x57 with value 0x15
+	{0x58, 0x2D}, // 0x58 with value 0x2D
+	{0x7F, 0x00}, // 0x7F with value 0x00
+	{0x54, 0x55}, // 0x54 with value 0x55
+	{0x40, 0x03}, // 0x40 bits [1:0] with value 0x03
+};
+
+
+#define SENSOR_SEQUENCE(table) {table, sizeof(table) / sizeof(table[0])}
+
+const sensor_sequence_t sensor_sequence_first = SENSOR_SEQUENCE(sensor_prog_seq_first);
+const sensor_sequence_t sensor_sequence_0x6C_fail = SENSOR_SEQUENCE(sensor_prog_seq_0x6C_fail);
+const sensor_sequence_t sensor_sequence_second = SENSOR_SEQUENCE(sensor_prog_seq_second);
+const sensor_sequence_t sensor_sequence_modes[4] = {
+    SENSOR_SEQUENCE(sensor_prog_seq_hpm),
+    SENSOR_SEQUENCE(sensor_prog_seq_lpm),
+    SENSOR_SEQUENCE(sensor_prog_seq_wrk),
+    SENSOR_SEQUENCE(sensor_prog_seq_crd),
+};
+
+/************* Register Types ****************/
+
+// Bits of a register the typed writes may change, the rest is read-modify-written.
+static uint8_t sensor_register_mask(uint8_t bank, uint8_t address)
+{
+    if (bank == 0x00 && address == SENSOR_REG_PERFORMANCE)
+    {
+        return SENSOR_PERFORMANCE_MODE_MASK;
+    }
+    return 0xFF;
+}
+
+// Registers whose write is a command rather than a stored value, they are never skipped or shadowed.
+static bool sensor_register_is_volatile(uint8_t bank, uint8_t address)
+{
+    if (bank != 0x00)
+    {
+        return false;
+    }
+    switch (address)
+    {
+    case SENSOR_REG_MOTION_BURST:
+    case SENSOR_REG_POWER_UP_RESET:
+    case SENSOR_REG_SHUTDOWN:
+    case SENSOR_REG_SET_RESOLUTION:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/************* Shadow ****************/
+
+static bool sensor_shadow_is_known(const sensor_shadow_t *shadow, uint8_t bank, uint8_t address)
+{
+    return shadow->known[bank][address / 32] & (1u << (address % 32));
+}
+
+static void sensor_shadow_store(sensor_shadow_t *shadow, uint8_t bank, uint8_t address, uint8_t value)
+{
+    shadow->values[bank][address] = value;
+    shadow->known[bank][address / 32] |= 1u << (address % 32);
+}
+
+static void sensor_shadow_forget(sensor_shadow_t *shadow, uint8_t bank, uint8_t address)
+{
+    shadow->known[bank][address / 32] &= ~(1u << (address % 32));
+}
+
+// Set up an empty shadow on top of the bus.
+void sensor_shadow_init(sensor_shadow_t *shadow, const sensor_bus_t *bus)
+{
+    shadow->bus = bus;
+    shadow->transactions = 0;
+    shadow->skipped = 0;
+    sensor_shadow_reset(shadow);
+}
+
+// Forget all register values, called after the sensor was reset or power cycled.
+// A reset leaves bank 0 selected.
+void sensor_shadow_reset(sensor_shadow_t *shadow)
+{
+    for (int bank = 0; bank < SENSOR_REG_BANKS; bank++)
+    {
+        for (int word = 0; word < SENSOR_REG_COUNT / 32; word++)
+        {
+            shadow->known[bank][word] = 0;
+        }
+    }
+    shadow->bank = 0x00;
+    shadow->pending_bank = 0x00;
+}
+
+// Make the sensor select a bank, skipping the write if it is already selected.
+int sensor_shadow_select_bank(sensor_shadow_t *shadow, uint8_t bank)
+{
+    shadow->pending_bank = bank;
+    if (shadow->bank == bank)
+    {
+        return 0;
+    }
+    shadow->transactions++;
+    int err = shadow->bus->write(shadow->bus->context, SENSOR_REG_BANK_SELECT, bank);
+    // The sensor may or may not have switched on a failed write.
+    shadow->bank = err ? SENSOR_BANK_UNKNOWN : bank;
+    return err;
+}
+
+// Write a register of the pending bank.
+// 0x7F writes only record the bank, it is selected once a register in it actually has to be written.
+int sensor_shadow_write(sensor_shadow_t *shadow, uint8_t address, uint8_t value, sensor_write_policy_t policy)
+{
+    if (address == SENSOR_REG_BANK_SELECT)
+    {
+        shadow->pending_bank = value;
+        return 0;
+    }
+
+    uint8_t bank = shadow->pending_bank;
+    bool is_volatile = sensor_register_is_volatile(bank, address);
+    if (policy == SENSOR_WRITE_CHANGED && !is_volatile)
+    {
+        uint8_t mask = sensor_register_mask(bank, address);
+        if (mask != 0xFF)
+        {
+            // Read-modify-write, the read is only needed if the register was not written since the reset.
+            if (!sensor_shadow_is_known(shadow, bank, address))
+            {
+                uint8_t current;
+                int err = sensor_shadow_select_bank(shadow, bank);
+                if (err)
+                {
+                    return err;
+                }
+                shadow->transactions++;
+                err = shadow->bus->read(shadow->bus->context, address, &current);
+                if (err)
+                {
+                    return err;
+                }
+                sensor_shadow_store(shadow, bank, address, current);
+            }
+            value = (shadow->values[bank][address] & ~mask) | (value & mask);
+        }
+        if (sensor_shadow_is_known(shadow, bank, address) && shadow->values[bank][address] == value)
+        {
+            shadow->skipped++;
+            return 0;
+        }
+    }
+
+    int err = sensor_shadow_select_bank(shadow, bank);
+    if (err)
+    {
+        return err;
+    }
+    shadow->transactions++;
+    err = shadow->bus->write(shadow->bus->context, address, value);
+    if (err || is_volatile)
+    {
+        sensor_shadow_forget(shadow, bank, address);
+    }
+    else
+    {
+        sensor_shadow_store(shadow, bank, address, value);
+    }
+    return err;
+}
+
+// Write a programming sequence, stopping at the first failed write.
+// The sequence ends with bank 0 selected so plain register reads can follow.
+int sensor_shadow_write_sequence(sensor_shadow_t *shadow, const sensor_sequence_t *sequence, sensor_write_policy_t policy)
+{
+    for (size_t i = 0; i < sequence->length; i++)
+    {
+        int err = sensor_shadow_write(shadow, sequence->writes[i][0], sequence->writes[i][1], policy);
+        if (err)
+        {
+            return err;
+        }
+    }
+    return sensor_shadow_select_bank(shadow, 0x00);
+}
+
+// Build the register writes for a resolution change.
+// The resolution registers hold (CPI / 50) - 1 and take effect when 0x01 is written to Set_Resolution.
+void sensor_resolution_sequence(uint16_t cpi, uint8_t writes[SENSOR_RESOLUTION_SEQUENCE_LENGTH][2])
+{
+    uint16_t resolution = cpi / SENSOR_CPI_STEP - 1;
+    const uint8_t sequence[SENSOR_RESOLUTION_SEQUENCE_LENGTH][2] = {
+        {SENSOR_REG_RESOLUTION_X_LOW, (uint8_t)resolution},
+        {SENSOR_REG_RESOLUTION_X_HIGH, (uint8_t)(resolution >> 8)},
+        {SENSOR_REG_RESOLUTION_Y_LOW, (uint8_t)resolution},
+        {SENSOR_REG_RESOLUTION_Y_HIGH, (uint8_t)(resolution >> 8)},
+        {SENSOR_REG_SET_RESOLUTION, 0x01},
+    };
+    for (int i = 0; i < SENSOR_RESOLUTION_SEQUENCE_LENGTH; i++)
+    {
+        writes[i][0] = sequence[i][0];
+        writes[i][1] = sequence[i][1];
+    }
+}
+
+/************* Rest Modes ****************/
+
+// Register value for a time in units, rounded to the nearest unit and kept within the register range.
+static uint8_t sensor_rest_register(uint32_t value, uint32_t unit)
+{
+    uint32_t count = (value + unit / 2) / unit;
+    if (count < 1)
+    {
+        return 1;
+    }
+    return count > SENSOR_REST_REG_MAX ? SENSOR_REST_REG_MAX : (uint8_t)count;
+}
+
+// Check that every time of a rest timing can be programmed.
+// A rest downshift must be at least one step of its own rest mode and at most the register range of steps.
+bool sensor_rest_valid(const sensor_rest_t *rest)
+{
+    if (rest->run_downshift_ms < SENSOR_RUN_DOWNSHIFT_UNIT_MS || rest->run_downshift_ms > SENSOR_RUN_DOWNSHIFT_MS_MAX)
+    {
+        return false;
+    }
+    if (rest->rest1_period_ms == 0 || rest->rest2_period_ms == 0 || rest->rest3_period_ms == 0)
+    {
+        return false;
+    }
+    // Each rest mode is slower than the one before it.
+    if (rest->rest2_period_ms < rest->rest1_period_ms || rest->rest3_period_ms < rest->rest2_period_ms)
+    {
+        return false;
+    }
+    uint32_t rest1_step_ms = SENSOR_REST_DOWNSHIFT_FRAMES * rest->rest1_period_ms;
+    uint32_t rest2_step_ms = SENSOR_REST_DOWNSHIFT_FRAMES * rest->rest2_period_ms;
+    return rest->rest1_downshift_ms >= rest1_step_ms && rest->rest1_downshift_ms <= rest1_step_ms * SENSOR_REST_REG_MAX &&
+           rest->rest2_downshift_ms >= rest2_step_ms && rest->rest2_downshift_ms <= rest2_step_ms * SENSOR_REST_REG_MAX;
+}
+
+// Build the register writes for a rest timing change.
+// The downshift times are rounded to the nearest step the registers can hold.
+void sensor_rest_sequence(const sensor_rest_t *rest, uint8_t writes[SENSOR_REST_SEQUENCE_LENGTH][2])
+{
+    const uint8_t sequence[SENSOR_REST_SEQUENCE_LENGTH][2] = {
+        {SENSOR_REG_BANK_SELECT, 0x00},
+        {SENSOR_REG_RUN_DOWNSHIFT, sensor_rest_register(rest->run_downshift_ms, SENSOR_RUN_DOWNSHIFT_UNIT_MS)},
+        {SENSOR_REG_REST1_PERIOD, rest->rest1_period_ms},
+        {SENSOR_REG_REST1_DOWNSHIFT, sensor_rest_register(rest->rest1_downshift_ms, SENSOR_REST_DOWNSHIFT_FRAMES * rest->rest1_period_ms)},
+        {SENSOR_REG_REST2_PERIOD, rest->rest2_period_ms},
+        {SENSOR_REG_REST2_DOWNSHIFT, sensor_rest_register(rest->rest2_downshift_ms, SENSOR_REST_DOWNSHIFT_FRAMES * rest->rest2_period_ms)},
+        {SENSOR_REG_REST3_PERIOD, rest->rest3_period_ms},
+    };
+    for (int i = 0; i < SENSOR_REST_SEQUENCE_LENGTH; i++)
+    {
+        writes[i][0] = sequence[i][0];
+        writes[i][1] = sequence[i][1];
+    }
+}
+
+/************* Link Calibration ****************/
+
+// 80 MHz divided by 10, 8, 6, 5 and 4, the SPI clock divider hits these exactly.
+const uint32_t sensor_link_clocks_hz[SENSOR_LINK_CLOCKS] = {8000000, 10000000, 13333333, 16000000, 20000000};
+
+static int sensor_link_clock_index(uint32_t clock_hz)
+{
+    for (int i = 0; i < SENSOR_LINK_CLOCKS; i++)
+    {
+        if (sensor_link_clocks_hz[i] == clock_hz)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Dummy bits that cover a read setup time at a clock, rounded up.
+uint32_t sensor_link_dummy_bits(uint32_t clock_hz, uint32_t setup_us)
+{
+    return (setup_us * clock_hz + 999999) / 1000000;
+}
+
+// Check a stored link setting, one that was never calibrated is ignored and always passes.
+bool sensor_link_valid(const sensor_link_t *link)
+{
+    if (!link->calibrated)
+    {
+        return true;
+    }
+    return sensor_link_clock_index(link->clock_hz) >= 0 && link->input_delay_ns % SENSOR_LINK_DELAY_STEP_NS == 0 &&
+           link->input_delay_ns / SENSOR_LINK_DELAY_STEP_NS < SENSOR_LINK_DELAYS;
+}
+
+// Read the product ID and its inverse a number of times and count the bits that came back wrong.
+// A failed transfer counts as a whole byte of errors.
+uint32_t sensor_link_read_errors(const sensor_bus_t *bus, uint32_t reads)
+{
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < reads; i++)
+    {
+        uint8_t value;
+        errors += bus->read(bus->context, SENSOR_REG_PRODUCT_ID, &value) ? 8 : __builtin_popcount(value ^ SENSOR_PRODUCT_ID);
+        errors += bus->read(bus->context, SENSOR_REG_INVERSE_PRODUCT_ID, &value) ? 8 : __builtin_popcount(value ^ SENSOR_INVERSE_PRODUCT_ID);
+    }
+    return errors;
+}
+
+// Fastest clock whose widest run of error free input delays leaves SENSOR_LINK_MARGIN_NS on both sides of its middle.
+// The ends of the sweep count as errors, the delays past them were not tried.
+static bool sensor_link_pick_cell(const sensor_link_report_t *report, int *clock, int *delay)
+{
+    for (int c = SENSOR_LINK_CLOCKS - 1; c >= 0; c--)
+    {
+        int best_start = 0;
+        int best_length = 0;
+        int length = 0;
+        for (int d = 0; d < SENSOR_LINK_DELAYS; d++)
+        {
+            length = report->bit_errors[c][d] == 0 ? length + 1 : 0;
+            if (length > best_length)
+            {
+                best_length = length;
+                best_start = d - length + 1;
+            }
+        }
+        if (best_length > 0 && (best_length - 1) / 2 * report->delay_step_ns >= SENSOR_LINK_MARGIN_NS)
+        {
+            *clock = c;
+            *delay = best_start + (best_length - 1) / 2;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pick the link setting from the bit errors of a sweep, returns false if no setting has the margin.
+bool sensor_link_pick(const sensor_link_report_t *report, sensor_link_t *link)
+{
+    int clock;
+    int delay;
+    if (!sensor_link_pick_cell(report, &clock, &delay))
+    {
+        return false;
+    }
+    link->clock_hz = report->clock_hz[clock];
+    link->input_delay_ns = delay * report->delay_step_ns;
+    link->calibrated = 1;
+    return true;
+}
+
+// Sweep every clock and input delay and pick the fastest setting with margin. The sweep reads too little to see
+// a rare bit error, so the pick and both ends of its margin are read back many more times. A setting that shows
+// errors then has them counted against it and the next best pick is tried.
+// Leaves the link configured to the last setting tried, returns true with the accepted one in report->link.
+bool sensor_link_calibrate(sensor_link_report_t *report, const sensor_bus_t *bus, sensor_link_configure_t configure)
+{
+    report->delay_step_ns = SENSOR_LINK_DELAY_STEP_NS;
+    report->bits = SENSOR_LINK_SWEEP_READS * 16;
+    report->confirm_bits = 0;
+    report->confirm_bit_errors = 0;
+    report->rejected = 0;
+    report->link = (sensor_link_t){0};
+    for (int c = 0; c < SENSOR_LINK_CLOCKS; c++)
+    {
+        report->clock_hz[c] = sensor_link_clocks_hz[c];
+        for (int d = 0; d < SENSOR_LINK_DELAYS; d++)
+        {
+            if (configure(bus->context, sensor_link_clocks_hz[c], d * SENSOR_LINK_DELAY_STEP_NS) != 0)
+            {
+                report->bit_errors[c][d] = SENSOR_LINK_REFUSED;
+                continue;
+            }
+            report->bit_errors[c][d] = sensor_link_read_errors(bus, SENSOR_LINK_SWEEP_READS);
+        }
+    }
+
+    const int margin = SENSOR_LINK_MARGIN_NS / SENSOR_LINK_DELAY_STEP_NS;
+    int clock;
+    int delay;
+    while (sensor_link_pick_cell(report, &clock, &delay))
+    {
+        const int confirm[] = {delay, delay - margin, delay + margin};
+        uint32_t errors = 0;
+        report->confirm_bits = 0;
+        for (int i = 0; i < 3 && errors == 0; i++)
+        {
+            if (configure(bus->context, report->clock_hz[clock], confirm[i] * SENSOR_LINK_DELAY_STEP_NS) != 0)
+            {
+                errors = SENSOR_LINK_REFUSED;
+            }
+            else
+            {
+                errors = sensor_link_read_errors(bus, SENSOR_LINK_CONFIRM_READS);
+                report->confirm_bits += SENSOR_LINK_CONFIRM_READS * 16;
+            }
+            if (errors != 0)
+            {
+                report->bit_errors[clock][confirm[i]] = errors;
+            }
+        }
+        report->confirm_bit_errors = errors == SENSOR_LINK_REFUSED ? 0 : errors;
+        if (errors == 0)
+        {
+            sensor_link_pick(report, &report->link);
+            return true;
+        }
+        report->rejected++;
+    }
+    return false;
+}
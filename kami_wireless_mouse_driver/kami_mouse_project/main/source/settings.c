@@ -0,0 +1,393 @@
+#include "header/settings.h"
+
+static void settings_defaults(settings_store_t *store);
+static bool settings_load(settings_store_t *store);
+static void settings_save(void);
+static void settings_publish(const settings_t *live);
+
+static const settings_t settings_default_profile = {
+    .cpi = SETTINGS_CPI_DEFAULT,
+    .report_rate_us = REPORT_RATE_US,
+    .sensor_mode = MOUSE_MODE_HPM,
+    .debounce_ms = STABLE_POLL_TIME_MS,
+    .debounce_min_ms = STABLE_POLL_TIME_MIN_MS,
+    .scroll_speed_min = SCROLL_WHEEL_SPEED_MIN,
+    .scroll_speed_max = SCROLL_WHEEL_SPEED_MAX,
+    .scroll_pause_ms = SCROLL_WHEEL_PAUSE_MS,
+    .scroll_accel = false,
+    .power_idle_ms = SETTINGS_POWER_IDLE_MS_DEFAULT,
+    .power_sleep_ms = SETTINGS_POWER_SLEEP_MS_DEFAULT,
+    .rest_run_ms = SETTINGS_REST_GAMING_RUN_MS,
+    .rest1_ms = SETTINGS_REST_GAMING_REST1_MS,
+    .rest2_ms = SETTINGS_REST_GAMING_REST2_MS,
+    .rest1_period_ms = SETTINGS_REST_GAMING_REST1_PERIOD_MS,
+    .rest2_period_ms = SETTINGS_REST_GAMING_REST2_PERIOD_MS,
+    .rest3_period_ms = SETTINGS_REST_GAMING_REST3_PERIOD_MS,
+    .button_map = INPUT_REMAP_DEFAULT,
+};
+
+// Office profile, the sensor in office mode and resting early.
+static const settings_t settings_office_profile = {
+    .cpi = SETTINGS_CPI_DEFAULT,
+    .report_rate_us = REPORT_RATE_US,
+    .sensor_mode = MOUSE_MODE_WRK,
+    .debounce_ms = STABLE_POLL_TIME_MS,
+    .debounce_min_ms = STABLE_POLL_TIME_MIN_MS,
+    .scroll_speed_min = SCROLL_WHEEL_SPEED_MIN,
+    .scroll_speed_max = SCROLL_WHEEL_SPEED_MAX,
+    .scroll_pause_ms = SCROLL_WHEEL_PAUSE_MS,
+    .scroll_accel = false,
+    .power_idle_ms = SETTINGS_POWER_IDLE_MS_DEFAULT,
+    .power_sleep_ms = SETTINGS_POWER_SLEEP_MS_DEFAULT,
+    .rest_run_ms = SETTINGS_REST_OFFICE_RUN_MS,
+    .rest1_ms = SETTINGS_REST_OFFICE_REST1_MS,
+    .rest2_ms = SETTINGS_REST_OFFICE_REST2_MS,
+    .rest1_period_ms = SETTINGS_REST_OFFICE_REST1_PERIOD_MS,
+    .rest2_period_ms = SETTINGS_REST_OFFICE_REST2_PERIOD_MS,
+    .rest3_period_ms = SETTINGS_REST_OFFICE_REST3_PERIOD_MS,
+    .button_map = INPUT_REMAP_DEFAULT,
+};
+
+// Live copy of the active profile, published with a sequence lock so readers take no lock.
+// The sequence is odd while a commit writes the copy.
+static settings_t settings_live = settings_default_profile;
+static volatile uint32_t settings_sequence = 0;
+
+volatile uint32_t settings_generation = 0;
+
+// RAM cache of all profiles, and the copy that was last written to NVS.
+static settings_store_t settings_store;
+static settings_store_t settings_saved;
+// Guards settings_store and serializes the commits, the hot path only ever reads the live settings copy.
+static portMUX_TYPE settings_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t settings_task_handle = NULL;
+
+/************* Storage ****************/
+
+// Fill every profile with the compile time defaults.
+static void settings_defaults(settings_store_t *store)
+{
+    // Zeroed, every macro is a lone END step and does nothing.
+    memset(store, 0, sizeof(*store));
+    store->version = SETTINGS_VERSION;
+    store->active_profile = 0;
+    for (int i = 0; i < SETTINGS_PROFILE_COUNT; i++)
+    {
+        store->profiles[i] = settings_default_profile;
+    }
+    store->profiles[SETTINGS_PROFILE_OFFICE] = settings_office_profile;
+    store->energy = energy_costs_default;
+}
+
+// Load the settings blob from NVS, returns false if there is no usable blob.
+static bool settings_load(settings_store_t *store)
+{
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        // The partition is full or was written by a newer NVS version, start over.
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "NVS init failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    nvs_handle_t handle;
+    err = nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK)
+    {
+        // The namespace does not exist until the first save.
+        return false;
+    }
+    size_t length = sizeof(*store);
+    err = nvs_get_blob(handle, SETTINGS_NVS_KEY, store, &length);
+    nvs_close(handle);
+    if (err != ESP_OK || length != sizeof(*store) || store->version != SETTINGS_VERSION)
+    {
+        return false;
+    }
+
+    if (store->active_profile >= SETTINGS_PROFILE_COUNT)
+    {
+        return false;
+    }
+    for (int i = 0; i < SETTINGS_PROFILE_COUNT; i++)
+    {
+        if (!settings_validate(&store->profiles[i]))
+        {
+            return false;
+        }
+    }
+    for (int i = 0; i < INPUT_MACRO_COUNT; i++)
+    {
+        if (!input_macro_valid(&store->macros.macros[i]))
+        {
+            return false;
+        }
+    }
+    return sensor_link_valid(&store->link) && energy_costs_valid(&store->energy);
+}
+
+// Write the RAM cache to NVS if it differs from what is stored.
+static void settings_save(void)
+{
+    settings_store_t store;
+    portENTER_CRITICAL(&settings_lock);
+    store = settings_store;
+    portEXIT_CRITICAL(&settings_lock);
+
+    if (memcmp(&store, &settings_saved, sizeof(store)) == 0)
+    {
+        return;
+    }
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SETTINGS_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(handle, SETTINGS_NVS_KEY, &store, sizeof(store));
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK)
+    {
+        // Keep the RAM copy, the next change retries the write.
+        ESP_LOGE(TAG, "Settings save failed: %s", esp_err_to_name(err));
+        return;
+    }
+    settings_saved = store;
+    ESP_LOGI(TAG, "Settings saved, profile %d", store.active_profile);
+}
+
+/************* Settings ****************/
+
+// Load the stored profiles, or the compile time defaults if nothing valid is stored.
+void settings_init(void)
+{
+    settings_store_t store;
+    if (!settings_load(&store))
+    {
+        settings_defaults(&store);
+        ESP_LOGI(TAG, "Settings defaults loaded");
+    }
+    portENTER_CRITICAL(&settings_lock);
+    settings_store = store;
+    settings_publish(&store.profiles[store.active_profile]);
+    portEXIT_CRITICAL(&settings_lock);
+    settings_saved = store;
+    ESP_LOGI(TAG, "USB settings_init");
+}
+
+// Check a full set of settings before any of it is applied.
+bool settings_validate(const settings_t *candidate)
+{
+    if (candidate->cpi < SETTINGS_CPI_MIN || candidate->cpi > SETTINGS_CPI_MAX || candidate->cpi % SETTINGS_CPI_STEP != 0)
+    {
+        return false;
+    }
+    if (candidate->report_rate_us < SETTINGS_REPORT_RATE_US_MIN || candidate->report_rate_us > SETTINGS_REPORT_RATE_US_MAX)
+    {
+        return false;
+    }
+    if (candidate->sensor_mode > MOUSE_MODE_CRD)
+    {
+        return false;
+    }
+    if (candidate->debounce_ms < SETTINGS_DEBOUNCE_MS_MIN || candidate->debounce_ms > SETTINGS_DEBOUNCE_MS_MAX ||
+        candidate->debounce_min_ms < SETTINGS_DEBOUNCE_MS_MIN || candidate->debounce_min_ms > candidate->debounce_ms)
+    {
+        return false;
+    }
+    if (candidate->scroll_speed_min < 1 || candidate->scroll_speed_min > candidate->scroll_speed_max ||
+        candidate->scroll_speed_max > SETTINGS_SCROLL_SPEED_LIMIT)
+    {
+        return false;
+    }
+    if (candidate->scroll_pause_ms > SETTINGS_SCROLL_PAUSE_MS_MAX)
+    {
+        return false;
+    }
+    if (candidate->power_idle_ms < 1 || candidate->power_idle_ms > candidate->power_sleep_ms ||
+        candidate->power_sleep_ms > SETTINGS_POWER_MS_MAX)
+    {
+        return false;
+    }
+    if (!input_remap_valid(candidate->button_map))
+    {
+        return false;
+    }
+    sensor_rest_t rest;
+    settings_sensor_rest(candidate, &rest);
+    return sensor_rest_valid(&rest);
+}
+
+// Rest timing of a profile in the form the sensor register layer takes.
+void settings_sensor_rest(const settings_t *source, sensor_rest_t *rest)
+{
+    rest->run_downshift_ms = source->rest_run_ms;
+    rest->rest1_downshift_ms = source->rest1_ms;
+    rest->rest2_downshift_ms = source->rest2_ms;
+    rest->rest1_period_ms = source->rest1_period_ms;
+    rest->rest2_period_ms = source->rest2_period_ms;
+    rest->rest3_period_ms = source->rest3_period_ms;
+}
+
+// Replace the live copy, called with settings_lock held.
+// The lock keeps interrupts off on this core, so a reader never spins on a commit it preempted.
+static void settings_publish(const settings_t *live)
+{
+    settings_sequence++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    settings_live = *live;
+    settings_generation++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    settings_sequence++;
+}
+
+// Copy out the live settings without locking, every field from the same commit.
+// A read that overlaps a commit on the other core is retried. Returns the generation of the copy.
+uint32_t HOT_PATH settings_snapshot(settings_t *out)
+{
+    uint32_t sequence;
+    uint32_t generation;
+    do
+    {
+        sequence = __atomic_load_n(&settings_sequence, __ATOMIC_ACQUIRE);
+        *out = settings_live;
+        generation = settings_generation;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) != 0 || sequence != settings_sequence);
+    return generation;
+}
+
+uint8_t settings_active_profile(void)
+{
+    return settings_store.active_profile;
+}
+
+// Copy out a stored profile.
+void settings_get_profile(uint8_t profile, settings_t *out)
+{
+    portENTER_CRITICAL(&settings_lock);
+    *out = settings_store.profiles[profile];
+    portEXIT_CRITICAL(&settings_lock);
+}
+
+// Store a validated profile and make it the active one.
+// Switching republishes the live copy, so it lands before the next report frame.
+// The flash write is left to settings_task.
+void settings_commit(uint8_t profile, const settings_t *candidate)
+{
+    settings_t live = *candidate;
+    live.reserved2 = 0;
+    live.reserved3 = 0;
+
+    portENTER_CRITICAL(&settings_lock);
+    settings_store.profiles[profile] = live;
+    settings_store.active_profile = profile;
+    settings_publish(&live);
+    portEXIT_CRITICAL(&settings_lock);
+
+    if (settings_task_handle != NULL)
+    {
+        xTaskNotifyGive(settings_task_handle);
+    }
+}
+
+/************* Macros ****************/
+
+// Copy out one macro, taken by the macro task when a button starts it.
+void settings_get_macro(uint8_t index, input_macro_t *out)
+{
+    portENTER_CRITICAL(&settings_lock);
+    *out = settings_store.macros.macros[index];
+    portEXIT_CRITICAL(&settings_lock);
+}
+
+void settings_get_macros(input_macro_table_t *out)
+{
+    portENTER_CRITICAL(&settings_lock);
+    *out = settings_store.macros;
+    portEXIT_CRITICAL(&settings_lock);
+}
+
+// Store a validated macro table, a macro already playing keeps its old copy.
+void settings_commit_macros(const input_macro_table_t *table)
+{
+    portENTER_CRITICAL(&settings_lock);
+    settings_store.macros = *table;
+    portEXIT_CRITICAL(&settings_lock);
+
+    if (settings_task_handle != NULL)
+    {
+        xTaskNotifyGive(settings_task_handle);
+    }
+}
+
+/************* Sensor Link ****************/
+
+void settings_get_link(sensor_link_t *out)
+{
+    portENTER_CRITICAL(&settings_lock);
+    *out = settings_store.link;
+    portEXIT_CRITICAL(&settings_lock);
+}
+
+// Store the setting picked by a link calibration, the sensor task already runs on it.
+void settings_commit_link(const sensor_link_t *link)
+{
+    portENTER_CRITICAL(&settings_lock);
+    settings_store.link = *link;
+    portEXIT_CRITICAL(&settings_lock);
+
+    if (settings_task_handle != NULL)
+    {
+        xTaskNotifyGive(settings_task_handle);
+    }
+}
+
+/************* Energy Costs ****************/
+
+void settings_get_energy_costs(energy_costs_t *out)
+{
+    portENTER_CRITICAL(&settings_lock);
+    *out = settings_store.energy;
+    portEXIT_CRITICAL(&settings_lock);
+}
+
+// Store a validated cost table, the next energy estimate uses it.
+void settings_commit_energy_costs(const energy_costs_t *costs)
+{
+    portENTER_CRITICAL(&settings_lock);
+    settings_store.energy = *costs;
+    portEXIT_CRITICAL(&settings_lock);
+
+    if (settings_task_handle != NULL)
+    {
+        xTaskNotifyGive(settings_task_handle);
+    }
+}
+
+// Task that writes changed settings to NVS.
+// Writes are deferred until the changes stop for SETTINGS_SAVE_DELAY_MS, so a burst of tweaks costs one flash write
+// and the input tasks never wait on flash.
+void settings_task(void *arg)
+{
+    settings_task_handle = xTaskGetCurrentTaskHandle();
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // Restart the delay on every further change.
+        while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SETTINGS_SAVE_DELAY_MS)) != 0)
+        {
+        }
+        settings_save();
+    }
+}
@@ -0,0 +1,90 @@
+#include "header/telemetry.h"
+
+telemetry_counters_t telemetry_counters;
+
+static telemetry_latency_histograms_t telemetry_histograms;
+
+// Not cleared by telemetry_reset, a boot happens once.
+static telemetry_boot_times_t telemetry_boot;
+// Start of the time the counters cover.
+static uint64_t telemetry_reset_us;
+
+// Add a sample to one of the latency histograms.
+void HOT_PATH telemetry_record_latency(telemetry_latency_t histogram, uint32_t latency_us)
+{
+    // Index of the highest set bit, so 2-3us lands in bucket 1, 4-7us in bucket 2 and so on.
+    int bucket = latency_us < 2 ? 0 : 31 - __builtin_clz(latency_us);
+    bucket = min(bucket, TELEMETRY_LATENCY_BUCKETS - 1);
+    __atomic_fetch_add(&telemetry_histograms.buckets[histogram][bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Copy the counters and histograms out for the host.
+void telemetry_snapshot(telemetry_counters_t *counters, telemetry_latency_histograms_t *histograms)
+{
+    uint64_t now_us = esp_timer_get_time();
+    telemetry_counters.uptime_ms = now_us / 1000;
+    telemetry_counters.counted_ms = (now_us - telemetry_reset_us) / 1000;
+    if (counters != NULL)
+    {
+        *counters = telemetry_counters;
+    }
+    if (histograms != NULL)
+    {
+        *histograms = telemetry_histograms;
+    }
+}
+
+// Clear all counters and histograms.
+void telemetry_reset(void)
+{
+    memset(&telemetry_counters, 0, sizeof(telemetry_counters));
+    memset(&telemetry_histograms, 0, sizeof(telemetry_histograms));
+    telemetry_reset_us = esp_timer_get_time();
+}
+
+/************* Boot ****************/
+
+// Record the first time a boot milestone is reached.
+// Once the inputs, the host and the sensor are all up the boot timeline is logged.
+void telemetry_boot_mark(telemetry_boot_t milestone)
+{
+    if (telemetry_boot.us[milestone] != 0)
+    {
+        return;
+    }
+    uint32_t now_us = esp_timer_get_time();
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&telemetry_boot.us[milestone], &expected, now_us, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    if (milestone <= TELEMETRY_BOOT_SENSOR_READY && telemetry_boot.us[TELEMETRY_BOOT_BUTTONS_READY] != 0 &&
+        telemetry_boot.us[TELEMETRY_BOOT_USB_MOUNTED] != 0 && telemetry_boot.us[TELEMETRY_BOOT_SENSOR_READY] != 0)
+    {
+        // Clicks can be delivered once the buttons and the host are up, motion once the sensor is up as well.
+        uint32_t click_ready_us = max(telemetry_boot.us[TELEMETRY_BOOT_BUTTONS_READY], telemetry_boot.us[TELEMETRY_BOOT_USB_MOUNTED]);
+        uint32_t motion_ready_us = max(click_ready_us, telemetry_boot.us[TELEMETRY_BOOT_SENSOR_READY]);
+        ESP_LOGI(TAG, "Boot: buttons %lu us, USB mounted %lu us, sensor %lu us, clicks ready %lu us, motion ready %lu us",
+                 telemetry_boot.us[TELEMETRY_BOOT_BUTTONS_READY], telemetry_boot.us[TELEMETRY_BOOT_USB_MOUNTED],
+                 telemetry_boot.us[TELEMETRY_BOOT_SENSOR_READY], click_ready_us, motion_ready_us);
+    }
+}
+
+// Note the first delivered click and motion report.
+void telemetry_boot_report(uint8_t buttons, int16_t x, int16_t y)
+{
+    if (buttons != 0)
+    {
+        telemetry_boot_mark(TELEMETRY_BOOT_FIRST_CLICK);
+    }
+    if (x != 0 || y != 0)
+    {
+        telemetry_boot_mark(TELEMETRY_BOOT_FIRST_MOTION);
+    }
+}
+
+void telemetry_boot_snapshot(telemetry_boot_times_t *times)
+{
+    *times = telemetry_boot;
+}
@@ -0,0 +1,307 @@
+#include "header/trace.h"
+#include "header/telemetry.h"
+
+#include "esp_attr.h"
+#include "esp_private/cache_utils.h"
+
+static uint32_t trace_serialize_record(const trace_record_t *record, uint8_t *out);
+static bool trace_read_abandoned(int64_t now);
+static void trace_read_begin(void);
+static void trace_read_end(bool complete);
+static void trace_read_expire(void);
+static void trace_dump(void);
+
+/************* Capture Ring ****************/
+
+#if TRACE_ENABLED
+// The ring is far too large for internal RAM, it is placed in PSRAM at link time instead of allocated at boot.
+static EXT_RAM_BSS_ATTR trace_record_t trace_ring[TRACE_RING_RECORDS];
+#else
+static trace_record_t *const trace_ring = NULL;
+#endif
+// Total records written since boot, the ring index is the count masked by the ring size.
+static uint32_t trace_write_count = 0;
+static bool trace_capturing = false;
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t trace_task_handle = NULL;
+
+// Start recording.
+void trace_init(void)
+{
+    trace_capturing = TRACE_ENABLED;
+    ESP_LOGI(TAG, "USB trace_init");
+}
+
+#if TRACE_ENABLED
+
+// Add a record to the ring, overwriting the oldest record when full.
+// Safe to call from ISRs and tasks on either core.
+void HOT_PATH trace_record(trace_record_type_t type, const uint8_t *payload, uint8_t length)
+{
+    if (!trace_capturing)
+    {
+        return;
+    }
+    // PSRAM goes through the cache, an ISR that ran during a flash write drops its record.
+    if (!spi_flash_cache_enabled())
+    {
+        TELEMETRY_COUNT(trace_dropped);
+        return;
+    }
+
+    uint32_t timestamp = esp_timer_get_time();
+    length = min(length, TRACE_PAYLOAD_MAX);
+
+    portENTER_CRITICAL_SAFE(&trace_lock);
+    // Checked again under the lock, a reader stops capture under the same lock and then owns the ring.
+    if (!trace_capturing)
+    {
+        portEXIT_CRITICAL_SAFE(&trace_lock);
+        return;
+    }
+    trace_record_t *record = &trace_ring[trace_write_count & (TRACE_RING_RECORDS - 1)];
+    trace_write_count++;
+    record->timestamp_us = timestamp;
+    record->type = type;
+    record->length = length;
+    memcpy(record->payload, payload, length);
+    portEXIT_CRITICAL_SAFE(&trace_lock);
+}
+
+// Record the pin levels seen by an input ISR.
+void HOT_PATH trace_record_gpio(uint8_t pin, uint8_t levels)
+{
+    uint8_t payload[TRACE_GPIO_PAYLOAD_SIZE] = {pin, levels};
+    trace_record(TRACE_RECORD_GPIO, payload, sizeof(payload));
+}
+
+// Record a report as the transport mux submitted it, with the motion of the inputs merged into it.
+void HOT_PATH trace_record_report(uint8_t buttons, int16_t x, int16_t y, int8_t wheel, int8_t pan)
+{
+    trace_report_t report = {
+        .buttons = buttons,
+        .x = x,
+        .y = y,
+        .wheel = wheel,
+        .pan = pan,
+    };
+    uint8_t payload[TRACE_REPORT_PAYLOAD_SIZE];
+    trace_record(TRACE_RECORD_REPORT, payload, trace_pack_report(payload, &report));
+}
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_BURSTS
+// Record a raw motion burst as read from the sensor.
+void HOT_PATH trace_record_burst(const uint8_t *response)
+{
+    trace_record(TRACE_RECORD_BURST, response, SENSOR_MOTION_BURST_SIZE);
+}
+#endif
+
+/************* Dump ****************/
+
+// Serialize a record into the compact dump format, returns the number of bytes written.
+static uint32_t trace_serialize_record(const trace_record_t *record, uint8_t *out)
+{
+    out[0] = record->type;
+    out[1] = record->length;
+    out[2] = (uint8_t)record->timestamp_us;
+    out[3] = (uint8_t)(record->timestamp_us >> 8);
+    out[4] = (uint8_t)(record->timestamp_us >> 16);
+    out[5] = (uint8_t)(record->timestamp_us >> 24);
+    memcpy(&out[TRACE_RECORD_HEADER_SIZE], record->payload, record->length);
+    return TRACE_RECORD_HEADER_SIZE + record->length;
+}
+
+// Reader state, the ring is frozen while a read is in progress.
+// The owner and the busy flag are changed under trace_lock, the rest only by the call that set the busy flag.
+static trace_reader_t trace_reader = TRACE_READER_NONE;
+static bool trace_read_busy = false;
+static int64_t trace_read_last_us = 0;
+static uint32_t trace_read_first = 0;
+static uint32_t trace_read_count = 0;
+static uint32_t trace_read_index = 0;
+static uint32_t trace_read_offset = 0;
+static uint32_t trace_read_total = 0;
+static uint8_t trace_read_staging[TRACE_RECORD_HEADER_SIZE + TRACE_PAYLOAD_MAX];
+static uint32_t trace_read_staging_length = 0;
+static uint32_t trace_read_staging_offset = 0;
+
+// True if the reader has not continued its read within the idle timeout. Called with trace_lock held.
+static bool trace_read_abandoned(int64_t now)
+{
+    return !trace_read_busy && now - trace_read_last_us > TRACE_READ_IDLE_TIMEOUT_MS * 1000LL;
+}
+
+// Size the dump of the frozen ring.
+static void trace_read_begin(void)
+{
+    trace_read_count = min(trace_write_count, (uint32_t)TRACE_RING_RECORDS);
+    trace_read_first = trace_write_count - trace_read_count;
+    trace_read_index = 0;
+    trace_read_offset = 0;
+    trace_read_total = sizeof(trace_file_header_t);
+    for (uint32_t i = 0; i < trace_read_count; i++)
+    {
+        trace_read_total += TRACE_RECORD_HEADER_SIZE + trace_ring[(trace_read_first + i) & (TRACE_RING_RECORDS - 1)].length;
+    }
+
+    trace_file_header_t header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .header_size = sizeof(trace_file_header_t),
+        .record_count = trace_read_count,
+        .dropped_count = trace_read_first,
+    };
+    memcpy(trace_read_staging, &header, sizeof(header));
+    trace_read_staging_length = sizeof(header);
+    trace_read_staging_offset = 0;
+}
+
+// Release the ring and resume capturing, a complete read also clears it. Called with trace_lock held.
+static void trace_read_end(bool complete)
+{
+    trace_reader = TRACE_READER_NONE;
+    if (complete)
+    {
+        trace_write_count = 0;
+    }
+    trace_capturing = true;
+}
+
+// Read the ring in the dump format, oldest record first.
+// Reads must be sequential. Reading offset 0 freezes the ring and reading the last byte clears it and resumes capture.
+// Only one reader at a time, another reader gets busy until the read completes or is abandoned. Never blocks.
+// Returns the number of bytes copied, TRACE_READ_BAD_OFFSET if the offset is out of sequence or TRACE_READ_BUSY.
+int trace_read(trace_reader_t reader, uint32_t offset, uint8_t *out, uint32_t length, uint32_t *total)
+{
+    if (!TRACE_ENABLED)
+    {
+        return TRACE_READ_BAD_OFFSET;
+    }
+
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&trace_lock);
+    if (trace_read_busy || (trace_reader != TRACE_READER_NONE && trace_reader != reader && !trace_read_abandoned(now)))
+    {
+        portEXIT_CRITICAL(&trace_lock);
+        return TRACE_READ_BUSY;
+    }
+    if (offset != 0 && (trace_reader != reader || offset != trace_read_offset))
+    {
+        portEXIT_CRITICAL(&trace_lock);
+        return TRACE_READ_BAD_OFFSET;
+    }
+    if (offset == 0)
+    {
+        // Writers check the flag under the same lock, none is left inside the ring once it is released.
+        trace_capturing = false;
+        trace_reader = reader;
+    }
+    trace_read_busy = true;
+    portEXIT_CRITICAL(&trace_lock);
+
+    if (offset == 0)
+    {
+        trace_read_begin();
+    }
+
+    uint32_t copied = 0;
+    while (copied < length && trace_read_offset < trace_read_total)
+    {
+        if (trace_read_staging_offset == trace_read_staging_length)
+        {
+            const trace_record_t *record = &trace_ring[(trace_read_first + trace_read_index++) & (TRACE_RING_RECORDS - 1)];
+            trace_read_staging_length = trace_serialize_record(record, trace_read_staging);
+            trace_read_staging_offset = 0;
+        }
+        uint32_t chunk = min(length - copied, trace_read_staging_length - trace_read_staging_offset);
+        memcpy(&out[copied], &trace_read_staging[trace_read_staging_offset], chunk);
+        trace_read_staging_offset += chunk;
+        trace_read_offset += chunk;
+        copied += chunk;
+    }
+
+    if (total != NULL)
+    {
+        *total = trace_read_total;
+    }
+
+    portENTER_CRITICAL(&trace_lock);
+    trace_read_busy = false;
+    trace_read_last_us = esp_timer_get_time();
+    if (trace_read_offset == trace_read_total)
+    {
+        trace_read_end(true);
+    }
+    portEXIT_CRITICAL(&trace_lock);
+    return copied;
+}
+
+// Resume capture if the reader abandoned its read.
+static void trace_read_expire(void)
+{
+    portENTER_CRITICAL(&trace_lock);
+    if (trace_reader != TRACE_READER_NONE && trace_read_abandoned(esp_timer_get_time()))
+    {
+        trace_read_end(false);
+    }
+    portEXIT_CRITICAL(&trace_lock);
+}
+
+// Dump the ring over the console as hex lines.
+// The host replay tool accepts the captured monitor log directly.
+static void trace_dump(void)
+{
+    uint8_t line[TRACE_DUMP_LINE_BYTES];
+    uint32_t total = 0;
+    uint32_t offset = 0;
+
+    int length = trace_read(TRACE_READER_CONSOLE, offset, line, sizeof(line), &total);
+    if (length == TRACE_READ_BUSY)
+    {
+        printf("TRACE BUSY\n");
+        return;
+    }
+    printf("TRACE BEGIN %lu\n", (unsigned long)trace_read_count);
+    while (length > 0)
+    {
+        for (int i = 0; i < length; i++)
+        {
+            printf("%02x", line[i]);
+        }
+        printf("\n");
+        offset += length;
+        length = (offset < total) ? trace_read(TRACE_READER_CONSOLE, offset, line, sizeof(line), NULL) : 0;
+    }
+    printf("TRACE END\n");
+}
+
+// Request a dump from any task.
+void trace_request_dump(void)
+{
+    if (trace_task_handle != NULL)
+    {
+        xTaskNotifyGive(trace_task_handle);
+    }
+}
+
+// Trace task, sleeps until a dump is requested and resumes capture after an abandoned read.
+void trace_task(void *arg)
+{
+    trace_task_handle = xTaskGetCurrentTaskHandle();
+
+    while (1)
+    {
+        bool requested = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TRACE_READ_IDLE_TIMEOUT_MS)) != 0;
+        if (TRACE_ENABLED)
+        {
+            trace_read_expire();
+            if (requested)
+            {
+                trace_dump();
+            }
+        }
+    }
+}
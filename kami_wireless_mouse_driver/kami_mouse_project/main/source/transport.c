@@ -0,0 +1,236 @@
+#include "header/transport.h"
+#include "header/heap_guard.h"
+#include "header/macro.h"
+#include "header/power.h"
+#include "header/radio_link.h"
+#include "header/settings.h"
+#include "header/telemetry.h"
+#include "header/trace.h"
+
+#include "freertos/semphr.h"
+
+static bool transport_usb_available(void *context);
+static bool transport_usb_ready(void *context);
+static bool transport_usb_submit(void *context, const transport_report_t *report);
+static bool transport_radio_available(void *context);
+static bool transport_radio_ready(void *context);
+static bool transport_radio_submit(void *context, const transport_report_t *report);
+static void transport_count(const transport_report_t *report, bool sent);
+static void transport_poll(void);
+#if TRACE_ENABLED
+static void transport_trace(const transport_report_t *report);
+#endif
+
+static const transport_t transport_backends[TRANSPORT_COUNT] = {
+    [TRANSPORT_USB] = {
+        .name = "USB",
+        .available = transport_usb_available,
+        .ready = transport_usb_ready,
+        .submit = transport_usb_submit,
+    },
+    [TRANSPORT_RADIO] = {
+        .name = "radio",
+        .available = transport_radio_available,
+        .ready = transport_radio_ready,
+        .submit = transport_radio_submit,
+    },
+};
+
+static transport_mux_t transport_mux;
+// The input tasks and the transport task all submit through the mux.
+static SemaphoreHandle_t transport_mutex = NULL;
+static StaticSemaphore_t transport_mutex_buffer;
+// Button map tables and the settings generation they were built from, guarded by transport_mutex.
+static input_remap_t transport_remap;
+static uint32_t transport_remap_generation = 0;
+// HID buttons held by the macro being played.
+static uint8_t transport_macro_buttons = 0;
+static TaskHandle_t transport_task_handle = NULL;
+
+/************* Backends ****************/
+
+// A suspended bus looks the same as a pulled cable, unless the host allowed remote wakeup.
+// The host is then asleep and expects its mouse to wake it, so reports wait for the resume instead of moving to the radio.
+static bool transport_usb_available(void *context)
+{
+    return tud_mounted() && (!tud_suspended() || power_remote_wakeup_armed());
+}
+
+// The IN endpoint holds one report, TinyUSB reports its completion through tud_hid_report_complete_cb.
+// Not ready while suspended.
+static bool transport_usb_ready(void *context)
+{
+    return tud_hid_ready();
+}
+
+static bool transport_usb_submit(void *context, const transport_report_t *report)
+{
+#if TRANSPORT_MOTION_16BIT
+    const transport_usb_report_t usb_report = {
+        .buttons = report->buttons,
+        .x = report->x,
+        .y = report->y,
+        .wheel = report->wheel,
+        .pan = report->pan,
+    };
+    bool sent = tud_hid_report(HID_ITF_PROTOCOL_MOUSE, &usb_report, sizeof(usb_report));
+#else
+    bool sent = tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE, report->buttons, report->x, report->y, report->wheel, report->pan);
+#endif
+    transport_count(report, sent);
+    return sent;
+}
+
+static bool transport_radio_available(void *context)
+{
+    return radio_link_available();
+}
+
+// The radio link packs reports into its next packet, so it always takes one.
+static bool transport_radio_ready(void *context)
+{
+    return true;
+}
+
+static bool transport_radio_submit(void *context, const transport_report_t *report)
+{
+    bool sent = radio_link_report(report->buttons, report->x, report->y, report->wheel, report->pan);
+    transport_count(report, sent);
+    return sent;
+}
+
+static void transport_count(const transport_report_t *report, bool sent)
+{
+    if (sent)
+    {
+        TELEMETRY_COUNT(reports_sent);
+        telemetry_boot_report(report->buttons, report->x, report->y);
+        power_report_sent();
+    }
+    else
+    {
+        TELEMETRY_COUNT(reports_failed);
+    }
+}
+
+/************* Mux ****************/
+
+#if TRACE_ENABLED
+// Trace the reports as the mux hands them to the active backend, so a replay sees what the host was sent.
+static void HOT_PATH transport_trace(const transport_report_t *report)
+{
+    trace_record_report(report->buttons, report->x, report->y, report->wheel, report->pan);
+}
+#endif
+
+void transport_init(void)
+{
+    transport_mux_init(&transport_mux, transport_backends, TRANSPORT_COUNT);
+#if TRACE_ENABLED
+    transport_mux.observe = transport_trace;
+#endif
+    transport_mutex = xSemaphoreCreateMutexStatic(&transport_mutex_buffer);
+    settings_t current;
+    transport_remap_generation = settings_snapshot(&current);
+    input_remap_build(&transport_remap, current.button_map);
+    ESP_LOGI(TAG, "USB transport_init");
+}
+
+// Poll the mux, the caller holds transport_mutex.
+static void HOT_PATH transport_poll(void)
+{
+    transport_mux_poll(&transport_mux, esp_timer_get_time());
+
+    telemetry_counters.transport_switches = transport_mux.switches;
+    telemetry_counters.transport_switch_last_us = transport_mux.switch_last_us;
+    telemetry_counters.transport_switch_max_us = transport_mux.switch_max_us;
+    telemetry_counters.transport_stale_motion = transport_mux.stale_motion_dropped;
+    telemetry_counters.transport_motion_merged = transport_mux.motion_merged;
+    telemetry_counters.transport_motion_recovered = transport_mux.motion_recovered;
+    power_reports_pending(transport_mux_pending(&transport_mux));
+}
+
+// Press or release a physical button, the report carries the full button state.
+// The button map turns the held buttons into HID buttons with one table lookup.
+void HOT_PATH transport_report_button(input_button_t button, bool pressed)
+{
+    power_activity();
+    xSemaphoreTake(transport_mutex, portMAX_DELAY);
+    // A changed map is picked up here, so the tables and the held buttons always change together.
+    if (transport_remap_generation != settings_generation)
+    {
+        settings_t current;
+        transport_remap_generation = settings_snapshot(&current);
+        input_remap_build(&transport_remap, current.button_map);
+    }
+    uint8_t buttons = input_remap_button(&transport_remap, button, pressed);
+    if (pressed && transport_remap.macros[button] != INPUT_REMAP_NONE)
+    {
+        macro_trigger(transport_remap.macros[button]);
+    }
+    transport_mux_buttons(&transport_mux, buttons | transport_macro_buttons);
+    transport_poll();
+    xSemaphoreGive(transport_mutex);
+}
+
+// Report motion or scrolling, it is merged with earlier motion the transport has not taken yet.
+void HOT_PATH transport_report_motion(int16_t x, int16_t y, int8_t wheel, int8_t pan)
+{
+    power_activity();
+    xSemaphoreTake(transport_mutex, portMAX_DELAY);
+    transport_mux_motion(&transport_mux, x, y, wheel, pan, esp_timer_get_time());
+    transport_poll();
+    xSemaphoreGive(transport_mutex);
+}
+
+// Play a macro step, the buttons the macro holds are added to those of the button map.
+void HOT_PATH transport_report_macro(const input_macro_step_t *step, uint8_t buttons)
+{
+    bool move = step->op == INPUT_MACRO_MOVE;
+    bool wheel = step->op == INPUT_MACRO_WHEEL;
+    int16_t x = move ? step->x : 0;
+    int16_t y = move ? step->y : 0;
+    int8_t wheel_steps = wheel ? step->wheel : 0;
+    int8_t pan = wheel ? step->pan : 0;
+
+    power_activity();
+    xSemaphoreTake(transport_mutex, portMAX_DELAY);
+    transport_macro_buttons = buttons;
+    transport_mux_buttons(&transport_mux, transport_remap.buttons[transport_remap.held] | buttons);
+    transport_mux_motion(&transport_mux, x, y, wheel_steps, pan, esp_timer_get_time());
+    transport_poll();
+    xSemaphoreGive(transport_mutex);
+}
+
+// Wake the transport task after a report completed or a link went up or down.
+void transport_notify(void)
+{
+    if (transport_task_handle != NULL)
+    {
+        xTaskNotifyGive(transport_task_handle);
+    }
+}
+
+// Task that drains merged motion as the backends complete reports and moves the stream between transports.
+void transport_task(void *arg)
+{
+    transport_task_handle = xTaskGetCurrentTaskHandle();
+    heap_guard_watch();
+    // Switches also happen on the input tasks' polls, they are logged here and not on the hot path.
+    int logged = TRANSPORT_NONE;
+    while (1)
+    {
+        power_wait_active();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TRANSPORT_POLL_MS));
+        TELEMETRY_COUNT(task_wakeups);
+        xSemaphoreTake(transport_mutex, portMAX_DELAY);
+        transport_poll();
+        int active = transport_mux.active;
+        xSemaphoreGive(transport_mutex);
+        if (active != logged)
+        {
+            logged = active;
+            ESP_LOGI(TAG, "Transport: %s", active == TRANSPORT_NONE ? "none" : transport_backends[active].name);
+        }
+    }
+}
@@ -0,0 +1,252 @@
+#include "header/transport_mux.h"
+
+static int transport_mux_select(const transport_mux_t *mux);
+static void transport_mux_recover(transport_mux_t *mux);
+static void transport_mux_switch(transport_mux_t *mux, int next, uint32_t now_us);
+static int32_t transport_mux_take(int32_t *value, int32_t limit);
+
+void transport_mux_init(transport_mux_t *mux, const transport_t *transports, int count)
+{
+    mux->transports = transports;
+    mux->count = count < TRANSPORT_MAX ? count : TRANSPORT_MAX;
+    mux->active = TRANSPORT_NONE;
+    mux->observe = NULL;
+    mux->buttons = 0;
+    mux->x = 0;
+    mux->y = 0;
+    mux->wheel = 0;
+    mux->pan = 0;
+    mux->motion_pending = false;
+    mux->motion_us = 0;
+    mux->sent_buttons = 0;
+    mux->buttons_dirty = false;
+    mux->release = TRANSPORT_NONE;
+    mux->inflight = TRANSPORT_NONE;
+    mux->inflight_x = 0;
+    mux->inflight_y = 0;
+    mux->inflight_wheel = 0;
+    mux->inflight_pan = 0;
+    mux->inflight_us = 0;
+    mux->switching = false;
+    mux->switch_start_us = 0;
+    mux->switches = 0;
+    mux->switch_last_us = 0;
+    mux->switch_max_us = 0;
+    mux->stale_motion_dropped = 0;
+    mux->motion_merged = 0;
+    mux->motion_recovered = 0;
+    mux->submitted = 0;
+    mux->submit_failed = 0;
+}
+
+/************* Input ****************/
+
+// Press or release the buttons in mask.
+void HOT_PATH transport_mux_button(transport_mux_t *mux, uint8_t mask, bool pressed)
+{
+    mux->buttons = pressed ? (mux->buttons | mask) : (mux->buttons & ~mask);
+}
+
+// Set the held buttons, the whole state at once.
+void HOT_PATH transport_mux_buttons(transport_mux_t *mux, uint8_t buttons)
+{
+    mux->buttons = buttons;
+}
+
+// Add motion, it is merged with any motion the transport has not taken yet.
+void HOT_PATH transport_mux_motion(transport_mux_t *mux, int16_t x, int16_t y, int8_t wheel, int8_t pan, uint32_t now_us)
+{
+    if (x == 0 && y == 0 && wheel == 0 && pan == 0)
+    {
+        return;
+    }
+    if (!mux->motion_pending)
+    {
+        mux->motion_pending = true;
+        mux->motion_us = now_us;
+    }
+    else
+    {
+        mux->motion_merged++;
+    }
+    mux->x += x;
+    mux->y += y;
+    mux->wheel += wheel;
+    mux->pan += pan;
+}
+
+// True if there is a button change or motion the active transport has not been sent.
+bool HOT_PATH transport_mux_pending(const transport_mux_t *mux)
+{
+    return mux->motion_pending || mux->buttons_dirty || mux->buttons != mux->sent_buttons ||
+           mux->release != TRANSPORT_NONE;
+}
+
+/************* Output ****************/
+
+// The first available transport in order of preference.
+static int HOT_PATH transport_mux_select(const transport_mux_t *mux)
+{
+    for (int i = 0; i < mux->count; i++)
+    {
+        const transport_t *transport = &mux->transports[i];
+        if (transport->available(transport->context))
+        {
+            return i;
+        }
+    }
+    return TRANSPORT_NONE;
+}
+
+// Take back the motion of the last report if its transport went away before completing it.
+// The host on the other end never got it, e.g. a USB report queued after the cable was pulled.
+static void transport_mux_recover(transport_mux_t *mux)
+{
+    const transport_t *transport = &mux->transports[mux->inflight];
+    if (!transport->available(transport->context))
+    {
+        if (!mux->motion_pending || (int32_t)(mux->motion_us - mux->inflight_us) > 0)
+        {
+            mux->motion_us = mux->inflight_us;
+        }
+        mux->x += mux->inflight_x;
+        mux->y += mux->inflight_y;
+        mux->wheel += mux->inflight_wheel;
+        mux->pan += mux->inflight_pan;
+        mux->motion_pending = mux->x != 0 || mux->y != 0 || mux->wheel != 0 || mux->pan != 0;
+        mux->motion_recovered++;
+    }
+    mux->inflight = TRANSPORT_NONE;
+}
+
+// Move the report stream to another transport.
+static void transport_mux_switch(transport_mux_t *mux, int next, uint32_t now_us)
+{
+    if (mux->inflight != TRANSPORT_NONE)
+    {
+        transport_mux_recover(mux);
+    }
+
+    // The old host may still be listening, e.g. the dongle after the cable is plugged in.
+    if (mux->active != TRANSPORT_NONE && mux->sent_buttons != 0)
+    {
+        mux->release = mux->active;
+    }
+
+    mux->active = next;
+    mux->switches++;
+    mux->switching = next != TRANSPORT_NONE;
+    mux->switch_start_us = now_us;
+    // The new host has not seen the held buttons yet.
+    mux->sent_buttons = 0;
+    mux->buttons_dirty = true;
+
+    if (mux->motion_pending && (uint32_t)(now_us - mux->motion_us) > TRANSPORT_STALE_MOTION_US)
+    {
+        mux->x = 0;
+        mux->y = 0;
+        mux->wheel = 0;
+        mux->pan = 0;
+        mux->motion_pending = false;
+        mux->stale_motion_dropped++;
+    }
+}
+
+// Take as much of an accumulated delta as fits in one report.
+static int32_t HOT_PATH transport_mux_take(int32_t *value, int32_t limit)
+{
+    int32_t step = *value > limit ? limit : (*value < -limit ? -limit : *value);
+    *value -= step;
+    return step;
+}
+
+// Follow transport availability and submit pending reports while the active transport is ready.
+// Call whenever input arrives, a backend completes a report or a link goes up or down.
+// Returns the number of reports submitted.
+int HOT_PATH transport_mux_poll(transport_mux_t *mux, uint32_t now_us)
+{
+    // A transport that is ready again has completed the last report.
+    if (mux->inflight != TRANSPORT_NONE && mux->transports[mux->inflight].ready(mux->transports[mux->inflight].context))
+    {
+        mux->inflight = TRANSPORT_NONE;
+    }
+    int next = transport_mux_select(mux);
+    if (next != mux->active)
+    {
+        transport_mux_switch(mux, next, now_us);
+    }
+
+    if (mux->release != TRANSPORT_NONE)
+    {
+        const transport_t *old = &mux->transports[mux->release];
+        if (!old->available(old->context) || mux->release == mux->active)
+        {
+            mux->release = TRANSPORT_NONE;
+        }
+        else if (old->ready(old->context))
+        {
+            transport_report_t release = {0};
+            old->submit(old->context, &release);
+            mux->release = TRANSPORT_NONE;
+        }
+    }
+
+    if (mux->active == TRANSPORT_NONE)
+    {
+        return 0;
+    }
+
+    const transport_t *transport = &mux->transports[mux->active];
+    int submitted = 0;
+    while ((mux->motion_pending || mux->buttons_dirty || mux->buttons != mux->sent_buttons) &&
+           transport->ready(transport->context))
+    {
+        int32_t x = mux->x;
+        int32_t y = mux->y;
+        int32_t wheel = mux->wheel;
+        int32_t pan = mux->pan;
+        transport_report_t report = {
+            .buttons = mux->buttons,
+            .x = transport_mux_take(&x, TRANSPORT_MOTION_MAX),
+            .y = transport_mux_take(&y, TRANSPORT_MOTION_MAX),
+            .wheel = transport_mux_take(&wheel, TRANSPORT_WHEEL_MAX),
+            .pan = transport_mux_take(&pan, TRANSPORT_WHEEL_MAX),
+        };
+        if (!transport->submit(transport->context, &report))
+        {
+            mux->submit_failed++;
+            break;
+        }
+        if (mux->observe != NULL)
+        {
+            mux->observe(&report);
+        }
+        mux->inflight = mux->active;
+        mux->inflight_x = report.x;
+        mux->inflight_y = report.y;
+        mux->inflight_wheel = report.wheel;
+        mux->inflight_pan = report.pan;
+        mux->inflight_us = mux->motion_us;
+
+        mux->x = x;
+        mux->y = y;
+        mux->wheel = wheel;
+        mux->pan = pan;
+        mux->motion_pending = x != 0 || y != 0 || wheel != 0 || pan != 0;
+        mux->sent_buttons = report.buttons;
+        mux->buttons_dirty = false;
+        mux->submitted++;
+        submitted++;
+
+        if (mux->switching)
+        {
+            mux->switching = false;
+            mux->switch_last_us = now_us - mux->switch_start_us;
+            if (mux->switch_last_us > mux->switch_max_us)
+            {
+                mux->switch_max_us = mux->switch_last_us;
+            }
+        }
+    }
+    return submitted;
+}
@@ -0,0 +1,176 @@
+#include "header/ulp_mailbox.h"
+#ifndef IS_ULP_COCPU
+#include "header/input_pipeline.h"
+#endif
+
+/************* ULP Side ****************/
+
+// Start a scan period, the levels the main CPU last saw are the rest levels.
+void ulp_mailbox_arm(ulp_mailbox_t *mailbox, uint32_t mask, uint32_t wheel_mask, uint32_t rest)
+{
+    mailbox->mask = mask;
+    mailbox->wheel_mask = wheel_mask & mask;
+    mailbox->rest = rest & mask;
+    mailbox->busy = 0;
+    mailbox->scans = 0;
+    mailbox->pins = mailbox->rest;
+    mailbox->held = 0;
+    mailbox->wheel_toggled = 0;
+    mailbox->woken = 0;
+    mailbox->glitches = 0;
+    mailbox->overflows = 0;
+    mailbox->count = 0;
+}
+
+// One scan of the pins, called by the ULP every scan period.
+// Returns true once there is real input and the main CPU should wake: a button pin held a new level for
+// ULP_MAILBOX_CONFIRM_SCANS scans, or both wheel phases changed, which only a step does.
+// Changes that go back to the rest levels before that were glitches and are dropped.
+bool ulp_mailbox_scan(ulp_mailbox_t *mailbox, uint32_t levels)
+{
+    uint32_t pins = levels & mailbox->mask;
+    uint32_t changed = pins ^ mailbox->pins;
+    mailbox->scans++;
+    if (changed)
+    {
+        uint32_t slot = mailbox->count;
+        if (slot < ULP_MAILBOX_EVENTS)
+        {
+            mailbox->count++;
+        }
+        else
+        {
+            slot = ULP_MAILBOX_EVENTS - 1;
+            mailbox->overflows++;
+        }
+        mailbox->events[slot].scan = mailbox->scans;
+        mailbox->events[slot].pins = pins;
+        mailbox->pins = pins;
+        mailbox->held = 0;
+        mailbox->wheel_toggled |= changed & mailbox->wheel_mask;
+    }
+    else
+    {
+        mailbox->held++;
+    }
+
+    // Once woken the ULP only records until the main CPU takes the pins back.
+    if (mailbox->woken)
+    {
+        return false;
+    }
+    if (pins == mailbox->rest)
+    {
+        if (mailbox->count)
+        {
+            mailbox->glitches++;
+            mailbox->count = 0;
+        }
+        mailbox->wheel_toggled = 0;
+        return false;
+    }
+    bool wheel_step = mailbox->wheel_mask && mailbox->wheel_toggled == mailbox->wheel_mask;
+    bool button = ((pins ^ mailbox->rest) & ~mailbox->wheel_mask) && mailbox->held + 1 >= ULP_MAILBOX_CONFIRM_SCANS;
+    if (wheel_step || button)
+    {
+        mailbox->woken = 1;
+        return true;
+    }
+    return false;
+}
+
+#ifndef IS_ULP_COCPU
+
+/************* Main CPU Side ****************/
+
+static int ulp_level(uint32_t pins, uint8_t pin)
+{
+    return (pins >> pin) & 1;
+}
+
+// All pins of the watched inputs.
+uint32_t ulp_mailbox_mask(const ulp_pins_t *map)
+{
+    uint32_t mask = 1u << map->wheel_a | 1u << map->wheel_b;
+    for (int i = 0; i < ULP_LATCH_BUTTONS; i++)
+    {
+        mask |= 1u << map->latch_no[i] | 1u << map->latch_nc[i];
+    }
+    for (int i = 0; i < ULP_DEBOUNCED_BUTTONS; i++)
+    {
+        mask |= 1u << map->debounced[i];
+    }
+    return mask;
+}
+
+// Time of a change, counted back from the last scan. The scan period is the ULP timer period,
+// so the times are early by up to the run time of the scans in between.
+uint32_t ulp_mailbox_event_us(const ulp_mailbox_t *mailbox, const ulp_event_t *event, uint32_t now_us, uint32_t period_us)
+{
+    return now_us - (mailbox->scans - event->scan) * period_us;
+}
+
+// Start decoding from the levels and main button states at handover.
+void ulp_decoder_init(ulp_decoder_t *decoder, const ulp_pins_t *map, uint32_t pins, const mouse_button_state_t *latch)
+{
+    decoder->map = map;
+    decoder->pins = pins;
+    for (int i = 0; i < ULP_LATCH_BUTTONS; i++)
+    {
+        decoder->latch[i] = latch[i];
+    }
+    decoder->wheel_dir = 0;
+}
+
+// Decode one change of the levels into inputs, in the order the input tasks would have seen them.
+// Returns the number of inputs written, at most ULP_INPUTS_PER_EVENT.
+int ulp_decoder_change(ulp_decoder_t *decoder, uint32_t pins, uint32_t time_us, ulp_input_t *inputs)
+{
+    const ulp_pins_t *map = decoder->map;
+    uint32_t changed = pins ^ decoder->pins;
+    int count = 0;
+    for (int i = 0; i < ULP_LATCH_BUTTONS; i++)
+    {
+        if (!(changed & (1u << map->latch_no[i] | 1u << map->latch_nc[i])))
+        {
+            continue;
+        }
+        mouse_button_state_t state = input_latch_state(ulp_level(pins, map->latch_no[i]), ulp_level(pins, map->latch_nc[i]),
+                                                       decoder->latch[i]);
+        if (state != decoder->latch[i])
+        {
+            decoder->latch[i] = state;
+            inputs[count++] = (ulp_input_t){.time_us = time_us, .kind = ULP_INPUT_LATCH, .index = i, .value = state};
+        }
+    }
+    for (int i = 0; i < ULP_DEBOUNCED_BUTTONS; i++)
+    {
+        if (changed & 1u << map->debounced[i])
+        {
+            inputs[count++] = (ulp_input_t){.time_us = time_us, .kind = ULP_INPUT_EDGE, .index = i,
+                                            .value = ulp_level(pins, map->debounced[i])};
+        }
+    }
+
+    bool a_changed = changed & 1u << map->wheel_a;
+    bool b_changed = changed & 1u << map->wheel_b;
+    int steps = 0;
+    if (a_changed && b_changed)
+    {
+        // Both edges fell into one scan, their order is lost. The wheel most likely kept turning the same way.
+        steps = 2 * decoder->wheel_dir;
+    }
+    else if (a_changed || b_changed)
+    {
+        decoder->wheel_dir = input_quadrature_step(a_changed, ulp_level(pins, map->wheel_a), ulp_level(pins, map->wheel_b));
+        steps = decoder->wheel_dir;
+    }
+    if (a_changed || b_changed)
+    {
+        inputs[count++] = (ulp_input_t){.time_us = time_us, .kind = ULP_INPUT_WHEEL, .value = steps};
+    }
+    decoder->pins = pins;
+    return count;
+}
+
+#endif
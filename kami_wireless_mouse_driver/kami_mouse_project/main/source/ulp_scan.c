@@ -0,0 +1,163 @@
+#include "header/ulp_scan.h"
+#include "header/eager_debounce_switch.h"
+#include "header/latch_switch.h"
+#include "header/power.h"
+#include "header/scroll_wheel.h"
+#include "header/telemetry.h"
+
+#if ULP_SCAN
+
+static void ulp_scan_isr(void *arg);
+static void ulp_scan_apply(ulp_decoder_t *decoder, uint32_t pins, uint32_t time_us);
+
+// The ULP program, built from main/ulp by ulp_embed_binary.
+extern const uint8_t ulp_kami_scan_bin_start[] asm("_binary_ulp_kami_scan_bin_start");
+extern const uint8_t ulp_kami_scan_bin_end[] asm("_binary_ulp_kami_scan_bin_end");
+
+// The mailbox in RTC slow memory, shared with the ULP program.
+static ulp_mailbox_t *const ulp_scan_mailbox = (ulp_mailbox_t *)&ulp_mailbox;
+
+// The same pins the input tasks use, in the order their replay functions index them.
+static const ulp_pins_t ulp_scan_pins = {
+    .latch_no = {GPIO_NUM_4, GPIO_NUM_6},
+    .latch_nc = {GPIO_NUM_5, GPIO_NUM_7},
+    .debounced = {GPIO_NUM_10, GPIO_NUM_18, GPIO_NUM_19},
+    .wheel_a = GPIO_NUM_11,
+    .wheel_b = GPIO_NUM_12,
+};
+
+static uint32_t ulp_scan_mask = 0;
+static bool ulp_scan_running = false;
+
+// Load the ULP program, it is started by the power task when it parks the input tasks for light sleep.
+void ulp_scan_init(void)
+{
+    ulp_scan_mask = ulp_mailbox_mask(&ulp_scan_pins);
+    ESP_ERROR_CHECK(ulp_riscv_load_binary(ulp_kami_scan_bin_start, ulp_kami_scan_bin_end - ulp_kami_scan_bin_start));
+    ESP_ERROR_CHECK(ulp_set_wakeup_period(0, ULP_SCAN_PERIOD_US));
+    ESP_ERROR_CHECK(ulp_riscv_isr_register(ulp_scan_isr, NULL, ULP_RISCV_SW_INTR));
+    ESP_ERROR_CHECK(esp_sleep_enable_ulp_wakeup());
+    ESP_LOGI(TAG, "USB ulp_scan_init");
+}
+
+// Raised by the ULP program with ulp_riscv_trigger_sw_intr when it wakes the main CPU, this is the wake the button
+// and wheel ISRs give without it. Without the interrupt the CPU wakes but the power task stays blocked.
+static void ulp_scan_isr(void *arg)
+{
+    power_wake_from_isr();
+}
+
+// True for the pins the ULP watches while it runs.
+bool ulp_scan_owns(gpio_num_t pin)
+{
+    return ulp_scan_running && (ulp_scan_mask & BIT(pin));
+}
+
+// Hand the buttons and the wheel to the ULP, their edge interrupts stay off until ulp_scan_stop.
+// The levels now are the rest levels, the ULP wakes the main CPU once they change for real.
+void ulp_scan_start(void)
+{
+    if (ulp_scan_running)
+    {
+        return;
+    }
+    uint32_t rest = 0;
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++)
+    {
+        if (!(ulp_scan_mask & BIT(pin)))
+        {
+            continue;
+        }
+        gpio_intr_disable(pin);
+        rest |= (uint32_t)gpio_get_level(pin) << pin;
+        rtc_gpio_init(pin);
+        rtc_gpio_set_direction(pin, RTC_GPIO_MODE_INPUT_ONLY);
+        rtc_gpio_pullup_en(pin);
+        rtc_gpio_pulldown_dis(pin);
+    }
+    ulp_mailbox_arm(ulp_scan_mailbox, ulp_scan_mask, BIT(ulp_scan_pins.wheel_a) | BIT(ulp_scan_pins.wheel_b), rest);
+    ESP_ERROR_CHECK(ulp_riscv_run());
+    ulp_scan_running = true;
+    TELEMETRY_COUNT(ulp_handovers);
+}
+
+// Take the pins back and replay what the ULP saw, in order and with the times of the scans that saw it.
+// Called by the power task before it releases the input tasks. The latch and wheel changes are reported here,
+// the debounced pins go through their debouncers. Changes after the last scan are picked up from the live levels.
+void ulp_scan_stop(void)
+{
+    if (!ulp_scan_running)
+    {
+        return;
+    }
+    ulp_riscv_timer_stop();
+    // A scan that already started finishes, its changes are kept.
+    for (int waited = 0; ulp_scan_mailbox->busy && waited < ULP_SCAN_BUSY_TIMEOUT_US; waited += 10)
+    {
+        esp_rom_delay_us(10);
+    }
+    ulp_scan_running = false;
+    uint32_t now_us = esp_timer_get_time();
+
+    ulp_decoder_t decoder;
+    mouse_button_state_t latch[ULP_LATCH_BUTTONS] = {mb_latch_state(0), mb_latch_state(1)};
+    ulp_decoder_init(&decoder, &ulp_scan_pins, ulp_scan_mailbox->rest, latch);
+    uint32_t count = ulp_scan_mailbox->count;
+    for (uint32_t i = 0; i < count && i < ULP_MAILBOX_EVENTS; i++)
+    {
+        const ulp_event_t *event = &ulp_scan_mailbox->events[i];
+        ulp_scan_apply(&decoder, event->pins, ulp_mailbox_event_us(ulp_scan_mailbox, event, now_us, ULP_SCAN_PERIOD_US));
+    }
+    TELEMETRY_ADD(ulp_events, count);
+    TELEMETRY_ADD(ulp_glitches, ulp_scan_mailbox->glitches);
+    TELEMETRY_ADD(ulp_overflows, ulp_scan_mailbox->overflows);
+    if (ulp_scan_mailbox->woken)
+    {
+        TELEMETRY_COUNT(ulp_wakes);
+    }
+
+    // Back on the GPIO matrix with the edge interrupts on, an edge from here on reaches the ISRs.
+    // An edge between the last scan and now is in the live levels, the replay functions skip what an ISR already saw.
+    uint32_t levels = 0;
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++)
+    {
+        if (ulp_scan_mask & BIT(pin))
+        {
+            rtc_gpio_deinit(pin);
+            gpio_intr_enable(pin);
+        }
+    }
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++)
+    {
+        if (ulp_scan_mask & BIT(pin))
+        {
+            levels |= (uint32_t)gpio_get_level(pin) << pin;
+        }
+    }
+    ulp_scan_apply(&decoder, levels, esp_timer_get_time());
+}
+
+// Send the inputs of one change to the modules that own the pins.
+static void ulp_scan_apply(ulp_decoder_t *decoder, uint32_t pins, uint32_t time_us)
+{
+    ulp_input_t inputs[ULP_INPUTS_PER_EVENT];
+    int count = ulp_decoder_change(decoder, pins, time_us, inputs);
+    for (int i = 0; i < count; i++)
+    {
+        switch (inputs[i].kind)
+        {
+        case ULP_INPUT_LATCH:
+            mb_latch_replay(inputs[i].index, inputs[i].value, inputs[i].time_us);
+            break;
+        case ULP_INPUT_EDGE:
+            button_debounce_replay(inputs[i].index, inputs[i].value, inputs[i].time_us);
+            break;
+        case ULP_INPUT_WHEEL:
+            swheel_replay(inputs[i].value, (pins >> ulp_scan_pins.wheel_a) & 1, (pins >> ulp_scan_pins.wheel_b) & 1,
+                          inputs[i].time_us);
+            break;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,512 @@
+#include "header/vendor_report.h"
+#include "header/settings.h"
+#include "header/telemetry.h"
+#include "header/trace.h"
+#include "header/profiler.h"
+#include "header/frame_capture.h"
+#include "header/power.h"
+
+static vendor_status_t vendor_get_settings(const uint8_t *tags, uint8_t length);
+static vendor_status_t vendor_set_settings(const uint8_t *tlvs, uint8_t length);
+static vendor_status_t vendor_read_block(const uint8_t *payload, uint8_t length);
+static vendor_status_t vendor_read_snapshot(const void *block, uint32_t block_size, uint32_t offset);
+static vendor_status_t vendor_write_block(const uint8_t *payload, uint8_t length);
+static vendor_status_t vendor_apply_upload(uint8_t block);
+static void vendor_energy_snapshot(energy_report_t *report);
+
+// Response to the last request, returned by GET_REPORT(Feature).
+static uint8_t vendor_response[VENDOR_REPORT_SIZE];
+
+// Block snapshots, taken when offset 0 is read so a multi report read is consistent.
+static union
+{
+    telemetry_counters_t counters;
+    telemetry_latency_histograms_t histograms;
+    telemetry_boot_times_t boot;
+    profiler_stats_t tasks;
+    switch_wear_stats_t switches;
+    input_macro_table_t macros;
+    sensor_link_report_t link;
+    energy_costs_t energy_costs;
+    energy_report_t energy;
+} vendor_snapshot;
+
+// Block being written and the offset the next chunk has to start at.
+static union
+{
+    input_macro_table_t macros;
+    energy_costs_t energy_costs;
+} vendor_upload;
+static uint8_t vendor_upload_block = 0;
+static uint32_t vendor_upload_offset = 0;
+
+static uint16_t vendor_read_u16(const uint8_t *in)
+{
+    return in[0] | in[1] << 8;
+}
+
+static void vendor_write_u16(uint8_t *out, uint16_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static void vendor_write_u32(uint8_t *out, uint32_t value)
+{
+    vendor_write_u16(out, (uint16_t)value);
+    vendor_write_u16(&out[2], (uint16_t)(value >> 16));
+}
+
+// Response payload helpers.
+static uint8_t *vendor_response_payload(void)
+{
+    return &vendor_response[VENDOR_RESPONSE_HEADER_SIZE];
+}
+
+static void vendor_response_length(uint8_t length)
+{
+    vendor_response[3] = length;
+}
+
+// Answer a GET with the TLVs of the requested tags.
+static vendor_status_t vendor_get_settings(const uint8_t *tags, uint8_t length)
+{
+    uint8_t *out = vendor_response_payload();
+    uint8_t used = 0;
+    // Every tag of the batch answers from the same profile.
+    settings_t current;
+    settings_snapshot(&current);
+    for (int i = 0; i < length; i++)
+    {
+        uint8_t tag = tags[i];
+        uint8_t value_length = vendor_tag_length(tag);
+        if (value_length == 0)
+        {
+            return VENDOR_STATUS_UNKNOWN_TAG;
+        }
+        if (used + 2 + value_length > VENDOR_RESPONSE_PAYLOAD_MAX)
+        {
+            return VENDOR_STATUS_BAD_LENGTH;
+        }
+
+        uint8_t *value = &out[used + 2];
+        out[used] = tag;
+        out[used + 1] = value_length;
+        switch (tag)
+        {
+        case VENDOR_TAG_CPI:
+            vendor_write_u16(value, current.cpi);
+            break;
+        case VENDOR_TAG_REPORT_RATE_US:
+            vendor_write_u16(value, current.report_rate_us);
+            break;
+        case VENDOR_TAG_SENSOR_MODE:
+            *value = current.sensor_mode;
+            break;
+        case VENDOR_TAG_DEBOUNCE_MS:
+            *value = current.debounce_ms;
+            break;
+        case VENDOR_TAG_SCROLL_SPEED_MIN:
+            *value = current.scroll_speed_min;
+            break;
+        case VENDOR_TAG_SCROLL_SPEED_MAX:
+            *value = current.scroll_speed_max;
+            break;
+        case VENDOR_TAG_SCROLL_PAUSE_MS:
+            vendor_write_u16(value, current.scroll_pause_ms);
+            break;
+        case VENDOR_TAG_SCROLL_ACCEL:
+            *value = current.scroll_accel;
+            break;
+        case VENDOR_TAG_PROFILE:
+            *value = settings_active_profile();
+            break;
+        case VENDOR_TAG_POWER_IDLE_MS:
+            vendor_write_u16(value, current.power_idle_ms);
+            break;
+        case VENDOR_TAG_POWER_SLEEP_MS:
+            vendor_write_u16(value, current.power_sleep_ms);
+            break;
+        case VENDOR_TAG_REST_RUN_MS:
+            vendor_write_u16(value, current.rest_run_ms);
+            break;
+        case VENDOR_TAG_REST1_MS:
+            vendor_write_u16(value, current.rest1_ms);
+            break;
+        case VENDOR_TAG_REST2_MS:
+            vendor_write_u16(value, current.rest2_ms);
+            break;
+        case VENDOR_TAG_REST1_PERIOD_MS:
+            *value = current.rest1_period_ms;
+            break;
+        case VENDOR_TAG_REST2_PERIOD_MS:
+            *value = current.rest2_period_ms;
+            break;
+        case VENDOR_TAG_REST3_PERIOD_MS:
+            *value = current.rest3_period_ms;
+            break;
+        case VENDOR_TAG_DEBOUNCE_MIN_MS:
+            *value = current.debounce_min_ms;
+            break;
+        case VENDOR_TAG_BUTTON_MAP:
+            memcpy(value, current.button_map, sizeof(current.button_map));
+            break;
+        }
+        used += 2 + value_length;
+    }
+    vendor_response_length(used);
+    return VENDOR_STATUS_OK;
+}
+
+// Apply a batch of TLVs, either all of them or none.
+static vendor_status_t vendor_set_settings(const uint8_t *tlvs, uint8_t length)
+{
+    uint8_t profile = settings_active_profile();
+    settings_t candidate;
+    settings_get_profile(profile, &candidate);
+    uint8_t used = 0;
+    while (used < length)
+    {
+        if (used + 2 > length)
+        {
+            return VENDOR_STATUS_BAD_LENGTH;
+        }
+        uint8_t tag = tlvs[used];
+        uint8_t value_length = tlvs[used + 1];
+        const uint8_t *value = &tlvs[used + 2];
+        if (vendor_tag_length(tag) == 0)
+        {
+            return VENDOR_STATUS_UNKNOWN_TAG;
+        }
+        if (value_length != vendor_tag_length(tag) || used + 2 + value_length > length)
+        {
+            return VENDOR_STATUS_BAD_LENGTH;
+        }
+
+        switch (tag)
+        {
+        case VENDOR_TAG_CPI:
+            candidate.cpi = vendor_read_u16(value);
+            break;
+        case VENDOR_TAG_REPORT_RATE_US:
+            candidate.report_rate_us = vendor_read_u16(value);
+            break;
+        case VENDOR_TAG_SENSOR_MODE:
+            candidate.sensor_mode = *value;
+            break;
+        case VENDOR_TAG_DEBOUNCE_MS:
+            candidate.debounce_ms = *value;
+            break;
+        case VENDOR_TAG_SCROLL_SPEED_MIN:
+            candidate.scroll_speed_min = *value;
+            break;
+        case VENDOR_TAG_SCROLL_SPEED_MAX:
+            candidate.scroll_speed_max = *value;
+            break;
+        case VENDOR_TAG_SCROLL_PAUSE_MS:
+            candidate.scroll_pause_ms = vendor_read_u16(value);
+            break;
+        case VENDOR_TAG_SCROLL_ACCEL:
+            candidate.scroll_accel = *value != 0;
+            break;
+        case VENDOR_TAG_PROFILE:
+            // Only valid as the first tag, earlier edits would be lost.
+            if (used != 0 || *value >= SETTINGS_PROFILE_COUNT)
+            {
+                return VENDOR_STATUS_BAD_VALUE;
+            }
+            profile = *value;
+            settings_get_profile(profile, &candidate);
+            break;
+        case VENDOR_TAG_POWER_IDLE_MS:
+            candidate.power_idle_ms = vendor_read_u16(value);
+            break;
+        case VENDOR_TAG_POWER_SLEEP_MS:
+            candidate.power_sleep_ms = vendor_read_u16(value);
+            break;
+        case VENDOR_TAG_REST_RUN_MS:
+            candidate.rest_run_ms = vendor_read_u16(value);
+            break;
+        case VENDOR_TAG_REST1_MS:
+            candidate.rest1_ms = vendor_read_u16(value);
+            break;
+        case VENDOR_TAG_REST2_MS:
+            candidate.rest2_ms = vendor_read_u16(value);
+            break;
+        case VENDOR_TAG_REST1_PERIOD_MS:
+            candidate.rest1_period_ms = *value;
+            break;
+        case VENDOR_TAG_REST2_PERIOD_MS:
+            candidate.rest2_period_ms = *value;
+            break;
+        case VENDOR_TAG_REST3_PERIOD_MS:
+            candidate.rest3_period_ms = *value;
+            break;
+        case VENDOR_TAG_DEBOUNCE_MIN_MS:
+            candidate.debounce_min_ms = *value;
+            break;
+        case VENDOR_TAG_BUTTON_MAP:
+            memcpy(candidate.button_map, value, sizeof(candidate.button_map));
+            break;
+        }
+        used += 2 + value_length;
+    }
+
+    if (!settings_validate(&candidate))
+    {
+        return VENDOR_STATUS_BAD_VALUE;
+    }
+    settings_commit(profile, &candidate);
+    return VENDOR_STATUS_OK;
+}
+
+// Copy a chunk of a snapshotted block into the response.
+static vendor_status_t vendor_read_snapshot(const void *block, uint32_t block_size, uint32_t offset)
+{
+    if (offset > block_size)
+    {
+        return VENDOR_STATUS_BAD_OFFSET;
+    }
+    uint8_t *out = vendor_response_payload();
+    uint32_t chunk = min(block_size - offset, (uint32_t)VENDOR_READ_CHUNK_MAX);
+    vendor_write_u32(out, block_size);
+    memcpy(&out[4], (const uint8_t *)block + offset, chunk);
+    vendor_response_length(4 + chunk);
+    return VENDOR_STATUS_OK;
+}
+
+// Read part of a bulk block.
+static vendor_status_t vendor_read_block(const uint8_t *payload, uint8_t length)
+{
+    if (length != 5)
+    {
+        return VENDOR_STATUS_BAD_LENGTH;
+    }
+    uint8_t block = payload[0];
+    uint32_t offset = vendor_read_u16(&payload[1]) | (uint32_t)vendor_read_u16(&payload[3]) << 16;
+
+    switch (block)
+    {
+    case VENDOR_BLOCK_COUNTERS:
+        if (offset == 0)
+        {
+            telemetry_snapshot(&vendor_snapshot.counters, NULL);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.counters, sizeof(vendor_snapshot.counters), offset);
+    case VENDOR_BLOCK_LATENCY:
+        if (offset == 0)
+        {
+            telemetry_snapshot(NULL, &vendor_snapshot.histograms);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.histograms, sizeof(vendor_snapshot.histograms), offset);
+    case VENDOR_BLOCK_BOOT:
+        if (offset == 0)
+        {
+            telemetry_boot_snapshot(&vendor_snapshot.boot);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.boot, sizeof(vendor_snapshot.boot), offset);
+    case VENDOR_BLOCK_TASKS:
+        if (offset == 0)
+        {
+            profiler_snapshot(&vendor_snapshot.tasks);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.tasks, sizeof(vendor_snapshot.tasks), offset);
+    case VENDOR_BLOCK_SWITCHES:
+        if (offset == 0)
+        {
+            button_debounce_wear_snapshot(&vendor_snapshot.switches);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.switches, sizeof(vendor_snapshot.switches), offset);
+    case VENDOR_BLOCK_MACROS:
+        if (offset == 0)
+        {
+            settings_get_macros(&vendor_snapshot.macros);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.macros, sizeof(vendor_snapshot.macros), offset);
+    case VENDOR_BLOCK_SPI_LINK:
+        if (offset == 0)
+        {
+            if (sensor_link_busy())
+            {
+                return VENDOR_STATUS_BUSY;
+            }
+            sensor_link_snapshot(&vendor_snapshot.link);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.link, sizeof(vendor_snapshot.link), offset);
+    case VENDOR_BLOCK_ENERGY_COSTS:
+        if (offset == 0)
+        {
+            settings_get_energy_costs(&vendor_snapshot.energy_costs);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.energy_costs, sizeof(vendor_snapshot.energy_costs), offset);
+    case VENDOR_BLOCK_ENERGY:
+        if (offset == 0)
+        {
+            vendor_energy_snapshot(&vendor_snapshot.energy);
+        }
+        return vendor_read_snapshot(&vendor_snapshot.energy, sizeof(vendor_snapshot.energy), offset);
+    case VENDOR_BLOCK_TRACE:
+    {
+        uint8_t *out = vendor_response_payload();
+        uint32_t total = 0;
+        // Never waits, the console dump may be holding the reader.
+        int chunk = trace_read(TRACE_READER_VENDOR, offset, &out[4], VENDOR_READ_CHUNK_MAX, &total);
+        if (chunk == TRACE_READ_BUSY)
+        {
+            return VENDOR_STATUS_BUSY;
+        }
+        if (chunk < 0)
+        {
+            return VENDOR_STATUS_BAD_OFFSET;
+        }
+        vendor_write_u32(out, total);
+        vendor_response_length(4 + chunk);
+        return VENDOR_STATUS_OK;
+    }
+    default:
+        return VENDOR_STATUS_BAD_VALUE;
+    }
+}
+
+// Energy counts since the last reset and their estimate at the stored cost table.
+static void vendor_energy_snapshot(energy_report_t *report)
+{
+    power_sync_telemetry();
+    telemetry_snapshot(NULL, NULL);
+    energy_counts_from_telemetry(&report->counts, &telemetry_counters);
+    settings_get_energy_costs(&report->costs);
+    energy_estimate(&report->estimate, &report->counts, &report->costs);
+}
+
+// Write part of a block, the chunk that completes it applies the block.
+static vendor_status_t vendor_write_block(const uint8_t *payload, uint8_t length)
+{
+    if (length < 5)
+    {
+        return VENDOR_STATUS_BAD_LENGTH;
+    }
+    uint8_t block = payload[0];
+    uint32_t offset = vendor_read_u16(&payload[1]) | (uint32_t)vendor_read_u16(&payload[3]) << 16;
+    uint32_t chunk = length - 5;
+    uint32_t size;
+    switch (block)
+    {
+    case VENDOR_BLOCK_MACROS:
+        size = sizeof(vendor_upload.macros);
+        break;
+    case VENDOR_BLOCK_ENERGY_COSTS:
+        size = sizeof(vendor_upload.energy_costs);
+        break;
+    default:
+        return VENDOR_STATUS_BAD_VALUE;
+    }
+    // Offset 0 starts over, anything else has to continue the upload of the same block.
+    if ((offset != 0 && (offset != vendor_upload_offset || block != vendor_upload_block)) || offset + chunk > size)
+    {
+        vendor_upload_offset = 0;
+        return VENDOR_STATUS_BAD_OFFSET;
+    }
+    memcpy((uint8_t *)&vendor_upload + offset, &payload[5], chunk);
+    vendor_upload_block = block;
+    vendor_upload_offset = offset + chunk;
+    if (vendor_upload_offset < size)
+    {
+        return VENDOR_STATUS_OK;
+    }
+
+    vendor_upload_offset = 0;
+    return vendor_apply_upload(block);
+}
+
+// Validate and store a completed upload.
+static vendor_status_t vendor_apply_upload(uint8_t block)
+{
+    if (block == VENDOR_BLOCK_ENERGY_COSTS)
+    {
+        if (!energy_costs_valid(&vendor_upload.energy_costs))
+        {
+            return VENDOR_STATUS_BAD_VALUE;
+        }
+        settings_commit_energy_costs(&vendor_upload.energy_costs);
+        return VENDOR_STATUS_OK;
+    }
+
+    for (int i = 0; i < INPUT_MACRO_COUNT; i++)
+    {
+        if (!input_macro_valid(&vendor_upload.macros.macros[i]))
+        {
+            return VENDOR_STATUS_BAD_VALUE;
+        }
+    }
+    settings_commit_macros(&vendor_upload.macros);
+    return VENDOR_STATUS_OK;
+}
+
+// Handle SET_REPORT(Feature) on the vendor report ID.
+// Runs in the TinyUSB task, never in the input tasks.
+void vendor_report_set(const uint8_t *buffer, uint16_t bufsize)
+{
+    memset(vendor_response, 0, sizeof(vendor_response));
+    if (bufsize < VENDOR_REQUEST_HEADER_SIZE)
+    {
+        vendor_response[2] = VENDOR_STATUS_BAD_LENGTH;
+        return;
+    }
+
+    uint8_t command = buffer[0];
+    uint8_t length = buffer[2];
+    const uint8_t *payload = &buffer[VENDOR_REQUEST_HEADER_SIZE];
+    vendor_response[0] = command;
+    vendor_response[1] = buffer[1];
+    if (length > VENDOR_REQUEST_PAYLOAD_MAX || VENDOR_REQUEST_HEADER_SIZE + length > bufsize)
+    {
+        vendor_response[2] = VENDOR_STATUS_BAD_LENGTH;
+        return;
+    }
+
+    vendor_status_t status;
+    switch (command)
+    {
+    case VENDOR_CMD_GET:
+        status = vendor_get_settings(payload, length);
+        break;
+    case VENDOR_CMD_SET:
+        status = vendor_set_settings(payload, length);
+        break;
+    case VENDOR_CMD_READ:
+        status = vendor_read_block(payload, length);
+        break;
+    case VENDOR_CMD_RESET:
+        telemetry_reset();
+        status = VENDOR_STATUS_OK;
+        break;
+    case VENDOR_CMD_WRITE:
+        status = vendor_write_block(payload, length);
+        break;
+    case VENDOR_CMD_CALIBRATE:
+        if (sensor_link_busy() || frame_capture_active())
+        {
+            status = VENDOR_STATUS_BUSY;
+            break;
+        }
+        sensor_link_request();
+        status = VENDOR_STATUS_OK;
+        break;
+    default:
+        status = VENDOR_STATUS_UNKNOWN_COMMAND;
+        break;
+    }
+    vendor_response[2] = status;
+    if (status != VENDOR_STATUS_OK)
+    {
+        vendor_response_length(0);
+    }
+}
+
+// Handle GET_REPORT(Feature) on the vendor report ID.
+uint16_t vendor_report_get(uint8_t *buffer, uint16_t reqlen)
+{
+    uint16_t length = min(reqlen, (uint16_t)sizeof(vendor_response));
+    memcpy(buffer, vendor_response, length);
+    return length;
+}
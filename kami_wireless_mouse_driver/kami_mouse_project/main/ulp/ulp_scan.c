@@ -0,0 +1,27 @@
+// ULP-RISC-V program that scans the buttons and the wheel while the main CPU sleeps.
+//
+// The ULP timer starts it once per scan period and it halts when main returns. Each run reads the levels of all
+// RTC pins at once and passes them to the mailbox, which records the changes and decides when to wake the main CPU.
+// The main CPU arms the mailbox and routes the pins to the RTC domain before it starts the timer, see ulp_scan.c.
+#include "ulp_riscv_utils.h"
+#include "soc/rtc_io_reg.h"
+
+#include "header/ulp_mailbox.h"
+
+// Exported to the main CPU as ulp_mailbox.
+ulp_mailbox_t mailbox;
+
+int main(void)
+{
+    mailbox.busy = 1;
+    // RTC pad numbers match the GPIO numbers for GPIO 0 to 21.
+    uint32_t levels = REG_GET_FIELD(RTC_GPIO_IN_REG, RTC_GPIO_GPIO_IN_NEXT);
+    if (ulp_mailbox_scan(&mailbox, levels))
+    {
+        // The wake only starts the main CPU, the interrupt is what reaches ulp_scan_isr and the power task.
+        ulp_riscv_trigger_sw_intr();
+        ulp_riscv_wakeup_main_processor();
+    }
+    mailbox.busy = 0;
+    return 0;
+}
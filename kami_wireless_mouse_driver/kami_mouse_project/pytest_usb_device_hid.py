@@ -7,10 +7,16 @@ from pytest_embedded import Dut
 @pytest.mark.esp32s3
 @pytest.mark.usb_device
 def test_usb_device_hid_example(dut: Dut) -> None:
-    dut.expect_exact('USB initialization')
-    dut.expect_exact('USB initialization DONE')
+    dut.expect_exact('USB settings_init')
+    dut.expect_exact('USB trace_init')
+    dut.expect_exact('USB transport_init')
+    dut.expect_exact('USB macro_init')
+    dut.expect_exact('USB frame_capture_init')
+    dut.expect_exact('USB power_init')
     dut.expect_exact('USB mb_latch_init')
     dut.expect_exact('USB button_debounce_init')
     dut.expect_exact('USB swheel_init')
+    dut.expect_exact('USB initialization')
+    dut.expect_exact('USB initialization DONE')
     dut.expect_exact('SPI device configured')
     
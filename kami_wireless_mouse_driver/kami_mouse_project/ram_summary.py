@@ -0,0 +1,77 @@
+# Print the static RAM of the input subsystem after a firmware build.
+#
+# The input path takes nothing from the heap once it runs, so its RAM is fixed at link time and this is all of it.
+# The firmware is a single translation unit, so the sizes come from the symbol table and each data symbol goes to
+# a module by its name prefix. The stacks and control blocks of the tasks (TASK_CREATE_STATIC) are named after
+# their task and count with its module. Internal RAM and PSRAM are summed apart.
+#
+#   python ram_summary.py [--objdump xtensa-esp32s3-elf-objdump] kami_mouse_project.elf
+import argparse
+import re
+import subprocess
+import sys
+
+# Name prefixes of each input module's statics.
+MODULES = [
+    ('sensor', ('sensor_', 'motion_ring')),
+    ('buttons', ('mb_latch_', 'lmb_', 'rmb_', 'current_lmb', 'current_rmb', 'button_', 'debounced_buttons', 'mmb',
+                 'smb4', 'smb5')),
+    ('wheel', ('swheel_', 'scroll_')),
+    ('transport', ('transport_',)),
+    ('macros', ('macro_',)),
+    ('power', ('power_',)),
+    ('ulp scan', ('ulp_scan_',)),
+    ('trace', ('trace_',)),
+    ('frame capture', ('frame_capture_',)),
+    ('heap guard', ('heap_guard_',)),
+]
+
+# Output sections, .ext_ram.bss holds the EXT_RAM_BSS_ATTR data.
+INTERNAL_SECTIONS = ('.dram0.', '.noinit')
+PSRAM_SECTIONS = ('.ext_ram.',)
+
+OBJECT_RE = re.compile(r'^[0-9a-f]+\s.*\sO\s+(\S+)\s+([0-9a-f]+)\s+(.+)$')
+
+
+def base_name(name):
+    # Static locals get a suffix, sensor_task_stack.1.
+    return name.split('.')[0]
+
+
+def module_of(name):
+    for module, prefixes in MODULES:
+        if name.startswith(prefixes):
+            return module
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Print the static RAM of the input subsystem.')
+    parser.add_argument('--objdump', default='xtensa-esp32s3-elf-objdump')
+    parser.add_argument('elf')
+    args = parser.parse_args()
+
+    output = subprocess.run([args.objdump, '-t', args.elf], check=True, capture_output=True, text=True).stdout
+    sizes = {module: [0, 0] for module, _ in MODULES}
+    for line in output.splitlines():
+        match = OBJECT_RE.match(line)
+        if not match:
+            continue
+        section, size, name = match.group(1), int(match.group(2), 16), base_name(match.group(3))
+        module = module_of(name)
+        if module is None:
+            continue
+        if section.startswith(INTERNAL_SECTIONS):
+            sizes[module][0] += size
+        elif section.startswith(PSRAM_SECTIONS):
+            sizes[module][1] += size
+
+    print(f'input RAM: {"module":<14} {"internal":>9} {"PSRAM":>9}')
+    for module, (internal, psram) in sizes.items():
+        print(f'input RAM: {module:<14} {internal:>9} {psram:>9}')
+    print(f'input RAM: {"total":<14} {sum(s[0] for s in sizes.values()):>9} {sum(s[1] for s in sizes.values()):>9}')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())